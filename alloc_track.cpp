@@ -0,0 +1,365 @@
+#include "alloc_track.h"
+
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <execinfo.h>
+
+const size_t ALLOC_SHARD_COUNT   = 64;
+const size_t ALLOC_SHARD_MIN     = 256;
+const size_t ALLOC_SITE_CAPACITY = 4096;         // the last site takes the overflow
+const size_t ALLOC_REPORT_SITES  = 20;
+
+struct AllocRecord_t {
+    const void* ptr;
+    size_t size;
+    uint32_t site;
+    uint8_t phase;
+    uint8_t kind;
+};
+
+// Live blocks by address. Open addressing with linear probing, one
+// spinlock per shard: the critical sections are a few probes long.
+struct AllocShard_t {
+    char lock;
+    AllocRecord_t* slots;
+    size_t capacity;
+    size_t count;
+};
+
+// key is the return address shifted left with the kind in the low bits
+struct AllocSite_t {
+    uintptr_t key;
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t live;
+    uint64_t live_bytes;
+};
+
+struct AllocPhaseStats_t {
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t live_bytes;
+    uint64_t live_nodes;
+    uint64_t peak_bytes;
+    uint64_t peak_nodes;
+};
+
+#ifdef DIF_ALLOC_TRACK
+
+static const char* kind_names[ALLOC_KIND_COUNT] = {
+    "node",
+    "string",
+    "buffer"
+};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static AllocSite_t* sites = NULL;
+static AllocShard_t shards[ALLOC_SHARD_COUNT] = {};
+static AllocPhaseStats_t phases[PHASE_COUNT + 1] = {};
+static uint64_t live_bytes = 0;
+static uint64_t live_nodes = 0;
+
+static void AllocTrackInit();
+static void AllocTrackAtExit();
+static size_t HashPtr(const void* ptr);
+static uint32_t FindSite(const void* address, AllocKind_t kind);
+static void Insert(void* ptr, size_t size, AllocKind_t kind, const void* site);
+static int Remove(const void* ptr, AllocRecord_t* record);
+static int ShardGrow(AllocShard_t* shard);
+static void UpdatePeak(uint64_t* peak, uint64_t value);
+static int CompareLiveBytes(const void* a, const void* b);
+
+void* AllocTrackCalloc(size_t count, size_t size, AllocKind_t kind, const void* site) {
+    void* ptr = calloc(count, size);
+    if (ptr != NULL) {
+        Insert(ptr, count * size, kind, site);
+    }
+
+    return ptr;
+}
+
+char* AllocTrackStrdup(const char* str, const void* site) {
+    assert( str != NULL );
+
+    char* copy = strdup(str);
+    if (copy != NULL) {
+        Insert(copy, strlen(copy) + 1, ALLOC_STRING, site);
+    }
+
+    return copy;
+}
+
+// For blocks reallocated behind the tracker's back, e.g. by getline
+void AllocTrackResized(const void* old_ptr, void* new_ptr, size_t size, AllocKind_t kind, const void* site) {
+    AllocRecord_t record = {};
+    if (old_ptr == new_ptr && old_ptr != NULL && Remove(old_ptr, &record)) {
+        Insert(new_ptr, size, kind, (const void*)(sites[record.site].key >> 2));
+        return;
+    }
+
+    if (old_ptr != NULL) {
+        Remove(old_ptr, &record);
+    }
+    if (new_ptr != NULL) {
+        Insert(new_ptr, size, kind, site);
+    }
+}
+
+void AllocTrackFree(void* ptr) {
+    if (ptr != NULL) {
+        AllocRecord_t record = {};
+        Remove(ptr, &record);       // blocks allocated before tracking or by libc are freed as is
+    }
+
+    free(ptr);
+}
+
+static void AllocTrackInit() {
+    sites = (AllocSite_t*)calloc(ALLOC_SITE_CAPACITY, sizeof(AllocSite_t));
+    assert( sites != NULL );
+
+    atexit(AllocTrackAtExit);
+}
+
+static void AllocTrackAtExit() {
+    if (__atomic_load_n(&live_bytes, __ATOMIC_RELAXED) != 0) {
+        AllocTrackReport(stderr);
+    }
+}
+
+static size_t HashPtr(const void* ptr) {
+    uint64_t hash = (uintptr_t)ptr;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static uint32_t FindSite(const void* address, AllocKind_t kind) {
+    uintptr_t key = ((uintptr_t)address << 2) | (uintptr_t)kind;
+    size_t probed = ALLOC_SITE_CAPACITY - 1;    // the last slot is never probed
+    size_t index = HashPtr(address) % probed;
+
+    for (size_t probe = 0; probe < probed; probe++) {
+        AllocSite_t* site = &sites[index];
+
+        uintptr_t current = __atomic_load_n(&site->key, __ATOMIC_ACQUIRE);
+        if (current == 0) {
+            uintptr_t expected = 0;
+            if (__atomic_compare_exchange_n(&site->key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return (uint32_t)index;
+            }
+            current = expected;
+        }
+        if (current == key) {
+            return (uint32_t)index;
+        }
+
+        index = (index + 1) % probed;
+    }
+
+    return (uint32_t)probed;
+}
+
+static void Insert(void* ptr, size_t size, AllocKind_t kind, const void* site) {
+    pthread_once(&init_once, AllocTrackInit);
+
+    AllocRecord_t record = {};
+    record.ptr   = ptr;
+    record.size  = size;
+    record.site  = FindSite(site, kind);
+    record.phase = (uint8_t)MetricsCurrentPhase();
+    record.kind  = (uint8_t)kind;
+
+    AllocShard_t* shard = &shards[HashPtr(ptr) % ALLOC_SHARD_COUNT];
+    while (__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE));
+
+    if (2 * (shard->count + 1) > shard->capacity && !ShardGrow(shard)) {
+        __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+        return;                     // stays untracked
+    }
+
+    size_t mask = shard->capacity - 1;
+    size_t index = (HashPtr(ptr) / ALLOC_SHARD_COUNT) & mask;
+    while (shard->slots[index].ptr != NULL) {
+        index = (index + 1) & mask;
+    }
+    shard->slots[index] = record;
+    ++shard->count;
+
+    __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+
+    AllocSite_t* entry = &sites[record.site];
+    __atomic_fetch_add(&entry->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry->bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry->live, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry->live_bytes, size, __ATOMIC_RELAXED);
+
+    AllocPhaseStats_t* stats = &phases[record.phase];
+    __atomic_fetch_add(&stats->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->live_bytes, size, __ATOMIC_RELAXED);
+    UpdatePeak(&stats->peak_bytes, __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED));
+
+    if (kind == ALLOC_NODE) {
+        __atomic_fetch_add(&stats->live_nodes, 1, __ATOMIC_RELAXED);
+        UpdatePeak(&stats->peak_nodes, __atomic_add_fetch(&live_nodes, 1, __ATOMIC_RELAXED));
+    }
+}
+
+static int Remove(const void* ptr, AllocRecord_t* record) {
+    AllocShard_t* shard = &shards[HashPtr(ptr) % ALLOC_SHARD_COUNT];
+    while (__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE));
+
+    if (shard->capacity == 0) {
+        __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    size_t mask = shard->capacity - 1;
+    size_t index = (HashPtr(ptr) / ALLOC_SHARD_COUNT) & mask;
+    while (shard->slots[index].ptr != NULL && shard->slots[index].ptr != ptr) {
+        index = (index + 1) & mask;
+    }
+    if (shard->slots[index].ptr == NULL) {
+        __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    *record = shard->slots[index];
+    --shard->count;
+
+    // backward shift: later records of the probe run move into the hole
+    size_t hole = index;
+    for (size_t next = (hole + 1) & mask; shard->slots[next].ptr != NULL; next = (next + 1) & mask) {
+        size_t home = (HashPtr(shard->slots[next].ptr) / ALLOC_SHARD_COUNT) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            shard->slots[hole] = shard->slots[next];
+            hole = next;
+        }
+    }
+    shard->slots[hole] = {};
+
+    __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+
+    AllocSite_t* entry = &sites[record->site];
+    __atomic_fetch_sub(&entry->live, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&entry->live_bytes, record->size, __ATOMIC_RELAXED);
+
+    AllocPhaseStats_t* stats = &phases[record->phase];
+    __atomic_fetch_sub(&stats->live_bytes, record->size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&live_bytes, record->size, __ATOMIC_RELAXED);
+
+    if (record->kind == ALLOC_NODE) {
+        __atomic_fetch_sub(&stats->live_nodes, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&live_nodes, 1, __ATOMIC_RELAXED);
+    }
+
+    return 1;
+}
+
+static int ShardGrow(AllocShard_t* shard) {
+    size_t capacity = (shard->capacity != 0) ? 2 * shard->capacity : ALLOC_SHARD_MIN;
+    AllocRecord_t* slots = (AllocRecord_t*)calloc(capacity, sizeof(AllocRecord_t));
+    if (slots == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < shard->capacity; i++) {
+        if (shard->slots[i].ptr == NULL) {
+            continue;
+        }
+
+        size_t index = (HashPtr(shard->slots[i].ptr) / ALLOC_SHARD_COUNT) & (capacity - 1);
+        while (slots[index].ptr != NULL) {
+            index = (index + 1) & (capacity - 1);
+        }
+        slots[index] = shard->slots[i];
+    }
+
+    FREE(shard->slots);
+    shard->slots = slots;
+    shard->capacity = capacity;
+
+    return 1;
+}
+
+static void UpdatePeak(uint64_t* peak, uint64_t value) {
+    uint64_t current = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (value > current
+           && !__atomic_compare_exchange_n(peak, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static int CompareLiveBytes(const void* a, const void* b) {
+    uint64_t lhs = sites[*(const size_t*)a].live_bytes;
+    uint64_t rhs = sites[*(const size_t*)b].live_bytes;
+
+    return (lhs < rhs) - (lhs > rhs);
+}
+
+void AllocTrackReport(FILE* fp) {
+    assert( fp != NULL );
+
+    fprintf(fp, "alloc: %-9s %10s %12s %12s %10s %12s %10s\n",
+            "phase", "allocs", "bytes", "live bytes", "live nodes", "peak bytes", "peak nodes");
+    for (size_t i = 0; i <= PHASE_COUNT; i++) {
+        const AllocPhaseStats_t* stats = &phases[i];
+        fprintf(fp, "alloc: %-9s %10llu %12llu %12llu %10llu %12llu %10llu\n",
+                MetricsPhaseName((MetricsPhase_t)i),
+                (unsigned long long)__atomic_load_n(&stats->allocs, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&stats->bytes, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&stats->live_bytes, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&stats->live_nodes, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&stats->peak_nodes, __ATOMIC_RELAXED));
+    }
+
+    if (sites == NULL) {
+        return;
+    }
+
+    size_t* order = (size_t*)calloc(ALLOC_SITE_CAPACITY, sizeof(size_t));
+    if (order == NULL) {
+        return;
+    }
+
+    size_t count = 0;
+    uint64_t leaked = 0, leaked_bytes = 0;
+    for (size_t i = 0; i < ALLOC_SITE_CAPACITY; i++) {
+        if (__atomic_load_n(&sites[i].live, __ATOMIC_RELAXED) != 0) {
+            leaked       += sites[i].live;
+            leaked_bytes += sites[i].live_bytes;
+            order[count++] = i;
+        }
+    }
+    qsort(order, count, sizeof(size_t), CompareLiveBytes);
+
+    fprintf(fp, "alloc: %llu blocks, %llu bytes live at %zu call sites\n",
+            (unsigned long long)leaked, (unsigned long long)leaked_bytes, count);
+
+    for (size_t i = 0; i < count && i < ALLOC_REPORT_SITES; i++) {
+        const AllocSite_t* site = &sites[order[i]];
+
+        void* address = (void*)(site->key >> 2);
+        char** symbol = (order[i] != ALLOC_SITE_CAPACITY - 1) ? backtrace_symbols(&address, 1) : NULL;
+
+        fprintf(fp, "alloc: %10llu blocks %12llu bytes  %-6s  %s\n",
+                (unsigned long long)site->live, (unsigned long long)site->live_bytes,
+                kind_names[site->key & 3], (symbol != NULL) ? symbol[0] : "(other sites)");
+        free(symbol);
+    }
+
+    FREE(order);
+}
+
+#else // DIF_ALLOC_TRACK
+
+void AllocTrackReport(FILE* fp) {
+    assert( fp != NULL );
+
+    fprintf(fp, "alloc: tracking is off, build with -D DIF_ALLOC_TRACK\n");
+}
+
+#endif // DIF_ALLOC_TRACK
@@ -0,0 +1,48 @@
+#ifndef ALLOC_TRACK_H
+#define ALLOC_TRACK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree.h"
+#include "metrics.h"
+
+enum AllocKind_t {
+    ALLOC_NODE,
+    ALLOC_STRING,
+    ALLOC_BUFFER,
+    ALLOC_KIND_COUNT
+};
+
+// Tracking of nodes, their strings and buffers, compiled in with
+// DIF_ALLOC_TRACK. A block is charged to the phase its thread is in and to
+// its call site: the return address of the function that allocates on
+// behalf of its caller (NodeInit, TreeCopySubtree, BufferInit, ...).
+// Blocks still live at exit are reported by call site.
+#ifdef DIF_ALLOC_TRACK
+
+void* AllocTrackCalloc(size_t count, size_t size, AllocKind_t kind, const void* site);
+char* AllocTrackStrdup(const char* str, const void* site);
+void AllocTrackResized(const void* old_ptr, void* new_ptr, size_t size, AllocKind_t kind, const void* site);
+void AllocTrackFree(void* ptr);
+
+#define TRACK_CALLOC(count, size, kind)         AllocTrackCalloc(count, size, kind, __builtin_return_address(0))
+#define TRACK_STRDUP(str)                       AllocTrackStrdup(str, __builtin_return_address(0))
+#define TRACK_RESIZED(old_ptr, ptr, size, kind) AllocTrackResized(old_ptr, ptr, size, kind, __builtin_return_address(0))
+#define TRACK_FREE(ptr)                         AllocTrackFree(ptr); ptr = NULL;
+
+#else // DIF_ALLOC_TRACK
+
+#define TRACK_CALLOC(count, size, kind)         calloc(count, size)
+#define TRACK_STRDUP(str)                       strdup(str)
+#define TRACK_RESIZED(old_ptr, ptr, size, kind) ((void)(old_ptr))
+#define TRACK_FREE(ptr)                         FREE(ptr)
+
+#endif // DIF_ALLOC_TRACK
+
+// Live and peak bytes and nodes by phase, then the call sites holding live
+// blocks. Peaks are the highest total in use while the phase was running.
+void AllocTrackReport(FILE* fp);
+
+#endif // ALLOC_TRACK_H
@@ -0,0 +1,173 @@
+#include "budget.h"
+
+#include <assert.h>
+#include <time.h>
+
+const size_t BUDGET_CLOCK_TICKS = 256;        // checks between clock and cancel reads
+
+static const char* limit_names[] = {
+    "within budget",
+    "node limit",
+    "byte limit",
+    "depth limit",
+    "time limit",
+    "cancelled"
+};
+
+static __thread Budget_t* current = NULL;
+
+static uint64_t BudgetNow();
+static void Exceed(Budget_t* budget, BudgetLimit_t limit);
+static int Tick(Budget_t* budget);
+
+void BudgetLimitsInit(BudgetLimits_t* limits) {
+    assert( limits != NULL );
+
+    limits->max_nodes = 0;
+    limits->max_bytes = 0;
+    limits->max_depth = 0;
+    limits->max_ns    = 0;
+}
+
+void BudgetBegin(Budget_t* budget, const BudgetLimits_t* limits, const int* cancel) {
+    assert( budget != NULL );
+    assert( limits != NULL );
+
+    *budget = {};
+    budget->limits   = *limits;
+    budget->cancel   = cancel;
+    budget->start_ns = BudgetNow();
+    budget->phase    = PHASE_COUNT;
+    budget->prev     = current;
+
+    current = budget;
+}
+
+BudgetLimit_t BudgetEnd(Budget_t* budget) {
+    assert( budget != NULL );
+    assert( budget == current );
+
+    budget->elapsed_ns = BudgetNow() - budget->start_ns;
+    if (budget->limits.max_ns != 0 && budget->elapsed_ns > budget->limits.max_ns) {
+        Exceed(budget, BUDGET_TIME);
+    }
+    current = budget->prev;
+    budget->prev = NULL;
+
+    return budget->exceeded;
+}
+
+Budget_t* BudgetSuspend() {
+    Budget_t* budget = current;
+    current = NULL;
+
+    return budget;
+}
+
+void BudgetResume(Budget_t* budget) {
+    assert( current == NULL );
+
+    current = budget;
+}
+
+int BudgetExceeded() {
+    return current != NULL && current->exceeded != BUDGET_WITHIN;
+}
+
+// 0 when the operation has to stop; BudgetAscend follows a nonzero result only
+int BudgetDescend() {
+    Budget_t* budget = current;
+    if (budget == NULL) {
+        return 1;
+    }
+
+    if (budget->limits.max_depth != 0 && budget->depth >= budget->limits.max_depth) {
+        Exceed(budget, BUDGET_DEPTH);
+    }
+    if (!Tick(budget)) {
+        return 0;
+    }
+
+    if (++budget->depth > budget->max_depth) {
+        budget->max_depth = budget->depth;
+    }
+
+    return 1;
+}
+
+void BudgetAscend() {
+    if (current != NULL && current->depth != 0) {
+        --current->depth;
+    }
+}
+
+void BudgetCharge(size_t nodes, size_t bytes) {
+    Budget_t* budget = current;
+    if (budget == NULL) {
+        return;
+    }
+
+    budget->nodes += nodes;
+    budget->bytes += bytes;
+
+    if (budget->limits.max_nodes != 0 && budget->nodes > budget->limits.max_nodes) {
+        Exceed(budget, BUDGET_NODES);
+    }
+    if (budget->limits.max_bytes != 0 && budget->bytes > budget->limits.max_bytes) {
+        Exceed(budget, BUDGET_BYTES);
+    }
+
+    Tick(budget);
+}
+
+const char* BudgetLimitName(BudgetLimit_t limit) {
+    if ((size_t)limit >= sizeof(limit_names) / sizeof(limit_names[0])) {
+        return "unknown limit";
+    }
+
+    return limit_names[limit];
+}
+
+size_t BudgetDescribe(const Budget_t* budget, char* str, size_t size) {
+    assert( budget != NULL );
+    assert( str != NULL );
+
+    uint64_t elapsed = (budget->elapsed_ns != 0) ? budget->elapsed_ns : BudgetNow() - budget->start_ns;
+
+    int length = snprintf(str, size, "%s in %s after %zu nodes, %zu bytes, depth %zu, %.3lf ms",
+                          BudgetLimitName(budget->exceeded), MetricsPhaseName(budget->phase),
+                          budget->nodes, budget->bytes, budget->max_depth, (double)elapsed * 1e-6);
+
+    return (length > 0) ? (size_t)length : 0;
+}
+
+static uint64_t BudgetNow() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// The first limit hit is the one reported
+static void Exceed(Budget_t* budget, BudgetLimit_t limit) {
+    if (budget->exceeded == BUDGET_WITHIN) {
+        budget->exceeded = limit;
+        budget->phase = MetricsCurrentPhase();
+    }
+}
+
+static int Tick(Budget_t* budget) {
+    if (budget->exceeded != BUDGET_WITHIN) {
+        return 0;
+    }
+
+    if (++budget->ticks % BUDGET_CLOCK_TICKS == 0) {
+        if (budget->cancel != NULL && __atomic_load_n(budget->cancel, __ATOMIC_RELAXED)) {
+            Exceed(budget, BUDGET_CANCELLED);
+        } else if (budget->limits.max_ns != 0 && BudgetNow() - budget->start_ns > budget->limits.max_ns) {
+            Exceed(budget, BUDGET_TIME);
+        }
+    }
+
+    return budget->exceeded == BUDGET_WITHIN;
+}
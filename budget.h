@@ -0,0 +1,67 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+const size_t BUDGET_REPORT_MAX = 128;
+
+enum BudgetLimit_t {
+    BUDGET_WITHIN,
+    BUDGET_NODES,
+    BUDGET_BYTES,
+    BUDGET_DEPTH,
+    BUDGET_TIME,
+    BUDGET_CANCELLED
+};
+
+// 0 - no limit
+struct BudgetLimits_t {
+    size_t max_nodes;           // nodes allocated, freed ones included
+    size_t max_bytes;           // bytes of those nodes and their strings
+    size_t max_depth;           // recursion depth of parse, diff, optimize and print
+    uint64_t max_ns;            // wall time
+};
+
+// Resources of one operation on one thread. Parse, diff, optimize and
+// print check the budget of their thread as they go: once it is exceeded
+// they stop early, free what they built and fail. The budget then keeps
+// the limit, the phase and the counts it got to.
+struct Budget_t {
+    BudgetLimits_t limits;
+    const int* cancel;          // stops the operation once nonzero, set from any thread
+    size_t nodes;
+    size_t bytes;
+    size_t depth;
+    size_t max_depth;
+    uint64_t start_ns;
+    uint64_t elapsed_ns;
+    size_t ticks;
+    BudgetLimit_t exceeded;
+    MetricsPhase_t phase;
+    Budget_t* prev;
+};
+
+void BudgetLimitsInit(BudgetLimits_t* limits);
+
+// Budgets nest: an inner one covers its operation only
+void BudgetBegin(Budget_t* budget, const BudgetLimits_t* limits, const int* cancel);
+BudgetLimit_t BudgetEnd(Budget_t* budget);
+
+// Takes the thread out of its budget until BudgetResume: work in between is
+// neither limited nor counted. For copies into shared structures, which
+// have to be whole whatever the request that makes them has left.
+Budget_t* BudgetSuspend();
+void BudgetResume(Budget_t* budget);
+
+int BudgetExceeded();
+int BudgetDescend();
+void BudgetAscend();
+void BudgetCharge(size_t nodes, size_t bytes);
+
+const char* BudgetLimitName(BudgetLimit_t limit);
+size_t BudgetDescribe(const Budget_t* budget, char* str, size_t size);
+
+#endif // BUDGET_H
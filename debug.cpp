@@ -0,0 +1,126 @@
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+const size_t DEBUG_MESSAGE_MAX = 512;
+const size_t DEBUG_STEP_LINE_MAX = 64;
+
+static const char* const level_names[] = {"off", "error", "warn", "info", "trace"};
+
+DebugLevel_t debug_level = (DebugLevel_t)DIF_LOG_LEVEL;
+int debug_stepping = 0;
+
+static FILE* step_in = NULL;
+
+#ifdef DIF_LIBRARY
+static __thread DebugSinkState_t current = {NULL, NULL};       // the library never writes to the console
+#else
+static void StderrSink(void* user, const char* message);
+
+static __thread DebugSinkState_t current = {StderrSink, NULL};
+static pthread_mutex_t step_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif // DIF_LIBRARY
+
+static void Emit(DebugLevel_t level, const char* where, const char* text);
+
+DebugSinkState_t DebugSetSink(DebugSink_t sink, void* user) {
+    DebugSinkState_t prev = current;
+    current.sink = sink;
+    current.user = user;
+
+    return prev;
+}
+
+void DebugRestoreSink(DebugSinkState_t state) {
+    current = state;
+}
+
+void DebugSetLevel(DebugLevel_t level) {
+    debug_level = level;
+}
+
+DebugLevel_t DebugParseLevel(const char* name, DebugLevel_t fallback) {
+    if (name == NULL) {
+        return fallback;
+    }
+
+    for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            return (DebugLevel_t)i;
+        }
+    }
+
+    return fallback;
+}
+
+void DebugConfigFromEnv() {
+    debug_level = DebugParseLevel(getenv("DIF_LOG"), debug_level);
+}
+
+void DebugSetStep(FILE* in) {
+    step_in = in;
+    debug_stepping = (in != NULL);
+}
+
+void DebugLog(DebugLevel_t level, const char* where, const char* format, ...) {
+    if (current.sink == NULL) {
+        return;
+    }
+
+    char text[DEBUG_MESSAGE_MAX] = "";
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    Emit(level, where, text);
+}
+
+void DebugStep(const char* where, const char* format, ...) {
+    char text[DEBUG_MESSAGE_MAX] = "";
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+#ifndef DIF_LIBRARY
+    if (debug_stepping) {
+        // threads take their steps one at a time
+        pthread_mutex_lock(&step_lock);
+        if (debug_stepping) {
+            fprintf(stderr, "step %s: %s [enter - next, c - continue] ", where, text);
+
+            char line[DEBUG_STEP_LINE_MAX] = "";
+            if (fgets(line, sizeof(line), step_in) == NULL || line[0] == 'c') {
+                debug_stepping = 0;
+            }
+        }
+        pthread_mutex_unlock(&step_lock);
+        return;
+    }
+#endif // DIF_LIBRARY
+
+    if (DEBUG_ENABLED(DEBUG_LEVEL_TRACE) && current.sink != NULL) {
+        Emit(DEBUG_LEVEL_TRACE, where, text);
+    }
+}
+
+static void Emit(DebugLevel_t level, const char* where, const char* text) {
+    char message[DEBUG_MESSAGE_MAX] = "";
+    snprintf(message, sizeof(message), "%s %s: %s", level_names[level], where, text);
+
+    current.sink(current.user, message);
+}
+
+#ifndef DIF_LIBRARY
+
+static void StderrSink(void*, const char* message) {
+    fprintf(stderr, "%s\n", message);
+}
+
+#endif // DIF_LIBRARY
@@ -0,0 +1,98 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdio.h>
+
+// Numbered for DIF_LOG_LEVEL, which the preprocessor compares
+enum DebugLevel_t {
+    DEBUG_LEVEL_OFF   = 0,
+    DEBUG_LEVEL_ERROR = 1,
+    DEBUG_LEVEL_WARN  = 2,
+    DEBUG_LEVEL_INFO  = 3,
+    DEBUG_LEVEL_TRACE = 4
+};
+
+// Messages above DIF_LOG_LEVEL are not compiled in: their arguments are not
+// even evaluated. Release builds keep errors, DIF_DEBUG builds keep all.
+#ifndef DIF_LOG_LEVEL
+#ifdef DIF_DEBUG
+#define DIF_LOG_LEVEL 4
+#else
+#define DIF_LOG_LEVEL 1
+#endif // DIF_DEBUG
+#endif // DIF_LOG_LEVEL
+
+// Diagnostics of the library code. They go to the sink of the calling
+// thread: stderr, unless an embedding context installed its own. A message
+// reads "<level> <where>: <text>".
+typedef void (*DebugSink_t)(void* user, const char* message);
+
+struct DebugSinkState_t {
+    DebugSink_t sink;
+    void* user;
+};
+
+extern DebugLevel_t debug_level;            // the runtime level, DebugSetLevel
+extern int debug_stepping;
+
+DebugSinkState_t DebugSetSink(DebugSink_t sink, void* user);
+void DebugRestoreSink(DebugSinkState_t state);
+
+void DebugSetLevel(DebugLevel_t level);
+// "off", "error", "warn", "info" or "trace"; fallback for anything else
+DebugLevel_t DebugParseLevel(const char* name, DebugLevel_t fallback);
+// Level from the DIF_LOG environment variable, if it is set
+void DebugConfigFromEnv();
+
+// Step-through mode: every step point waits for a line from in. An empty
+// line goes to the next step, "c" runs on without stopping. NULL - off.
+// The library build never stops.
+void DebugSetStep(FILE* in);
+
+void DebugLog(DebugLevel_t level, const char* where, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+// Logs at trace and waits if stepping
+void DebugStep(const char* where, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#define DEBUG_ENABLED(level) ((level) <= debug_level)
+
+#define DEBUG_LOG(level, where, ...)                    \
+    do {                                                \
+        if (DEBUG_ENABLED(level)) {                     \
+            DebugLog(level, where, __VA_ARGS__);        \
+        }                                               \
+    } while (0)
+
+#if DIF_LOG_LEVEL >= 1
+#define LOG_ERROR(where, ...) DEBUG_LOG(DEBUG_LEVEL_ERROR, where, __VA_ARGS__)
+#else
+#define LOG_ERROR(where, ...) ((void)0)
+#endif
+
+#if DIF_LOG_LEVEL >= 2
+#define LOG_WARN(where, ...)  DEBUG_LOG(DEBUG_LEVEL_WARN, where, __VA_ARGS__)
+#else
+#define LOG_WARN(where, ...)  ((void)0)
+#endif
+
+#if DIF_LOG_LEVEL >= 3
+#define LOG_INFO(where, ...)  DEBUG_LOG(DEBUG_LEVEL_INFO, where, __VA_ARGS__)
+#else
+#define LOG_INFO(where, ...)  ((void)0)
+#endif
+
+// Step points sit on hot paths, so they come and go with trace
+#if DIF_LOG_LEVEL >= 4
+#define LOG_TRACE(where, ...) DEBUG_LOG(DEBUG_LEVEL_TRACE, where, __VA_ARGS__)
+#define LOG_STEP(where, ...)                                            \
+    do {                                                                \
+        if (DEBUG_ENABLED(DEBUG_LEVEL_TRACE) || debug_stepping) {      \
+            DebugStep(where, __VA_ARGS__);                              \
+        }                                                               \
+    } while (0)
+#else
+#define LOG_TRACE(where, ...) ((void)0)
+#define LOG_STEP(where, ...)  ((void)0)
+#endif
+
+#endif // DEBUG_H
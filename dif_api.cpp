@@ -0,0 +1,431 @@
+#include "dif_api.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree.h"
+#include "io.h"
+#include "dif_math.h"
+#include "dif_optimize.h"
+#include "dif_eval.h"
+#include "dif_interval.h"
+#include "dif_jacobian.h"
+#include "dif_cache.h"
+#include "debug.h"
+#include "budget.h"
+
+const size_t DIF_API_CACHE_ENTRIES   = 1024;
+const size_t DIF_API_CACHE_NODES     = 1 << 20;
+const size_t DIF_API_SIMPLIFY_PASSES = 8;
+
+struct DifContext_t {
+    DifConfig_t config;
+    DiffCache_t cache;
+    int has_cache;
+    Buffer_t scratch;           // writable copy of the expression being parsed
+    BudgetLimits_t limits;
+    Budget_t budget;
+    int cancel;
+    char report[BUDGET_REPORT_MAX];
+};
+
+static const char* dif_errors[] = {
+    "ok",
+    "bad argument",
+    "tree syntax error",
+    "unbound variable",
+    "evaluation failed",
+    "differentiation failed",
+    "printing failed",
+    "allocation failed",
+    "budget exceeded"
+};
+
+static DifErr_t ParseExpression(DifContext_t* ctx, const char* expr, Tree_t** tree);
+static DifErr_t Render(Tree_t* tree, DifFormat_t format, char** result);
+static void ContextLog(void* user, const char* message);
+static DebugSinkState_t EnterContext(DifContext_t* ctx);
+static DifErr_t LeaveContext(DifContext_t* ctx, DebugSinkState_t sink, DifErr_t err);
+
+void DifConfigInit(DifConfig_t* config) {
+    if (config == NULL) {
+        return;
+    }
+
+    config->cache_entries   = DIF_API_CACHE_ENTRIES;
+    config->cache_nodes     = DIF_API_CACHE_NODES;
+    config->simplify_passes = DIF_API_SIMPLIFY_PASSES;
+    config->max_nodes       = 0;
+    config->max_bytes       = 0;
+    config->max_depth       = 0;
+    config->max_ms          = 0;
+    config->log             = NULL;
+    config->log_user        = NULL;
+}
+
+DifContext_t* DifContextCreate(const DifConfig_t* config) {
+    DifContext_t* ctx = (DifContext_t*)calloc(1, sizeof(DifContext_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    if (config != NULL) {
+        ctx->config = *config;
+    } else {
+        DifConfigInit(&ctx->config);
+    }
+
+    if (ctx->config.cache_entries != 0) {
+        if (DiffCacheInit(&ctx->cache, ctx->config.cache_entries, ctx->config.cache_nodes) != DIF_CACHE_OK) {
+            FREE(ctx);
+            return NULL;
+        }
+        ctx->has_cache = 1;
+    }
+
+    BufferInit(&ctx->scratch, 0);
+
+    ctx->limits.max_nodes = ctx->config.max_nodes;
+    ctx->limits.max_bytes = ctx->config.max_bytes;
+    ctx->limits.max_depth = ctx->config.max_depth;
+    ctx->limits.max_ns    = ctx->config.max_ms * 1000000;
+
+    return ctx;
+}
+
+void DifContextDestroy(DifContext_t* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+
+    if (ctx->has_cache) {
+        DiffCacheDestroy(&ctx->cache);
+    }
+    BufferDestroy(&ctx->scratch);
+
+    FREE(ctx);
+}
+
+DifErr_t DifSimplify(DifContext_t* ctx, const char* expr, DifFormat_t format, char** result) {
+    if (ctx == NULL || expr == NULL || result == NULL) {
+        return DIF_BAD_ARGUMENT;
+    }
+    *result = NULL;
+
+    DebugSinkState_t sink = EnterContext(ctx);
+
+    Tree_t* tree = NULL;
+    DifErr_t err = ParseExpression(ctx, expr, &tree);
+    if (err == DIF_OK) {
+        TreeSimplify(tree, ctx->config.simplify_passes);
+        err = Render(tree, format, result);
+        TreeDestroy(&tree);
+    }
+
+    return LeaveContext(ctx, sink, err);
+}
+
+DifErr_t DifDerivative(DifContext_t* ctx, const char* expr, const char* var, DifFormat_t format, char** result) {
+    if (ctx == NULL || expr == NULL || var == NULL || result == NULL) {
+        return DIF_BAD_ARGUMENT;
+    }
+    *result = NULL;
+
+    DebugSinkState_t sink = EnterContext(ctx);
+
+    Tree_t* tree = NULL;
+    DifErr_t err = ParseExpression(ctx, expr, &tree);
+
+    Tree_t* deriv = NULL;
+    if (err == DIF_OK && TreeInit(&deriv) != TREE_OK) {
+        err = DIF_ALLOCATION_FAILED;
+    }
+
+    if (err == DIF_OK) {
+        deriv->root = TreeDiffCached(tree->root, var, ctx->has_cache ? &ctx->cache : NULL);
+        if (deriv->root == NULL) {
+            err = DIF_DIFF_FAILED;
+        }
+    }
+
+    if (err == DIF_OK) {
+        deriv->root->parent = NULL;
+        TreeSimplify(deriv, ctx->config.simplify_passes);
+        err = Render(deriv, format, result);
+    }
+
+    if (deriv != NULL) TreeDestroy(&deriv);
+    if (tree != NULL)  TreeDestroy(&tree);
+
+    return LeaveContext(ctx, sink, err);
+}
+
+DifErr_t DifEvaluate(DifContext_t* ctx, const char* expr, const char* const* names, const double* values,
+                     size_t count, double* value) {
+    if (ctx == NULL || expr == NULL || value == NULL || (count != 0 && (names == NULL || values == NULL))) {
+        return DIF_BAD_ARGUMENT;
+    }
+
+    DebugSinkState_t sink = EnterContext(ctx);
+
+    EvalVar_t* vars = (EvalVar_t*)calloc(count + 1, sizeof(EvalVar_t));
+    DifErr_t err = (vars != NULL) ? DIF_OK : DIF_ALLOCATION_FAILED;
+    for (size_t i = 0; err == DIF_OK && i < count; i++) {
+        vars[i].name  = names[i];
+        vars[i].value = values[i];
+    }
+
+    Tree_t* tree = NULL;
+    if (err == DIF_OK) {
+        err = ParseExpression(ctx, expr, &tree);
+    }
+
+    if (err == DIF_OK) {
+        switch (TreeEval(tree->root, vars, count, value)) {
+        case EVAL_OK:
+            break;
+        case EVAL_UNBOUND_VARIABLE:
+            err = DIF_UNBOUND_VARIABLE;
+            break;
+        case EVAL_UNDEFINED_NODE:
+        case EVAL_ALLOCATION_FAILED:
+        default:
+            err = DIF_EVAL_FAILED;
+            break;
+        }
+        TreeDestroy(&tree);
+    }
+
+    FREE(vars);
+    return LeaveContext(ctx, sink, err);
+}
+
+DifErr_t DifEvaluateInterval(DifContext_t* ctx, const char* expr, const char* const* names,
+                             const double* lo, const double* hi, size_t count,
+                             double* result_lo, double* result_hi, int* domain) {
+    if (ctx == NULL || expr == NULL || result_lo == NULL || result_hi == NULL || domain == NULL
+        || (count != 0 && (names == NULL || lo == NULL || hi == NULL))) {
+        return DIF_BAD_ARGUMENT;
+    }
+
+    DebugSinkState_t sink = EnterContext(ctx);
+
+    IntervalVar_t* vars = (IntervalVar_t*)calloc(count + 1, sizeof(IntervalVar_t));
+    DifErr_t err = (vars != NULL) ? DIF_OK : DIF_ALLOCATION_FAILED;
+    for (size_t i = 0; err == DIF_OK && i < count; i++) {
+        vars[i].name     = names[i];
+        vars[i].range.lo = lo[i];
+        vars[i].range.hi = hi[i];
+    }
+
+    Tree_t* tree = NULL;
+    if (err == DIF_OK) {
+        err = ParseExpression(ctx, expr, &tree);
+    }
+
+    if (err == DIF_OK) {
+        Interval_t result = IntervalEmpty();
+        unsigned flags = 0;
+
+        switch (TreeEvalInterval(tree->root, vars, count, &result, &flags)) {
+        case EVAL_OK:
+            *result_lo = result.lo;
+            *result_hi = result.hi;
+            *domain    = flags != 0;
+            break;
+        case EVAL_UNBOUND_VARIABLE:
+            err = DIF_UNBOUND_VARIABLE;
+            break;
+        case EVAL_UNDEFINED_NODE:
+        case EVAL_ALLOCATION_FAILED:
+        default:
+            err = DIF_EVAL_FAILED;
+            break;
+        }
+        TreeDestroy(&tree);
+    }
+
+    FREE(vars);
+    return LeaveContext(ctx, sink, err);
+}
+
+DifErr_t DifJacobian(DifContext_t* ctx, const char* const* exprs, size_t count, const char* const* names,
+                     const double* values, size_t count_vars, double* jacobian) {
+    if (ctx == NULL || (count != 0 && (exprs == NULL || jacobian == NULL))
+        || (count_vars != 0 && (names == NULL || values == NULL))) {
+        return DIF_BAD_ARGUMENT;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (exprs[i] == NULL) {
+            return DIF_BAD_ARGUMENT;
+        }
+    }
+
+    DebugSinkState_t sink = EnterContext(ctx);
+
+    Tree_t** trees = (Tree_t**)calloc(count + 1, sizeof(Tree_t*));
+    const Node_t** roots = (const Node_t**)calloc(count + 1, sizeof(Node_t*));
+    DifErr_t err = (trees != NULL && roots != NULL) ? DIF_OK : DIF_ALLOCATION_FAILED;
+
+    size_t parsed = 0;
+    for (; err == DIF_OK && parsed < count; parsed++) {
+        err = ParseExpression(ctx, exprs[parsed], &trees[parsed]);
+        if (err == DIF_OK) {
+            roots[parsed] = trees[parsed]->root;
+        }
+    }
+
+    Jacobian_t jac = {};
+    if (err == DIF_OK) {
+        switch (JacobianInit(&jac, roots, count, names, count_vars, JACOBIAN_AUTO)) {
+        case JACOBIAN_OK:
+            break;
+        case JACOBIAN_UNBOUND_VARIABLE:
+            err = DIF_UNBOUND_VARIABLE;
+            break;
+        case JACOBIAN_ALLOCATION_FAILED:
+            err = DIF_ALLOCATION_FAILED;
+            break;
+        case JACOBIAN_UNDEFINED_NODE:
+        default:
+            err = DIF_EVAL_FAILED;
+            break;
+        }
+    }
+
+    if (err == DIF_OK) {
+        JacobianEval(&jac, values, NULL);
+
+        memset(jacobian, 0, count * count_vars * sizeof(double));
+        for (size_t i = 0; i < count; i++) {
+            for (size_t k = jac.matrix.row_ptr[i]; k < jac.matrix.row_ptr[i + 1]; k++) {
+                jacobian[i * count_vars + jac.matrix.col_idx[k]] = jac.matrix.values[k];
+            }
+        }
+        JacobianDestroy(&jac);
+    }
+
+    for (size_t i = 0; trees != NULL && i < parsed; i++) {
+        if (trees[i] != NULL) {
+            TreeDestroy(&trees[i]);
+        }
+    }
+    FREE(trees);
+    FREE(roots);
+
+    return LeaveContext(ctx, sink, err);
+}
+
+void DifCancel(DifContext_t* ctx) {
+    if (ctx != NULL) {
+        __atomic_store_n(&ctx->cancel, 1, __ATOMIC_RELAXED);
+    }
+}
+
+const char* DifBudgetReport(const DifContext_t* ctx) {
+    return (ctx != NULL) ? ctx->report : "";
+}
+
+void DifFree(char* result) {
+    free(result);
+}
+
+const char* DifErrorString(DifErr_t err) {
+    if ((size_t)err >= sizeof(dif_errors) / sizeof(dif_errors[0])) {
+        return "unknown error";
+    }
+
+    return dif_errors[err];
+}
+
+static DifErr_t ParseExpression(DifContext_t* ctx, const char* expr, Tree_t** tree) {
+    size_t length = strlen(expr);
+
+    // the parser marks up its input in place, so it gets a copy
+    if (ctx->scratch.capacity < length + 1) {
+        BufferDestroy(&ctx->scratch);
+        if (BufferInit(&ctx->scratch, length + 1) != IO_OK) {
+            return DIF_ALLOCATION_FAILED;
+        }
+    }
+    memcpy(ctx->scratch.data, expr, length + 1);
+    ctx->scratch.size = length + 1;
+
+    if (TreeInit(tree) != TREE_OK) {
+        return DIF_ALLOCATION_FAILED;
+    }
+
+    switch (ReadTreeFromString(*tree, ctx->scratch.data)) {
+    case TREE_OK:
+        return DIF_OK;
+    case TREE_ALLOCATION_FAILED:
+    case NODE_ALLOCATION_FAILED:
+        TreeDestroy(tree);
+        return DIF_ALLOCATION_FAILED;
+    case TREE_BUDGET_EXCEEDED:
+        TreeDestroy(tree);
+        return DIF_BUDGET_EXCEEDED;
+    case TREE_SYNTAX_ERROR:
+    case TREE_PRINT_LATEX_FAILED:
+    case TREE_FILE_OPEN_FAILED:
+    case TREE_GET_FILE_SIZE_FAILED:
+    case TREE_BUFFER_FREAD_FAILED:
+    default:
+        TreeDestroy(tree);
+        return DIF_SYNTAX_ERROR;
+    }
+}
+
+static DifErr_t Render(Tree_t* tree, DifFormat_t format, char** result) {
+    char* text = NULL;
+    size_t size = 0;
+
+    FILE* fp = open_memstream(&text, &size);
+    if (fp == NULL) {
+        return DIF_ALLOCATION_FAILED;
+    }
+
+    TreeErr_t err = (format == DIF_FORMAT_LATEX) ? WriteLatexTree(tree, fp) : WriteTree(tree, fp);
+    fclose(fp);
+
+    if (err != TREE_OK) {
+        free(text);
+        return DIF_PRINT_FAILED;
+    }
+
+    if (size != 0 && text[size - 1] == '\n') {
+        text[size - 1] = '\0';
+    }
+    *result = text;
+
+    return DIF_OK;
+}
+
+static void ContextLog(void* user, const char* message) {
+    const DifContext_t* ctx = (const DifContext_t*)user;
+
+    ctx->config.log(ctx->config.log_user, message);
+}
+
+// Library diagnostics made on this thread go to the context's log and its
+// work is charged to the context's budget until the call returns
+static DebugSinkState_t EnterContext(DifContext_t* ctx) {
+    ctx->report[0] = '\0';
+    __atomic_store_n(&ctx->cancel, 0, __ATOMIC_RELAXED);
+    BudgetBegin(&ctx->budget, &ctx->limits, &ctx->cancel);
+
+    return DebugSetSink((ctx->config.log != NULL) ? ContextLog : NULL, ctx);
+}
+
+// Whatever failed past the budget, it failed on the budget
+static DifErr_t LeaveContext(DifContext_t* ctx, DebugSinkState_t sink, DifErr_t err) {
+    DebugRestoreSink(sink);
+
+    if (BudgetEnd(&ctx->budget) != BUDGET_WITHIN) {
+        BudgetDescribe(&ctx->budget, ctx->report, sizeof(ctx->report));
+        return DIF_BUDGET_EXCEEDED;
+    }
+
+    return err;
+}
@@ -0,0 +1,97 @@
+#ifndef DIF_API_H
+#define DIF_API_H
+
+#include <stddef.h>
+
+/*
+Embeddable differentiator, built into libdif.a and libdif.so by lib_script.sh.
+
+Everything a call needs lives in its context: the derivative cache, the
+scratch buffer for the expression being parsed and the log callback. The
+library never reads or writes the console; diagnostics go to the log
+callback and are dropped without one. Calls on different contexts may run
+concurrently. One context is used by one thread at a time.
+
+A call that goes past the context's limits, or is cancelled with DifCancel
+from another thread, frees what it built and fails with
+DIF_BUDGET_EXCEEDED; DifBudgetReport then tells how far it got.
+
+Expressions and results are in the input.txt tree format, e.g.
+("*" ("x" nil nil) ("2" nil nil)). Results are released with DifFree.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DIF_API __attribute__((visibility("default")))
+
+typedef struct DifContext_t DifContext_t;
+
+typedef enum DifErr_t {
+    DIF_OK,
+    DIF_BAD_ARGUMENT,
+    DIF_SYNTAX_ERROR,
+    DIF_UNBOUND_VARIABLE,
+    DIF_EVAL_FAILED,
+    DIF_DIFF_FAILED,
+    DIF_PRINT_FAILED,
+    DIF_ALLOCATION_FAILED,
+    DIF_BUDGET_EXCEEDED
+} DifErr_t;
+
+typedef enum DifFormat_t {
+    DIF_FORMAT_TREE,
+    DIF_FORMAT_LATEX
+} DifFormat_t;
+
+typedef void (*DifLog_t)(void* user, const char* message);
+
+typedef struct DifConfig_t {
+    size_t cache_entries;       // 0 - no derivative cache
+    size_t cache_nodes;
+    size_t simplify_passes;
+    size_t max_nodes;           // limits of each call, 0 - none
+    size_t max_bytes;
+    size_t max_depth;
+    size_t max_ms;
+    DifLog_t log;               // NULL - diagnostics are dropped
+    void* log_user;
+} DifConfig_t;
+
+DIF_API void DifConfigInit(DifConfig_t* config);
+
+// NULL config - the defaults. NULL on allocation failure.
+DIF_API DifContext_t* DifContextCreate(const DifConfig_t* config);
+DIF_API void DifContextDestroy(DifContext_t* ctx);
+
+DIF_API DifErr_t DifSimplify(DifContext_t* ctx, const char* expr, DifFormat_t format, char** result);
+DIF_API DifErr_t DifDerivative(DifContext_t* ctx, const char* expr, const char* var, DifFormat_t format, char** result);
+DIF_API DifErr_t DifEvaluate(DifContext_t* ctx, const char* expr, const char* const* names, const double* values,
+                             size_t count, double* value);
+// Encloses expr over the box names[i] in [lo[i], hi[i]]. result_lo > result_hi
+// if no point of the box is inside the domain; *domain is nonzero if some
+// point may be outside it, the enclosure then covers only the points inside.
+DIF_API DifErr_t DifEvaluateInterval(DifContext_t* ctx, const char* expr, const char* const* names,
+                                     const double* lo, const double* hi, size_t count,
+                                     double* result_lo, double* result_hi, int* domain);
+// jacobian[i * count_vars + j] gets d exprs[i] / d names[j] at the point
+// names = values, row by row
+DIF_API DifErr_t DifJacobian(DifContext_t* ctx, const char* const* exprs, size_t count, const char* const* names,
+                             const double* values, size_t count_vars, double* jacobian);
+
+// Stops the call running on ctx, safe from any thread. Every call starts
+// uncancelled.
+DIF_API void DifCancel(DifContext_t* ctx);
+// Which limit the last call hit, in which phase and its counts at that point;
+// "" if it stayed within them
+DIF_API const char* DifBudgetReport(const DifContext_t* ctx);
+
+DIF_API void DifFree(char* result);
+DIF_API const char* DifErrorString(DifErr_t err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DIF_API_H
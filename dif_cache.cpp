@@ -0,0 +1,300 @@
+#include "dif_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "metrics.h"
+#include "budget.h"
+
+static const size_t DIF_CACHE_NIL = (size_t)-1;
+
+static uint64_t CacheKey(uint64_t hash, const char* var);
+static size_t CacheFind(const DiffCache_t* cache, uint64_t key, const Node_t* node, const char* var);
+static int CacheTreeRelease(DiffCacheTree_t* tree);
+static void LruUnlink(DiffCache_t* cache, size_t idx);
+static void LruPushFront(DiffCache_t* cache, size_t idx);
+static void CacheEvict(DiffCache_t* cache, size_t idx);
+
+DiffCacheErr_t DiffCacheInit(DiffCache_t* cache, size_t max_entries, size_t max_nodes) {
+    assert( cache != NULL );
+    assert( max_entries != 0 );
+
+    cache->entries = (DiffCacheEntry_t*)calloc(max_entries, sizeof(DiffCacheEntry_t));
+    if (cache->entries == NULL) {
+        return DIF_CACHE_ALLOCATION_FAILED;
+    }
+
+    cache->bucket_count = 1;
+    while (cache->bucket_count < max_entries) {
+        cache->bucket_count *= 2;
+    }
+
+    cache->buckets = (size_t*)calloc(cache->bucket_count, sizeof(size_t));
+    if (cache->buckets == NULL) {
+        FREE(cache->entries);
+        return DIF_CACHE_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; i < cache->bucket_count; i++) {
+        cache->buckets[i] = DIF_CACHE_NIL;
+    }
+    for (size_t i = 0; i < max_entries; i++) {
+        cache->entries[i].next = (i + 1 < max_entries) ? i + 1 : DIF_CACHE_NIL;
+    }
+
+    cache->capacity  = max_entries;
+    cache->count     = 0;
+    cache->lru_head  = DIF_CACHE_NIL;
+    cache->lru_tail  = DIF_CACHE_NIL;
+    cache->free_head = 0;
+    cache->max_nodes = max_nodes;
+    cache->nodes     = 0;
+    memset(&cache->stats, 0, sizeof(cache->stats));
+
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return DIF_CACHE_OK;
+}
+
+DiffCacheErr_t DiffCacheDestroy(DiffCache_t* cache) {
+    assert( cache != NULL );
+
+    while (cache->lru_tail != DIF_CACHE_NIL) {
+        CacheEvict(cache, cache->lru_tail);
+    }
+
+    FREE(cache->entries);
+    FREE(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+
+    return DIF_CACHE_OK;
+}
+
+static uint64_t CacheKey(uint64_t hash, const char* var) {
+    uint64_t key = hash ^ (HashString(var) * 0x9E3779B97F4A7C15ull);
+
+    return key ^ (key >> 29);
+}
+
+Node_t* DiffCacheLookup(DiffCache_t* cache, const Node_t* node, uint64_t hash, const char* var) {
+    assert( cache != NULL );
+    assert( node != NULL );
+    assert( var != NULL );
+
+    uint64_t key = CacheKey(hash, var);
+    DiffCacheTree_t* hit = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    ++cache->stats.lookups;
+    METRICS_INC(COUNTER_DIFF_CACHE_LOOKUPS);
+
+    size_t idx = CacheFind(cache, key, node, var);
+    if (idx != DIF_CACHE_NIL) {
+        LruUnlink(cache, idx);
+        LruPushFront(cache, idx);
+
+        hit = cache->entries[idx].derivative;
+        ++hit->refs;
+        ++cache->stats.hits;
+        METRICS_INC(COUNTER_DIFF_CACHE_HITS);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    if (hit == NULL) {
+        return NULL;
+    }
+
+    Budget_t* budget = BudgetSuspend();         // a truncated hit would pass for a derivative
+    Node_t* result = TreeCopySubtree(hit->root, NULL);
+    BudgetResume(budget);
+
+    pthread_mutex_lock(&cache->lock);
+    int last = CacheTreeRelease(hit);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (last) {                                 // evicted while it was copied
+        TreeDestroySubtree(&hit->root);
+        FREE(hit);
+    }
+
+    if (result != NULL) {                       // the copy is the caller's, charged after the fact
+        size_t size = TreeSubtreeSize(result);
+        BudgetCharge(size, size * sizeof(Node_t));
+    }
+
+    return result;
+}
+
+DiffCacheErr_t DiffCacheInsert(DiffCache_t* cache, const Node_t* node, uint64_t hash, const char* var,
+                               const Node_t* derivative) {
+    assert( cache != NULL );
+    assert( node != NULL );
+    assert( var != NULL );
+    assert( derivative != NULL );
+
+    size_t cost = TreeSubtreeSize(node) + TreeSubtreeSize(derivative);
+    if (cost > cache->max_nodes) {
+        return DIF_CACHE_TOO_LARGE;
+    }
+
+    uint64_t key = CacheKey(hash, var);
+
+    pthread_mutex_lock(&cache->lock);
+    int present = CacheFind(cache, key, node, var) != DIF_CACHE_NIL;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (present) {
+        return DIF_CACHE_OK;
+    }
+
+    // copies are made outside the lock, the cache owns them from now on; they
+    // are not the request's, so its budget neither limits nor counts them
+    Budget_t* budget = BudgetSuspend();
+    Node_t* source_copy = TreeCopySubtree(node, NULL);
+    Node_t* derivative_copy = TreeCopySubtree(derivative, NULL);
+    BudgetResume(budget);
+    char* var_copy = strdup(var);
+    DiffCacheTree_t* tree = (DiffCacheTree_t*)calloc(1, sizeof(DiffCacheTree_t));
+    if (source_copy == NULL || derivative_copy == NULL || var_copy == NULL || tree == NULL) {
+        TreeDestroySubtree(&source_copy);
+        TreeDestroySubtree(&derivative_copy);
+        FREE(var_copy);
+        FREE(tree);
+        return DIF_CACHE_ALLOCATION_FAILED;
+    }
+    tree->root = derivative_copy;
+    tree->refs = 1;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (CacheFind(cache, key, node, var) != DIF_CACHE_NIL) {     // another writer was first
+        pthread_mutex_unlock(&cache->lock);
+
+        TreeDestroySubtree(&source_copy);
+        TreeDestroySubtree(&tree->root);
+        FREE(var_copy);
+        FREE(tree);
+        return DIF_CACHE_OK;
+    }
+
+    while (cache->lru_tail != DIF_CACHE_NIL && (cache->free_head == DIF_CACHE_NIL || cache->nodes + cost > cache->max_nodes)) {
+        CacheEvict(cache, cache->lru_tail);
+        ++cache->stats.evictions;
+    }
+
+    size_t idx = cache->free_head;
+    DiffCacheEntry_t* entry = &cache->entries[idx];
+    cache->free_head = entry->next;
+
+    entry->key_hash   = key;
+    entry->var        = var_copy;
+    entry->source     = source_copy;
+    entry->derivative = tree;
+    entry->cost       = cost;
+
+    size_t bucket = key & (cache->bucket_count - 1);
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = idx;
+
+    LruPushFront(cache, idx);
+    ++cache->count;
+    cache->nodes += cost;
+    ++cache->stats.inserts;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return DIF_CACHE_OK;
+}
+
+static size_t CacheFind(const DiffCache_t* cache, uint64_t key, const Node_t* node, const char* var) {
+    size_t idx = cache->buckets[key & (cache->bucket_count - 1)];
+    for (; idx != DIF_CACHE_NIL; idx = cache->entries[idx].bucket_next) {
+        const DiffCacheEntry_t* entry = &cache->entries[idx];
+        if (entry->key_hash == key && strcmp(entry->var, var) == 0 && TreeEqualSubtree(entry->source, node)) {
+            return idx;
+        }
+    }
+
+    return DIF_CACHE_NIL;
+}
+
+// Under the lock; 1 if that was the last reference, the caller frees the tree
+static int CacheTreeRelease(DiffCacheTree_t* tree) {
+    return --tree->refs == 0;
+}
+
+static void LruUnlink(DiffCache_t* cache, size_t idx) {
+    DiffCacheEntry_t* entry = &cache->entries[idx];
+
+    if (entry->prev != DIF_CACHE_NIL) cache->entries[entry->prev].next = entry->next;
+    else                              cache->lru_head = entry->next;
+
+    if (entry->next != DIF_CACHE_NIL) cache->entries[entry->next].prev = entry->prev;
+    else                              cache->lru_tail = entry->prev;
+}
+
+static void LruPushFront(DiffCache_t* cache, size_t idx) {
+    DiffCacheEntry_t* entry = &cache->entries[idx];
+
+    entry->prev = DIF_CACHE_NIL;
+    entry->next = cache->lru_head;
+
+    if (cache->lru_head != DIF_CACHE_NIL) cache->entries[cache->lru_head].prev = idx;
+    else                                  cache->lru_tail = idx;
+
+    cache->lru_head = idx;
+}
+
+static void CacheEvict(DiffCache_t* cache, size_t idx) {
+    DiffCacheEntry_t* entry = &cache->entries[idx];
+
+    size_t* link = &cache->buckets[entry->key_hash & (cache->bucket_count - 1)];
+    for (; *link != idx; link = &cache->entries[*link].bucket_next);
+    *link = entry->bucket_next;
+
+    LruUnlink(cache, idx);
+
+    cache->nodes -= entry->cost;
+    --cache->count;
+
+    TreeDestroySubtree(&entry->source);
+    if (CacheTreeRelease(entry->derivative)) {
+        TreeDestroySubtree(&entry->derivative->root);
+        FREE(entry->derivative);
+    }
+    entry->derivative = NULL;
+    FREE(entry->var);
+
+    entry->next = cache->free_head;
+    cache->free_head = idx;
+}
+
+DiffCacheStats_t DiffCacheGetStats(DiffCache_t* cache) {
+    assert( cache != NULL );
+
+    pthread_mutex_lock(&cache->lock);
+
+    DiffCacheStats_t stats = cache->stats;
+    stats.entries = cache->count;
+    stats.nodes   = cache->nodes;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return stats;
+}
+
+void DiffCachePrintStats(DiffCache_t* cache, FILE* fp) {
+    assert( cache != NULL );
+    assert( fp != NULL );
+
+    DiffCacheStats_t stats = DiffCacheGetStats(cache);
+    double hit_rate = (stats.lookups != 0) ? (double)stats.hits / (double)stats.lookups : 0;
+
+    fprintf(fp, "{\"lookups\": %llu, \"hits\": %llu, \"hit_rate\": %lg, \"inserts\": %llu, "
+                "\"evictions\": %llu, \"entries\": %zu, \"nodes\": %zu}\n",
+            (unsigned long long)stats.lookups, (unsigned long long)stats.hits, hit_rate,
+            (unsigned long long)stats.inserts, (unsigned long long)stats.evictions,
+            stats.entries, stats.nodes);
+}
@@ -0,0 +1,70 @@
+#ifndef DIF_CACHE_H
+#define DIF_CACHE_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "tree.h"
+
+const size_t DIF_CACHE_MIN_NODES = 2;
+
+enum DiffCacheErr_t {
+    DIF_CACHE_OK,
+    DIF_CACHE_ALLOCATION_FAILED,
+    DIF_CACHE_TOO_LARGE
+};
+
+// Lookups copy the derivative outside the lock: the entry holds one
+// reference and every copy in progress another, the last one frees it
+struct DiffCacheTree_t {
+    Node_t* root;
+    size_t refs;
+};
+
+struct DiffCacheEntry_t {
+    uint64_t key_hash;
+    char* var;
+    Node_t* source;
+    DiffCacheTree_t* derivative;
+    size_t cost;
+    size_t prev;
+    size_t next;
+    size_t bucket_next;
+};
+
+struct DiffCacheStats_t {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t inserts;
+    uint64_t evictions;
+    size_t entries;
+    size_t nodes;
+};
+
+struct DiffCache_t {
+    DiffCacheEntry_t* entries;
+    size_t capacity;
+    size_t count;
+    size_t* buckets;
+    size_t bucket_count;
+    size_t lru_head;
+    size_t lru_tail;
+    size_t free_head;
+    size_t max_nodes;
+    size_t nodes;
+    DiffCacheStats_t stats;
+    pthread_mutex_t lock;
+};
+
+DiffCacheErr_t DiffCacheInit(DiffCache_t* cache, size_t max_entries, size_t max_nodes);
+DiffCacheErr_t DiffCacheDestroy(DiffCache_t* cache);
+
+Node_t* DiffCacheLookup(DiffCache_t* cache, const Node_t* node, uint64_t hash, const char* var);
+// A key already present is left as it is
+DiffCacheErr_t DiffCacheInsert(DiffCache_t* cache, const Node_t* node, uint64_t hash, const char* var,
+                               const Node_t* derivative);
+
+DiffCacheStats_t DiffCacheGetStats(DiffCache_t* cache);
+void DiffCachePrintStats(DiffCache_t* cache, FILE* fp);
+
+#endif // DIF_CACHE_H
@@ -0,0 +1,297 @@
+#include "dif_eval.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "io.h"
+#include "operations.h"
+
+// zero tangents and adjoints are skipped exactly so that a partial that is
+// not finite only matters where it is actually used
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+
+EvalErr_t TreeEval(const Node_t* node, const EvalVar_t* vars, size_t var_count, double* result) {
+    return TreeEvalScalar(node, vars, var_count, result);
+}
+
+template <typename S>
+EvalErr_t TreeEvalScalar(const Node_t* node, const ScalarVar_t<S>* vars, size_t var_count, S* result) {
+    assert( node != NULL );
+    assert( vars != NULL || var_count == 0 );
+    assert( result != NULL );
+
+    switch (node->type) {
+    case TYPE_NUMBER:
+        *result = ScalarTraits<S>::Splat(node->data.number);
+        return EVAL_OK;
+
+    case TYPE_VARIABLE:
+        for (size_t i = 0; i < var_count; i++) {
+            if (strcmp(vars[i].name, node->data.variable) == 0) {
+                *result = vars[i].value;
+                return EVAL_OK;
+            }
+        }
+        return EVAL_UNBOUND_VARIABLE;
+
+    case TYPE_THUNK: {                      // evaluate a temporary expansion, the tree stays lazy
+        Node_t* expanded = node->data.thunk->expand(node->data.thunk);
+        if (expanded == NULL) {
+            return EVAL_UNDEFINED_NODE;
+        }
+
+        EvalErr_t err = TreeEvalScalar(expanded, vars, var_count, result);
+        TreeDestroySubtree(&expanded);
+
+        return err;
+    }
+
+    case TYPE_OPERATION:
+        break;
+
+    case TYPE_UNDEFINED:
+    default:
+        return EVAL_UNDEFINED_NODE;
+    }
+
+    S left = ScalarTraits<S>::Splat(0), right = ScalarTraits<S>::Splat(0);
+    EvalErr_t err = EVAL_OK;
+
+    if (node->left != NULL && (err = TreeEvalScalar(node->left, vars, var_count, &left)) != EVAL_OK) {
+        return err;
+    }
+    if (node->right == NULL || node->data.operation == OPERATION_UNDEF) {
+        return EVAL_UNDEFINED_NODE;
+    }
+    if ((err = TreeEvalScalar(node->right, vars, var_count, &right)) != EVAL_OK) {
+        return err;
+    }
+
+    *result = ScalarFuncOp(node->data.operation, left, right);
+
+    return EVAL_OK;
+}
+
+static EvalErr_t RecursiveTapeBuild(EvalTape_t* tape, const Node_t* node, const char* const* vars, size_t* slot);
+static EvalErr_t TapePush(EvalTape_t* tape, const TapeInstr_t* instr, size_t* slot);
+
+EvalErr_t EvalTapeBuild(EvalTape_t* tape, const Node_t* node, const char* const* vars, size_t var_count) {
+    assert( tape != NULL );
+    assert( node != NULL );
+    assert( vars != NULL || var_count == 0 );
+
+    tape->size      = 0;
+    tape->capacity  = TreeSubtreeSize(node);
+    tape->var_count = var_count;
+    tape->code      = (TapeInstr_t*)calloc(tape->capacity, sizeof(TapeInstr_t));
+    if (tape->code == NULL) {
+        return EVAL_ALLOCATION_FAILED;
+    }
+
+    size_t slot = TAPE_NONE;
+    EvalErr_t err = RecursiveTapeBuild(tape, node, vars, &slot);
+    if (err != EVAL_OK) {
+        EvalTapeDestroy(tape);
+    }
+
+    return err;
+}
+
+EvalErr_t EvalTapeDestroy(EvalTape_t* tape) {
+    assert( tape != NULL );
+
+    FREE(tape->code);
+    tape->size = 0;
+    tape->capacity = 0;
+
+    return EVAL_OK;
+}
+
+static EvalErr_t RecursiveTapeBuild(EvalTape_t* tape, const Node_t* node, const char* const* vars, size_t* slot) {
+    TapeInstr_t instr = {node->type, OPERATION_UNDEF, TAPE_NONE, TAPE_NONE, TAPE_NONE, 0};
+    EvalErr_t err = EVAL_OK;
+
+    switch (node->type) {
+    case TYPE_NUMBER:
+        instr.number = node->data.number;
+        break;
+
+    case TYPE_VARIABLE:
+        for (size_t i = 0; i < tape->var_count; i++) {
+            if (strcmp(vars[i], node->data.variable) == 0) {
+                instr.var = i;
+                break;
+            }
+        }
+        if (instr.var == TAPE_NONE) {
+            return EVAL_UNBOUND_VARIABLE;
+        }
+        break;
+
+    case TYPE_THUNK: {                      // compile a temporary expansion, the tree stays lazy
+        Node_t* expanded = node->data.thunk->expand(node->data.thunk);
+        if (expanded == NULL) {
+            return EVAL_UNDEFINED_NODE;
+        }
+
+        err = RecursiveTapeBuild(tape, expanded, vars, slot);
+        TreeDestroySubtree(&expanded);
+
+        return err;
+    }
+
+    case TYPE_OPERATION:
+        if (node->right == NULL) {
+            return EVAL_UNDEFINED_NODE;
+        }
+
+        instr.operation = node->data.operation;
+        if (node->left != NULL && (err = RecursiveTapeBuild(tape, node->left, vars, &instr.left)) != EVAL_OK) {
+            return err;
+        }
+        if ((err = RecursiveTapeBuild(tape, node->right, vars, &instr.right)) != EVAL_OK) {
+            return err;
+        }
+        break;
+
+    case TYPE_UNDEFINED:
+    default:
+        return EVAL_UNDEFINED_NODE;
+    }
+
+    return TapePush(tape, &instr, slot);
+}
+
+static EvalErr_t TapePush(EvalTape_t* tape, const TapeInstr_t* instr, size_t* slot) {
+    if (tape->size == tape->capacity) {
+        size_t capacity = 2 * tape->capacity + 1;
+        TapeInstr_t* code = (TapeInstr_t*)realloc(tape->code, capacity * sizeof(TapeInstr_t));
+        if (code == NULL) {
+            return EVAL_ALLOCATION_FAILED;
+        }
+
+        tape->code = code;
+        tape->capacity = capacity;
+    }
+
+    *slot = tape->size;
+    tape->code[tape->size++] = *instr;
+
+    return EVAL_OK;
+}
+
+double EvalTapeRun(const EvalTape_t* tape, const double* values, double* slots) {
+    return EvalTapeRunScalar(tape, values, slots);
+}
+
+template <typename S>
+S EvalTapeRunScalar(const EvalTape_t* tape, const S* values, S* slots) {
+    assert( tape != NULL );
+    assert( tape->size != 0 );
+    assert( values != NULL || tape->var_count == 0 );
+    assert( slots != NULL );
+
+    for (size_t i = 0; i < tape->size; i++) {
+        const TapeInstr_t* instr = &tape->code[i];
+
+        switch (instr->type) {
+        case TYPE_NUMBER:
+            slots[i] = ScalarTraits<S>::Splat(instr->number);
+            break;
+
+        case TYPE_VARIABLE:
+            slots[i] = values[instr->var];
+            break;
+
+        case TYPE_OPERATION:
+            slots[i] = ScalarFuncOp(instr->operation, (instr->left != TAPE_NONE) ? slots[instr->left]
+                                                                                : ScalarTraits<S>::Splat(0),
+                                    slots[instr->right]);
+            break;
+
+        case TYPE_THUNK:
+        case TYPE_UNDEFINED:
+        default:
+            slots[i] = ScalarTraits<S>::Splat(0);
+            break;
+        }
+    }
+
+    return slots[tape->size - 1];
+}
+
+void EvalTapeTangent(const EvalTape_t* tape, const double* slots, const double* seeds, double* tangents) {
+    assert( tape != NULL );
+    assert( slots != NULL );
+    assert( seeds != NULL || tape->var_count == 0 );
+    assert( tangents != NULL );
+
+    for (size_t i = 0; i < tape->size; i++) {
+        const TapeInstr_t* instr = &tape->code[i];
+
+        tangents[i] = 0;
+        if (instr->type == TYPE_VARIABLE) {
+            tangents[i] = seeds[instr->var];
+            continue;
+        }
+        if (instr->type != TYPE_OPERATION) {
+            continue;
+        }
+
+        double left  = (instr->left != TAPE_NONE) ? tangents[instr->left] : 0;
+        double right = tangents[instr->right];
+        if (left == 0 && right == 0) {
+            continue;
+        }
+
+        double da = 0, db = 0;
+        OPERATIONS[instr->operation].partial((instr->left != TAPE_NONE) ? slots[instr->left] : 0,
+                                             slots[instr->right], slots[i], &da, &db);
+
+        tangents[i] = ((left != 0) ? da * left : 0) + ((right != 0) ? db * right : 0);
+    }
+}
+
+void EvalTapeAdjoint(const EvalTape_t* tape, const double* slots, double* adjoints, double* gradient) {
+    assert( tape != NULL );
+    assert( slots != NULL );
+    assert( adjoints != NULL );
+    assert( gradient != NULL || tape->var_count == 0 );
+
+    for (size_t i = tape->size; i-- > 0;) {
+        const TapeInstr_t* instr = &tape->code[i];
+        double adjoint = adjoints[i];
+        adjoints[i] = 0;
+
+        if (adjoint == 0) {
+            continue;
+        }
+        if (instr->type == TYPE_VARIABLE) {
+            gradient[instr->var] += adjoint;
+            continue;
+        }
+        if (instr->type != TYPE_OPERATION) {
+            continue;
+        }
+
+        double da = 0, db = 0;
+        OPERATIONS[instr->operation].partial((instr->left != TAPE_NONE) ? slots[instr->left] : 0,
+                                             slots[instr->right], slots[i], &da, &db);
+
+        if (instr->left != TAPE_NONE) {
+            adjoints[instr->left] += da * adjoint;
+        }
+        adjoints[instr->right] += db * adjoint;
+    }
+}
+
+#define EVAL_SCALAR_INSTANTIATE(type_)                                                                  \
+    template EvalErr_t TreeEvalScalar<type_>(const Node_t*, const ScalarVar_t<type_>*, size_t, type_*); \
+    template type_ EvalTapeRunScalar<type_>(const EvalTape_t*, const type_*, type_*);
+
+EVAL_SCALAR_INSTANTIATE(float)
+EVAL_SCALAR_INSTANTIATE(double)
+EVAL_SCALAR_INSTANTIATE(long double)
+EVAL_SCALAR_INSTANTIATE(LanesF8_t)
+EVAL_SCALAR_INSTANTIATE(LanesD4_t)
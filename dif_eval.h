@@ -0,0 +1,78 @@
+#ifndef DIF_EVAL_H
+#define DIF_EVAL_H
+
+#include "tree.h"
+#include "scalar.h"
+
+enum EvalErr_t {
+    EVAL_OK,
+    EVAL_UNBOUND_VARIABLE,
+    EVAL_UNDEFINED_NODE,
+    EVAL_ALLOCATION_FAILED
+};
+
+template <typename S>
+struct ScalarVar_t {
+    const char* name;
+    S value;
+};
+
+typedef ScalarVar_t<double> EvalVar_t;
+
+const size_t TAPE_NONE = (size_t)-1;
+
+struct TapeInstr_t {
+    TreeElemType type;
+    Operation_t operation;
+    size_t left;
+    size_t right;
+    size_t var;
+    double number;
+};
+
+// Postorder instruction list of one tree: operands always come before the
+// instruction that uses them and the result is in the last slot. Variables
+// are indices into the name list given to EvalTapeBuild.
+struct EvalTape_t {
+    TapeInstr_t* code;
+    size_t size;
+    size_t capacity;
+    size_t var_count;
+};
+
+EvalErr_t TreeEval(const Node_t* node, const EvalVar_t* vars, size_t var_count, double* result);
+
+EvalErr_t EvalTapeBuild(EvalTape_t* tape, const Node_t* node, const char* const* vars, size_t var_count);
+EvalErr_t EvalTapeDestroy(EvalTape_t* tape);
+double EvalTapeRun(const EvalTape_t* tape, const double* values, double* slots);
+
+// Forward mode over slots of EvalTapeRun: tangents[i] = d slot_i / d seed direction
+void EvalTapeTangent(const EvalTape_t* tape, const double* slots, const double* seeds, double* tangents);
+// Reverse mode over slots of EvalTapeRun: adjoints hold the output seeds and are
+// consumed, gradient[var] accumulates d (seeded outputs) / d var
+void EvalTapeAdjoint(const EvalTape_t* tape, const double* slots, double* adjoints, double* gradient);
+
+typedef Lanes_t<float, 8>  LanesF8_t;
+typedef Lanes_t<double, 4> LanesD4_t;
+
+// TreeEval and EvalTapeRun in any scalar type of scalar.h, the double ones
+// are these. Instantiated for float, double, long double, LanesF8_t and
+// LanesD4_t; a Lanes_t tape run evaluates one point per lane.
+template <typename S>
+EvalErr_t TreeEvalScalar(const Node_t* node, const ScalarVar_t<S>* vars, size_t var_count, S* result);
+template <typename S>
+S EvalTapeRunScalar(const EvalTape_t* tape, const S* values, S* slots);
+
+#define EVAL_SCALAR_EXTERN(type_)                                                                               \
+    extern template EvalErr_t TreeEvalScalar<type_>(const Node_t*, const ScalarVar_t<type_>*, size_t, type_*); \
+    extern template type_ EvalTapeRunScalar<type_>(const EvalTape_t*, const type_*, type_*);
+
+EVAL_SCALAR_EXTERN(float)
+EVAL_SCALAR_EXTERN(double)
+EVAL_SCALAR_EXTERN(long double)
+EVAL_SCALAR_EXTERN(LanesF8_t)
+EVAL_SCALAR_EXTERN(LanesD4_t)
+
+#undef EVAL_SCALAR_EXTERN
+
+#endif // DIF_EVAL_H
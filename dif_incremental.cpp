@@ -0,0 +1,452 @@
+#include "dif_incremental.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "io.h"
+#include "utils.h"
+#include "metrics.h"
+#include "dif_math.h"
+#include "alloc_track.h"
+
+// as in the rules of dif_math.cpp, a number only matches the exact value:
+// the optimizer's tolerance would drop small nonzero constants for good
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+
+#define IS_VALUE(ptr, val) \
+    (ptr != NULL && ptr->type == TYPE_NUMBER && ptr->data.number == val)
+
+// Rule being rebuilt with the records of its operands
+struct IncRule_t {
+    IncDiff_t* inc;
+    IncRecord_t* lrec;
+    IncRecord_t* rrec;
+};
+
+static IncRecord_t* GetRecord(IncDiff_t* inc, const Node_t* node);
+static TreeErr_t BuildRecords(IncDiff_t* inc, Node_t* node);
+static void RebuildRecord(IncDiff_t* inc, IncRecord_t* rec);
+static void ReleaseRecords(IncDiff_t* inc, Node_t* node);
+static void MarkPath(IncDiff_t* inc, Node_t* node);
+static void TeardownDirty(IncDiff_t* inc, Node_t* node);
+static void RebuildDirty(IncDiff_t* inc, Node_t* node);
+
+static int IsSlot(const Node_t* node, const IncRecord_t* lrec, const IncRecord_t* rrec);
+static void DropOwn(Node_t* node, IncRecord_t* lrec, IncRecord_t* rrec);
+static Node_t* FoldOwn(Node_t* node, IncRecord_t* lrec, IncRecord_t* rrec);
+
+static Node_t* IncDiffHook(const Node_t* operand, void* arg);
+static Node_t* IncCopyHook(const Node_t* operand, void* arg);
+static void IncDiscardHook(Node_t* node, void* arg);
+static int IncDependsHook(const Node_t* operand, void* arg);
+static Node_t* ExpandRef(const Thunk_t* thunk);
+
+TreeErr_t IncDiffInit(IncDiff_t* inc, Tree_t* source, const char* var) {
+    assert( inc != NULL );
+    assert( source != NULL );
+    assert( source->root != NULL );
+    assert( var != NULL );
+
+    inc->var = strdup(var);
+    inc->source = source;
+    inc->rebuilt = 0;
+
+    if (inc->var == NULL || NodeMapInit(&inc->records, TreeSubtreeSize(source->root)) != TREE_OK) {
+        FREE(inc->var);
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    TreeErr_t err = BuildRecords(inc, source->root);
+    if (err != TREE_OK) {
+        IncDiffDestroy(inc);
+    }
+
+    return err;
+}
+
+TreeErr_t IncDiffDestroy(IncDiff_t* inc) {
+    assert( inc != NULL );
+
+    // attached derivatives are freed together with the derivative that embeds them
+    for (size_t i = 0; i < inc->records.capacity; i++) {
+        if (inc->records.entries[i].key == NULL) {
+            continue;
+        }
+
+        IncRecord_t* rec = (IncRecord_t*)inc->records.entries[i].info.data;
+        if (!rec->attached) {
+            TreeDestroySubtree(&rec->deriv);
+        }
+    }
+
+    for (size_t i = 0; i < inc->records.capacity; i++) {
+        if (inc->records.entries[i].key != NULL) {
+            free(inc->records.entries[i].info.data);
+        }
+    }
+
+    NodeMapDestroy(&inc->records);
+    FREE(inc->var);
+    inc->source = NULL;
+
+    return TREE_OK;
+}
+
+static IncRecord_t* GetRecord(IncDiff_t* inc, const Node_t* node) {
+    NodeInfo_t* info = NodeMapFind(&inc->records, node);
+
+    return (info != NULL) ? (IncRecord_t*)info->data : NULL;
+}
+
+static TreeErr_t BuildRecords(IncDiff_t* inc, Node_t* node) {
+    if (node->left != NULL && BuildRecords(inc, node->left) != TREE_OK) {
+        return TREE_ALLOCATION_FAILED;
+    }
+    if (node->right != NULL && BuildRecords(inc, node->right) != TREE_OK) {
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    IncRecord_t* rec = (IncRecord_t*)calloc(1, sizeof(IncRecord_t));
+    NodeInfo_t* info = (rec != NULL) ? NodeMapInsert(&inc->records, node) : NULL;
+    if (info == NULL) {
+        free(rec);
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    rec->source = node;
+    rec->ref.expand = ExpandRef;
+    rec->ref.source = node;
+    rec->ref.ctx = inc;
+    info->data = rec;
+
+    RebuildRecord(inc, rec);
+
+    return TREE_OK;
+}
+
+static void RebuildRecord(IncDiff_t* inc, IncRecord_t* rec) {
+    Node_t* node = rec->source;
+    IncRecord_t* lrec = (node->left  != NULL) ? GetRecord(inc, node->left)  : NULL;
+    IncRecord_t* rrec = (node->right != NULL) ? GetRecord(inc, node->right) : NULL;
+
+    rec->depends = (node->type == TYPE_VARIABLE && strcmp(node->data.variable, inc->var) == 0)
+                || (lrec != NULL && lrec->depends) || (rrec != NULL && rrec->depends);
+
+    IncRule_t rule = {inc, lrec, rrec};
+    DiffHooks_t hooks = {IncDiffHook, IncCopyHook, &rule, IncDiscardHook, IncDependsHook};
+
+    rec->deriv = FoldOwn(TreeDiffStep(node, inc->var, &hooks), lrec, rrec);
+    rec->deriv->parent = NULL;
+    rec->attached = 0;
+    rec->dirty = 0;
+
+    ++inc->rebuilt;
+    METRICS_INC(COUNTER_INC_REBUILT);
+}
+
+static Node_t* IncDiffHook(const Node_t* operand, void* arg) {
+    IncRecord_t* rec = GetRecord(((IncRule_t*)arg)->inc, operand);
+    assert( rec != NULL && !rec->attached );
+
+    rec->attached = 1;
+
+    return rec->deriv;
+}
+
+static Node_t* IncCopyHook(const Node_t* operand, void* arg) {
+    if (operand->type != TYPE_OPERATION) {
+        return TreeCopySubtree(operand, NULL);
+    }
+
+    IncRecord_t* rec = GetRecord(((IncRule_t*)arg)->inc, operand);
+    assert( rec != NULL );
+
+    return NodeInit(NULL, NULL, NULL, TYPE_THUNK, (const Thunk_t*)&rec->ref);
+}
+
+static void IncDiscardHook(Node_t* node, void* arg) {
+    IncRule_t* rule = (IncRule_t*)arg;
+
+    DropOwn(node, rule->lrec, rule->rrec);
+}
+
+static int IncDependsHook(const Node_t* operand, void* arg) {
+    IncRecord_t* rec = GetRecord(((IncRule_t*)arg)->inc, operand);
+
+    return rec == NULL || rec->depends;
+}
+
+static Node_t* ExpandRef(const Thunk_t* thunk) {
+    return TreeCopySubtree(thunk->source, NULL);
+}
+
+static int IsSlot(const Node_t* node, const IncRecord_t* lrec, const IncRecord_t* rrec) {
+    return (lrec != NULL && lrec->attached && node == lrec->deriv)
+        || (rrec != NULL && rrec->attached && node == rrec->deriv);
+}
+
+// Frees the nodes a rule created itself. Operand derivatives met on the way
+// are only detached: they still belong to their own records.
+static void DropOwn(Node_t* node, IncRecord_t* lrec, IncRecord_t* rrec) {
+    if (node == NULL) {
+        return;
+    }
+
+    if (IsSlot(node, lrec, rrec)) {
+        Node_t** parent_ptr = GetParentNodePointer(node);
+        if (parent_ptr != NULL) {
+            *parent_ptr = NULL;
+        }
+        node->parent = NULL;
+
+        if (lrec != NULL && node == lrec->deriv) lrec->attached = 0;
+        if (rrec != NULL && node == rrec->deriv) rrec->attached = 0;
+        return;
+    }
+
+    DropOwn(node->left, lrec, rrec);
+    DropOwn(node->right, lrec, rrec);
+    node->left = node->right = NULL;
+    NodeDestroy(&node);
+}
+
+// The ConstOptimization* rules, applied to the rule's own nodes only: the
+// embedded operand derivatives were simplified when they were built.
+static Node_t* FoldOwn(Node_t* node, IncRecord_t* lrec, IncRecord_t* rrec) {
+    if (IsSlot(node, lrec, rrec) || node->type != TYPE_OPERATION) {
+        return node;
+    }
+
+    if (node->left != NULL) {
+        node->left = FoldOwn(node->left, lrec, rrec);
+        node->left->parent = node;
+    }
+    if (node->right != NULL) {
+        node->right = FoldOwn(node->right, lrec, rrec);
+        node->right->parent = node;
+    }
+
+    Node_t* left = node->left;
+    Node_t* right = node->right;
+    Node_t* keep = NULL;
+    Node_t* result = NULL;
+
+    double value = 0;
+    if (FoldFuncOp(node, &value)) {
+        result = NodeInit(NULL, NULL, NULL, TYPE_NUMBER, value);
+    } else {
+        switch (node->data.operation) {
+        case OPERATION_ADD:
+            if      (IS_VALUE(left,  0.0)) keep = right;
+            else if (IS_VALUE(right, 0.0)) keep = left;
+            break;
+
+        case OPERATION_SUB:
+            if      (IS_VALUE(right, 0.0)) keep = left;
+            break;
+
+        case OPERATION_MUL:
+            if      (IS_VALUE(left,  0.0) || IS_VALUE(right, 0.0))
+                                           result = NodeInit(NULL, NULL, NULL, TYPE_NUMBER, 0.0);
+            else if (IS_VALUE(left,  1.0)) keep = right;
+            else if (IS_VALUE(right, 1.0)) keep = left;
+            break;
+
+        case OPERATION_DIV:
+            if      (IS_VALUE(left,  0.0)) result = NodeInit(NULL, NULL, NULL, TYPE_NUMBER, 0.0);
+            else if (IS_VALUE(right, 1.0)) keep = left;
+            break;
+
+        case OPERATION_EXP:
+            if      (IS_VALUE(right, 0.0) || IS_VALUE(left, 1.0))
+                                           result = NodeInit(NULL, NULL, NULL, TYPE_NUMBER, 1.0);
+            else if (IS_VALUE(right, 1.0)) keep = left;
+            break;
+
+        case OPERATION_UNDEF:
+        case OPERATION_SQRT:
+        case OPERATION_LN:
+        case OPERATION_LOG:
+        case OPERATION_SIN:
+        case OPERATION_COS:
+        case OPERATION_TAN:
+        case OPERATION_COT:
+        case OPERATION_SINH:
+        case OPERATION_COSH:
+        case OPERATION_TANH:
+        case OPERATION_COTH:
+        case OPERATION_ASIN:
+        case OPERATION_ACOS:
+        case OPERATION_ATAN:
+        case OPERATION_ACOT:
+        default:
+            break;
+        }
+    }
+
+    if (keep != NULL) {
+        if (keep == node->left) node->left  = NULL;
+        else                    node->right = NULL;
+        keep->parent = NULL;
+        result = keep;
+    }
+
+    if (result == NULL) {
+        return node;
+    }
+
+    node->parent = NULL;
+    DropOwn(node, lrec, rrec);
+
+    return result;
+}
+
+static void ReleaseRecords(IncDiff_t* inc, Node_t* node) {
+    IncRecord_t* rec = GetRecord(inc, node);
+    if (rec != NULL) {
+        if (!rec->attached) {
+            TreeDestroySubtree(&rec->deriv);
+        }
+        NodeMapErase(&inc->records, node);
+        free(rec);
+    }
+
+    if (node->left != NULL) {
+        ReleaseRecords(inc, node->left);
+    }
+    if (node->right != NULL) {
+        ReleaseRecords(inc, node->right);
+    }
+}
+
+static void MarkPath(IncDiff_t* inc, Node_t* node) {
+    for (; node != NULL; node = node->parent) {
+        IncRecord_t* rec = GetRecord(inc, node);
+        if (rec == NULL || rec->dirty) {
+            break;
+        }
+        rec->dirty = 1;
+    }
+}
+
+static void TeardownDirty(IncDiff_t* inc, Node_t* node) {
+    IncRecord_t* rec = GetRecord(inc, node);
+    if (rec == NULL || !rec->dirty) {
+        return;
+    }
+
+    IncRecord_t* lrec = (node->left  != NULL) ? GetRecord(inc, node->left)  : NULL;
+    IncRecord_t* rrec = (node->right != NULL) ? GetRecord(inc, node->right) : NULL;
+
+    DropOwn(rec->deriv, lrec, rrec);
+    rec->deriv = NULL;
+
+    if (node->left != NULL) {
+        TeardownDirty(inc, node->left);
+    }
+    if (node->right != NULL) {
+        TeardownDirty(inc, node->right);
+    }
+}
+
+static void RebuildDirty(IncDiff_t* inc, Node_t* node) {
+    IncRecord_t* rec = GetRecord(inc, node);
+    if (rec == NULL || !rec->dirty) {
+        return;
+    }
+
+    if (node->left != NULL) {
+        RebuildDirty(inc, node->left);
+    }
+    if (node->right != NULL) {
+        RebuildDirty(inc, node->right);
+    }
+
+    RebuildRecord(inc, rec);
+}
+
+TreeErr_t IncDiffReplace(IncDiff_t* inc, Node_t* target, Node_t* subtree) {
+    assert( inc != NULL );
+    assert( target != NULL );
+    assert( subtree != NULL );
+
+    if (GetRecord(inc, target) == NULL) {
+        return TREE_SYNTAX_ERROR;
+    }
+
+    MarkPath(inc, target);
+    TeardownDirty(inc, inc->source->root);
+
+    // the target keeps its identity, so references to its ancestors stay valid
+    if (target->left != NULL) {
+        ReleaseRecords(inc, target->left);
+        TreeDestroySubtree(&target->left);
+    }
+    if (target->right != NULL) {
+        ReleaseRecords(inc, target->right);
+        TreeDestroySubtree(&target->right);
+    }
+
+    if (target->type == TYPE_VARIABLE) {
+        TRACK_FREE(target->data.variable);
+    }
+
+    target->type  = subtree->type;
+    target->data  = subtree->data;
+    target->left  = subtree->left;
+    target->right = subtree->right;
+    if (target->left  != NULL) target->left->parent  = target;
+    if (target->right != NULL) target->right->parent = target;
+
+    subtree->type = TYPE_NUMBER;
+    subtree->left = subtree->right = subtree->parent = NULL;
+    NodeDestroy(&subtree);
+
+    if (target->left != NULL && BuildRecords(inc, target->left) != TREE_OK) {
+        return TREE_ALLOCATION_FAILED;
+    }
+    if (target->right != NULL && BuildRecords(inc, target->right) != TREE_OK) {
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    RebuildDirty(inc, inc->source->root);
+
+    return TREE_OK;
+}
+
+TreeErr_t IncDiffMarkDirty(IncDiff_t* inc, Node_t* node) {
+    assert( inc != NULL );
+    assert( node != NULL );
+
+    if (GetRecord(inc, node) == NULL) {
+        return TREE_SYNTAX_ERROR;
+    }
+
+    MarkPath(inc, node);
+
+    return TREE_OK;
+}
+
+TreeErr_t IncDiffUpdate(IncDiff_t* inc) {
+    assert( inc != NULL );
+
+    TeardownDirty(inc, inc->source->root);
+    RebuildDirty(inc, inc->source->root);
+
+    return TREE_OK;
+}
+
+Node_t* IncDiffResult(IncDiff_t* inc) {
+    assert( inc != NULL );
+
+    IncRecord_t* rec = GetRecord(inc, inc->source->root);
+    if (rec == NULL || rec->deriv == NULL) {
+        return NULL;
+    }
+
+    Node_t* result = TreeCopySubtree(rec->deriv, NULL);
+    TreeForce(&result);
+
+    return result;
+}
@@ -0,0 +1,36 @@
+#ifndef DIF_INCREMENTAL_H
+#define DIF_INCREMENTAL_H
+
+#include "tree.h"
+#include "node_map.h"
+
+struct IncRecord_t {
+    Node_t* source;
+    Node_t* deriv;
+    Thunk_t ref;
+    int depends;                // source contains var
+    int attached;
+    int dirty;
+};
+
+// Keeps the simplified derivative of every input node. The derivative of a
+// node embeds its operands' derivatives without copying them and refers to
+// operand subtrees through reference thunks, so an edit only rebuilds the
+// rules on the path from the edited node to the root.
+struct IncDiff_t {
+    char* var;
+    Tree_t* source;
+    NodeMap_t records;
+    size_t rebuilt;
+};
+
+TreeErr_t IncDiffInit(IncDiff_t* inc, Tree_t* source, const char* var);
+TreeErr_t IncDiffDestroy(IncDiff_t* inc);
+
+TreeErr_t IncDiffReplace(IncDiff_t* inc, Node_t* target, Node_t* subtree);
+TreeErr_t IncDiffMarkDirty(IncDiff_t* inc, Node_t* node);
+TreeErr_t IncDiffUpdate(IncDiff_t* inc);
+
+Node_t* IncDiffResult(IncDiff_t* inc);
+
+#endif // DIF_INCREMENTAL_H
@@ -0,0 +1,550 @@
+#include "dif_interval.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+
+#include "debug.h"
+
+// bounds are compared exactly on purpose
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+
+// +, -, *, / and sqrt bounds are rounded outward exactly: the rounding error
+// of the nearest result is recovered with an error-free transformation
+// (TwoSum, fma) and the bound moves by one ulp only when it was inexact, so
+// exact results such as integer exponents stay points. libm functions are
+// widened by a few ulps.
+const int INTERVAL_LIBM_ULPS = 3;
+
+// Below this magnitude the fma residual may itself be rounded.
+const double INTERVAL_TINY = 0x1p-960;
+
+// Beyond this magnitude a period of sin/cos/tan is only a few ulps wide.
+const double INTERVAL_PERIODIC_LIMIT = 1e12;
+
+static double Down(double x, int ulps);
+static double Up(double x, int ulps);
+static Interval_t Make(double lo, double hi, int ulps);
+static double Overflow(double result, double a, double b, int up);
+static double AddDown(double a, double b);
+static double AddUp(double a, double b);
+static double MulDown(double a, double b);
+static double MulUp(double a, double b);
+static double DivDown(double a, double b);
+static double DivUp(double a, double b);
+static double SqrtBound(double x, int up);
+static Interval_t IntervalMul(Interval_t a, Interval_t b);
+static Interval_t IntervalDiv(Interval_t a, Interval_t b, unsigned* domain);
+static Interval_t IntervalPow(Interval_t a, Interval_t b, unsigned* domain);
+static Interval_t IntervalLn(Interval_t x, unsigned* domain);
+static Interval_t IntervalSinCos(Interval_t x, double max_phase, double (*func)(double));
+static Interval_t IntervalTanCot(Interval_t x, unsigned* domain, int is_tan);
+static int ContainsPhase(Interval_t x, double phase, double period);
+static EvalErr_t RecursiveEvalInterval(const Node_t* node, const IntervalVar_t* vars, size_t var_count,
+                                       Interval_t* result, unsigned* domain);
+
+Interval_t IntervalPoint(double x) {
+    Interval_t interval = {x, x};
+    return interval;
+}
+
+Interval_t IntervalEmpty() {
+    Interval_t interval = {INFINITY, -INFINITY};
+    return interval;
+}
+
+int IntervalIsEmpty(Interval_t x) {
+    return !(x.lo <= x.hi);
+}
+
+static double Down(double x, int ulps) {
+    for (int i = 0; i < ulps && x != -INFINITY; i++) {
+        x = nextafter(x, -INFINITY);
+    }
+
+    return x;
+}
+
+static double Up(double x, int ulps) {
+    for (int i = 0; i < ulps && x != INFINITY; i++) {
+        x = nextafter(x, INFINITY);
+    }
+
+    return x;
+}
+
+// NaN bounds come from inf - inf and inf / inf, they mean "unbounded"
+static Interval_t Make(double lo, double hi, int ulps) {
+    Interval_t interval = {isnan(lo) ? -INFINITY : Down(lo, ulps), isnan(hi) ? INFINITY : Up(hi, ulps)};
+    return interval;
+}
+
+// a finite result that overflowed to infinity is bounded by DBL_MAX on the inner side
+static double Overflow(double result, double a, double b, int up) {
+    if (isfinite(a) && isfinite(b)) {
+        if (!up && result == INFINITY)  return DBL_MAX;
+        if (up  && result == -INFINITY) return -DBL_MAX;
+    }
+
+    return result;
+}
+
+static double AddDown(double a, double b) {
+    double s = a + b;
+    if (!isfinite(s)) {
+        return Overflow(s, a, b, 0);
+    }
+
+    double bb = s - a;
+    double err = (a - (s - bb)) + (b - bb);     // a + b == s + err exactly
+
+    return (err < 0) ? nextafter(s, -INFINITY) : s;
+}
+
+static double AddUp(double a, double b) {
+    return -AddDown(-a, -b);
+}
+
+static double MulDown(double a, double b) {
+    if (a == 0 || b == 0) {                     // 0 * inf is 0 for bounds
+        return 0;
+    }
+
+    double p = a * b;
+    if (!isfinite(p) || !isfinite(a) || !isfinite(b)) {
+        return Overflow(p, a, b, 0);
+    }
+    if (fabs(p) < INTERVAL_TINY) {
+        return nextafter(p, -INFINITY);
+    }
+
+    return (fma(a, b, -p) < 0) ? nextafter(p, -INFINITY) : p;
+}
+
+static double MulUp(double a, double b) {
+    return -MulDown(-a, b);
+}
+
+static double DivDown(double a, double b) {
+    double q = a / b;
+    if (!isfinite(q) || !isfinite(a) || !isfinite(b) || a == 0) {
+        return Overflow(q, a, b, 0);
+    }
+    if (fabs(q) < INTERVAL_TINY) {
+        return nextafter(q, -INFINITY);
+    }
+
+    double r = fma(q, b, -a);                   // q * b - a exactly, q is above a / b when r / b > 0
+    return ((b > 0) ? r > 0 : r < 0) ? nextafter(q, -INFINITY) : q;
+}
+
+static double DivUp(double a, double b) {
+    return -DivDown(-a, b);
+}
+
+static double SqrtBound(double x, int up) {
+    double s = sqrt(x);
+    if (!isfinite(s) || s == 0) {
+        return s;
+    }
+    if (s < INTERVAL_TINY) {
+        return nextafter(s, up ? INFINITY : -INFINITY);
+    }
+
+    double r = fma(s, s, -x);                   // s * s - x exactly
+    if (!up && r > 0) return nextafter(s, -INFINITY);
+    if ( up && r < 0) return nextafter(s,  INFINITY);
+
+    return s;
+}
+
+static Interval_t IntervalMul(Interval_t a, Interval_t b) {
+    Interval_t res = {fmin(fmin(MulDown(a.lo, b.lo), MulDown(a.lo, b.hi)), fmin(MulDown(a.hi, b.lo), MulDown(a.hi, b.hi))),
+                      fmax(fmax(MulUp(a.lo, b.lo),   MulUp(a.lo, b.hi)),   fmax(MulUp(a.hi, b.lo),   MulUp(a.hi, b.hi)))};
+    return res;
+}
+
+static Interval_t IntervalDiv(Interval_t a, Interval_t b, unsigned* domain) {
+    if (b.lo > 0 || b.hi < 0) {
+        if ((isinf(a.lo) || isinf(a.hi)) && (isinf(b.lo) || isinf(b.hi))) {
+            return Make(-INFINITY, INFINITY, 0);            // inf / inf
+        }
+
+        Interval_t res = {fmin(fmin(DivDown(a.lo, b.lo), DivDown(a.lo, b.hi)), fmin(DivDown(a.hi, b.lo), DivDown(a.hi, b.hi))),
+                          fmax(fmax(DivUp(a.lo, b.lo),   DivUp(a.lo, b.hi)),   fmax(DivUp(a.hi, b.lo),   DivUp(a.hi, b.hi)))};
+        return res;
+    }
+
+    *domain |= INTERVAL_DIV_BY_ZERO;
+
+    if (b.lo == 0 && b.hi == 0) {
+        return IntervalEmpty();
+    }
+    if (b.lo == 0) {                            // 1 / [0, hi] = [1 / hi, +inf]
+        Interval_t inv = {DivDown(1, b.hi), INFINITY};
+        return IntervalMul(a, inv);
+    }
+    if (b.hi == 0) {                            // 1 / [lo, 0] = [-inf, 1 / lo]
+        Interval_t inv = {-INFINITY, DivUp(1, b.lo)};
+        return IntervalMul(a, inv);
+    }
+
+    return Make(-INFINITY, INFINITY, 0);
+}
+
+static Interval_t IntervalPow(Interval_t a, Interval_t b, unsigned* domain) {
+    if (b.lo == b.hi && b.lo == trunc(b.lo) && fabs(b.lo) < 0x1p53) {      // x^n
+        double n = fabs(b.lo);
+        if (n == 0) {
+            return IntervalPoint(1);
+        }
+
+        double lo = pow(a.lo, n), hi = pow(a.hi, n);
+        Interval_t power = {};
+        if (fmod(n, 2) != 0 || a.lo >= 0) {
+            power = Make(fmin(lo, hi), fmax(lo, hi), INTERVAL_LIBM_ULPS);
+        } else if (a.hi <= 0) {
+            power = Make(hi, lo, INTERVAL_LIBM_ULPS);
+        } else {
+            power = Make(0, fmax(lo, hi), INTERVAL_LIBM_ULPS);
+            power.lo = 0;
+        }
+
+        return (b.lo > 0) ? power : IntervalDiv(IntervalPoint(1), power, domain);
+    }
+
+    Interval_t negative = IntervalEmpty();
+    if (a.lo < 0) {                             // real powers need a non-negative base
+        *domain |= INTERVAL_POW_DOMAIN;
+        if (floor(b.hi) >= b.lo) {              // but the integers of b still give +-|x|^n
+            Interval_t magnitude = {(a.hi < 0) ? -a.hi : 0, -a.lo};
+            double bound = IntervalPow(magnitude, b, domain).hi;
+            negative = Make(-bound, bound, 0);
+        }
+        if (a.hi < 0) {
+            return negative;
+        }
+        a.lo = 0;
+    }
+
+    // x^y is monotone in x and in y for x > 0, the extremes are at the corners
+    double p1 = pow(a.lo, b.lo), p2 = pow(a.lo, b.hi),
+           p3 = pow(a.hi, b.lo), p4 = pow(a.hi, b.hi);
+
+    Interval_t power = Make(fmin(fmin(p1, p2), fmin(p3, p4)), fmax(fmax(p1, p2), fmax(p3, p4)), INTERVAL_LIBM_ULPS);
+    if (!IntervalIsEmpty(negative)) {
+        power.lo = fmin(power.lo, negative.lo);
+        power.hi = fmax(power.hi, negative.hi);
+    }
+
+    return power;
+}
+
+static Interval_t IntervalLn(Interval_t x, unsigned* domain) {
+    if (x.lo <= 0) {
+        *domain |= INTERVAL_LN_DOMAIN;
+        if (x.hi <= 0) {
+            return IntervalEmpty();
+        }
+    }
+
+    return Make((x.lo <= 0) ? -INFINITY : log(x.lo), log(x.hi), INTERVAL_LIBM_ULPS);
+}
+
+// Some phase + k * period lies in x. The test is inflated by the rounding
+// error of phase + k * period, so a point near the border counts as inside.
+static int ContainsPhase(Interval_t x, double phase, double period) {
+    double k = ceil((x.lo - phase) / period);
+    double tolerance = 8 * DBL_EPSILON * (fabs(x.lo) + fabs(x.hi) + period);
+
+    for (double i = k - 1; i <= k; i++) {
+        double point = phase + i * period;
+        if (point >= x.lo - tolerance && point <= x.hi + tolerance) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static Interval_t IntervalSinCos(Interval_t x, double max_phase, double (*func)(double)) {
+    Interval_t full = {-1, 1};
+    if (!(x.hi - x.lo < 2 * M_PI) || fabs(x.lo) > INTERVAL_PERIODIC_LIMIT || fabs(x.hi) > INTERVAL_PERIODIC_LIMIT) {
+        return full;
+    }
+
+    double a = func(x.lo), b = func(x.hi);
+    Interval_t res = Make(fmin(a, b), fmax(a, b), INTERVAL_LIBM_ULPS);
+
+    if (ContainsPhase(x, max_phase, 2 * M_PI)) {
+        res.hi = 1;
+    }
+    if (ContainsPhase(x, max_phase + M_PI, 2 * M_PI)) {
+        res.lo = -1;
+    }
+
+    res.lo = fmax(res.lo, -1);
+    res.hi = fmin(res.hi, 1);
+
+    return res;
+}
+
+// tan is increasing between poles at pi/2 + k * pi, cot decreasing between poles at k * pi
+static Interval_t IntervalTanCot(Interval_t x, unsigned* domain, int is_tan) {
+    if (!(x.hi - x.lo < M_PI) || fabs(x.lo) > INTERVAL_PERIODIC_LIMIT || fabs(x.hi) > INTERVAL_PERIODIC_LIMIT
+        || ContainsPhase(x, is_tan ? M_PI_2 : 0, M_PI)) {
+        *domain |= INTERVAL_POLE;
+        return Make(-INFINITY, INFINITY, 0);
+    }
+
+    if (is_tan) {
+        return Make(tan(x.lo), tan(x.hi), INTERVAL_LIBM_ULPS);
+    }
+
+    return Make(1 / tan(x.hi), 1 / tan(x.lo), INTERVAL_LIBM_ULPS + 1);
+}
+
+Interval_t IntervalOp(Operation_t operation, Interval_t a, Interval_t b, unsigned* domain) {
+    assert( domain != NULL );
+
+    int unary = (operation != OPERATION_ADD && operation != OPERATION_SUB && operation != OPERATION_MUL
+                 && operation != OPERATION_DIV && operation != OPERATION_EXP && operation != OPERATION_LOG);
+    if ((!unary && IntervalIsEmpty(a)) || IntervalIsEmpty(b)) {
+        return IntervalEmpty();
+    }
+
+    switch (operation) {
+    case OPERATION_ADD:
+        return Make(AddDown(a.lo, b.lo), AddUp(a.hi, b.hi), 0);
+
+    case OPERATION_SUB:
+        return Make(AddDown(a.lo, -b.hi), AddUp(a.hi, -b.lo), 0);
+
+    case OPERATION_MUL:
+        return IntervalMul(a, b);
+
+    case OPERATION_DIV:
+        return IntervalDiv(a, b, domain);
+
+    case OPERATION_EXP:
+        return IntervalPow(a, b, domain);
+
+    case OPERATION_LOG:                         // log(a, b) = ln b / ln a
+        return IntervalDiv(IntervalLn(b, domain), IntervalLn(a, domain), domain);
+
+    case OPERATION_LN:
+        return IntervalLn(b, domain);
+
+    case OPERATION_SQRT:
+        if (b.lo < 0) {
+            *domain |= INTERVAL_SQRT_DOMAIN;
+            if (b.hi < 0) {
+                return IntervalEmpty();
+            }
+        }
+        return Make((b.lo < 0) ? 0 : SqrtBound(b.lo, 0), SqrtBound(b.hi, 1), 0);
+
+    case OPERATION_SIN:
+        return IntervalSinCos(b, M_PI_2, sin);
+
+    case OPERATION_COS:
+        return IntervalSinCos(b, 0, cos);
+
+    case OPERATION_TAN:
+        return IntervalTanCot(b, domain, 1);
+
+    case OPERATION_COT:
+        return IntervalTanCot(b, domain, 0);
+
+    case OPERATION_SINH:
+        return Make(sinh(b.lo), sinh(b.hi), INTERVAL_LIBM_ULPS);
+
+    case OPERATION_COSH: {
+        double lo = cosh(b.lo), hi = cosh(b.hi);
+        if (b.lo <= 0 && b.hi >= 0) {
+            Interval_t res = Make(1, fmax(lo, hi), INTERVAL_LIBM_ULPS);
+            res.lo = 1;
+            return res;
+        }
+        return Make(fmin(lo, hi), fmax(lo, hi), INTERVAL_LIBM_ULPS);
+    }
+
+    case OPERATION_TANH:
+        return Make(tanh(b.lo), tanh(b.hi), INTERVAL_LIBM_ULPS);
+
+    case OPERATION_COTH:                        // decreasing on both sides of the pole at 0
+        if (b.lo <= 0 && b.hi >= 0) {
+            *domain |= INTERVAL_POLE;
+            return Make(-INFINITY, INFINITY, 0);
+        }
+        return Make(1 / tanh(b.hi), 1 / tanh(b.lo), INTERVAL_LIBM_ULPS + 1);
+
+    case OPERATION_ASIN:
+    case OPERATION_ACOS: {
+        if (b.lo < -1 || b.hi > 1) {
+            *domain |= INTERVAL_ASIN_DOMAIN;
+            if (b.hi < -1 || b.lo > 1) {
+                return IntervalEmpty();
+            }
+            b.lo = fmax(b.lo, -1);
+            b.hi = fmin(b.hi, 1);
+        }
+        return (operation == OPERATION_ASIN) ? Make(asin(b.lo), asin(b.hi), INTERVAL_LIBM_ULPS)
+                                             : Make(acos(b.hi), acos(b.lo), INTERVAL_LIBM_ULPS);
+    }
+
+    case OPERATION_ATAN:
+        return Make(atan(b.lo), atan(b.hi), INTERVAL_LIBM_ULPS);
+
+    case OPERATION_ACOT:                        // arccot(x) = pi/2 - arctan(x), decreasing
+        return Make(M_PI_2 - atan(b.hi), M_PI_2 - atan(b.lo), INTERVAL_LIBM_ULPS + 1);
+
+    case OPERATION_UNDEF:
+    default:
+        LOG_ERROR("interval", "default in IntervalOp");
+        break;
+    }
+
+    return Make(-INFINITY, INFINITY, 0);
+}
+
+EvalErr_t TreeEvalInterval(const Node_t* node, const IntervalVar_t* vars, size_t var_count,
+                           Interval_t* result, unsigned* domain) {
+    assert( node != NULL );
+    assert( vars != NULL || var_count == 0 );
+    assert( result != NULL );
+    assert( domain != NULL );
+
+    *domain = 0;
+
+    return RecursiveEvalInterval(node, vars, var_count, result, domain);
+}
+
+static EvalErr_t RecursiveEvalInterval(const Node_t* node, const IntervalVar_t* vars, size_t var_count,
+                                       Interval_t* result, unsigned* domain) {
+    switch (node->type) {
+    case TYPE_NUMBER:
+        *result = IntervalPoint(node->data.number);
+        return EVAL_OK;
+
+    case TYPE_VARIABLE:
+        for (size_t i = 0; i < var_count; i++) {
+            if (strcmp(vars[i].name, node->data.variable) == 0) {
+                *result = vars[i].range;
+                return EVAL_OK;
+            }
+        }
+        return EVAL_UNBOUND_VARIABLE;
+
+    case TYPE_THUNK: {
+        Node_t* expanded = node->data.thunk->expand(node->data.thunk);
+        if (expanded == NULL) {
+            return EVAL_UNDEFINED_NODE;
+        }
+
+        EvalErr_t err = RecursiveEvalInterval(expanded, vars, var_count, result, domain);
+        TreeDestroySubtree(&expanded);
+
+        return err;
+    }
+
+    case TYPE_OPERATION:
+        break;
+
+    case TYPE_UNDEFINED:
+    default:
+        return EVAL_UNDEFINED_NODE;
+    }
+
+    Interval_t left = IntervalEmpty(), right = IntervalEmpty();
+    EvalErr_t err = EVAL_OK;
+
+    if (node->left != NULL && (err = RecursiveEvalInterval(node->left, vars, var_count, &left, domain)) != EVAL_OK) {
+        return err;
+    }
+    if (node->right == NULL) {
+        return EVAL_UNDEFINED_NODE;
+    }
+    if ((err = RecursiveEvalInterval(node->right, vars, var_count, &right, domain)) != EVAL_OK) {
+        return err;
+    }
+
+    *result = IntervalOp(node->data.operation, left, right, domain);
+
+    return EVAL_OK;
+}
+
+// Boxes are rows of tape->var_count intervals. The tape is run one
+// instruction at a time over a chunk of boxes, so the instruction switch is
+// paid once per chunk and the inner loops stay tight.
+EvalErr_t IntervalEvalBatch(const EvalTape_t* tape, const Interval_t* boxes, size_t box_count,
+                            Interval_t* results, unsigned* domains) {
+    assert( tape != NULL );
+    assert( tape->size != 0 );
+    assert( boxes != NULL || box_count == 0 || tape->var_count == 0 );
+    assert( results != NULL );
+
+    Interval_t* slots = (Interval_t*)calloc(tape->size * INTERVAL_BATCH_CHUNK, sizeof(Interval_t));
+    unsigned* chunk_domains = (unsigned*)calloc(INTERVAL_BATCH_CHUNK, sizeof(unsigned));
+    if (slots == NULL || chunk_domains == NULL) {
+        FREE(slots);
+        FREE(chunk_domains);
+        return EVAL_ALLOCATION_FAILED;
+    }
+
+    Interval_t none = IntervalEmpty();
+
+    for (size_t base = 0; base < box_count; base += INTERVAL_BATCH_CHUNK) {
+        size_t count = (box_count - base < INTERVAL_BATCH_CHUNK) ? box_count - base : INTERVAL_BATCH_CHUNK;
+        memset(chunk_domains, 0, count * sizeof(unsigned));
+
+        for (size_t i = 0; i < tape->size; i++) {
+            const TapeInstr_t* instr = &tape->code[i];
+            Interval_t* out = &slots[i * INTERVAL_BATCH_CHUNK];
+
+            switch (instr->type) {
+            case TYPE_NUMBER:
+                for (size_t j = 0; j < count; j++) {
+                    out[j] = IntervalPoint(instr->number);
+                }
+                break;
+
+            case TYPE_VARIABLE:
+                for (size_t j = 0; j < count; j++) {
+                    out[j] = boxes[(base + j) * tape->var_count + instr->var];
+                }
+                break;
+
+            case TYPE_OPERATION: {
+                const Interval_t* left  = (instr->left != TAPE_NONE) ? &slots[instr->left * INTERVAL_BATCH_CHUNK] : NULL;
+                const Interval_t* right = &slots[instr->right * INTERVAL_BATCH_CHUNK];
+                for (size_t j = 0; j < count; j++) {
+                    out[j] = IntervalOp(instr->operation, left ? left[j] : none, right[j], &chunk_domains[j]);
+                }
+                break;
+            }
+
+            case TYPE_THUNK:
+            case TYPE_UNDEFINED:
+            default:
+                for (size_t j = 0; j < count; j++) {
+                    out[j] = none;
+                }
+                break;
+            }
+        }
+
+        memcpy(&results[base], &slots[(tape->size - 1) * INTERVAL_BATCH_CHUNK], count * sizeof(Interval_t));
+        if (domains != NULL) {
+            memcpy(&domains[base], chunk_domains, count * sizeof(unsigned));
+        }
+    }
+
+    FREE(slots);
+    FREE(chunk_domains);
+
+    return EVAL_OK;
+}
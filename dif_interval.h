@@ -0,0 +1,40 @@
+#ifndef DIF_INTERVAL_H
+#define DIF_INTERVAL_H
+
+#include "tree.h"
+#include "dif_eval.h"
+
+// Domain flags: some point of the input box may violate the domain of
+const unsigned INTERVAL_DIV_BY_ZERO = 1 << 0;    // '/' (and log with a base around 1)
+const unsigned INTERVAL_LN_DOMAIN   = 1 << 1;    // ln, log
+const unsigned INTERVAL_SQRT_DOMAIN = 1 << 2;    // sqrt
+const unsigned INTERVAL_ASIN_DOMAIN = 1 << 3;    // arcsin, arccos
+const unsigned INTERVAL_POW_DOMAIN  = 1 << 4;    // '^' with a negative base and a non-integer exponent
+const unsigned INTERVAL_POLE        = 1 << 5;    // tan, cot, coth
+
+const size_t INTERVAL_BATCH_CHUNK = 128;
+
+// Closed interval [lo, hi], possibly unbounded. lo > hi (or NaN) is the empty
+// interval: no point of the box is inside the domain.
+struct Interval_t {
+    double lo;
+    double hi;
+};
+
+struct IntervalVar_t {
+    const char* name;
+    Interval_t range;
+};
+
+Interval_t IntervalPoint(double x);
+Interval_t IntervalEmpty();
+int IntervalIsEmpty(Interval_t x);
+
+Interval_t IntervalOp(Operation_t operation, Interval_t a, Interval_t b, unsigned* domain);
+
+EvalErr_t TreeEvalInterval(const Node_t* node, const IntervalVar_t* vars, size_t var_count,
+                           Interval_t* result, unsigned* domain);
+EvalErr_t IntervalEvalBatch(const EvalTape_t* tape, const Interval_t* boxes, size_t box_count,
+                            Interval_t* results, unsigned* domains);
+
+#endif // DIF_INTERVAL_H
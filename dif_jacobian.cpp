@@ -0,0 +1,525 @@
+#include "dif_jacobian.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+const size_t JACOBIAN_NO_COLOR = (size_t)-1;
+
+struct JacobianVar_t {
+    const char* name;
+    size_t index;
+};
+
+// Compiles all expressions to one tape: instructions are interned by their
+// contents, so equal subexpressions get one slot
+struct TapeBuilder_t {
+    Jacobian_t* jac;
+    JacobianVar_t* vars;            // sorted by name
+    size_t var_count;
+    size_t* table;                  // slot + 1, 0 - empty
+    size_t table_capacity;
+    size_t* last_row;               // row + 1 that last listed the column
+    size_t row;
+    size_t nnz_capacity;
+};
+
+struct ColorOrder_t {
+    size_t degree;
+    size_t index;
+};
+
+static JacobianErr_t BuildTape(TapeBuilder_t* builder, const Node_t* const* exprs, size_t count);
+static JacobianErr_t RecursiveBuild(TapeBuilder_t* builder, const Node_t* node, size_t* slot);
+static JacobianErr_t Intern(TapeBuilder_t* builder, const TapeInstr_t* instr, size_t* slot);
+static JacobianErr_t TableGrow(TapeBuilder_t* builder);
+static JacobianErr_t AddColumn(TapeBuilder_t* builder, size_t col);
+static uint64_t InstrHash(const TapeInstr_t* instr);
+static int InstrEqual(const TapeInstr_t* a, const TapeInstr_t* b);
+static JacobianErr_t Colorize(Jacobian_t* jac);
+static size_t GreedyColor(size_t count, const size_t* ptr, const size_t* idx,
+                          const size_t* other_ptr, const size_t* other_idx, size_t* colors);
+static void EvalForward(Jacobian_t* jac);
+static void EvalReverse(Jacobian_t* jac);
+static int CompareVars(const void* a, const void* b);
+static int CompareSize(const void* a, const void* b);
+static int CompareDegree(const void* a, const void* b);
+
+JacobianErr_t JacobianInit(Jacobian_t* jac, const Node_t* const* exprs, size_t count,
+                           const char* const* vars, size_t var_count, JacobianMode_t mode) {
+    assert( jac != NULL );
+    assert( exprs != NULL || count == 0 );
+    assert( vars != NULL || var_count == 0 );
+
+    memset(jac, 0, sizeof(*jac));
+    jac->matrix.rows = count;
+    jac->matrix.cols = var_count;
+
+    TapeBuilder_t builder = {};
+    builder.jac       = jac;
+    builder.var_count = var_count;
+    builder.vars      = (JacobianVar_t*)calloc(var_count + 1, sizeof(JacobianVar_t));
+    builder.last_row  = (size_t*)calloc(var_count + 1, sizeof(size_t));
+
+    JacobianErr_t err = JACOBIAN_ALLOCATION_FAILED;
+    if (builder.vars != NULL && builder.last_row != NULL) {
+        for (size_t i = 0; i < var_count; i++) {
+            builder.vars[i].name  = vars[i];
+            builder.vars[i].index = i;
+        }
+        if (var_count != 0) {
+            qsort(builder.vars, var_count, sizeof(JacobianVar_t), CompareVars);
+        }
+
+        err = BuildTape(&builder, exprs, count);
+    }
+
+    FREE(builder.vars);
+    FREE(builder.last_row);
+    FREE(builder.table);
+
+    if (err == JACOBIAN_OK) {
+        err = Colorize(jac);
+    }
+
+    if (err == JACOBIAN_OK) {
+        jac->mode = mode;
+        if (mode == JACOBIAN_AUTO) {
+            jac->mode = (jac->col_color_count <= jac->row_color_count) ? JACOBIAN_FORWARD : JACOBIAN_REVERSE;
+        }
+
+        jac->slots  = (double*)calloc(jac->tape.size + 1, sizeof(double));
+        jac->work   = (double*)calloc(jac->tape.size + 1, sizeof(double));
+        jac->seeds  = (double*)calloc(var_count + 1, sizeof(double));
+        jac->matrix.values = (double*)calloc(jac->matrix.row_ptr[count] + 1, sizeof(double));
+
+        if (jac->slots == NULL || jac->work == NULL || jac->seeds == NULL || jac->matrix.values == NULL) {
+            err = JACOBIAN_ALLOCATION_FAILED;
+        }
+    }
+
+    if (err != JACOBIAN_OK) {
+        JacobianDestroy(jac);
+    }
+
+    return err;
+}
+
+JacobianErr_t JacobianDestroy(Jacobian_t* jac) {
+    assert( jac != NULL );
+
+    FREE(jac->matrix.row_ptr);
+    FREE(jac->matrix.col_idx);
+    FREE(jac->matrix.values);
+    FREE(jac->col_colors);
+    FREE(jac->row_colors);
+    FREE(jac->outputs);
+    FREE(jac->slots);
+    FREE(jac->work);
+    FREE(jac->seeds);
+    EvalTapeDestroy(&jac->tape);
+
+    jac->col_color_count = 0;
+    jac->row_color_count = 0;
+
+    return JACOBIAN_OK;
+}
+
+JacobianErr_t JacobianEval(Jacobian_t* jac, const double* values, double* residuals) {
+    assert( jac != NULL );
+    assert( jac->slots != NULL );
+    assert( values != NULL || jac->matrix.cols == 0 );
+
+    if (jac->tape.size == 0) {
+        return JACOBIAN_OK;
+    }
+
+    EvalTapeRun(&jac->tape, values, jac->slots);
+
+    if (residuals != NULL) {
+        for (size_t i = 0; i < jac->matrix.rows; i++) {
+            residuals[i] = jac->slots[jac->outputs[i]];
+        }
+    }
+
+    if (jac->mode == JACOBIAN_REVERSE) {
+        EvalReverse(jac);
+    } else {
+        EvalForward(jac);
+    }
+
+    return JACOBIAN_OK;
+}
+
+// Column c's seed is 1 for every column of color c; a row has at most one
+// such column, so its tangent is exactly that entry
+static void EvalForward(Jacobian_t* jac) {
+    SparseMatrix_t* matrix = &jac->matrix;
+
+    for (size_t color = 0; color < jac->col_color_count; color++) {
+        for (size_t j = 0; j < matrix->cols; j++) {
+            jac->seeds[j] = (jac->col_colors[j] == color) ? 1 : 0;
+        }
+
+        EvalTapeTangent(&jac->tape, jac->slots, jac->seeds, jac->work);
+
+        for (size_t i = 0; i < matrix->rows; i++) {
+            for (size_t p = matrix->row_ptr[i]; p < matrix->row_ptr[i + 1]; p++) {
+                if (jac->col_colors[matrix->col_idx[p]] == color) {
+                    matrix->values[p] = jac->work[jac->outputs[i]];
+                }
+            }
+        }
+    }
+}
+
+// Rows of one color share no column, so the summed gradient splits back
+static void EvalReverse(Jacobian_t* jac) {
+    SparseMatrix_t* matrix = &jac->matrix;
+
+    for (size_t color = 0; color < jac->row_color_count; color++) {
+        memset(jac->seeds, 0, matrix->cols * sizeof(double));
+
+        for (size_t i = 0; i < matrix->rows; i++) {
+            if (jac->row_colors[i] == color) {
+                jac->work[jac->outputs[i]] += 1;
+            }
+        }
+
+        EvalTapeAdjoint(&jac->tape, jac->slots, jac->work, jac->seeds);
+
+        for (size_t i = 0; i < matrix->rows; i++) {
+            if (jac->row_colors[i] != color) {
+                continue;
+            }
+            for (size_t p = matrix->row_ptr[i]; p < matrix->row_ptr[i + 1]; p++) {
+                matrix->values[p] = jac->seeds[matrix->col_idx[p]];
+            }
+        }
+    }
+}
+
+static JacobianErr_t BuildTape(TapeBuilder_t* builder, const Node_t* const* exprs, size_t count) {
+    Jacobian_t* jac = builder->jac;
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += TreeSubtreeSize(exprs[i]);
+    }
+
+    jac->tape.capacity  = size + 1;
+    jac->tape.var_count = builder->var_count;
+    jac->tape.code      = (TapeInstr_t*)calloc(jac->tape.capacity, sizeof(TapeInstr_t));
+    jac->outputs        = (size_t*)calloc(count + 1, sizeof(size_t));
+    jac->matrix.row_ptr = (size_t*)calloc(count + 1, sizeof(size_t));
+
+    builder->nnz_capacity = count + 16;
+    jac->matrix.col_idx   = (size_t*)calloc(builder->nnz_capacity, sizeof(size_t));
+
+    if (jac->tape.code == NULL || jac->outputs == NULL || jac->matrix.row_ptr == NULL
+        || jac->matrix.col_idx == NULL || TableGrow(builder) != JACOBIAN_OK) {
+        return JACOBIAN_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        assert( exprs[i] != NULL );
+
+        builder->row = i;
+        jac->matrix.row_ptr[i + 1] = jac->matrix.row_ptr[i];
+
+        JacobianErr_t err = RecursiveBuild(builder, exprs[i], &jac->outputs[i]);
+        if (err != JACOBIAN_OK) {
+            return err;
+        }
+
+        size_t first = jac->matrix.row_ptr[i];
+        size_t nonzeros = jac->matrix.row_ptr[i + 1] - first;
+        if (nonzeros > 1) {
+            qsort(jac->matrix.col_idx + first, nonzeros, sizeof(size_t), CompareSize);
+        }
+    }
+
+    return JACOBIAN_OK;
+}
+
+static JacobianErr_t RecursiveBuild(TapeBuilder_t* builder, const Node_t* node, size_t* slot) {
+    TapeInstr_t instr = {node->type, OPERATION_UNDEF, TAPE_NONE, TAPE_NONE, TAPE_NONE, 0};
+    JacobianErr_t err = JACOBIAN_OK;
+
+    switch (node->type) {
+    case TYPE_NUMBER:
+        instr.number = node->data.number;
+        break;
+
+    case TYPE_VARIABLE: {
+        JacobianVar_t key = {node->data.variable, 0};
+        const JacobianVar_t* var = (const JacobianVar_t*)bsearch(&key, builder->vars, builder->var_count,
+                                                                 sizeof(JacobianVar_t), CompareVars);
+        if (var == NULL) {
+            return JACOBIAN_UNBOUND_VARIABLE;
+        }
+
+        instr.var = var->index;
+        if ((err = AddColumn(builder, var->index)) != JACOBIAN_OK) {
+            return err;
+        }
+        break;
+    }
+
+    case TYPE_THUNK: {                      // compile a temporary expansion, the tree stays lazy
+        Node_t* expanded = node->data.thunk->expand(node->data.thunk);
+        if (expanded == NULL) {
+            return JACOBIAN_UNDEFINED_NODE;
+        }
+
+        err = RecursiveBuild(builder, expanded, slot);
+        TreeDestroySubtree(&expanded);
+
+        return err;
+    }
+
+    case TYPE_OPERATION:
+        if (node->right == NULL) {
+            return JACOBIAN_UNDEFINED_NODE;
+        }
+
+        instr.operation = node->data.operation;
+        if (node->left != NULL && (err = RecursiveBuild(builder, node->left, &instr.left)) != JACOBIAN_OK) {
+            return err;
+        }
+        if ((err = RecursiveBuild(builder, node->right, &instr.right)) != JACOBIAN_OK) {
+            return err;
+        }
+        break;
+
+    case TYPE_UNDEFINED:
+    default:
+        return JACOBIAN_UNDEFINED_NODE;
+    }
+
+    return Intern(builder, &instr, slot);
+}
+
+static JacobianErr_t Intern(TapeBuilder_t* builder, const TapeInstr_t* instr, size_t* slot) {
+    EvalTape_t* tape = &builder->jac->tape;
+
+    size_t mask = builder->table_capacity - 1;
+    size_t i = InstrHash(instr) & mask;
+    for (; builder->table[i] != 0; i = (i + 1) & mask) {
+        if (InstrEqual(&tape->code[builder->table[i] - 1], instr)) {
+            *slot = builder->table[i] - 1;
+            return JACOBIAN_OK;
+        }
+    }
+
+    if (tape->size == tape->capacity) {         // thunk expansions are not counted in advance
+        size_t capacity = 2 * tape->capacity;
+        TapeInstr_t* code = (TapeInstr_t*)realloc(tape->code, capacity * sizeof(TapeInstr_t));
+        if (code == NULL) {
+            return JACOBIAN_ALLOCATION_FAILED;
+        }
+
+        tape->code = code;
+        tape->capacity = capacity;
+    }
+
+    *slot = tape->size;
+    tape->code[tape->size++] = *instr;
+    builder->table[i] = tape->size;
+
+    return (tape->size * 2 > builder->table_capacity) ? TableGrow(builder) : JACOBIAN_OK;
+}
+
+static JacobianErr_t TableGrow(TapeBuilder_t* builder) {
+    const EvalTape_t* tape = &builder->jac->tape;
+
+    size_t capacity = 16;
+    while (capacity < tape->capacity * 2) {
+        capacity *= 2;
+    }
+
+    size_t* table = (size_t*)calloc(capacity, sizeof(size_t));
+    if (table == NULL) {
+        return JACOBIAN_ALLOCATION_FAILED;
+    }
+
+    for (size_t slot = 0; slot < tape->size; slot++) {
+        size_t i = InstrHash(&tape->code[slot]) & (capacity - 1);
+        while (table[i] != 0) {
+            i = (i + 1) & (capacity - 1);
+        }
+        table[i] = slot + 1;
+    }
+
+    FREE(builder->table);
+    builder->table = table;
+    builder->table_capacity = capacity;
+
+    return JACOBIAN_OK;
+}
+
+static JacobianErr_t AddColumn(TapeBuilder_t* builder, size_t col) {
+    SparseMatrix_t* matrix = &builder->jac->matrix;
+
+    if (builder->last_row[col] == builder->row + 1) {
+        return JACOBIAN_OK;
+    }
+    builder->last_row[col] = builder->row + 1;
+
+    size_t nnz = matrix->row_ptr[builder->row + 1];
+    if (nnz == builder->nnz_capacity) {
+        size_t capacity = 2 * builder->nnz_capacity;
+        size_t* col_idx = (size_t*)realloc(matrix->col_idx, capacity * sizeof(size_t));
+        if (col_idx == NULL) {
+            return JACOBIAN_ALLOCATION_FAILED;
+        }
+
+        matrix->col_idx = col_idx;
+        builder->nnz_capacity = capacity;
+    }
+
+    matrix->col_idx[nnz] = col;
+    matrix->row_ptr[builder->row + 1] = nnz + 1;
+
+    return JACOBIAN_OK;
+}
+
+static uint64_t InstrHash(const TapeInstr_t* instr) {
+    uint64_t number = 0;
+    memcpy(&number, &instr->number, sizeof(number));
+
+    uint64_t hash = (uint64_t)instr->type;
+    hash = hash * 0x100000001B3ull + (uint64_t)instr->operation;
+    hash = hash * 0x100000001B3ull + instr->left;
+    hash = hash * 0x100000001B3ull + instr->right;
+    hash = hash * 0x100000001B3ull + instr->var;
+    hash = hash * 0x100000001B3ull + number;
+
+    hash ^= hash >> 31;
+    hash *= 0x9E3779B97F4A7C15ull;
+
+    return hash ^ (hash >> 29);
+}
+
+// numbers compare bitwise: -0 and 0 stay apart, NaN matches itself
+static int InstrEqual(const TapeInstr_t* a, const TapeInstr_t* b) {
+    return a->type == b->type && a->operation == b->operation && a->left == b->left
+        && a->right == b->right && a->var == b->var && memcmp(&a->number, &b->number, sizeof(double)) == 0;
+}
+
+static JacobianErr_t Colorize(Jacobian_t* jac) {
+    SparseMatrix_t* matrix = &jac->matrix;
+    size_t nnz = matrix->row_ptr[matrix->rows];
+
+    size_t* col_ptr = (size_t*)calloc(matrix->cols + 2, sizeof(size_t));
+    size_t* row_idx = (size_t*)calloc(nnz + 1, sizeof(size_t));
+    jac->col_colors = (size_t*)calloc(matrix->cols + 1, sizeof(size_t));
+    jac->row_colors = (size_t*)calloc(matrix->rows + 1, sizeof(size_t));
+
+    if (col_ptr == NULL || row_idx == NULL || jac->col_colors == NULL || jac->row_colors == NULL) {
+        FREE(col_ptr);
+        FREE(row_idx);
+        return JACOBIAN_ALLOCATION_FAILED;
+    }
+
+    // transpose: rows of every column
+    for (size_t p = 0; p < nnz; p++) {
+        ++col_ptr[matrix->col_idx[p] + 2];
+    }
+    for (size_t j = 0; j < matrix->cols; j++) {
+        col_ptr[j + 2] += col_ptr[j + 1];
+    }
+    for (size_t i = 0; i < matrix->rows; i++) {
+        for (size_t p = matrix->row_ptr[i]; p < matrix->row_ptr[i + 1]; p++) {
+            row_idx[col_ptr[matrix->col_idx[p] + 1]++] = i;
+        }
+    }
+
+    jac->col_color_count = GreedyColor(matrix->cols, col_ptr, row_idx, matrix->row_ptr, matrix->col_idx,
+                                       jac->col_colors);
+    jac->row_color_count = GreedyColor(matrix->rows, matrix->row_ptr, matrix->col_idx, col_ptr, row_idx,
+                                       jac->row_colors);
+
+    FREE(col_ptr);
+    FREE(row_idx);
+
+    if (jac->col_color_count == JACOBIAN_NO_COLOR || jac->row_color_count == JACOBIAN_NO_COLOR) {
+        return JACOBIAN_ALLOCATION_FAILED;
+    }
+
+    return JACOBIAN_OK;
+}
+
+// Largest degree first: item gets the smallest color not used by an item it
+// shares a line with. ptr/idx - lines of every item, other_* - items of every
+// line. Returns the number of colors.
+static size_t GreedyColor(size_t count, const size_t* ptr, const size_t* idx,
+                          const size_t* other_ptr, const size_t* other_idx, size_t* colors) {
+    ColorOrder_t* order = (ColorOrder_t*)calloc(count + 1, sizeof(ColorOrder_t));
+    size_t* forbidden = (size_t*)calloc(count + 1, sizeof(size_t));
+    if (order == NULL || forbidden == NULL) {
+        FREE(order);
+        FREE(forbidden);
+        return JACOBIAN_NO_COLOR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        order[i].degree = ptr[i + 1] - ptr[i];
+        order[i].index  = i;
+        colors[i] = JACOBIAN_NO_COLOR;
+        forbidden[i] = JACOBIAN_NO_COLOR;
+    }
+    if (count != 0) {
+        qsort(order, count, sizeof(ColorOrder_t), CompareDegree);
+    }
+
+    size_t color_count = 0;
+    for (size_t k = 0; k < count; k++) {
+        size_t item = order[k].index;
+
+        for (size_t p = ptr[item]; p < ptr[item + 1]; p++) {
+            size_t line = idx[p];
+            for (size_t q = other_ptr[line]; q < other_ptr[line + 1]; q++) {
+                size_t color = colors[other_idx[q]];
+                if (color != JACOBIAN_NO_COLOR) {
+                    forbidden[color] = item;
+                }
+            }
+        }
+
+        size_t color = 0;
+        while (forbidden[color] == item) {
+            ++color;
+        }
+
+        colors[item] = color;
+        if (color + 1 > color_count) {
+            color_count = color + 1;
+        }
+    }
+
+    FREE(order);
+    FREE(forbidden);
+
+    return color_count;
+}
+
+static int CompareVars(const void* a, const void* b) {
+    return strcmp(((const JacobianVar_t*)a)->name, ((const JacobianVar_t*)b)->name);
+}
+
+static int CompareSize(const void* a, const void* b) {
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int CompareDegree(const void* a, const void* b) {
+    const ColorOrder_t* x = (const ColorOrder_t*)a;
+    const ColorOrder_t* y = (const ColorOrder_t*)b;
+
+    if (x->degree != y->degree) {
+        return (x->degree < y->degree) - (x->degree > y->degree);
+    }
+
+    return (x->index > y->index) - (x->index < y->index);
+}
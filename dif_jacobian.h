@@ -0,0 +1,57 @@
+#ifndef DIF_JACOBIAN_H
+#define DIF_JACOBIAN_H
+
+#include "tree.h"
+#include "dif_eval.h"
+
+enum JacobianErr_t {
+    JACOBIAN_OK,
+    JACOBIAN_UNBOUND_VARIABLE,
+    JACOBIAN_UNDEFINED_NODE,
+    JACOBIAN_ALLOCATION_FAILED
+};
+
+enum JacobianMode_t {
+    JACOBIAN_AUTO,          // the mode with fewer passes
+    JACOBIAN_FORWARD,       // one tangent pass per column color
+    JACOBIAN_REVERSE        // one adjoint pass per row color
+};
+
+// CSR: nonzeros of row i are values[row_ptr[i] .. row_ptr[i + 1]), their
+// columns col_idx[] ascend within a row
+struct SparseMatrix_t {
+    size_t rows;
+    size_t cols;
+    size_t* row_ptr;
+    size_t* col_idx;
+    double* values;
+};
+
+// Jacobian of count expressions by var_count variables. The pattern comes
+// from the variables each expression contains; columns that never share a
+// row get one color and one forward pass, rows that never share a column -
+// one reverse pass. All expressions are compiled to one tape where equal
+// subexpressions are computed once.
+struct Jacobian_t {
+    SparseMatrix_t matrix;
+    JacobianMode_t mode;            // resolved, never JACOBIAN_AUTO
+    size_t* col_colors;
+    size_t col_color_count;
+    size_t* row_colors;
+    size_t row_color_count;
+    EvalTape_t tape;
+    size_t* outputs;                // tape slot of each expression
+    double* slots;
+    double* work;                   // tangents or adjoints
+    double* seeds;                  // seeds or gradient by variable
+};
+
+JacobianErr_t JacobianInit(Jacobian_t* jac, const Node_t* const* exprs, size_t count,
+                           const char* const* vars, size_t var_count, JacobianMode_t mode);
+JacobianErr_t JacobianDestroy(Jacobian_t* jac);
+
+// Fills jac->matrix.values at the point values[var_count]; residuals, if not
+// NULL, get the values of the expressions
+JacobianErr_t JacobianEval(Jacobian_t* jac, const double* values, double* residuals);
+
+#endif // DIF_JACOBIAN_H
@@ -0,0 +1,105 @@
+#include "dif_lazy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "metrics.h"
+
+static int RecursiveIndex(LazyDiff_t* lazy, const Node_t* node, ThunkFunc expand, TreeErr_t* err);
+
+TreeErr_t LazyDiffInit(LazyDiff_t* lazy, const Node_t* source, const char* var, ThunkFunc expand) {
+    assert( lazy != NULL );
+    assert( source != NULL );
+    assert( var != NULL );
+    assert( expand != NULL );
+
+    size_t size = TreeSubtreeSize(source);
+
+    lazy->var = strdup(var);
+    lazy->thunks = (Thunk_t*)calloc(size, sizeof(Thunk_t));
+    lazy->count = 0;
+
+    if (lazy->var == NULL || lazy->thunks == NULL || NodeMapInit(&lazy->index, size) != TREE_OK) {
+        FREE(lazy->var);
+        FREE(lazy->thunks);
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    TreeErr_t err = TREE_OK;
+    RecursiveIndex(lazy, source, expand, &err);
+    if (err != TREE_OK) {
+        LazyDiffDestroy(lazy);
+    }
+
+    return err;
+}
+
+TreeErr_t LazyDiffDestroy(LazyDiff_t* lazy) {
+    assert( lazy != NULL );
+
+    FREE(lazy->var);
+    FREE(lazy->thunks);
+    NodeMapDestroy(&lazy->index);
+    lazy->count = 0;
+
+    return TREE_OK;
+}
+
+static int RecursiveIndex(LazyDiff_t* lazy, const Node_t* node, ThunkFunc expand, TreeErr_t* err) {
+    int depends = 0;
+
+    if (node->left != NULL) {
+        depends |= RecursiveIndex(lazy, node->left, expand, err);
+    }
+    if (node->right != NULL) {
+        depends |= RecursiveIndex(lazy, node->right, expand, err);
+    }
+
+    if (node->type == TYPE_VARIABLE && strcmp(node->data.variable, lazy->var) == 0) {
+        depends = 1;
+    }
+
+    Thunk_t* thunk = &lazy->thunks[lazy->count++];
+    thunk->expand = expand;
+    thunk->source = node;
+    thunk->ctx = lazy;
+
+    NodeInfo_t* info = NodeMapInsert(&lazy->index, node);
+    if (info == NULL) {
+        *err = TREE_ALLOCATION_FAILED;
+        return depends;
+    }
+
+    info->flags = depends ? LAZY_DEPENDS_ON_VAR : 0;
+    info->data = thunk;
+
+    return depends;
+}
+
+int LazyDiffDepends(const LazyDiff_t* lazy, const Node_t* node) {
+    assert( lazy != NULL );
+    assert( node != NULL );
+
+    NodeInfo_t* info = NodeMapFind(&lazy->index, node);
+
+    return info == NULL || (info->flags & LAZY_DEPENDS_ON_VAR);
+}
+
+Node_t* LazyDiffNode(LazyDiff_t* lazy, const Node_t* node) {
+    assert( lazy != NULL );
+    assert( node != NULL );
+
+    NodeInfo_t* info = NodeMapFind(&lazy->index, node);
+    if (info == NULL) {
+        return NULL;
+    }
+
+    if (!(info->flags & LAZY_DEPENDS_ON_VAR)) {
+        METRICS_INC(COUNTER_LAZY_SKIPPED);
+        return NodeInit(NULL, NULL, NULL, TYPE_NUMBER, 0.0);
+    }
+
+    METRICS_INC(COUNTER_LAZY_THUNKS);
+    return NodeInit(NULL, NULL, NULL, TYPE_THUNK, (const Thunk_t*)info->data);
+}
@@ -0,0 +1,24 @@
+#ifndef DIF_LAZY_H
+#define DIF_LAZY_H
+
+#include "tree.h"
+#include "node_map.h"
+
+const unsigned LAZY_DEPENDS_ON_VAR = 1;
+
+// Owns the thunk records of one lazy derivative. The source tree and this
+// context must outlive every thunk node that is still unexpanded.
+struct LazyDiff_t {
+    char* var;
+    Thunk_t* thunks;
+    size_t count;
+    NodeMap_t index;
+};
+
+TreeErr_t LazyDiffInit(LazyDiff_t* lazy, const Node_t* source, const char* var, ThunkFunc expand);
+TreeErr_t LazyDiffDestroy(LazyDiff_t* lazy);
+
+int LazyDiffDepends(const LazyDiff_t* lazy, const Node_t* node);
+Node_t* LazyDiffNode(LazyDiff_t* lazy, const Node_t* node);
+
+#endif // DIF_LAZY_H
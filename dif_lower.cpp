@@ -0,0 +1,685 @@
+#include "dif_lower.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+// exponents and coefficients are matched exactly
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+
+const size_t LOWER_TABLE_MIN = 64;
+
+// sign * coef * base^degree, a number if base is TAPE_NONE
+struct LowerTerm_t {
+    size_t slot;                // src slot of the whole term
+    size_t base;                // dst slot
+    unsigned degree;
+    double coef;
+    double sign;
+    int has_coef;               // src multiplies by coef
+};
+
+struct Lower_t {
+    const EvalTape_t* src;
+    EvalTape_t* dst;
+    const LowerCosts_t* costs;
+    LowerStats_t* stats;
+    size_t* memo;               // src slot -> dst slot, TAPE_NONE until lowered
+    unsigned char* summed;      // src sums already split into terms
+    size_t* table;              // dst slots by instruction, TAPE_NONE - empty
+    size_t table_size;
+    LowerTerm_t* terms;         // of the sums being lowered, the innermost last
+    size_t term_count;
+    size_t term_capacity;
+    int count_shared;
+    EvalErr_t err;
+};
+
+static EvalErr_t LowerInit(Lower_t* lower, const EvalTape_t* src, EvalTape_t* dst,
+                           const LowerCosts_t* costs, LowerStats_t* stats);
+static void LowerDestroy(Lower_t* lower);
+static size_t LowerSlot(Lower_t* lower, size_t slot);
+static size_t LowerOperands(Lower_t* lower, const TapeInstr_t* instr);
+static size_t LowerPower(Lower_t* lower, const TapeInstr_t* instr, long k);
+static size_t LowerSum(Lower_t* lower, size_t slot);
+static void CollectTerms(Lower_t* lower, size_t slot, double sign);
+static size_t EmitPolynomials(Lower_t* lower, size_t begin, size_t end);
+static size_t EmitHorner(Lower_t* lower, size_t base, const double* coefs, unsigned degree);
+static size_t EmitPowerChain(Lower_t* lower, size_t base, unsigned long n);
+static EvalErr_t ShareReciprocals(Lower_t* lower, size_t* root);
+static EvalErr_t DropDead(EvalTape_t* tape, size_t root);
+static double PowerCost(const LowerCosts_t* costs, unsigned long n);
+static int IntegerExponent(const EvalTape_t* tape, const TapeInstr_t* instr, long* k);
+static int TermCompare(const void* first, const void* second);
+static size_t Emit(Lower_t* lower, const TapeInstr_t* instr);
+static size_t EmitNumber(Lower_t* lower, double number);
+static size_t EmitOp(Lower_t* lower, Operation_t operation, size_t left, size_t right);
+static int TableReset(Lower_t* lower, size_t size);
+static uint64_t InstrHash(const TapeInstr_t* instr);
+static int InstrEqual(const TapeInstr_t* first, const TapeInstr_t* second);
+
+void LowerCostsInit(LowerCosts_t* costs) {
+    assert( costs != NULL );
+
+    for (size_t i = 0; i < OPERATION_COUNT; i++) {
+        costs->op[i] = OPERATIONS[i].cost;
+    }
+}
+
+double EvalTapeCost(const EvalTape_t* tape, const LowerCosts_t* costs) {
+    assert( tape != NULL );
+    assert( costs != NULL );
+
+    double cost = 0;
+    for (size_t i = 0; i < tape->size; i++) {
+        const TapeInstr_t* instr = &tape->code[i];
+        if (instr->type == TYPE_OPERATION && (size_t)instr->operation < OPERATION_COUNT) {
+            cost += costs->op[instr->operation];
+        }
+    }
+
+    return cost;
+}
+
+EvalErr_t EvalTapeLower(const EvalTape_t* src, EvalTape_t* dst, const LowerCosts_t* costs, LowerStats_t* stats) {
+    assert( src != NULL );
+    assert( src->size != 0 );
+    assert( dst != NULL );
+    assert( costs != NULL );
+    assert( stats != NULL );
+
+    Lower_t lower = {};
+    EvalErr_t err = LowerInit(&lower, src, dst, costs, stats);
+
+    size_t root = TAPE_NONE;
+    if (err == EVAL_OK) {
+        root = LowerSlot(&lower, src->size - 1);
+        err = lower.err;
+    }
+    if (err == EVAL_OK) {
+        lower.count_shared = 0;
+        err = ShareReciprocals(&lower, &root);
+    }
+    LowerDestroy(&lower);
+
+    if (err == EVAL_OK) {
+        err = DropDead(dst, root);
+    }
+    if (err != EVAL_OK) {
+        EvalTapeDestroy(dst);
+        return err;
+    }
+
+    ++stats->tapes;
+    stats->size_before += src->size;
+    stats->size_after  += dst->size;
+    stats->cost_before += EvalTapeCost(src, costs);
+    stats->cost_after  += EvalTapeCost(dst, costs);
+
+    return EVAL_OK;
+}
+
+void LowerStatsPrint(const LowerStats_t* stats, FILE* fp) {
+    assert( stats != NULL );
+    assert( fp != NULL );
+
+    double saved = stats->cost_before - stats->cost_after;
+    double percent = (stats->cost_before > 0) ? 100 * saved / stats->cost_before : 0;
+
+    fprintf(fp, "lower: %zu tapes, %zu -> %zu instructions, %.0lf -> %.0lf estimated flops per evaluation (%.1lf%% saved)\n",
+            stats->tapes, stats->size_before, stats->size_after, stats->cost_before, stats->cost_after, percent);
+    fprintf(fp, "lower: %zu powers, %zu reciprocals, %zu horner polynomials, %zu shared instructions\n",
+            stats->powers, stats->reciprocals, stats->horner, stats->shared);
+}
+
+static EvalErr_t LowerInit(Lower_t* lower, const EvalTape_t* src, EvalTape_t* dst,
+                           const LowerCosts_t* costs, LowerStats_t* stats) {
+    lower->src          = src;
+    lower->dst          = dst;
+    lower->costs        = costs;
+    lower->stats        = stats;
+    lower->count_shared = 1;
+    lower->err          = EVAL_OK;
+
+    dst->size      = 0;
+    dst->capacity  = src->size;
+    dst->var_count = src->var_count;
+    dst->code      = (TapeInstr_t*)calloc(dst->capacity, sizeof(TapeInstr_t));
+
+    lower->memo   = (size_t*)calloc(src->size, sizeof(size_t));
+    lower->summed = (unsigned char*)calloc(src->size, sizeof(unsigned char));
+
+    if (dst->code == NULL || lower->memo == NULL || lower->summed == NULL || !TableReset(lower, 2 * src->size)) {
+        return EVAL_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; i < src->size; i++) {
+        lower->memo[i] = TAPE_NONE;
+    }
+
+    return EVAL_OK;
+}
+
+static void LowerDestroy(Lower_t* lower) {
+    FREE(lower->memo);
+    FREE(lower->summed);
+    FREE(lower->table);
+    FREE(lower->terms);
+    lower->table_size = 0;
+    lower->term_count = 0;
+    lower->term_capacity = 0;
+}
+
+static size_t LowerSlot(Lower_t* lower, size_t slot) {
+    if (lower->memo[slot] != TAPE_NONE) {
+        return lower->memo[slot];
+    }
+
+    const TapeInstr_t* instr = &lower->src->code[slot];
+    size_t result = TAPE_NONE;
+    long k = 0;
+
+    if (instr->type != TYPE_OPERATION) {
+        result = Emit(lower, instr);
+    } else if ((instr->operation == OPERATION_ADD || instr->operation == OPERATION_SUB) && !lower->summed[slot]) {
+        result = LowerSum(lower, slot);
+    } else if (IntegerExponent(lower->src, instr, &k)) {
+        result = LowerPower(lower, instr, k);
+    } else {
+        result = LowerOperands(lower, instr);
+    }
+
+    lower->memo[slot] = result;
+
+    return result;
+}
+
+static size_t LowerOperands(Lower_t* lower, const TapeInstr_t* instr) {
+    size_t left  = (instr->left != TAPE_NONE) ? LowerSlot(lower, instr->left) : TAPE_NONE;
+    size_t right = LowerSlot(lower, instr->right);
+
+    return EmitOp(lower, instr->operation, left, right);
+}
+
+// pow(u, 0) is 1 even for u that is not finite
+static size_t LowerPower(Lower_t* lower, const TapeInstr_t* instr, long k) {
+    const double* cost = lower->costs->op;
+    unsigned long n = (unsigned long)labs(k);
+
+    if (n == 0) {
+        ++lower->stats->powers;
+        return EmitNumber(lower, 1);
+    }
+
+    double chain = PowerCost(lower->costs, n) + ((k < 0) ? cost[OPERATION_DIV] : 0);
+    if (!(chain < cost[OPERATION_EXP])) {
+        return LowerOperands(lower, instr);
+    }
+
+    size_t power = EmitPowerChain(lower, LowerSlot(lower, instr->left), n);
+    if (k < 0) {
+        power = EmitOp(lower, OPERATION_DIV, EmitNumber(lower, 1), power);
+    }
+    ++lower->stats->powers;
+
+    return power;
+}
+
+// A sum is split into its terms once; the sums inside it are then lowered
+// as they are, so a long sum costs linear time
+static size_t LowerSum(Lower_t* lower, size_t slot) {
+    size_t begin = lower->term_count;
+
+    CollectTerms(lower, slot, 1);
+
+    size_t result = TAPE_NONE;
+    if (lower->err == EVAL_OK) {
+        result = EmitPolynomials(lower, begin, lower->term_count);
+    }
+    lower->term_count = begin;
+
+    if (result == TAPE_NONE) {
+        result = LowerOperands(lower, &lower->src->code[slot]);
+    }
+
+    return result;
+}
+
+static void CollectTerms(Lower_t* lower, size_t slot, double sign) {
+    const EvalTape_t* src = lower->src;
+    const TapeInstr_t* instr = &src->code[slot];
+
+    if (instr->type == TYPE_OPERATION && (instr->operation == OPERATION_ADD || instr->operation == OPERATION_SUB)
+        && !lower->summed[slot] && lower->memo[slot] == TAPE_NONE) {
+        lower->summed[slot] = 1;
+        CollectTerms(lower, instr->left, sign);
+        CollectTerms(lower, instr->right, (instr->operation == OPERATION_SUB) ? -sign : sign);
+        return;
+    }
+
+    LowerTerm_t term = {slot, TAPE_NONE, 0, 1, sign, 0};
+    size_t power = slot;
+
+    if (instr->type == TYPE_OPERATION && instr->operation == OPERATION_MUL) {
+        if (src->code[instr->left].type == TYPE_NUMBER) {
+            term.coef = src->code[instr->left].number;
+            term.has_coef = 1;
+            power = instr->right;
+        } else if (src->code[instr->right].type == TYPE_NUMBER) {
+            term.coef = src->code[instr->right].number;
+            term.has_coef = 1;
+            power = instr->left;
+        }
+    }
+
+    long k = 0;
+    if (src->code[power].type == TYPE_NUMBER) {
+        term.coef *= src->code[power].number;
+    } else if (IntegerExponent(src, &src->code[power], &k) && k >= 1 && k <= (long)LOWER_MAX_DEGREE) {
+        term.base   = LowerSlot(lower, src->code[power].left);
+        term.degree = (unsigned)k;
+    } else {
+        term.base   = LowerSlot(lower, power);
+        term.degree = 1;
+    }
+
+    if (lower->term_count == lower->term_capacity) {
+        size_t capacity = 2 * lower->term_capacity + 16;
+        LowerTerm_t* terms = (LowerTerm_t*)realloc(lower->terms, capacity * sizeof(LowerTerm_t));
+        if (terms == NULL) {
+            lower->err = EVAL_ALLOCATION_FAILED;
+            return;
+        }
+
+        lower->terms = terms;
+        lower->term_capacity = capacity;
+    }
+    lower->terms[lower->term_count++] = term;
+}
+
+// Terms with one base make a polynomial in it, which goes to Horner form if
+// that is cheaper than the terms as they are. TAPE_NONE if none does.
+static size_t EmitPolynomials(Lower_t* lower, size_t begin, size_t end) {
+    const double* cost = lower->costs->op;
+    LowerTerm_t* terms = lower->terms + begin;
+    size_t count = end - begin;
+
+    qsort(terms, count, sizeof(LowerTerm_t), TermCompare);
+
+    size_t total = TAPE_NONE;
+    double constant = 0;
+    int has_constant = 0;
+    unsigned char* horner = (unsigned char*)calloc(count, sizeof(unsigned char));
+    if (horner == NULL) {
+        lower->err = EVAL_ALLOCATION_FAILED;
+        return TAPE_NONE;
+    }
+
+    for (size_t i = 0; i < count;) {
+        size_t run = i + 1;
+        while (run < count && terms[run].base == terms[i].base) {
+            run++;
+        }
+
+        if (terms[i].base == TAPE_NONE) {
+            for (size_t j = i; j < run; j++) {
+                constant += terms[j].sign * terms[j].coef;
+            }
+            has_constant = 1;
+            i = run;
+            continue;
+        }
+
+        double coefs[LOWER_MAX_DEGREE + 1] = {};
+        double naive = 0;
+        for (size_t j = i; j < run; j++) {
+            coefs[terms[j].degree] += terms[j].sign * terms[j].coef;
+
+            double power = (terms[j].degree > 1) ? PowerCost(lower->costs, terms[j].degree) : 0;
+            naive += fmin(power, cost[OPERATION_EXP]) + (terms[j].has_coef ? cost[OPERATION_MUL] : 0)
+                   + cost[OPERATION_ADD];
+        }
+
+        unsigned degree = LOWER_MAX_DEGREE;
+        while (degree > 0 && coefs[degree] == 0) {
+            degree--;
+        }
+
+        double nested = cost[OPERATION_ADD] + (double)degree * cost[OPERATION_MUL]
+                      - ((coefs[degree] == 1) ? cost[OPERATION_MUL] : 0);
+        for (unsigned k = 1; k < degree; k++) {
+            nested += (coefs[k] != 0) ? cost[OPERATION_ADD] : 0;
+        }
+
+        if (degree != 0 && nested < naive) {
+            size_t piece = EmitHorner(lower, terms[i].base, coefs, degree);
+            total = (total == TAPE_NONE) ? piece : EmitOp(lower, OPERATION_ADD, total, piece);
+            memset(horner + i, 1, run - i);
+            ++lower->stats->horner;
+        }
+
+        i = run;
+    }
+
+    for (size_t i = 0; total != TAPE_NONE && i < count; i++) {
+        if (!horner[i] && terms[i].base != TAPE_NONE) {
+            size_t term = LowerSlot(lower, terms[i].slot);
+            total = EmitOp(lower, (terms[i].sign > 0) ? OPERATION_ADD : OPERATION_SUB, total, term);
+        }
+    }
+    if (total != TAPE_NONE && has_constant && constant != 0) {
+        total = EmitOp(lower, OPERATION_ADD, total, EmitNumber(lower, constant));
+    }
+
+    FREE(horner);
+
+    return total;
+}
+
+// (((c_n * x + c_n-1) * x + ...) * x + c_1) * x
+static size_t EmitHorner(Lower_t* lower, size_t base, const double* coefs, unsigned degree) {
+    size_t acc = (coefs[degree] == 1) ? base : EmitOp(lower, OPERATION_MUL, EmitNumber(lower, coefs[degree]), base);
+
+    for (unsigned k = degree - 1; k > 0; k--) {
+        if (coefs[k] != 0) {
+            acc = EmitOp(lower, OPERATION_ADD, acc, EmitNumber(lower, coefs[k]));
+        }
+        acc = EmitOp(lower, OPERATION_MUL, acc, base);
+    }
+
+    return acc;
+}
+
+// Binary exponentiation, the squares are shared by every power of base
+static size_t EmitPowerChain(Lower_t* lower, size_t base, unsigned long n) {
+    size_t result = TAPE_NONE;
+    size_t square = base;
+
+    for (;;) {
+        if (n & 1) {
+            result = (result == TAPE_NONE) ? square : EmitOp(lower, OPERATION_MUL, result, square);
+        }
+        n >>= 1;
+        if (n == 0) {
+            break;
+        }
+        square = EmitOp(lower, OPERATION_MUL, square, square);
+    }
+
+    return result;
+}
+
+static EvalErr_t ShareReciprocals(Lower_t* lower, size_t* root) {
+    const double* cost = lower->costs->op;
+    EvalTape_t old = *lower->dst;
+
+    size_t* uses = (size_t*)calloc(old.size, sizeof(size_t));
+    if (uses == NULL) {
+        return EVAL_ALLOCATION_FAILED;
+    }
+
+    size_t worth = 0;
+    for (size_t i = 0; i < old.size; i++) {
+        const TapeInstr_t* instr = &old.code[i];
+        if (instr->type == TYPE_OPERATION && instr->operation == OPERATION_DIV) {
+            ++uses[instr->right];
+        }
+    }
+    for (size_t i = 0; i < old.size; i++) {
+        size_t n = uses[i];
+        uses[i] = (n > 1 && cost[OPERATION_DIV] + (double)n * cost[OPERATION_MUL] < (double)n * cost[OPERATION_DIV]);
+        worth += uses[i];
+    }
+
+    if (worth == 0) {
+        FREE(uses);
+        return EVAL_OK;
+    }
+
+    size_t* map   = (size_t*)calloc(old.size, sizeof(size_t));
+    size_t* recip = (size_t*)calloc(old.size, sizeof(size_t));
+    TapeInstr_t* code = (TapeInstr_t*)calloc(old.size + worth, sizeof(TapeInstr_t));
+
+    if (map == NULL || recip == NULL || code == NULL || !TableReset(lower, 2 * (old.size + worth))) {
+        FREE(uses);
+        FREE(map);
+        FREE(recip);
+        FREE(code);
+        return EVAL_ALLOCATION_FAILED;
+    }
+
+    lower->dst->code     = code;
+    lower->dst->size     = 0;
+    lower->dst->capacity = old.size + worth;
+
+    for (size_t i = 0; i < old.size; i++) {
+        TapeInstr_t instr = old.code[i];
+        recip[i] = TAPE_NONE;
+
+        if (instr.type != TYPE_OPERATION) {
+            map[i] = Emit(lower, &instr);
+            continue;
+        }
+
+        if (instr.operation != OPERATION_DIV || !uses[instr.right]) {
+            map[i] = EmitOp(lower, instr.operation, (instr.left != TAPE_NONE) ? map[instr.left] : TAPE_NONE,
+                            map[instr.right]);
+            continue;
+        }
+
+        size_t denominator = instr.right;
+        if (recip[denominator] == TAPE_NONE) {
+            recip[denominator] = EmitOp(lower, OPERATION_DIV, EmitNumber(lower, 1), map[denominator]);
+            ++lower->stats->reciprocals;
+        }
+
+        const TapeInstr_t* numerator = &old.code[instr.left];
+        map[i] = (numerator->type == TYPE_NUMBER && numerator->number == 1)
+               ? recip[denominator] : EmitOp(lower, OPERATION_MUL, map[instr.left], recip[denominator]);
+    }
+
+    *root = map[*root];
+
+    FREE(old.code);
+    FREE(uses);
+    FREE(map);
+    FREE(recip);
+
+    return lower->err;
+}
+
+// Whatever root does not use. Every instruction root uses is before it, so
+// root ends up last, where EvalTapeRun takes the result from.
+static EvalErr_t DropDead(EvalTape_t* tape, size_t root) {
+    size_t* map = (size_t*)calloc(tape->size, sizeof(size_t));
+    if (map == NULL) {
+        return EVAL_ALLOCATION_FAILED;
+    }
+
+    map[root] = 1;
+    for (size_t i = root + 1; i-- > 0;) {
+        const TapeInstr_t* instr = &tape->code[i];
+        if (map[i] && instr->type == TYPE_OPERATION) {
+            if (instr->left != TAPE_NONE) {
+                map[instr->left] = 1;
+            }
+            map[instr->right] = 1;
+        }
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i <= root; i++) {
+        if (!map[i]) {
+            continue;
+        }
+
+        TapeInstr_t instr = tape->code[i];
+        if (instr.type == TYPE_OPERATION) {
+            if (instr.left != TAPE_NONE) {
+                instr.left = map[instr.left];
+            }
+            instr.right = map[instr.right];
+        }
+
+        map[i] = size;
+        tape->code[size++] = instr;
+    }
+    tape->size = size;
+
+    FREE(map);
+
+    return EVAL_OK;
+}
+
+// Multiplications of binary exponentiation
+static double PowerCost(const LowerCosts_t* costs, unsigned long n) {
+    assert( n != 0 );
+
+    int bits = 64 - __builtin_clzl(n);
+    int ones = __builtin_popcountl(n);
+
+    return (double)(bits - 1 + ones - 1) * costs->op[OPERATION_MUL];
+}
+
+static int IntegerExponent(const EvalTape_t* tape, const TapeInstr_t* instr, long* k) {
+    if (instr->type != TYPE_OPERATION || instr->operation != OPERATION_EXP || instr->left == TAPE_NONE) {
+        return 0;
+    }
+
+    const TapeInstr_t* exponent = &tape->code[instr->right];
+    if (exponent->type != TYPE_NUMBER || fabs(exponent->number) > (double)LOWER_MAX_POWER
+                                      || exponent->number != floor(exponent->number)) {
+        return 0;
+    }
+
+    *k = (long)exponent->number;
+
+    return 1;
+}
+
+// By base, numbers last, and by position in the source for the same base
+static int TermCompare(const void* first, const void* second) {
+    const LowerTerm_t* a = (const LowerTerm_t*)first;
+    const LowerTerm_t* b = (const LowerTerm_t*)second;
+
+    if (a->base != b->base) {
+        return (a->base < b->base) ? -1 : 1;
+    }
+    if (a->slot != b->slot) {
+        return (a->slot < b->slot) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static size_t Emit(Lower_t* lower, const TapeInstr_t* instr) {
+    if (lower->err != EVAL_OK) {
+        return TAPE_NONE;
+    }
+
+    EvalTape_t* dst = lower->dst;
+    TapeInstr_t key = *instr;
+
+    // exactly commutative in IEEE arithmetic
+    if (key.type == TYPE_OPERATION && (key.operation == OPERATION_ADD || key.operation == OPERATION_MUL)
+        && key.left > key.right) {
+        size_t temp = key.left;
+        key.left  = key.right;
+        key.right = temp;
+    }
+
+    size_t mask = lower->table_size - 1;
+    size_t index = InstrHash(&key) & mask;
+    for (; lower->table[index] != TAPE_NONE; index = (index + 1) & mask) {
+        if (InstrEqual(&dst->code[lower->table[index]], &key)) {
+            lower->stats->shared += (size_t)lower->count_shared;
+            return lower->table[index];
+        }
+    }
+
+    if (dst->size == dst->capacity) {
+        size_t capacity = 2 * dst->capacity + 1;
+        TapeInstr_t* code = (TapeInstr_t*)realloc(dst->code, capacity * sizeof(TapeInstr_t));
+        if (code == NULL) {
+            lower->err = EVAL_ALLOCATION_FAILED;
+            return TAPE_NONE;
+        }
+
+        dst->code = code;
+        dst->capacity = capacity;
+    }
+
+    size_t slot = dst->size;
+    dst->code[dst->size++] = key;
+    lower->table[index] = slot;
+
+    if (2 * dst->size > lower->table_size && !TableReset(lower, 2 * lower->table_size)) {
+        lower->err = EVAL_ALLOCATION_FAILED;
+    }
+
+    return slot;
+}
+
+static size_t EmitNumber(Lower_t* lower, double number) {
+    TapeInstr_t instr = {TYPE_NUMBER, OPERATION_UNDEF, TAPE_NONE, TAPE_NONE, TAPE_NONE, number};
+
+    return Emit(lower, &instr);
+}
+
+static size_t EmitOp(Lower_t* lower, Operation_t operation, size_t left, size_t right) {
+    TapeInstr_t instr = {TYPE_OPERATION, operation, left, right, TAPE_NONE, 0};
+
+    return Emit(lower, &instr);
+}
+
+// Table of at least size entries holding the dst instructions emitted so far
+static int TableReset(Lower_t* lower, size_t size) {
+    size_t table_size = LOWER_TABLE_MIN;
+    while (table_size < size) {
+        table_size *= 2;
+    }
+
+    size_t* table = (size_t*)realloc(lower->table, table_size * sizeof(size_t));
+    if (table == NULL) {
+        return 0;
+    }
+
+    lower->table = table;
+    lower->table_size = table_size;
+    for (size_t i = 0; i < table_size; i++) {
+        table[i] = TAPE_NONE;
+    }
+
+    size_t mask = table_size - 1;
+    for (size_t slot = 0; slot < lower->dst->size; slot++) {
+        size_t index = InstrHash(&lower->dst->code[slot]) & mask;
+        while (table[index] != TAPE_NONE) {
+            index = (index + 1) & mask;
+        }
+        table[index] = slot;
+    }
+
+    return 1;
+}
+
+static uint64_t InstrHash(const TapeInstr_t* instr) {
+    uint64_t number = 0;
+    memcpy(&number, &instr->number, sizeof(number));
+
+    uint64_t hash = (uint64_t)instr->type * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ (uint64_t)instr->operation) * 0xFF51AFD7ED558CCDull;
+    hash = (hash ^ instr->left)  * 0xC4CEB9FE1A85EC53ull;
+    hash = (hash ^ instr->right) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ instr->var)   * 0xFF51AFD7ED558CCDull;
+    hash = (hash ^ number)       * 0xC4CEB9FE1A85EC53ull;
+
+    return hash ^ (hash >> 32);
+}
+
+// Numbers by their bits, so 0 and -0 stay apart
+static int InstrEqual(const TapeInstr_t* first, const TapeInstr_t* second) {
+    return first->type == second->type && first->operation == second->operation
+        && first->left == second->left && first->right == second->right && first->var == second->var
+        && memcmp(&first->number, &second->number, sizeof(double)) == 0;
+}
@@ -0,0 +1,53 @@
+#ifndef DIF_LOWER_H
+#define DIF_LOWER_H
+
+#include <stdio.h>
+
+#include "dif_eval.h"
+#include "operations.h"
+
+const long LOWER_MAX_POWER     = 64;        // bigger integer exponents stay pow
+const unsigned LOWER_MAX_DEGREE = 32;       // of the polynomials put in Horner form
+
+// Flops of one evaluation of each operation, numbers and variables are free
+struct LowerCosts_t {
+    double op[OPERATION_COUNT];
+};
+
+// Added to by every EvalTapeLower, so one of them can cover several tapes
+struct LowerStats_t {
+    size_t tapes;
+    size_t size_before;
+    size_t size_after;
+    double cost_before;
+    double cost_after;
+    size_t powers;              // integer powers turned into multiplications
+    size_t reciprocals;         // denominators divided by once and multiplied by after
+    size_t horner;              // polynomials in one base put in Horner form
+    size_t shared;              // repeated instructions computed once
+};
+
+// The cost column of OPERATIONS
+void LowerCostsInit(LowerCosts_t* costs);
+
+double EvalTapeCost(const EvalTape_t* tape, const LowerCosts_t* costs);
+
+/*
+Evaluation-oriented copy of src where a rewrite is made only if costs says
+it is cheaper:
+    u^k, integer |k| <= LOWER_MAX_POWER     multiplications by squaring
+    a / d, b / d, ...                       r = 1 / d, a * r, b * r, ...
+    c2 * x^2 + c1 * x + c0                  (c2 * x + c1) * x + c0
+Equal instructions are computed once, which is what lets the rewrites reuse
+the squares, the reciprocal and the base of a polynomial.
+
+The result agrees with src up to rounding for finite values only: sums are
+reassociated and multiplications round differently from pow and division.
+It is meant for point evaluation, tangents and adjoints; interval bounds of
+x * x are wider than those of x^2.
+*/
+EvalErr_t EvalTapeLower(const EvalTape_t* src, EvalTape_t* dst, const LowerCosts_t* costs, LowerStats_t* stats);
+
+void LowerStatsPrint(const LowerStats_t* stats, FILE* fp);
+
+#endif // DIF_LOWER_H
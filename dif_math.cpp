@@ -1,13 +1,34 @@
 #include "dif_math.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 
-#define cL TreeCopySubtree(node->left, node)
-#define cR TreeCopySubtree(node->right, node)
-#define dL TreeDiff(node->left, var)
-#define dR TreeDiff(node->right, var)
+#include "metrics.h"
+#include "node_map.h"
+#include "operations.h"
+#include "io.h"
+#include "utils.h"
+#include "alloc_track.h"
+#include "debug.h"
+#include "budget.h"
+
+const unsigned DIFF_REPEATED = 0x200;     // in the index of TreeDiffCached: the subtree occurs twice or more
+
+#define cL CopyOperand(node->left, ctx)
+#define cR CopyOperand(node->right, ctx)
+
+#define dL RecursiveDiff(node->left, ctx)
+#define dR RecursiveDiff(node->right, ctx)
+
+// the rules fold while building, so a number only matches the exact value:
+// the optimizer's tolerance would drop small nonzero constants for good
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+
+#define IS_VALUE(ptr, val) \
+    (ptr != NULL && ptr->type == TYPE_NUMBER && ptr->data.number == val)
 
 #define c(x) \
     NodeInit(NULL, NULL, NULL, TYPE_NUMBER, x)
@@ -15,19 +36,19 @@
     NodeInit(NULL, NULL, NULL, TYPE_VARIABLE, x)
 
 #define ADD_(left, right) \
-    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_ADD)
+    MakeBinary(ctx, OPERATION_ADD, left, right)
 
 #define SUB_(left, right) \
-    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_SUB)
+    MakeBinary(ctx, OPERATION_SUB, left, right)
 
 #define MUL_(left, right) \
-    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_MUL)
+    MakeBinary(ctx, OPERATION_MUL, left, right)
 
 #define DIV_(left, right) \
-    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_DIV)
+    MakeBinary(ctx, OPERATION_DIV, left, right)
 
 #define EXP_(left, right) \
-    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_EXP)
+    MakeBinary(ctx, OPERATION_EXP, left, right)
 
 #define LN_(right) \
     NodeInit(NULL, NULL, right, TYPE_OPERATION, OPERATION_LN)
@@ -47,104 +68,702 @@
 #define COSH_(right) \
     NodeInit(NULL, NULL, right, TYPE_OPERATION, OPERATION_COSH)
 
+// index - dependence flags of the input nodes, and their hashes when there is
+// a cache
+struct DiffCtx_t {
+    const char* var;
+    DiffCache_t* cache;
+    NodeMap_t* index;
+    const DiffHooks_t* hooks;
+};
+
+// Operands of the node whose rule is being applied by TreeDiffConsume
+struct ConsumeOperands_t {
+    const char* var;
+    NodeMap_t* index;
+    Node_t* node;
+    int left_moved;
+    int right_moved;
+};
+
+static Node_t* RecursiveDiff(const Node_t* node, DiffCtx_t* ctx);
+static Node_t* DiffNode(const Node_t* node, DiffCtx_t* ctx);
+static Node_t* CopyOperand(const Node_t* node, DiffCtx_t* ctx);
+static Node_t* ApplyDiffRule(const Node_t* node, DiffCtx_t* ctx);
+static TreeErr_t BuildIndex(NodeMap_t* index, const Node_t* root, const char* var);
+static int IndexDepends(NodeMap_t* index, const Node_t* node, const char* var, TreeErr_t* err);
+static TreeErr_t MarkRepeated(NodeMap_t* index);
+static int CompareHashes(const void* a, const void* b);
+static int OperandDepends(const Node_t* operand, const DiffCtx_t* ctx);
+static int LazyDependsHook(const Node_t* node, void* arg);
+static Node_t* ExpandDiffThunk(const Thunk_t* thunk);
+static Node_t* LazyDiffHook(const Node_t* node, void* arg);
+static Node_t* MakeBinary(DiffCtx_t* ctx, Operation_t operation, Node_t* left, Node_t* right);
+static Node_t* FoldBinary(DiffCtx_t* ctx, Operation_t operation, Node_t* left, Node_t* right);
+static void Discard(DiffCtx_t* ctx, Node_t* node);
+static Node_t* ConsumeDiff(Node_t* node, const char* var, NodeMap_t* index);
+static Node_t* ConsumeDiffNode(Node_t* node, const char* var, NodeMap_t* index);
+static Node_t* ConsumeOperandDiff(const Node_t* operand, void* arg);
+static Node_t* MoveOperand(const Node_t* operand, void* arg);
+static void DiscardOperand(Node_t* node, void* arg);
+
+Node_t* TreeDiff(const Node_t* node, const char* var) {
+    return TreeDiffCached(node, var, NULL);
+}
 
-Node_t* TreeDiff(Node_t* node, const char* var) {
+Node_t* TreeDiffLazy(LazyDiff_t* lazy, const Node_t* node, const char* var) {
+    assert( lazy != NULL );
     assert( node != NULL );
     assert( var != NULL );
 
-    if (node->type == TYPE_NUMBER) {
-        return c(0.f);
+    if (LazyDiffInit(lazy, node, var, ExpandDiffThunk) != TREE_OK) {
+        return NULL;
     }
 
-    if (node->type == TYPE_VARIABLE) {
-        if (strcmp(node->data.variable, var) == 0) {
-            return c(1.f);
-        } else {
-            return v(node->data.variable);
+    return LazyDiffNode(lazy, node);
+}
+
+static Node_t* ExpandDiffThunk(const Thunk_t* thunk) {
+    assert( thunk != NULL );
+
+    LazyDiff_t* lazy = (LazyDiff_t*)thunk->ctx;
+    DiffHooks_t hooks = {LazyDiffHook, NULL, lazy, NULL, LazyDependsHook};
+
+    METRICS_INC(COUNTER_LAZY_FORCED);
+
+    return TreeDiffStep(thunk->source, lazy->var, &hooks);
+}
+
+static Node_t* LazyDiffHook(const Node_t* node, void* arg) {
+    return LazyDiffNode((LazyDiff_t*)arg, node);
+}
+
+static int LazyDependsHook(const Node_t* node, void* arg) {
+    return LazyDiffDepends((const LazyDiff_t*)arg, node);
+}
+
+Node_t* TreeDiffConsume(Node_t* node, const char* var) {
+    assert( node != NULL );
+    assert( var != NULL );
+
+    METRICS_PHASE_BEGIN(PHASE_DIFF);
+    METRICS_ADD(COUNTER_DIFF_INPUT_NODES, TreeSubtreeSize(node));
+
+    // the rules only ask about operands that were not consumed yet
+    NodeMap_t index = {};
+    Node_t* new_node = NULL;
+    if (BuildIndex(&index, node, var) == TREE_OK) {
+        new_node = ConsumeDiff(node, var, &index);
+    } else {
+        TreeDestroySubtree(&node);
+    }
+    if (BudgetExceeded()) {
+        TreeDestroySubtree(&new_node);
+    }
+    if (index.entries != NULL) {
+        NodeMapDestroy(&index);
+    }
+    if (new_node != NULL) {
+        new_node->parent = NULL;
+    }
+
+    METRICS_PHASE_END(PHASE_DIFF);
+    METRICS_ADD(COUNTER_DIFF_OUTPUT_NODES, TreeSubtreeSize(new_node));
+
+    return new_node;
+}
+
+// Leaves turn into their derivative in place and linear operations keep
+// their node. Other rules get the operands moved into the result on first
+// use and copied on the next ones; the operand derivatives are built without
+// consuming, as the operands themselves may be in the result.
+static Node_t* ConsumeDiff(Node_t* node, const char* var, NodeMap_t* index) {
+    if (!BudgetDescend()) {
+        TreeDestroySubtree(&node);
+        return NULL;
+    }
+
+    Node_t* new_node = ConsumeDiffNode(node, var, index);
+
+    BudgetAscend();
+
+    return new_node;
+}
+
+static Node_t* ConsumeDiffNode(Node_t* node, const char* var, NodeMap_t* index) {
+    if (node->type == TYPE_NUMBER || node->type == TYPE_VARIABLE) {
+        double number = (node->type == TYPE_VARIABLE && strcmp(node->data.variable, var) == 0) ? 1 : 0;
+        if (node->type == TYPE_VARIABLE) {
+            TRACK_FREE(node->data.variable);
+        }
+
+        node->type = TYPE_NUMBER;
+        node->data.number = number;
+        return node;
+    }
+
+    const OperationInfo_t* info = (node->type == TYPE_OPERATION) ? OperationGet(node->data.operation) : NULL;
+    if (info != NULL && info->linear && node->left != NULL && node->right != NULL) {
+        Node_t* left  = ConsumeDiff(node->left, var, index);
+        Node_t* right = ConsumeDiff(node->right, var, index);
+        node->left = node->right = NULL;
+
+        // results of other rules may still point at their freed nodes
+        if (left != NULL)  left->parent  = NULL;
+        if (right != NULL) right->parent = NULL;
+
+        if (left == NULL || right == NULL) {
+            TreeDestroySubtree(&left);
+            TreeDestroySubtree(&right);
+            NodeDestroy(&node);
+            return NULL;
+        }
+
+        DiffCtx_t ctx = {var, NULL, NULL, NULL};
+        Node_t* folded = FoldBinary(&ctx, node->data.operation, left, right);
+        if (folded != NULL) {
+            NodeDestroy(&node);
+            return folded;
         }
+
+        node->left  = left;
+        node->right = right;
+        left->parent  = node;
+        right->parent = node;
+        return node;
+    }
+
+    ConsumeOperands_t operands = {var, index, node, 0, 0};
+    DiffHooks_t hooks = {ConsumeOperandDiff, MoveOperand, &operands, DiscardOperand};
+    DiffCtx_t ctx = {var, NULL, index, &hooks};
+
+    Node_t* new_node = ApplyDiffRule(node, &ctx);
+
+    if (operands.left_moved) {
+        node->left = NULL;
+    } else {
+        TreeDestroySubtree(&node->left);
+    }
+    if (operands.right_moved) {
+        node->right = NULL;
+    } else {
+        TreeDestroySubtree(&node->right);
+    }
+    NodeDestroy(&node);
+
+    return new_node;
+}
+
+static Node_t* ConsumeOperandDiff(const Node_t* operand, void* arg) {
+    ConsumeOperands_t* operands = (ConsumeOperands_t*)arg;
+    DiffCtx_t ctx = {operands->var, NULL, operands->index, NULL};
+
+    return RecursiveDiff(operand, &ctx);
+}
+
+static Node_t* MoveOperand(const Node_t* operand, void* arg) {
+    ConsumeOperands_t* operands = (ConsumeOperands_t*)arg;
+    Node_t* node = operands->node;
+
+    if (operand == node->left && !operands->left_moved) {
+        operands->left_moved = 1;
+        METRICS_INC(COUNTER_SUBTREES_MOVED);
+        return node->left;
+    }
+    if (operand == node->right && !operands->right_moved) {
+        operands->right_moved = 1;
+        METRICS_INC(COUNTER_SUBTREES_MOVED);
+        return node->right;
     }
 
-    switch (node->data.operation) {
+    METRICS_INC(COUNTER_SUBTREE_COPIES);        // a moved operand stays intact until the rule is done
+
+    return TreeCopySubtree(operand, NULL);
+}
+
+// A moved operand dropped by a folding constructor goes back to its node
+static void DiscardOperand(Node_t* node, void* arg) {
+    ConsumeOperands_t* operands = (ConsumeOperands_t*)arg;
+
+    if (node == NULL) {
+        return;
+    }
+
+    int* moved = (node == operands->node->left)  ? &operands->left_moved
+               : (node == operands->node->right) ? &operands->right_moved : NULL;
+    if (moved != NULL && *moved) {
+        *moved = 0;
+        node->parent = operands->node;
+        return;
+    }
+
+    DiscardOperand(node->left, arg);
+    DiscardOperand(node->right, arg);
+    node->left = node->right = NULL;            // a restored operand is no longer ours
+    NodeDestroy(&node);
+}
+
+Node_t* TreeDiffStep(const Node_t* node, const char* var, const DiffHooks_t* hooks) {
+    assert( node != NULL );
+    assert( var != NULL );
+    assert( hooks != NULL );
+    assert( hooks->diff != NULL );
+
+    DiffCtx_t ctx = {var, NULL, NULL, hooks};
+
+    return ApplyDiffRule(node, &ctx);
+}
+
+Node_t* TreeDiffCached(const Node_t* node, const char* var, DiffCache_t* cache) {
+    assert( node != NULL );
+    assert( var != NULL );
+
+    METRICS_PHASE_BEGIN(PHASE_DIFF);
+
+    NodeMap_t index = {};
+    DiffCtx_t ctx = {var, NULL, &index, NULL};
+
+    Node_t* new_node = NULL;
+    if (BuildIndex(&index, node, var) == TREE_OK) {
+        if (cache != NULL && NodeMapBuildHashes(&index, node) == TREE_OK && MarkRepeated(&index) == TREE_OK) {
+            ctx.cache = cache;
+        }
+
+        new_node = RecursiveDiff(node, &ctx);
+    }
+    if (BudgetExceeded()) {                     // rules keep building around the operands that failed
+        TreeDestroySubtree(&new_node);
+    }
+
+    if (index.entries != NULL) {
+        NodeMapDestroy(&index);
+    }
+
+    METRICS_PHASE_END(PHASE_DIFF);
+    METRICS_ADD(COUNTER_DIFF_INPUT_NODES, TreeSubtreeSize(node));
+    METRICS_ADD(COUNTER_DIFF_OUTPUT_NODES, TreeSubtreeSize(new_node));
+
+    return new_node;
+}
+
+static Node_t* RecursiveDiff(const Node_t* node, DiffCtx_t* ctx) {
+    assert( node != NULL );
+    assert( ctx != NULL );
+
+    if (!BudgetDescend()) {
+        return NULL;
+    }
+
+    Node_t* new_node = DiffNode(node, ctx);
+
+    BudgetAscend();
+
+    return new_node;
+}
+
+static Node_t* DiffNode(const Node_t* node, DiffCtx_t* ctx) {
+    if (ctx->hooks != NULL) {
+        return ctx->hooks->diff(node, ctx->hooks->arg);
+    }
+
+    if (ctx->cache == NULL) {
+        return ApplyDiffRule(node, ctx);
+    }
+
+    NodeInfo_t* info = NodeMapFind(ctx->index, node);
+    if (info == NULL || info->size < DIF_CACHE_MIN_NODES) {
+        return ApplyDiffRule(node, ctx);
+    }
+
+    Node_t* new_node = DiffCacheLookup(ctx->cache, node, info->hash, ctx->var);
+    if (new_node != NULL) {
+        return new_node;
+    }
+
+    new_node = ApplyDiffRule(node, ctx);
+    if (new_node != NULL && (info->flags & DIFF_REPEATED) && !BudgetExceeded()) {
+        DiffCacheInsert(ctx->cache, node, info->hash, ctx->var, new_node);
+    }
+
+    return new_node;
+}
+
+static Node_t* CopyOperand(const Node_t* node, DiffCtx_t* ctx) {
+    assert( node != NULL );
+    assert( ctx != NULL );
+
+    if (ctx->hooks != NULL && ctx->hooks->copy != NULL) {
+        return ctx->hooks->copy(node, ctx->hooks->arg);
+    }
+
+    METRICS_INC(COUNTER_SUBTREE_COPIES);
+
+    return TreeCopySubtree(node, NULL);
+}
+
+// left op right with the TreeOptimization rules applied while building:
+// numbers fold, identities return an operand and a zero factor gives a new 0,
+// so the rules never allocate what the optimizer would remove.
+static Node_t* MakeBinary(DiffCtx_t* ctx, Operation_t operation, Node_t* left, Node_t* right) {
+    Node_t* folded = FoldBinary(ctx, operation, left, right);
+
+    return (folded != NULL) ? folded : NodeInit(NULL, left, right, TYPE_OPERATION, operation);
+}
+
+// NULL if no rule applies, the operands are untouched then
+static Node_t* FoldBinary(DiffCtx_t* ctx, Operation_t operation, Node_t* left, Node_t* right) {
+    if (left == NULL || right == NULL) {
+        return NULL;
+    }
+
+    // 0 * u and 0 / u are 0 even for a constant u, as in TreeOptimization
+    if (IS_VALUE(left, 0.0) && (operation == OPERATION_MUL || operation == OPERATION_DIV)) {
+        Discard(ctx, left);
+        Discard(ctx, right);
+        METRICS_INC((operation == OPERATION_MUL) ? COUNTER_REWRITE_MUL : COUNTER_REWRITE_DIV);
+
+        return c(0.0);
+    }
+
+    // as in FoldFuncOp, a value that is not finite stays an expression
+    if (left->type == TYPE_NUMBER && right->type == TYPE_NUMBER) {
+        double value = GetFuncOp(operation, left->data.number, right->data.number);
+        if (isfinite(value)) {
+            Discard(ctx, left);
+            Discard(ctx, right);
+            METRICS_INC(COUNTER_REWRITE_CONST_FOLD);
+
+            return c(value);
+        }
+    }
+
+    Node_t* keep = NULL;
+
+    switch (operation) {
     case OPERATION_ADD:
-        return ADD_(dL, dR);
+        if      (IS_VALUE(left,  0.0)) keep = right;
+        else if (IS_VALUE(right, 0.0)) keep = left;
+        break;
 
     case OPERATION_SUB:
-        return SUB_(dL, dR);
+        if      (IS_VALUE(right, 0.0)) keep = left;
+        break;
 
     case OPERATION_MUL:
-        return ADD_(MUL_(dL, cR), MUL_(cL, dR));
+        if      (IS_VALUE(left,  1.0)) keep = right;
+        else if (IS_VALUE(right, 1.0)) keep = left;
+        else if (IS_VALUE(right, 0.0)) {
+            Discard(ctx, left);
+            Discard(ctx, right);
+            METRICS_INC(COUNTER_REWRITE_MUL);
+            return c(0.0);
+        }
+        break;
 
     case OPERATION_DIV:
-        return DIV_(SUB_(MUL_(dL, cR), MUL_(cL, dR)), EXP_(cR, c(2.f)));
+        if      (IS_VALUE(right, 1.0)) keep = left;
+        break;
 
-    case OPERATION_EXP: {
-        if (node->left->type == TYPE_NUMBER) {          // (a^x)` = (a^x * ln a) * x`
-            return MUL_(MUL_(EXP_(cL, cR), LN_(cL)), dR);
-        } else if (node->right->type == TYPE_NUMBER) {  // (x^a)` = (a * x ^ (a-1)) * x`
-            return MUL_(MUL_(cR, EXP_(cL, SUB_(cR, c(1.f)))), dL);
-        }                                               // (u^v)` = u^v * (v` * ln u + v/u * u`)
+    case OPERATION_EXP:
+        if      (IS_VALUE(left,  1.0)) keep = left;
+        else if (IS_VALUE(right, 1.0)) keep = left;
+        else if (IS_VALUE(right, 0.0)) {
+            Discard(ctx, left);
+            Discard(ctx, right);
+            METRICS_INC(COUNTER_REWRITE_EXP);
+            return c(1.0);
+        }
+        break;
 
-        return MUL_(EXP_(cL, cR), ADD_(MUL_(dR, LN_(cL)), MUL_(DIV_(cR, cL), dL)));
+    case OPERATION_UNDEF:
+    case OPERATION_SQRT:
+    case OPERATION_LN:
+    case OPERATION_LOG:
+    case OPERATION_SIN:
+    case OPERATION_COS:
+    case OPERATION_TAN:
+    case OPERATION_COT:
+    case OPERATION_SINH:
+    case OPERATION_COSH:
+    case OPERATION_TANH:
+    case OPERATION_COTH:
+    case OPERATION_ASIN:
+    case OPERATION_ACOS:
+    case OPERATION_ATAN:
+    case OPERATION_ACOT:
+    default:
+        break;
     }
 
-    case OPERATION_SQRT:                                // sqrt(x)` = x` / (2 * sqrt(x))
-        return DIV_(dR, MUL_(c(2.f), SQRT_(cR)));
+    if (keep == NULL) {
+        return NULL;
+    }
 
-    case OPERATION_LN:                                  // ln(x)` = x` / x
-        return DIV_(dR, cR);
+    Discard(ctx, (keep == left) ? right : left);
+
+    switch (operation) {
+    case OPERATION_ADD: METRICS_INC(COUNTER_REWRITE_ADD); break;
+    case OPERATION_SUB: METRICS_INC(COUNTER_REWRITE_SUB); break;
+    case OPERATION_MUL: METRICS_INC(COUNTER_REWRITE_MUL); break;
+    case OPERATION_DIV: METRICS_INC(COUNTER_REWRITE_DIV); break;
+    case OPERATION_EXP: METRICS_INC(COUNTER_REWRITE_EXP); break;
+
+    case OPERATION_UNDEF:
+    case OPERATION_SQRT:
+    case OPERATION_LN:
+    case OPERATION_LOG:
+    case OPERATION_SIN:
+    case OPERATION_COS:
+    case OPERATION_TAN:
+    case OPERATION_COT:
+    case OPERATION_SINH:
+    case OPERATION_COSH:
+    case OPERATION_TANH:
+    case OPERATION_COTH:
+    case OPERATION_ASIN:
+    case OPERATION_ACOS:
+    case OPERATION_ATAN:
+    case OPERATION_ACOT:
+    default:            break;
+    }
 
-    case OPERATION_LOG:                                 // log(a, x)` = x` / (x * ln a)
-        return DIV_(dR, MUL_(cR, LN_(cL)));
+    return keep;
+}
 
-    case OPERATION_SIN:                                 // sin(x)` = cos(x) * x`
-        return MUL_(COS_(cR), dR);
+// Operands may belong to the hooks' owner, the rest is freed
+static void Discard(DiffCtx_t* ctx, Node_t* node) {
+    if (ctx->hooks != NULL && ctx->hooks->discard != NULL) {
+        ctx->hooks->discard(node, ctx->hooks->arg);
+        return;
+    }
 
-    case OPERATION_COS:                                 // cos(x)` = (0 - sin(x)) * x`
-        return MUL_(SUB_(c(0.f), SIN_(cR)), dR);
+    TreeDestroySubtree(&node);
+}
 
-    case OPERATION_TAN:                                 // tan(x)` = (1 / cos(x) ^ 2) * x`
-        return MUL_(DIV_(c(1.f), EXP_(COS_(cR), c(2.f))), dR);
+static TreeErr_t BuildIndex(NodeMap_t* index, const Node_t* root, const char* var) {
+    if (NodeMapInit(index, TreeSubtreeSize(root)) != TREE_OK) {
+        return TREE_ALLOCATION_FAILED;
+    }
 
-    case OPERATION_COT:                                 // cot(x)` = (0 - 1 / sin(x) ^ 2) * x`
-        return MUL_(SUB_(c(0.f), DIV_(c(1.f), EXP_(SIN_(cR), c(2.f)))), dR);
+    return DiffIndexDepends(index, root, var);
+}
 
-    case OPERATION_SINH:                                // sinh(x)` = cosh(x) * x`
-        return MUL_(COSH_(cR), dR);
+TreeErr_t DiffIndexDepends(NodeMap_t* index, const Node_t* root, const char* var) {
+    assert( index != NULL );
+    assert( root != NULL );
+    assert( var != NULL );
 
-    case OPERATION_COSH:                                // cosh(x)`= sinh(x) * x`
-        return MUL_(SINH_(cR), dR);
+    TreeErr_t err = TREE_OK;
+    IndexDepends(index, root, var, &err);
 
-    case OPERATION_TANH:                                // tanh(x)` = (1 / cosh(x) ^ 2) * x`
-        return MUL_(DIV_(c(1.f), EXP_(COSH_(cR), c(2.f))), dR);
+    return err;
+}
 
-    case OPERATION_COTH:                                // coth(x)` = (0 - 1 / sinh(x) ^ 2) * x`
-        return MUL_(SUB_(c(0.f), DIV_(c(1.f), EXP_(SINH_(cR), c(2.f)))), dR);
+int DiffIndexHasVar(const NodeMap_t* index, const Node_t* node) {
+    assert( index != NULL );
 
-    case OPERATION_ASIN:                                // arcsin(x)` = x` / sqrt(1 - x^2)
-        return DIV_(dR, SQRT_(SUB_(c(1.f), EXP_(cR, c(2.f)))));
+    const NodeInfo_t* info = NodeMapFind(index, node);
 
-    case OPERATION_ACOS:                                // arccos(x)` = 0 - x` / sqrt(1 - x^2)
-        return SUB_(c(0.f), DIV_(dR, SQRT_(SUB_(c(1.f), EXP_(cR, c(2.f))))));
+    return info == NULL || (info->flags & DIFF_DEPENDS_ON_VAR);
+}
 
-    case OPERATION_ATAN:                                // arctan(x)` = x` / (1 + x^2)
-        return DIV_(dR, ADD_(c(1.f), EXP_(cR, c(2.f))));
+static int IndexDepends(NodeMap_t* index, const Node_t* node, const char* var, TreeErr_t* err) {
+    int depends = (node->type == TYPE_VARIABLE && strcmp(node->data.variable, var) == 0);
 
-    case OPERATION_ACOT:                                // arccot(x)` = 0 - x` / (1 + x^2)
-        return SUB_(c(0.f), DIV_(dR, ADD_(c(1.f), EXP_(cR, c(2.f)))));
+    if (node->left != NULL) {
+        depends |= IndexDepends(index, node->left, var, err);
+    }
+    if (node->right != NULL) {
+        depends |= IndexDepends(index, node->right, var, err);
+    }
 
-    default:
-        fprintf(stderr, "TreeDiff: default\n");
-        break;
+    NodeInfo_t* info = NodeMapInsert(index, node);
+    if (info == NULL) {
+        *err = TREE_ALLOCATION_FAILED;
+        return depends;
+    }
+    if (depends) {
+        info->flags |= DIFF_DEPENDS_ON_VAR;
+    }
+
+    return depends;
+}
+
+// Only a subtree that repeats in the input is worth copying into the cache:
+// a miss on any other would pay for two copies that no later node reuses
+static TreeErr_t MarkRepeated(NodeMap_t* index) {
+    uint64_t* hashes = (uint64_t*)calloc(index->size + 1, sizeof(uint64_t));
+    if (hashes == NULL) {
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < index->capacity; i++) {
+        const NodeMapEntry_t* entry = &index->entries[i];
+        if (entry->key != NULL && entry->info.size >= DIF_CACHE_MIN_NODES) {
+            hashes[count++] = entry->info.hash;
+        }
+    }
+    qsort(hashes, count, sizeof(uint64_t), CompareHashes);
+
+    for (size_t i = 0; i < index->capacity; i++) {
+        NodeMapEntry_t* entry = &index->entries[i];
+        if (entry->key == NULL || entry->info.size < DIF_CACHE_MIN_NODES) {
+            continue;
+        }
+
+        const uint64_t* found = (const uint64_t*)bsearch(&entry->info.hash, hashes, count, sizeof(uint64_t),
+                                                         CompareHashes);
+        if ((found > hashes && found[-1] == entry->info.hash)
+            || (found + 1 < hashes + count && found[1] == entry->info.hash)) {
+            entry->info.flags |= DIFF_REPEATED;
+        }
+    }
+
+    FREE(hashes);
+
+    return TREE_OK;
+}
+
+static int CompareHashes(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+// The special rules for a constant operand are an O(1) question: the hooks'
+// owner or the index of the input knows. Unknown operands take the general rule.
+static int OperandDepends(const Node_t* operand, const DiffCtx_t* ctx) {
+    if (ctx->hooks != NULL && ctx->hooks->depends != NULL) {
+        return ctx->hooks->depends(operand, ctx->hooks->arg);
+    }
+
+    return ctx->index == NULL || DiffIndexHasVar(ctx->index, operand);
+}
+
+static Node_t* ApplyDiffRule(const Node_t* node, DiffCtx_t* ctx) {
+    assert( node != NULL );
+    assert( ctx != NULL );
+
+    if (node->type == TYPE_NUMBER) {
+        return c(0.f);
+    }
+
+    if (node->type == TYPE_VARIABLE) {                 // other variables are constants for d/d(var)
+        if (strcmp(node->data.variable, ctx->var) == 0) {
+            return c(1.f);
+        } else {
+            return c(0.f);
+        }
+    }
+
+    const OperationInfo_t* info = OperationGet(node->data.operation);
+    if (info == NULL || info->diff == NULL) {
+        LOG_ERROR("diff", "TreeDiff: default");
+        return NULL;
+    }
+
+    return info->diff(node, ctx);
+}
+
+Node_t* DiffRuleAdd(const Node_t* node, DiffCtx_t* ctx) {
+    return ADD_(dL, dR);
+}
+
+Node_t* DiffRuleSub(const Node_t* node, DiffCtx_t* ctx) {
+    return SUB_(dL, dR);
+}
+
+Node_t* DiffRuleMul(const Node_t* node, DiffCtx_t* ctx) {
+    if (!OperandDepends(node->left, ctx)) {             // (a * x)` = a * x`
+        return MUL_(cL, dR);
+    } else if (!OperandDepends(node->right, ctx)) {     // (x * a)` = x` * a
+        return MUL_(dL, cR);
     }
 
-    // if (new_node->left) {
-    //     new_node->left->parent = new_node;
-    // }
-    // if (new_node->right) {
-    //     new_node->right->parent = new_node;
-    // }
+    return ADD_(MUL_(dL, cR), MUL_(cL, dR));
+}
+
+Node_t* DiffRuleDiv(const Node_t* node, DiffCtx_t* ctx) {
+    if (!OperandDepends(node->right, ctx)) {            // (x / a)` = x` / a
+        return DIV_(dL, cR);
+    }
+
+    return DIV_(SUB_(MUL_(dL, cR), MUL_(cL, dR)), EXP_(cR, c(2.f)));
+}
+
+Node_t* DiffRuleExp(const Node_t* node, DiffCtx_t* ctx) {
+    if (!OperandDepends(node->left, ctx)) {             // (a^x)` = (a^x * ln a) * x`
+        return MUL_(MUL_(EXP_(cL, cR), LN_(cL)), dR);
+    } else if (!OperandDepends(node->right, ctx)) {     // (x^a)` = (a * x ^ (a-1)) * x`
+        return MUL_(MUL_(cR, EXP_(cL, SUB_(cR, c(1.f)))), dL);
+    }                                                   // (u^v)` = u^v * (v` * ln u + v/u * u`)
+
+    return MUL_(EXP_(cL, cR), ADD_(MUL_(dR, LN_(cL)), MUL_(DIV_(cR, cL), dL)));
+}
+
+Node_t* DiffRuleSqrt(const Node_t* node, DiffCtx_t* ctx) {     // sqrt(x)` = x` / (2 * sqrt(x))
+    return DIV_(dR, MUL_(c(2.f), SQRT_(cR)));
+}
+
+Node_t* DiffRuleLn(const Node_t* node, DiffCtx_t* ctx) {       // ln(x)` = x` / x
+    return DIV_(dR, cR);
+}
+
+Node_t* DiffRuleLog(const Node_t* node, DiffCtx_t* ctx) {      // log(a, x)` = x` / (x * ln a)
+    if (!OperandDepends(node->left, ctx)) {
+        return DIV_(dR, MUL_(cR, LN_(cL)));
+    }                                                   // log(u, v)` = (v`/v * ln u - u`/u * ln v) / ln u ^ 2
+
+    return DIV_(SUB_(MUL_(DIV_(dR, cR), LN_(cL)), MUL_(DIV_(dL, cL), LN_(cR))), EXP_(LN_(cL), c(2.f)));
+}
+
+Node_t* DiffRuleSin(const Node_t* node, DiffCtx_t* ctx) {      // sin(x)` = cos(x) * x`
+    return MUL_(COS_(cR), dR);
+}
+
+Node_t* DiffRuleCos(const Node_t* node, DiffCtx_t* ctx) {      // cos(x)` = (0 - sin(x)) * x`
+    return MUL_(SUB_(c(0.f), SIN_(cR)), dR);
+}
+
+Node_t* DiffRuleTan(const Node_t* node, DiffCtx_t* ctx) {      // tan(x)` = (1 / cos(x) ^ 2) * x`
+    return MUL_(DIV_(c(1.f), EXP_(COS_(cR), c(2.f))), dR);
+}
+
+Node_t* DiffRuleCot(const Node_t* node, DiffCtx_t* ctx) {      // cot(x)` = (0 - 1 / sin(x) ^ 2) * x`
+    return MUL_(SUB_(c(0.f), DIV_(c(1.f), EXP_(SIN_(cR), c(2.f)))), dR);
+}
+
+Node_t* DiffRuleSinh(const Node_t* node, DiffCtx_t* ctx) {     // sinh(x)` = cosh(x) * x`
+    return MUL_(COSH_(cR), dR);
+}
+
+Node_t* DiffRuleCosh(const Node_t* node, DiffCtx_t* ctx) {     // cosh(x)`= sinh(x) * x`
+    return MUL_(SINH_(cR), dR);
+}
+
+Node_t* DiffRuleTanh(const Node_t* node, DiffCtx_t* ctx) {     // tanh(x)` = (1 / cosh(x) ^ 2) * x`
+    return MUL_(DIV_(c(1.f), EXP_(COSH_(cR), c(2.f))), dR);
+}
+
+Node_t* DiffRuleCoth(const Node_t* node, DiffCtx_t* ctx) {     // coth(x)` = (0 - 1 / sinh(x) ^ 2) * x`
+    return MUL_(SUB_(c(0.f), DIV_(c(1.f), EXP_(SINH_(cR), c(2.f)))), dR);
+}
+
+Node_t* DiffRuleAsin(const Node_t* node, DiffCtx_t* ctx) {     // arcsin(x)` = x` / sqrt(1 - x^2)
+    return DIV_(dR, SQRT_(SUB_(c(1.f), EXP_(cR, c(2.f)))));
+}
+
+Node_t* DiffRuleAcos(const Node_t* node, DiffCtx_t* ctx) {     // arccos(x)` = 0 - x` / sqrt(1 - x^2)
+    return SUB_(c(0.f), DIV_(dR, SQRT_(SUB_(c(1.f), EXP_(cR, c(2.f))))));
+}
+
+Node_t* DiffRuleAtan(const Node_t* node, DiffCtx_t* ctx) {     // arctan(x)` = x` / (1 + x^2)
+    return DIV_(dR, ADD_(c(1.f), EXP_(cR, c(2.f))));
+}
 
-    return NULL;
+Node_t* DiffRuleAcot(const Node_t* node, DiffCtx_t* ctx) {     // arccot(x)` = 0 - x` / (1 + x^2)
+    return SUB_(c(0.f), DIV_(dR, ADD_(c(1.f), EXP_(cR, c(2.f)))));
 }
 
 /*
@@ -2,7 +2,35 @@
 #define DIF_MATH_H
 
 #include "tree.h"
+#include "dif_cache.h"
+#include "dif_lazy.h"
 
-Node_t* TreeDiff(Node_t* node, const char* var);
+// Operand access for one rule application: diff gives the derivative of an
+// operand, copy (optional, TreeCopySubtree when NULL) gives a copy of it,
+// discard (optional, TreeDestroySubtree when NULL) takes back a subtree the
+// rule folded away, depends (optional, always true when NULL) tells whether
+// an operand contains var.
+struct DiffHooks_t {
+    Node_t* (*diff)(const Node_t* operand, void* arg);
+    Node_t* (*copy)(const Node_t* operand, void* arg);
+    void* arg;
+    void (*discard)(Node_t* node, void* arg);
+    int (*depends)(const Node_t* operand, void* arg);
+};
+
+const unsigned DIFF_DEPENDS_ON_VAR = 0x100;     // clear of the flags the maps' owners keep
+
+// Adds DIFF_DEPENDS_ON_VAR to the flags of the nodes of root that contain var,
+// so that a map the caller of TreeDiffStep keeps anyway answers its depends
+// hook. DiffIndexHasVar is 1 for nodes missing from the map.
+TreeErr_t DiffIndexDepends(NodeMap_t* index, const Node_t* root, const char* var);
+int DiffIndexHasVar(const NodeMap_t* index, const Node_t* node);
+
+Node_t* TreeDiff(const Node_t* node, const char* var);
+Node_t* TreeDiffCached(const Node_t* node, const char* var, DiffCache_t* cache);
+Node_t* TreeDiffLazy(LazyDiff_t* lazy, const Node_t* node, const char* var);
+// Takes ownership of node: its nodes are reused in the derivative
+Node_t* TreeDiffConsume(Node_t* node, const char* var);
+Node_t* TreeDiffStep(const Node_t* node, const char* var, const DiffHooks_t* hooks);
 
 #endif // DIF_MATH_H
@@ -5,40 +5,104 @@
 
 #include "io.h"
 #include "utils.h"
+#include "metrics.h"
+#include "debug.h"
+#include "budget.h"
 
-#define cL TreeCopySubtree(node->left, node)
-#define cR TreeCopySubtree(node->right, node)
+// the kept operand is moved out before the rest of the node is freed
+#define cL (METRICS_INC(COUNTER_SUBTREES_MOVED), DetachChild(&node->left))
+#define cR (METRICS_INC(COUNTER_SUBTREES_MOVED), DetachChild(&node->right))
 #define c(x) \
     NodeInit(NULL, NULL, NULL, TYPE_NUMBER, x)
 
 #define IS_VALUE(ptr, val) \
     (ptr->type == TYPE_NUMBER && isEqual(ptr->data.number, val))
 
-static TreeElemType CreateConstNode(Node_t* node, Node_t** parent_ptr, Node_t* parent);
+static TreeElemType CreateConstNode(Node_t* node, Node_t** parent_ptr, Node_t* parent, double value);
 static TreeElemType ConstOptimizationAdd(Node_t* node, Node_t** parent_ptr, Node_t* parent);
 static TreeElemType ConstOptimizationSub(Node_t* node, Node_t** parent_ptr, Node_t* parent);
 static TreeElemType ConstOptimizationMul(Node_t* node, Node_t** parent_ptr, Node_t* parent);
 static TreeElemType ConstOptimizationDiv(Node_t* node, Node_t** parent_ptr, Node_t* parent);
 static TreeElemType ConstOptimizationExp(Node_t* node, Node_t** parent_ptr, Node_t* parent);
+static TreeElemType RecursiveOptimization(Tree_t* tree, Node_t* node);
+static TreeElemType OptimizeNode(Tree_t* tree, Node_t* node);
+static Node_t* DetachChild(Node_t** child);
 
 TreeElemType TreeOptimization(Tree_t* tree, Node_t* node) {
     assert( tree != NULL );
     assert( node != NULL );
-    fprintf(stderr, "TreeOptimization: %p\n", node);
-    getchar();
+
+    METRICS_PHASE_BEGIN(PHASE_OPTIMIZE);
+
+    TreeElemType type = RecursiveOptimization(tree, node);
+
+    METRICS_PHASE_END(PHASE_OPTIMIZE);
+
+    return type;
+}
+
+void TreeSimplify(Tree_t* tree, size_t max_passes) {
+    assert( tree != NULL );
+    assert( tree->root != NULL );
+
+    size_t size = TreeSubtreeSize(tree->root);
+
+    for (size_t pass = 0; pass < max_passes; pass++) {
+        TreeOptimization(tree, tree->root);
+        if (BudgetExceeded()) {
+            break;
+        }
+
+        size_t new_size = TreeSubtreeSize(tree->root);
+        if (new_size == size) {
+            break;
+        }
+        size = new_size;
+    }
+}
+
+// Past the budget the rest of the tree is left as it is: every rewrite
+// done so far keeps it valid
+static TreeElemType RecursiveOptimization(Tree_t* tree, Node_t* node) {
+    assert( tree != NULL );
+    assert( node != NULL );
+
+    if (!BudgetDescend()) {
+        return TYPE_UNDEFINED;
+    }
+
+    TreeElemType type = OptimizeNode(tree, node);
+
+    BudgetAscend();
+
+    return type;
+}
+
+static TreeElemType OptimizeNode(Tree_t* tree, Node_t* node) {
+    LOG_STEP("optimize", "TreeOptimization %p", node);
+
+    if (node->type == TYPE_THUNK) {
+        node = NodeForce((node->parent) ? GetParentNodePointer(node) : &tree->root);
+    }
 
     TreeElemType  left_type = TYPE_UNDEFINED,
                    right_type = TYPE_UNDEFINED;
     if (node->left) {
-        left_type = TreeOptimization(tree, node->left);
+        left_type = RecursiveOptimization(tree, node->left);
     }
-    if (node->right) {
-        right_type = TreeOptimization(tree, node->right);
+
+    // 0 * u and 0 / u never need u, so a lazy u is dropped without being expanded
+    int left_absorbs = node->left != NULL && IS_VALUE(node->left, 0.f) && node->type == TYPE_OPERATION
+                       && (node->data.operation == OPERATION_MUL || node->data.operation == OPERATION_DIV);
+
+    if (node->right && !left_absorbs) {
+        right_type = RecursiveOptimization(tree, node->right);
     }
 
     Node_t** parent_ptr = (node->parent) ? GetParentNodePointer(node) : &tree->root;
-    if (left_type == TYPE_NUMBER && right_type == TYPE_NUMBER) {
-        return CreateConstNode(node, parent_ptr, node->parent);
+    double value = 0;
+    if ((left_type == TYPE_NUMBER || node->left == NULL) && right_type == TYPE_NUMBER && FoldFuncOp(node, &value)) {
+        return CreateConstNode(node, parent_ptr, node->parent, value);
     }
 
     if (node->type != TYPE_OPERATION) {
@@ -68,57 +132,61 @@ TreeElemType TreeOptimization(Tree_t* tree, Node_t* node) {
     return node->type;
 }
 
-TreeElemType CreateConstNode(Node_t* node, Node_t** parent_ptr, Node_t* parent) {
+TreeElemType CreateConstNode(Node_t* node, Node_t** parent_ptr, Node_t* parent, double value) {
     assert( node != NULL );
     assert( parent_ptr != NULL );
-    fprintf(stderr, "CreateConstNode: %p\n", node);
-    getchar();
+    LOG_STEP("optimize", "CreateConstNode %p", node);
 
-    double value = GetFuncOp(node->data.operation, 
-                                node->left->data.number, 
-                                node->right->data.number);
-
-    PostorderTraversal(node, NodeDestroy);
+    TreeDestroySubtree(&node);
     *parent_ptr = NodeInit(parent, NULL, NULL, TYPE_NUMBER, value);
+    METRICS_INC(COUNTER_REWRITE_CONST_FOLD);
 
     return TYPE_NUMBER;
 }
 
+static Node_t* DetachChild(Node_t** child) {
+    Node_t* node = *child;
+    *child = NULL;
+    node->parent = NULL;
+
+    return node;
+}
+
 #define STR(x_) #x_
 
-#define ConstOtimizationHandler(func_name, expressions)                                     \
+#define ConstOtimizationHandler(func_name, counter, expressions)                            \
 static TreeElemType func_name(Node_t* node, Node_t** parent_ptr, Node_t* parent) {          \
     assert( node != NULL );                                                                 \
     assert( parent_ptr != NULL );                                                           \
-    fprintf(stderr, STR(func_name)": %p\n", node);                                          \
-    getchar();                                                                              \
+    LOG_STEP("optimize", STR(func_name)" %p", node);                                        \
                                                                                             \
     Node_t* new_node = NULL;                                                                \
                                                                                             \
     expressions                                                                             \
                                                                                             \
-    PostorderTraversal(node, NodeDestroy);                                                  \
+    TreeDestroySubtree(&node);                                                              \
     *parent_ptr = new_node;                                                                 \
     new_node->parent = parent;                                                              \
+    METRICS_INC(counter);                                                                   \
                                                                                             \
-    return TYPE_OPERATION;                                                                  \
+    return new_node->type;                                                                  \
 }
 
 ConstOtimizationHandler(
-    ConstOptimizationAdd,
+    ConstOptimizationAdd, COUNTER_REWRITE_ADD,
     if      (IS_VALUE(node->left,  0.f)) new_node = cR;
     else if (IS_VALUE(node->right, 0.f)) new_node = cL;
     else    return TYPE_OPERATION;
 )
 
 ConstOtimizationHandler(
-    ConstOptimizationSub,
+    ConstOptimizationSub, COUNTER_REWRITE_SUB,
     if      (IS_VALUE(node->right, 0.f) ) new_node = cL;
     else    return TYPE_OPERATION;
 )
 
 ConstOtimizationHandler(
-    ConstOptimizationMul,
+    ConstOptimizationMul, COUNTER_REWRITE_MUL,
     if      (IS_VALUE(node->left,  0.f) ) new_node = c(0.f);
     else if (IS_VALUE(node->right, 0.f) ) new_node = c(0.f);
     else if (IS_VALUE(node->left,  1.f) ) new_node = cR;
@@ -127,14 +195,14 @@ ConstOtimizationHandler(
 )
 
 ConstOtimizationHandler(
-    ConstOptimizationDiv,
+    ConstOptimizationDiv, COUNTER_REWRITE_DIV,
     if      (IS_VALUE(node->left,  0.f) ) new_node = c(0.f);
     else if (IS_VALUE(node->right, 1.f) ) new_node = cL;
     else    return TYPE_OPERATION;
 )
 
 ConstOtimizationHandler(
-    ConstOptimizationExp,
+    ConstOptimizationExp, COUNTER_REWRITE_EXP,
     if      (IS_VALUE(node->right, 0.f)) new_node = c(1.f);
     else if (IS_VALUE(node->left,  1.f)) new_node = c(1.f);
     else if (IS_VALUE(node->right, 1.f)) new_node = cL;
@@ -147,8 +215,7 @@ ConstOtimizationHandler(
 TreeElemType ConstOptimizationAdd(Node_t* node, Node_t** parent_ptr, Node_t* parent) {
     assert( node != NULL );
     assert( parent_ptr != NULL );
-    fprintf(stderr, "ConstOptimizationAdd: %p\n", node);
-    getchar();
+    LOG_STEP("optimize", "ConstOptimizationAdd %p", node);
 
     Node_t* new_node = NULL;
     
@@ -166,8 +233,7 @@ TreeElemType ConstOptimizationAdd(Node_t* node, Node_t** parent_ptr, Node_t* par
 TreeElemType ConstOptimizationSub(Node_t* node, Node_t** parent_ptr, Node_t* parent) {
     assert( node != NULL );
     assert( parent_ptr != NULL );
-    fprintf(stderr, "ConstOptimizationSub: %p\n", node);
-    getchar();
+    LOG_STEP("optimize", "ConstOptimizationSub %p", node);
 
     Node_t* new_node = NULL;
     
@@ -184,8 +250,7 @@ TreeElemType ConstOptimizationSub(Node_t* node, Node_t** parent_ptr, Node_t* par
 TreeElemType ConstOptimizationMul(Node_t* node, Node_t** parent_ptr, Node_t* parent) {
     assert( node != NULL );
     assert( parent_ptr != NULL );
-    fprintf(stderr, "ConstOptimizationMul: %p\n", node);
-    getchar();
+    LOG_STEP("optimize", "ConstOptimizationMul %p", node);
 
     Node_t* new_node = NULL;
     
@@ -205,8 +270,7 @@ TreeElemType ConstOptimizationMul(Node_t* node, Node_t** parent_ptr, Node_t* par
 TreeElemType ConstOptimizationDiv(Node_t* node, Node_t** parent_ptr, Node_t* parent) {
     assert( node != NULL );
     assert( parent_ptr != NULL );
-    fprintf(stderr, "ConstOptimizationDiv: %p\n", node);
-    getchar();
+    LOG_STEP("optimize", "ConstOptimizationDiv %p", node);
 
     Node_t* new_node = NULL;
     
@@ -224,8 +288,7 @@ TreeElemType ConstOptimizationDiv(Node_t* node, Node_t** parent_ptr, Node_t* par
 TreeElemType ConstOptimizationExp(Node_t* node, Node_t** parent_ptr, Node_t* parent) {
     assert( node != NULL );
     assert( parent_ptr != NULL );
-    fprintf(stderr, "ConstOptimizationExp: %p\n", node);
-    getchar();
+    LOG_STEP("optimize", "ConstOptimizationExp %p", node);
 
     Node_t* new_node = NULL;
     
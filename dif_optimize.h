@@ -5,4 +5,7 @@
 
 TreeElemType TreeOptimization(Tree_t* tree, Node_t* node);
 
+// Optimization passes over the whole tree until its size stops changing
+void TreeSimplify(Tree_t* tree, size_t max_passes);
+
 #endif // DIF_OPTIMIZE_H
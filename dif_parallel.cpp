@@ -0,0 +1,449 @@
+#include "dif_parallel.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "dif_math.h"
+#include "node_map.h"
+#include "metrics.h"
+#include "budget.h"
+
+const size_t PARALLEL_DEQUE_MIN_CAPACITY = 64;
+
+struct DiffTask_t {
+    const Node_t* node;
+    Node_t* result;
+    int done;
+};
+
+// Owner pushes and pops at the tail, thieves steal from the head
+struct TaskDeque_t {
+    pthread_mutex_t lock;
+    DiffTask_t** tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+};
+
+struct ParallelDiff_t {
+    const char* var;
+    NodeMap_t sizes;                // and DIFF_DEPENDS_ON_VAR flags
+    TaskDeque_t* deques;
+    size_t threads;
+    size_t queued;                  // tasks in all the deques
+    DiffPool_t* pool;
+    int stop;
+};
+
+struct DiffWorker_t {
+    DiffPool_t* pool;
+    ParallelDiff_t* pd;             // the job, set by the caller for its duration
+    size_t index;
+    uint64_t rng;
+    pthread_t thread;
+};
+
+// Derivatives of the operands computed before the rule is applied
+struct DiffOperands_t {
+    const Node_t* left;
+    const Node_t* right;
+    Node_t* left_result;
+    Node_t* right_result;
+    const NodeMap_t* sizes;
+};
+
+static Node_t* ParallelDiffNode(DiffWorker_t* worker, const Node_t* node);
+static Node_t* SequentialDiff(const Node_t* node, void* arg);
+static Node_t* OperandDiff(const Node_t* node, void* arg);
+static int OperandDepends(const Node_t* node, void* arg);
+static int SequentialDepends(const Node_t* node, void* arg);
+static int DequePush(TaskDeque_t* deque, DiffTask_t* task);
+static int DequePopTask(TaskDeque_t* deque, const DiffTask_t* task);
+static DiffTask_t* DequeSteal(TaskDeque_t* deque);
+static int StealAndRun(DiffWorker_t* worker);
+static void RunTask(DiffWorker_t* worker, DiffTask_t* task);
+static void WaitForWork(ParallelDiff_t* pd, const DiffTask_t* task);
+static void Notify(ParallelDiff_t* pd);
+static void* HelperWorker(void* arg);
+static void HelperRun(DiffWorker_t* worker);
+
+TreeErr_t DiffPoolInit(DiffPool_t* pool, size_t threads) {
+    assert( pool != NULL );
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (size_t)cpus : 1;
+    }
+
+    *pool = {};
+    pool->workers = (DiffWorker_t*)calloc(threads, sizeof(DiffWorker_t));
+    if (pool->workers == NULL) {
+        return TREE_ALLOCATION_FAILED;
+    }
+    pool->threads = threads;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (size_t i = 0; i < threads; i++) {
+        pool->workers[i].pool  = pool;
+        pool->workers[i].index = i;
+    }
+
+    // with fewer helpers than asked the pool still works, only slower
+    for (size_t i = 1; i < threads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, HelperWorker, &pool->workers[i]) != 0) {
+            break;
+        }
+        pool->started = i;
+    }
+
+    return TREE_OK;
+}
+
+TreeErr_t DiffPoolDestroy(DiffPool_t* pool) {
+    assert( pool != NULL );
+
+    pthread_mutex_lock(&pool->lock);
+    assert( pool->job == NULL );
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 1; i <= pool->started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->lock);
+    FREE(pool->workers);
+    pool->threads = pool->started = 0;
+
+    return TREE_OK;
+}
+
+Node_t* TreeDiffParallel(const Node_t* node, const char* var, size_t threads) {
+    assert( node != NULL );
+    assert( var != NULL );
+
+    DiffPool_t pool = {};
+    if (threads == 1 || DiffPoolInit(&pool, threads) != TREE_OK) {
+        return TreeDiff(node, var);
+    }
+
+    Node_t* new_node = TreeDiffPooled(&pool, node, var);
+
+    DiffPoolDestroy(&pool);
+
+    return new_node;
+}
+
+Node_t* TreeDiffPooled(DiffPool_t* pool, const Node_t* node, const char* var) {
+    assert( pool != NULL );
+    assert( node != NULL );
+    assert( var != NULL );
+
+    size_t threads = pool->started + 1;
+    ParallelDiff_t pd = {var, {}, NULL, threads, 0, pool, 0};
+
+    if (threads == 1 || NodeMapInit(&pd.sizes, TreeSubtreeSize(node)) != TREE_OK) {
+        return TreeDiff(node, var);
+    }
+
+    METRICS_PHASE_BEGIN(PHASE_DIFF);
+
+    pd.deques = (TaskDeque_t*)calloc(threads, sizeof(TaskDeque_t));
+
+    if (pd.deques == NULL || NodeMapBuildHashes(&pd.sizes, node) != TREE_OK
+        || DiffIndexDepends(&pd.sizes, node, var) != TREE_OK) {
+        FREE(pd.deques);
+        NodeMapDestroy(&pd.sizes);
+        METRICS_PHASE_END(PHASE_DIFF);
+        return TreeDiff(node, var);
+    }
+
+    for (size_t i = 0; i < threads; i++) {
+        pthread_mutex_init(&pd.deques[i].lock, NULL);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->job != NULL) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pool->workers[i].pd  = &pd;
+        pool->workers[i].rng = 0x9E3779B97F4A7C15ull * (i + 1);
+    }
+    pool->job = &pd;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    Node_t* new_node = ParallelDiffNode(&pool->workers[0], node);
+
+    // the helpers leave before the deques they steal from are freed
+    __atomic_store_n(&pd.stop, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->active != 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pool->job = NULL;
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&pd.deques[i].lock);
+        FREE(pd.deques[i].tasks);
+    }
+    FREE(pd.deques);
+    NodeMapDestroy(&pd.sizes);
+
+    if (BudgetExceeded()) {                     // only this thread is budgeted, helpers finish their tasks
+        TreeDestroySubtree(&new_node);
+    }
+
+    METRICS_PHASE_END(PHASE_DIFF);
+    METRICS_ADD(COUNTER_DIFF_INPUT_NODES, TreeSubtreeSize(node));
+    METRICS_ADD(COUNTER_DIFF_OUTPUT_NODES, TreeSubtreeSize(new_node));
+
+    return new_node;
+}
+
+static Node_t* ParallelDiffNode(DiffWorker_t* worker, const Node_t* node) {
+    ParallelDiff_t* pd = worker->pd;
+
+    NodeInfo_t* info = NodeMapFind(&pd->sizes, node);
+    if (info == NULL || info->size < PARALLEL_DIFF_CUTOFF) {
+        return SequentialDiff(node, pd);
+    }
+
+    DiffOperands_t operands = {node->left, node->right, NULL, NULL, &pd->sizes};
+    DiffTask_t left_task = {node->left, NULL, 0};
+
+    int forked = node->left != NULL && DequePush(&pd->deques[worker->index], &left_task);
+    if (forked) {
+        __atomic_add_fetch(&pd->queued, 1, __ATOMIC_RELEASE);
+        Notify(pd);
+    }
+
+    if (node->right != NULL) {
+        operands.right_result = ParallelDiffNode(worker, node->right);
+    }
+
+    if (forked) {
+        if (DequePopTask(&pd->deques[worker->index], &left_task)) {
+            __atomic_sub_fetch(&pd->queued, 1, __ATOMIC_RELAXED);
+            RunTask(worker, &left_task);
+        }
+        while (!__atomic_load_n(&left_task.done, __ATOMIC_ACQUIRE)) {
+            if (!StealAndRun(worker)) {                 // help others while the thief works on our task
+                WaitForWork(pd, &left_task);
+            }
+        }
+        operands.left_result = left_task.result;
+    } else if (node->left != NULL) {
+        operands.left_result = ParallelDiffNode(worker, node->left);
+    }
+
+    DiffHooks_t hooks = {OperandDiff, NULL, &operands, NULL, OperandDepends};
+    Node_t* new_node = TreeDiffStep(node, pd->var, &hooks);
+
+    // rules with a constant operand never ask for its derivative
+    TreeDestroySubtree(&operands.left_result);
+    TreeDestroySubtree(&operands.right_result);
+
+    return new_node;
+}
+
+static Node_t* SequentialDiff(const Node_t* node, void* arg) {
+    ParallelDiff_t* pd = (ParallelDiff_t*)arg;
+    DiffHooks_t hooks = {SequentialDiff, NULL, pd, NULL, SequentialDepends};
+
+    return TreeDiffStep(node, pd->var, &hooks);
+}
+
+static int SequentialDepends(const Node_t* node, void* arg) {
+    return DiffIndexHasVar(&((ParallelDiff_t*)arg)->sizes, node);
+}
+
+static Node_t* OperandDiff(const Node_t* node, void* arg) {
+    DiffOperands_t* operands = (DiffOperands_t*)arg;
+    Node_t* result = NULL;
+
+    if (node == operands->left) {
+        result = operands->left_result;
+        operands->left_result = NULL;
+    } else if (node == operands->right) {
+        result = operands->right_result;
+        operands->right_result = NULL;
+    }
+
+    assert( result != NULL );       // every rule differentiates each operand at most once
+
+    return result;
+}
+
+static int OperandDepends(const Node_t* node, void* arg) {
+    return DiffIndexHasVar(((DiffOperands_t*)arg)->sizes, node);
+}
+
+static void RunTask(DiffWorker_t* worker, DiffTask_t* task) {
+    task->result = ParallelDiffNode(worker, task->node);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+    Notify(worker->pd);
+}
+
+// Sleeps until a task can be stolen, the awaited task is done or the job stops.
+// The flags are set before Notify takes the lock, so no wakeup is lost.
+static void WaitForWork(ParallelDiff_t* pd, const DiffTask_t* task) {
+    DiffPool_t* pool = pd->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!__atomic_load_n(&pd->stop, __ATOMIC_ACQUIRE) && __atomic_load_n(&pd->queued, __ATOMIC_ACQUIRE) == 0
+           && (task == NULL || !__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))) {
+        pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void Notify(ParallelDiff_t* pd) {
+    pthread_mutex_lock(&pd->pool->lock);
+    pthread_cond_broadcast(&pd->pool->wake);
+    pthread_mutex_unlock(&pd->pool->lock);
+}
+
+static int StealAndRun(DiffWorker_t* worker) {
+    ParallelDiff_t* pd = worker->pd;
+
+    worker->rng ^= worker->rng << 13;
+    worker->rng ^= worker->rng >> 7;
+    worker->rng ^= worker->rng << 17;
+
+    size_t first = worker->rng % pd->threads;
+    for (size_t i = 0; i < pd->threads; i++) {
+        size_t victim = (first + i) % pd->threads;
+        if (victim == worker->index) {
+            continue;
+        }
+
+        DiffTask_t* task = DequeSteal(&pd->deques[victim]);
+        if (task != NULL) {
+            __atomic_sub_fetch(&pd->queued, 1, __ATOMIC_RELAXED);
+            RunTask(worker, task);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void* HelperWorker(void* arg) {
+    DiffWorker_t* worker = (DiffWorker_t*)arg;
+    DiffPool_t* pool = worker->pool;
+    size_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && (pool->job == NULL || pool->generation == seen)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+
+        seen = pool->generation;
+        ++pool->active;
+        pthread_mutex_unlock(&pool->lock);
+
+        HelperRun(worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void HelperRun(DiffWorker_t* worker) {
+    ParallelDiff_t* pd = worker->pd;
+    METRICS_PHASE_ENTER(PHASE_DIFF);            // helpers only ever differentiate
+
+    while (!__atomic_load_n(&pd->stop, __ATOMIC_ACQUIRE)) {
+        if (!StealAndRun(worker)) {
+            WaitForWork(pd, NULL);
+        }
+    }
+
+    METRICS_PHASE_LEAVE(PHASE_DIFF);
+}
+
+static int DequePush(TaskDeque_t* deque, DiffTask_t* task) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail == deque->capacity) {
+        size_t count = deque->tail - deque->head;
+        size_t capacity = (deque->capacity != 0) ? deque->capacity : PARALLEL_DEQUE_MIN_CAPACITY;
+        if (count * 2 > capacity) {
+            capacity *= 2;
+        }
+
+        DiffTask_t** tasks = (DiffTask_t**)calloc(capacity, sizeof(DiffTask_t*));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return 0;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            tasks[i] = deque->tasks[deque->head + i];
+        }
+        FREE(deque->tasks);
+
+        deque->tasks    = tasks;
+        deque->capacity = capacity;
+        deque->head     = 0;
+        deque->tail     = count;
+    }
+
+    deque->tasks[deque->tail++] = task;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return 1;
+}
+
+// Takes the task back unless a thief already has it
+static int DequePopTask(TaskDeque_t* deque, const DiffTask_t* task) {
+    pthread_mutex_lock(&deque->lock);
+
+    int popped = deque->tail > deque->head && deque->tasks[deque->tail - 1] == task;
+    if (popped) {
+        --deque->tail;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return popped;
+}
+
+static DiffTask_t* DequeSteal(TaskDeque_t* deque) {
+    DiffTask_t* task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail > deque->head) {
+        task = deque->tasks[deque->head++];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
@@ -0,0 +1,42 @@
+#ifndef DIF_PARALLEL_H
+#define DIF_PARALLEL_H
+
+#include <pthread.h>
+
+#include "tree.h"
+
+const size_t PARALLEL_DIFF_CUTOFF = 2048;   // smaller subtrees are differentiated sequentially
+
+struct ParallelDiff_t;
+struct DiffWorker_t;
+
+// Helper threads kept between differentiations. They sleep on the condition
+// variable while there is no job and while a job has nothing to steal. One
+// differentiation runs at a time, other callers wait for it to end.
+struct DiffPool_t {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;            // a job began or stopped, a task was pushed or done
+    pthread_cond_t idle;            // the helpers left the job or the pool is free
+    DiffWorker_t* workers;          // [0] is the calling thread
+    size_t threads;
+    size_t started;                 // helpers running, workers [1, started]
+    ParallelDiff_t* job;
+    size_t generation;
+    size_t active;                  // helpers inside the job
+    int stop;
+};
+
+// threads == 0 - one per core
+TreeErr_t DiffPoolInit(DiffPool_t* pool, size_t threads);
+TreeErr_t DiffPoolDestroy(DiffPool_t* pool);
+
+// Fork-join differentiation: the left operand of a big enough binary node is
+// pushed to the worker's deque while the worker takes the right one, idle
+// workers steal from the other end. The result is structurally identical to
+// TreeDiff.
+Node_t* TreeDiffPooled(DiffPool_t* pool, const Node_t* node, const char* var);
+
+// TreeDiffPooled on a pool of its own, started and joined for this call
+Node_t* TreeDiffParallel(const Node_t* node, const char* var, size_t threads);
+
+#endif // DIF_PARALLEL_H
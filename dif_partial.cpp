@@ -0,0 +1,160 @@
+#include "dif_partial.h"
+
+#include <string.h>
+#include <assert.h>
+
+#include "dif_math.h"
+#include "dif_optimize.h"
+#include "budget.h"
+
+static Node_t* Substitute(const Node_t* node, const PartialBinding_t* bindings, size_t count,
+                          Node_t* parent, PartialErr_t* err);
+static Node_t* SubstituteVariable(const Node_t* node, const PartialBinding_t* bindings, size_t count,
+                                  Node_t* parent, PartialErr_t* err);
+static Node_t* Simplify(Node_t* root);
+
+PartialErr_t TreeSpecialize(const Node_t* node, const PartialBinding_t* bindings, size_t count, Node_t** result) {
+    assert( node != NULL );
+    assert( bindings != NULL || count == 0 );
+    assert( result != NULL );
+
+    PartialErr_t err = PARTIAL_OK;
+    Node_t* root = Substitute(node, bindings, count, NULL, &err);
+    if (err != PARTIAL_OK) {
+        TreeDestroySubtree(&root);
+        return err;
+    }
+
+    *result = Simplify(root);
+
+    return PARTIAL_OK;
+}
+
+PartialErr_t TreeSpecializeInPlace(Tree_t* tree, const PartialBinding_t* bindings, size_t count) {
+    assert( tree != NULL );
+    assert( tree->root != NULL );
+
+    Node_t* root = NULL;
+    PartialErr_t err = TreeSpecialize(tree->root, bindings, count, &root);
+    if (err != PARTIAL_OK) {
+        return err;
+    }
+
+    TreeDestroySubtree(&tree->root);
+    tree->root = root;
+    tree->size = TreeSubtreeSize(root);
+
+    return PARTIAL_OK;
+}
+
+PartialErr_t TreeDiffSpecialized(const Node_t* node, const PartialBinding_t* bindings, size_t count,
+                                 const char* var, Node_t** result) {
+    assert( var != NULL );
+    assert( result != NULL );
+
+    Node_t* special = NULL;
+    PartialErr_t err = TreeSpecialize(node, bindings, count, &special);
+    if (err != PARTIAL_OK) {
+        return err;
+    }
+
+    Node_t* deriv = TreeDiff(special, var);
+    TreeDestroySubtree(&special);
+    if (deriv == NULL) {
+        return PARTIAL_DIFF_FAILED;
+    }
+    deriv->parent = NULL;
+
+    *result = Simplify(deriv);
+
+    return PARTIAL_OK;
+}
+
+static Node_t* Substitute(const Node_t* node, const PartialBinding_t* bindings, size_t count,
+                          Node_t* parent, PartialErr_t* err) {
+    assert( node != NULL );
+    assert( err != NULL );
+
+    switch (node->type) {
+    case TYPE_VARIABLE:
+        return SubstituteVariable(node, bindings, count, parent, err);
+
+    case TYPE_THUNK: {
+        Node_t* expanded = node->data.thunk->expand(node->data.thunk);
+        if (expanded == NULL) {
+            *err = PARTIAL_UNDEFINED_NODE;
+            return NULL;
+        }
+
+        Node_t* new_node = Substitute(expanded, bindings, count, parent, err);
+        TreeDestroySubtree(&expanded);
+
+        return new_node;
+    }
+
+    case TYPE_NUMBER:
+    case TYPE_OPERATION:
+        break;
+
+    case TYPE_UNDEFINED:
+    default:
+        *err = PARTIAL_UNDEFINED_NODE;
+        return NULL;
+    }
+
+    if (!BudgetDescend()) {
+        *err = PARTIAL_BUDGET_EXCEEDED;
+        return NULL;
+    }
+
+    Node_t* new_node = EmptyNodeInit;
+    if (new_node == NULL) {
+        *err = PARTIAL_ALLOCATION_FAILED;
+        BudgetAscend();
+        return NULL;
+    }
+    new_node->parent = parent;
+    NodeCopyData(new_node, node);
+
+    if (node->left != NULL && *err == PARTIAL_OK) {
+        new_node->left = Substitute(node->left, bindings, count, new_node, err);
+    }
+    if (node->right != NULL && *err == PARTIAL_OK) {
+        new_node->right = Substitute(node->right, bindings, count, new_node, err);
+    }
+
+    BudgetAscend();
+
+    return new_node;
+}
+
+static Node_t* SubstituteVariable(const Node_t* node, const PartialBinding_t* bindings, size_t count,
+                                  Node_t* parent, PartialErr_t* err) {
+    Node_t* new_node = NULL;
+
+    size_t i = 0;
+    while (i < count && strcmp(bindings[i].name, node->data.variable) != 0) {
+        i++;
+    }
+
+    if (i == count) {
+        new_node = TreeCopySubtree(node, parent);
+    } else if (bindings[i].subtree != NULL) {
+        new_node = TreeCopySubtree(bindings[i].subtree, parent);
+    } else {
+        new_node = NodeInit(parent, NULL, NULL, TYPE_NUMBER, bindings[i].value);
+    }
+
+    if (new_node == NULL) {
+        *err = PARTIAL_ALLOCATION_FAILED;
+    }
+
+    return new_node;
+}
+
+static Node_t* Simplify(Node_t* root) {
+    Tree_t tree = {root, 0};
+    TreeSimplify(&tree, PARTIAL_SIMPLIFY_PASSES);
+
+    return tree.root;
+}
@@ -0,0 +1,39 @@
+#ifndef DIF_PARTIAL_H
+#define DIF_PARTIAL_H
+
+#include "tree.h"
+
+const size_t PARTIAL_SIMPLIFY_PASSES = 8;
+
+enum PartialErr_t {
+    PARTIAL_OK,
+    PARTIAL_ALLOCATION_FAILED,
+    PARTIAL_UNDEFINED_NODE,
+    PARTIAL_BUDGET_EXCEEDED,
+    PARTIAL_DIFF_FAILED
+};
+
+// A variable fixed for a batch: replaced by subtree, or by value if subtree
+// is NULL
+struct PartialBinding_t {
+    const char* name;
+    const Node_t* subtree;
+    double value;
+};
+
+/*
+Partial evaluation: a new tree equal to node with every bound variable
+replaced, then folded by TreeSimplify, unary functions of numbers included.
+The substitution is simultaneous: variables inside a substituted subtree are
+not replaced again. Thunks are expanded on the way, the source stays lazy.
+Unbound variables are kept, so a tree with none left folds to one number
+unless a value is out of an operation's domain.
+*/
+PartialErr_t TreeSpecialize(const Node_t* node, const PartialBinding_t* bindings, size_t count, Node_t** result);
+// Replaces tree->root by its specialization; the tree is unchanged on failure
+PartialErr_t TreeSpecializeInPlace(Tree_t* tree, const PartialBinding_t* bindings, size_t count);
+// Derivative by var of the specialized tree, simplified. A bound var gives 0.
+PartialErr_t TreeDiffSpecialized(const Node_t* node, const PartialBinding_t* bindings, size_t count,
+                                 const char* var, Node_t** result);
+
+#endif // DIF_PARTIAL_H
@@ -0,0 +1,691 @@
+#include "dif_poly.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "dif_math.h"
+#include "node_map.h"
+#include "metrics.h"
+#include "budget.h"
+
+#define c(x) \
+    NodeInit(NULL, NULL, NULL, TYPE_NUMBER, x)
+#define v(x) \
+    NodeInit(NULL, NULL, NULL, TYPE_VARIABLE, x)
+
+#define ADD_(left, right) \
+    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_ADD)
+
+#define SUB_(left, right) \
+    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_SUB)
+
+#define MUL_(left, right) \
+    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_MUL)
+
+#define EXP_(left, right) \
+    NodeInit(NULL, left, right, TYPE_OPERATION, OPERATION_EXP)
+
+#pragma GCC diagnostic ignored "-Wfloat-equal"     // coefficients are compared exactly on purpose
+
+const size_t POLY_MAX_PRODUCT = 1 << 20;    // terms of a product before they are merged
+
+const unsigned POLY_SHAPE = 1;
+const size_t POLY_EXPANSION_LIMIT = 2;      // derivative tree size per node of the source
+
+struct PolyDiffCtx_t {
+    const char* var;
+    NodeMap_t shapes;               // and DIFF_DEPENDS_ON_VAR flags
+};
+
+static PolyErr_t RecursivePolyFromTree(const Node_t* node, Poly_t* poly);
+static PolyErr_t PolyReserve(Poly_t* poly, size_t capacity);
+static PolyErr_t PolyPushTerm(Poly_t* poly, double coef, const unsigned char* exps);
+static PolyErr_t PolyNormalize(Poly_t* poly);
+static PolyErr_t PolyAdd(Poly_t* poly, const Poly_t* other, double sign);
+static PolyErr_t PolyMul(const Poly_t* a, const Poly_t* b, Poly_t* result);
+static PolyErr_t PolyPow(const Poly_t* base, unsigned exponent, Poly_t* result);
+static void PolyScale(Poly_t* poly, double factor);
+static int PolyIsConstant(const Poly_t* poly, double* value);
+static int CompareTerms(const void* a, const void* b);
+static double PowInt(double x, unsigned n);
+static Node_t* TermToTree(const Poly_t* poly, const PolyTerm_t* term, double coef);
+static int IsSmallExponent(const Node_t* node);
+static unsigned MarkPolynomial(NodeMap_t* shapes, const Node_t* node, int* err);
+static Node_t* PolyDiffNode(const Node_t* node, void* arg);
+static int PolyDepends(const Node_t* node, void* arg);
+static size_t PolyTreeSize(const Poly_t* poly);
+
+PolyErr_t PolyFromTree(Poly_t* poly, const Node_t* node) {
+    assert( poly != NULL );
+    assert( node != NULL );
+
+    memset(poly, 0, sizeof(*poly));
+
+    PolyErr_t err = RecursivePolyFromTree(node, poly);
+    if (err != POLY_OK) {
+        PolyDestroy(poly);
+    }
+
+    return err;
+}
+
+void PolyDestroy(Poly_t* poly) {
+    assert( poly != NULL );
+
+    FREE(poly->terms);
+    poly->size = 0;
+    poly->capacity = 0;
+}
+
+// Every intermediate polynomial shares the variable table of poly
+static PolyErr_t RecursivePolyFromTree(const Node_t* node, Poly_t* poly) {
+    unsigned char exps[POLY_MAX_VARS] = {};
+
+    switch (node->type) {
+    case TYPE_NUMBER:
+        return PolyPushTerm(poly, node->data.number, exps);
+
+    case TYPE_VARIABLE: {
+        size_t index = 0;
+        for (; index < poly->var_count && strcmp(poly->vars[index], node->data.variable) != 0; index++);
+
+        if (index == poly->var_count) {
+            if (poly->var_count == POLY_MAX_VARS) {
+                return POLY_TOO_MANY_VARS;
+            }
+            poly->vars[poly->var_count++] = node->data.variable;
+        }
+
+        exps[index] = 1;
+        return PolyPushTerm(poly, 1, exps);
+    }
+
+    case TYPE_OPERATION:
+        break;
+
+    case TYPE_THUNK:
+    case TYPE_UNDEFINED:
+    default:
+        return POLY_NOT_POLYNOMIAL;
+    }
+
+    if (node->left == NULL || node->right == NULL) {
+        return POLY_NOT_POLYNOMIAL;
+    }
+
+    Poly_t left = {}, right = {};
+    PolyErr_t err = RecursivePolyFromTree(node->left, poly);      // the left operand goes straight into poly
+    if (err != POLY_OK) {
+        return err;
+    }
+
+    left = *poly;
+    memset(&right, 0, sizeof(right));
+    right.var_count = poly->var_count;
+    memcpy(right.vars, poly->vars, sizeof(poly->vars));
+
+    err = RecursivePolyFromTree(node->right, &right);       // may add variables
+    memcpy(poly->vars, right.vars, sizeof(poly->vars));
+    memcpy(left.vars,  right.vars, sizeof(left.vars));
+    poly->var_count = right.var_count;
+    left.var_count  = right.var_count;
+
+    double value = 0;
+
+    if (err == POLY_OK) {
+        switch (node->data.operation) {
+        case OPERATION_ADD:
+            err = PolyAdd(poly, &right, 1);
+            break;
+
+        case OPERATION_SUB:
+            err = PolyAdd(poly, &right, -1);
+            break;
+
+        case OPERATION_MUL:
+            err = PolyMul(&left, &right, poly);
+            if (err == POLY_OK) {
+                PolyDestroy(&left);
+            }
+            break;
+
+        case OPERATION_DIV:
+            if (PolyIsConstant(&right, &value) && value != 0) {
+                PolyScale(poly, 1 / value);
+            } else {
+                err = POLY_NOT_POLYNOMIAL;
+            }
+            break;
+
+        case OPERATION_EXP:
+            if (IsSmallExponent(node->right)) {
+                err = PolyPow(&left, (unsigned)node->right->data.number, poly);
+                if (err == POLY_OK) {
+                    PolyDestroy(&left);
+                }
+            } else {
+                err = POLY_NOT_POLYNOMIAL;
+            }
+            break;
+
+        case OPERATION_SQRT:
+        case OPERATION_LN:
+        case OPERATION_LOG:
+        case OPERATION_SIN:
+        case OPERATION_COS:
+        case OPERATION_TAN:
+        case OPERATION_COT:
+        case OPERATION_SINH:
+        case OPERATION_COSH:
+        case OPERATION_TANH:
+        case OPERATION_COTH:
+        case OPERATION_ASIN:
+        case OPERATION_ACOS:
+        case OPERATION_ATAN:
+        case OPERATION_ACOT:
+        case OPERATION_UNDEF:
+        default:
+            err = POLY_NOT_POLYNOMIAL;
+            break;
+        }
+    }
+
+    PolyDestroy(&right);
+
+    return err;
+}
+
+static int IsSmallExponent(const Node_t* node) {
+    return node->type == TYPE_NUMBER && node->data.number >= 0 && node->data.number <= POLY_MAX_DEGREE
+           && node->data.number == floor(node->data.number);
+}
+
+static PolyErr_t PolyReserve(Poly_t* poly, size_t capacity) {
+    if (capacity <= poly->capacity) {
+        return POLY_OK;
+    }
+
+    size_t new_capacity = (poly->capacity != 0) ? poly->capacity : 4;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    PolyTerm_t* terms = (PolyTerm_t*)realloc(poly->terms, new_capacity * sizeof(PolyTerm_t));
+    if (terms == NULL) {
+        return POLY_ALLOCATION_FAILED;
+    }
+
+    poly->terms = terms;
+    poly->capacity = new_capacity;
+
+    return POLY_OK;
+}
+
+static PolyErr_t PolyPushTerm(Poly_t* poly, double coef, const unsigned char* exps) {
+    if (PolyReserve(poly, poly->size + 1) != POLY_OK) {
+        return POLY_ALLOCATION_FAILED;
+    }
+
+    poly->terms[poly->size].coef = coef;
+    memcpy(poly->terms[poly->size].exps, exps, POLY_MAX_VARS);
+    ++poly->size;
+
+    return PolyNormalize(poly);
+}
+
+static int CompareTerms(const void* a, const void* b) {
+    return memcmp(((const PolyTerm_t*)a)->exps, ((const PolyTerm_t*)b)->exps, POLY_MAX_VARS);
+}
+
+// Sorts the terms, merges equal monomials and drops zero coefficients
+static PolyErr_t PolyNormalize(Poly_t* poly) {
+    if (poly->size == 0) {
+        return POLY_OK;
+    }
+
+    qsort(poly->terms, poly->size, sizeof(PolyTerm_t), CompareTerms);
+
+    size_t size = 0;
+    for (size_t i = 0; i < poly->size; i++) {
+        if (size != 0 && CompareTerms(&poly->terms[size - 1], &poly->terms[i]) == 0) {
+            poly->terms[size - 1].coef += poly->terms[i].coef;
+        } else {
+            poly->terms[size++] = poly->terms[i];
+        }
+    }
+
+    poly->size = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (poly->terms[i].coef != 0) {
+            poly->terms[poly->size++] = poly->terms[i];
+        }
+    }
+
+    return (poly->size <= POLY_MAX_TERMS) ? POLY_OK : POLY_TOO_BIG;
+}
+
+static PolyErr_t PolyAdd(Poly_t* poly, const Poly_t* other, double sign) {
+    if (PolyReserve(poly, poly->size + other->size) != POLY_OK) {
+        return POLY_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; i < other->size; i++) {
+        poly->terms[poly->size] = other->terms[i];
+        poly->terms[poly->size].coef *= sign;
+        ++poly->size;
+    }
+
+    return PolyNormalize(poly);
+}
+
+// result must not alias a or b
+static PolyErr_t PolyMul(const Poly_t* a, const Poly_t* b, Poly_t* result) {
+    if (a->size * b->size > POLY_MAX_PRODUCT) {
+        return POLY_TOO_BIG;
+    }
+
+    Poly_t product = {};
+    product.var_count = a->var_count;
+    memcpy(product.vars, a->vars, sizeof(a->vars));
+
+    if (PolyReserve(&product, a->size * b->size) != POLY_OK) {
+        return POLY_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; i < a->size; i++) {
+        for (size_t j = 0; j < b->size; j++) {
+            PolyTerm_t* term = &product.terms[product.size++];
+            term->coef = a->terms[i].coef * b->terms[j].coef;
+
+            for (size_t k = 0; k < POLY_MAX_VARS; k++) {
+                unsigned exp = (unsigned)a->terms[i].exps[k] + b->terms[j].exps[k];
+                if (exp > POLY_MAX_DEGREE) {
+                    PolyDestroy(&product);
+                    return POLY_TOO_BIG;
+                }
+                term->exps[k] = (unsigned char)exp;
+            }
+        }
+    }
+
+    PolyErr_t err = PolyNormalize(&product);
+    if (err != POLY_OK) {
+        PolyDestroy(&product);
+        return err;
+    }
+
+    *result = product;
+
+    return POLY_OK;
+}
+
+static PolyErr_t PolyPow(const Poly_t* base, unsigned exponent, Poly_t* result) {
+    Poly_t acc = {}, power = {};
+    acc.var_count = base->var_count;
+    memcpy(acc.vars, base->vars, sizeof(base->vars));
+
+    unsigned char zero[POLY_MAX_VARS] = {};
+    PolyErr_t err = PolyPushTerm(&acc, 1, zero);
+    if (err == POLY_OK) {
+        err = PolyMul(base, &acc, &power);              // copy of base
+    }
+
+    while (exponent != 0 && err == POLY_OK) {
+        Poly_t next = {};
+
+        if (exponent & 1) {
+            err = PolyMul(&acc, &power, &next);
+            PolyDestroy(&acc);
+            acc = next;
+        }
+
+        exponent >>= 1;
+        if (exponent != 0 && err == POLY_OK) {
+            err = PolyMul(&power, &power, &next);
+            PolyDestroy(&power);
+            power = next;
+        }
+    }
+
+    PolyDestroy(&power);
+
+    if (err != POLY_OK) {
+        PolyDestroy(&acc);
+        return err;
+    }
+
+    *result = acc;
+
+    return POLY_OK;
+}
+
+static void PolyScale(Poly_t* poly, double factor) {
+    for (size_t i = 0; i < poly->size; i++) {
+        poly->terms[i].coef *= factor;
+    }
+}
+
+static int PolyIsConstant(const Poly_t* poly, double* value) {
+    unsigned char zero[POLY_MAX_VARS] = {};
+
+    if (poly->size == 0) {
+        *value = 0;
+        return 1;
+    }
+    if (poly->size == 1 && memcmp(poly->terms[0].exps, zero, POLY_MAX_VARS) == 0) {
+        *value = poly->terms[0].coef;
+        return 1;
+    }
+
+    return 0;
+}
+
+PolyErr_t PolyDiff(const Poly_t* poly, const char* var, Poly_t* result) {
+    assert( poly != NULL );
+    assert( var != NULL );
+    assert( result != NULL );
+
+    memset(result, 0, sizeof(*result));
+    result->var_count = poly->var_count;
+    memcpy(result->vars, poly->vars, sizeof(poly->vars));
+
+    size_t index = 0;
+    for (; index < poly->var_count && strcmp(poly->vars[index], var) != 0; index++);
+    if (index == poly->var_count) {
+        return POLY_OK;                                 // other variables are constants
+    }
+
+    if (PolyReserve(result, poly->size) != POLY_OK) {
+        return POLY_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; i < poly->size; i++) {
+        if (poly->terms[i].exps[index] == 0) {
+            continue;
+        }
+
+        PolyTerm_t* term = &result->terms[result->size++];
+        *term = poly->terms[i];
+        term->coef *= term->exps[index];
+        --term->exps[index];
+    }
+
+    return PolyNormalize(result);
+}
+
+// Highest terms first: 3*x^2 - x + 1
+Node_t* PolyToTree(const Poly_t* poly) {
+    assert( poly != NULL );
+
+    if (poly->size == 0) {
+        return c(0.f);
+    }
+
+    const PolyTerm_t* first = &poly->terms[poly->size - 1];
+    Node_t* sum = TermToTree(poly, first, first->coef);
+
+    for (size_t i = poly->size - 1; i-- > 0 && sum != NULL;) {
+        const PolyTerm_t* term = &poly->terms[i];
+
+        if (term->coef < 0) {
+            sum = SUB_(sum, TermToTree(poly, term, -term->coef));
+        } else {
+            sum = ADD_(sum, TermToTree(poly, term, term->coef));
+        }
+    }
+
+    return sum;
+}
+
+static Node_t* TermToTree(const Poly_t* poly, const PolyTerm_t* term, double coef) {
+    Node_t* monomial = NULL;
+
+    for (size_t k = 0; k < poly->var_count; k++) {
+        if (term->exps[k] == 0) {
+            continue;
+        }
+
+        Node_t* factor = v(poly->vars[k]);
+        if (term->exps[k] > 1) {
+            factor = EXP_(factor, c((double)term->exps[k]));
+        }
+
+        monomial = (monomial != NULL) ? MUL_(monomial, factor) : factor;
+    }
+
+    if (monomial == NULL) {
+        return c(coef);
+    }
+    if (coef == 1) {
+        return monomial;
+    }
+
+    return MUL_(c(coef), monomial);
+}
+
+// Nodes PolyToTree would create
+static size_t PolyTreeSize(const Poly_t* poly) {
+    size_t size = (poly->size != 0) ? poly->size - 1 : 1;     // '+' and '-' between terms
+
+    for (size_t i = 0; i < poly->size; i++) {
+        size_t factors = 0;
+        for (size_t k = 0; k < poly->var_count; k++) {
+            if (poly->terms[i].exps[k] != 0) {
+                size += (poly->terms[i].exps[k] > 1) ? 3 : 1;
+                ++factors;
+            }
+        }
+
+        size += (factors != 0) ? factors - 1 : 1;           // '*' between factors or the constant
+        if (factors != 0 && fabs(poly->terms[i].coef) != 1) {
+            size += 2;
+        }
+    }
+
+    return size;
+}
+
+static double PowInt(double x, unsigned n) {
+    double res = 1;
+    for (; n != 0; n >>= 1, x *= x) {
+        if (n & 1) {
+            res *= x;
+        }
+    }
+
+    return res;
+}
+
+double PolyEval(const Poly_t* poly, const double* values) {
+    assert( poly != NULL );
+    assert( values != NULL || poly->var_count == 0 );
+
+    if (poly->size == 0) {
+        return 0;
+    }
+
+    if (poly->var_count == 1) {                         // sparse Horner from the highest term
+        double x = values[0];
+        double res = 0;
+        unsigned degree = poly->terms[poly->size - 1].exps[0];
+
+        for (size_t i = poly->size; i-- > 0;) {
+            res = res * PowInt(x, degree - poly->terms[i].exps[0]) + poly->terms[i].coef;
+            degree = poly->terms[i].exps[0];
+        }
+
+        return res * PowInt(x, degree);
+    }
+
+    double res = 0;
+    for (size_t i = 0; i < poly->size; i++) {
+        double term = poly->terms[i].coef;
+        for (size_t k = 0; k < poly->var_count; k++) {
+            term *= PowInt(values[k], poly->terms[i].exps[k]);
+        }
+        res += term;
+    }
+
+    return res;
+}
+
+// points: count rows of var_count values. One variable: dense Horner with
+// the loop over points innermost so it vectorizes.
+PolyErr_t PolyEvalBatch(const Poly_t* poly, const double* points, size_t count, double* results) {
+    assert( poly != NULL );
+    assert( points != NULL || count == 0 );
+    assert( results != NULL || count == 0 );
+
+    if (poly->var_count != 1 || poly->size == 0) {
+        for (size_t i = 0; i < count; i++) {
+            results[i] = PolyEval(poly, points + i * poly->var_count);
+        }
+        return POLY_OK;
+    }
+
+    size_t degree = poly->terms[poly->size - 1].exps[0];
+    double* coefs = (double*)calloc(degree + 1, sizeof(double));
+    if (coefs == NULL) {
+        return POLY_ALLOCATION_FAILED;
+    }
+    for (size_t i = 0; i < poly->size; i++) {
+        coefs[poly->terms[i].exps[0]] = poly->terms[i].coef;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        results[i] = coefs[degree];
+    }
+    for (size_t d = degree; d-- > 0;) {
+        double coef = coefs[d];
+        for (size_t i = 0; i < count; i++) {
+            results[i] = results[i] * points[i] + coef;
+        }
+    }
+
+    FREE(coefs);
+
+    return POLY_OK;
+}
+
+Node_t* TreeDiffPoly(const Node_t* node, const char* var) {
+    assert( node != NULL );
+    assert( var != NULL );
+
+    PolyDiffCtx_t ctx = {var, {}};
+    if (NodeMapInit(&ctx.shapes, TreeSubtreeSize(node)) != TREE_OK) {
+        return TreeDiff(node, var);
+    }
+
+    int err = 0;
+    MarkPolynomial(&ctx.shapes, node, &err);
+    if (err || DiffIndexDepends(&ctx.shapes, node, var) != TREE_OK) {
+        NodeMapDestroy(&ctx.shapes);
+        return TreeDiff(node, var);
+    }
+
+    METRICS_PHASE_BEGIN(PHASE_DIFF);
+
+    Node_t* new_node = PolyDiffNode(node, &ctx);
+    if (BudgetExceeded()) {
+        TreeDestroySubtree(&new_node);
+    }
+
+    NodeMapDestroy(&ctx.shapes);
+
+    METRICS_PHASE_END(PHASE_DIFF);
+    METRICS_ADD(COUNTER_DIFF_INPUT_NODES, TreeSubtreeSize(node));
+    METRICS_ADD(COUNTER_DIFF_OUTPUT_NODES, TreeSubtreeSize(new_node));
+
+    return new_node;
+}
+
+// Cheap shape check so that conversion is tried only on the biggest candidates
+static unsigned MarkPolynomial(NodeMap_t* shapes, const Node_t* node, int* err) {
+    unsigned left  = (node->left  != NULL) ? MarkPolynomial(shapes, node->left,  err) : 0;
+    unsigned right = (node->right != NULL) ? MarkPolynomial(shapes, node->right, err) : 0;
+
+    unsigned shape = 0;
+    if (node->type == TYPE_NUMBER || node->type == TYPE_VARIABLE) {
+        shape = POLY_SHAPE;
+    } else if (node->type == TYPE_OPERATION && node->left != NULL) {
+        switch (node->data.operation) {
+        case OPERATION_ADD:
+        case OPERATION_SUB:
+        case OPERATION_MUL:
+            shape = left & right;
+            break;
+
+        case OPERATION_DIV:
+            shape = (node->right->type == TYPE_NUMBER) ? left : 0;
+            break;
+
+        case OPERATION_EXP:
+            shape = IsSmallExponent(node->right) ? left : 0;
+            break;
+
+        case OPERATION_SQRT:
+        case OPERATION_LN:
+        case OPERATION_LOG:
+        case OPERATION_SIN:
+        case OPERATION_COS:
+        case OPERATION_TAN:
+        case OPERATION_COT:
+        case OPERATION_SINH:
+        case OPERATION_COSH:
+        case OPERATION_TANH:
+        case OPERATION_COTH:
+        case OPERATION_ASIN:
+        case OPERATION_ACOS:
+        case OPERATION_ATAN:
+        case OPERATION_ACOT:
+        case OPERATION_UNDEF:
+        default:
+            break;
+        }
+    }
+
+    NodeInfo_t* info = NodeMapInsert(shapes, node);
+    if (info == NULL) {
+        *err = 1;
+        return 0;
+    }
+    info->flags = shape;
+    info->size  = TreeSubtreeSize(node->left) + TreeSubtreeSize(node->right) + 1;
+
+    return shape;
+}
+
+static Node_t* PolyDiffNode(const Node_t* node, void* arg) {
+    PolyDiffCtx_t* ctx = (PolyDiffCtx_t*)arg;
+
+    NodeInfo_t* info = NodeMapFind(&ctx->shapes, node);
+    if (info != NULL && (info->flags & POLY_SHAPE) && node->type == TYPE_OPERATION) {
+        Poly_t poly = {}, deriv = {};
+        Node_t* new_node = NULL;
+
+        // an expansion bigger than the usual rule output keeps the factored form
+        if (PolyFromTree(&poly, node) == POLY_OK && PolyDiff(&poly, ctx->var, &deriv) == POLY_OK
+            && PolyTreeSize(&deriv) <= POLY_EXPANSION_LIMIT * info->size) {
+            new_node = PolyToTree(&deriv);
+            METRICS_INC(COUNTER_POLY_SUBTREES);
+        }
+
+        PolyDestroy(&poly);
+        PolyDestroy(&deriv);
+
+        if (new_node != NULL) {
+            return new_node;
+        }
+    }
+
+    DiffHooks_t hooks = {PolyDiffNode, NULL, ctx, NULL, PolyDepends};
+
+    return TreeDiffStep(node, ctx->var, &hooks);
+}
+
+static int PolyDepends(const Node_t* node, void* arg) {
+    return DiffIndexHasVar(&((PolyDiffCtx_t*)arg)->shapes, node);
+}
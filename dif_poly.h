@@ -0,0 +1,46 @@
+#ifndef DIF_POLY_H
+#define DIF_POLY_H
+
+#include "tree.h"
+
+const size_t POLY_MAX_VARS   = 8;
+const unsigned POLY_MAX_DEGREE = 64;        // per variable
+const size_t POLY_MAX_TERMS  = 4096;        // bigger expansions stay trees
+
+enum PolyErr_t {
+    POLY_OK,
+    POLY_NOT_POLYNOMIAL,
+    POLY_TOO_MANY_VARS,
+    POLY_TOO_BIG,
+    POLY_ALLOCATION_FAILED
+};
+
+struct PolyTerm_t {
+    double coef;
+    unsigned char exps[POLY_MAX_VARS];
+};
+
+// Sparse polynomial: terms sorted by exponents, no zero coefficients.
+// Variable names point into the tree the polynomial was built from.
+struct Poly_t {
+    size_t var_count;
+    const char* vars[POLY_MAX_VARS];
+    PolyTerm_t* terms;
+    size_t size;
+    size_t capacity;
+};
+
+PolyErr_t PolyFromTree(Poly_t* poly, const Node_t* node);
+void PolyDestroy(Poly_t* poly);
+
+PolyErr_t PolyDiff(const Poly_t* poly, const char* var, Poly_t* result);
+Node_t* PolyToTree(const Poly_t* poly);
+
+// values are in poly->vars order; one variable is evaluated by Horner's rule
+double PolyEval(const Poly_t* poly, const double* values);
+PolyErr_t PolyEvalBatch(const Poly_t* poly, const double* points, size_t count, double* results);
+
+// TreeDiff that differentiates polynomial subtrees on their coefficients
+Node_t* TreeDiffPoly(const Node_t* node, const char* var);
+
+#endif // DIF_POLY_H
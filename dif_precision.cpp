@@ -0,0 +1,186 @@
+#include "dif_precision.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+
+static const char* const type_names[PRECISION_TYPE_COUNT] = {
+    "float", "double", "long double", "float x8", "double x4"
+};
+
+template <typename S>
+static EvalErr_t BenchType(const EvalTape_t* tape, const long double* xs, size_t points, size_t repeats,
+                           long double* values, PrecisionResult_t* result);
+static void CompareValues(const long double* reference, const long double* values, size_t points,
+                          PrecisionResult_t* result);
+static double Seconds(const timespec* start, const timespec* end);
+
+void PrecisionConfigInit(PrecisionConfig_t* config) {
+    assert( config != NULL );
+
+    config->points  = 100000;
+    config->repeats = 10;
+    config->lo      = -10;
+    config->hi      = 10;
+}
+
+EvalErr_t PrecisionBench(const Node_t* node, const char* var, const PrecisionConfig_t* config,
+                         PrecisionReport_t* report) {
+    assert( node != NULL );
+    assert( var != NULL );
+    assert( config != NULL );
+    assert( config->points != 0 );
+    assert( report != NULL );
+
+    *report = {};
+    report->points = config->points;
+
+    EvalTape_t tape = {};
+    EvalErr_t err = EvalTapeBuild(&tape, node, &var, 1);
+    if (err != EVAL_OK) {
+        return err;
+    }
+    report->tape_size = tape.size;
+
+    long double* xs = (long double*)calloc(config->points, sizeof(long double));
+    long double* reference = (long double*)calloc(config->points, sizeof(long double));
+    long double* values = (long double*)calloc(config->points, sizeof(long double));
+    if (xs == NULL || reference == NULL || values == NULL) {
+        err = EVAL_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; err == EVAL_OK && i < config->points; i++) {
+        xs[i] = config->lo + (config->hi - config->lo) * (long double)i / (long double)config->points;
+    }
+
+    PrecisionResult_t* results = report->results;
+    if (err == EVAL_OK) {
+        err = BenchType<long double>(&tape, xs, config->points, config->repeats, reference,
+                                     &results[PRECISION_LONG_DOUBLE]);
+    }
+    for (size_t i = 0; err == EVAL_OK && i < config->points; i++) {
+        report->reference_points += isfinite(reference[i]) ? 1u : 0u;
+    }
+
+    for (size_t type = 0; err == EVAL_OK && type < PRECISION_TYPE_COUNT; type++) {
+        switch ((PrecisionType_t)type) {
+        case PRECISION_FLOAT:
+            err = BenchType<float>(&tape, xs, config->points, config->repeats, values, &results[type]);
+            break;
+        case PRECISION_DOUBLE:
+            err = BenchType<double>(&tape, xs, config->points, config->repeats, values, &results[type]);
+            break;
+        case PRECISION_FLOAT_LANES:
+            err = BenchType<LanesF8_t>(&tape, xs, config->points, config->repeats, values, &results[type]);
+            break;
+        case PRECISION_DOUBLE_LANES:
+            err = BenchType<LanesD4_t>(&tape, xs, config->points, config->repeats, values, &results[type]);
+            break;
+
+        case PRECISION_LONG_DOUBLE:
+        case PRECISION_TYPE_COUNT:
+        default:
+            continue;
+        }
+
+        CompareValues(reference, values, config->points, &results[type]);
+    }
+
+    for (size_t type = 0; type < PRECISION_TYPE_COUNT; type++) {
+        results[type].type = type_names[type];
+    }
+
+    FREE(xs);
+    FREE(reference);
+    FREE(values);
+    EvalTapeDestroy(&tape);
+
+    return err;
+}
+
+void PrecisionReportPrint(const PrecisionReport_t* report, FILE* fp) {
+    assert( report != NULL );
+    assert( fp != NULL );
+
+    fprintf(fp, "precision: %zu points, %zu with a finite reference, %zu instructions\n",
+            report->points, report->reference_points, report->tape_size);
+
+    for (size_t type = 0; type < PRECISION_TYPE_COUNT; type++) {
+        const PrecisionResult_t* result = &report->results[type];
+        if (type == PRECISION_LONG_DOUBLE) {
+            fprintf(fp, "precision: %-12s %6.2lf ns/point  reference\n", result->type, result->ns_per_point);
+            continue;
+        }
+
+        fprintf(fp, "precision: %-12s %6.2lf ns/point  error %.2le max, %.2le mean, %zu not finite\n",
+                result->type, result->ns_per_point, result->max_error, result->mean_error, result->not_finite);
+    }
+}
+
+// values get the results as long double, point i from lane i % LANES
+template <typename S>
+static EvalErr_t BenchType(const EvalTape_t* tape, const long double* xs, size_t points, size_t repeats,
+                           long double* values, PrecisionResult_t* result) {
+    typedef ScalarTraits<S> Traits;
+    typedef typename Traits::Elem_t Elem_t;
+
+    S* slots = (S*)calloc(tape->size, sizeof(S));
+    if (slots == NULL) {
+        return EVAL_ALLOCATION_FAILED;
+    }
+
+    timespec start = {}, end = {};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t repeat = 0; repeat < repeats || repeat == 0; repeat++) {
+        for (size_t first = 0; first < points; first += Traits::LANES) {
+            S x = Traits::Splat(xs[first]);             // a short last batch repeats its first point
+            for (size_t lane = 1; lane < Traits::LANES && first + lane < points; lane++) {
+                Traits::SetLane(&x, lane, ScalarTraits<Elem_t>::Splat(xs[first + lane]));
+            }
+
+            S value = EvalTapeRunScalar(tape, &x, slots);
+            for (size_t lane = 0; lane < Traits::LANES && first + lane < points; lane++) {
+                values[first + lane] = Traits::Lane(value, lane);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    FREE(slots);
+
+    size_t runs = (repeats != 0) ? repeats : 1;
+    result->lanes = Traits::LANES;
+    result->ns_per_point = Seconds(&start, &end) * 1e9 / (double)(points * runs);
+
+    return EVAL_OK;
+}
+
+static void CompareValues(const long double* reference, const long double* values, size_t points,
+                          PrecisionResult_t* result) {
+    long double max_error = 0, sum_error = 0;
+    size_t compared = 0;
+
+    for (size_t i = 0; i < points; i++) {
+        if (!isfinite(reference[i])) {
+            continue;
+        }
+        if (!isfinite(values[i])) {
+            result->not_finite++;
+            continue;
+        }
+
+        long double error = fabsl(values[i] - reference[i]) / fmaxl(1, fabsl(reference[i]));
+        max_error = fmaxl(max_error, error);
+        sum_error += error;
+        compared++;
+    }
+
+    result->max_error  = (double)max_error;
+    result->mean_error = (compared != 0) ? (double)(sum_error / (long double)compared) : 0;
+}
+
+static double Seconds(const timespec* start, const timespec* end) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) * 1e-9;
+}
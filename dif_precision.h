@@ -0,0 +1,51 @@
+#ifndef DIF_PRECISION_H
+#define DIF_PRECISION_H
+
+#include <stdio.h>
+
+#include "tree.h"
+#include "dif_eval.h"
+
+enum PrecisionType_t {
+    PRECISION_FLOAT,
+    PRECISION_DOUBLE,
+    PRECISION_LONG_DOUBLE,      // the reference of the errors
+    PRECISION_FLOAT_LANES,
+    PRECISION_DOUBLE_LANES,
+    PRECISION_TYPE_COUNT
+};
+
+struct PrecisionConfig_t {
+    size_t points;              // spread evenly over [lo, hi]
+    size_t repeats;             // of the timed runs
+    double lo;
+    double hi;
+};
+
+// Errors are relative to max(1, |long double value|) at the points where
+// the long double value is finite
+struct PrecisionResult_t {
+    const char* type;
+    size_t lanes;
+    double ns_per_point;
+    double max_error;
+    double mean_error;
+    size_t not_finite;          // points that overflowed or left a domain in this type only
+};
+
+struct PrecisionReport_t {
+    PrecisionResult_t results[PRECISION_TYPE_COUNT];
+    size_t points;
+    size_t reference_points;    // with a finite long double value
+    size_t tape_size;
+};
+
+void PrecisionConfigInit(PrecisionConfig_t* config);
+
+// Speed and accuracy of the tape of node, a function of var only, in every
+// instantiation of EvalTapeRunScalar
+EvalErr_t PrecisionBench(const Node_t* node, const char* var, const PrecisionConfig_t* config,
+                         PrecisionReport_t* report);
+void PrecisionReportPrint(const PrecisionReport_t* report, FILE* fp);
+
+#endif // DIF_PRECISION_H
@@ -1,9 +1,9 @@
 #!/bin/bash
 
-source="g++ main.cpp tree.cpp io.cpp dif_math.cpp dif_optimize.cpp dump.cpp utils.cpp -o dif"
+source="g++ main.cpp tree.cpp io.cpp dif_math.cpp dif_optimize.cpp dump.cpp utils.cpp metrics.cpp node_map.cpp dif_cache.cpp dif_lazy.cpp dif_incremental.cpp dif_eval.cpp dif_interval.cpp server.cpp dif_verify.cpp share.cpp dif_parallel.cpp dif_poly.cpp dif_jacobian.cpp dif_solve.cpp alloc_track.cpp debug.cpp dif_api.cpp budget.cpp scan.cpp dif_lower.cpp disk_cache.cpp dif_partial.cpp dif_precision.cpp -o dif"
 
 flags=" \
--D STACK_MODE=STACK_DEBUG -ggdb3 -std=c++17 -O0 -Wall -Wextra -Weffc++ -Waggressive-loop-optimizations -Wc++14-compat \
+-D STACK_MODE=STACK_DEBUG -D DIF_METRICS -D DIF_ALLOC_TRACK -ggdb3 -pthread -std=c++17 -O0 -Wall -Wextra -Weffc++ -Waggressive-loop-optimizations -Wc++14-compat \
 -Wmissing-declarations -Wcast-align -Wcast-qual -Wchar-subscripts -Wconditionally-supported -Wconversion -Wctor-dtor-privacy    \
 -Wempty-body -Wfloat-equal -Wformat-nonliteral -Wformat-security -Wformat-signedness -Wformat=2 -Winline -Wlogical-op           \
 -Wnon-virtual-dtor -Wopenmp-simd -Woverloaded-virtual -Wpacked -Wpointer-arith -Winit-self -Wredundant-decls -Wshadow           \
@@ -0,0 +1,398 @@
+#include "dif_solve.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "dif_math.h"
+#include "dif_optimize.h"
+
+// f(x) == 0 exactly is a root, no tolerance applies
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+
+struct SolveWorker_t {
+    const Solver_t* solver;
+    const SolveConfig_t* config;
+    const SolveProblem_t* problems;
+    SolveResult_t* results;
+    size_t count;
+    size_t index;
+    size_t stride;
+    pthread_t thread;
+    SolveStats_t stats;
+    double* slots;
+    double* values;
+};
+
+static Tree_t* OptimizedDiff(const Node_t* node, const char* var);
+static SolveErr_t CompileTape(EvalTape_t* tape, const Node_t* node, const char* const* vars, size_t var_count);
+static SolveErr_t LowerTape(EvalTape_t* tape, const LowerCosts_t* costs, LowerStats_t* stats);
+static size_t SlotCount(const Solver_t* solver);
+static void* SolveWorker(void* arg);
+static void SolveOne(SolveWorker_t* worker, const SolveProblem_t* problem, SolveResult_t* result);
+static double Eval(SolveWorker_t* worker, const EvalTape_t* tape, double x);
+
+void SolveConfigInit(SolveConfig_t* config) {
+    assert( config != NULL );
+
+    config->threads        = 0;
+    config->max_iterations = 100;
+    config->tolerance      = 1e-13;
+}
+
+SolveErr_t SolverInit(Solver_t* solver, const Node_t* f, const char* var,
+                      const char* const* params, size_t param_count, SolveMethod_t method) {
+    assert( solver != NULL );
+    assert( f != NULL );
+    assert( var != NULL );
+    assert( params != NULL || param_count == 0 );
+
+    memset(solver, 0, sizeof(*solver));
+    solver->method      = method;
+    solver->param_count = param_count;
+
+    const char** vars = (const char**)calloc(param_count + 1, sizeof(const char*));
+    if (vars == NULL) {
+        return SOLVE_ALLOCATION_FAILED;
+    }
+    vars[0] = var;
+    for (size_t i = 0; i < param_count; i++) {
+        vars[i + 1] = params[i];
+    }
+
+    Tree_t* df = OptimizedDiff(f, var);
+    Tree_t* d2f = (df != NULL && method == SOLVE_HALLEY) ? OptimizedDiff(df->root, var) : NULL;
+
+    SolveErr_t err = SOLVE_ALLOCATION_FAILED;
+    if (df != NULL && (method != SOLVE_HALLEY || d2f != NULL)) {
+        err = CompileTape(&solver->f, f, vars, param_count + 1);
+    }
+    if (err == SOLVE_OK) {
+        err = CompileTape(&solver->df, df->root, vars, param_count + 1);
+    }
+    if (err == SOLVE_OK && method == SOLVE_HALLEY) {
+        err = CompileTape(&solver->d2f, d2f->root, vars, param_count + 1);
+    }
+
+    if (df != NULL)  TreeDestroy(&df);
+    if (d2f != NULL) TreeDestroy(&d2f);
+    FREE(vars);
+
+    if (err != SOLVE_OK) {
+        SolverDestroy(solver);
+        return err;
+    }
+
+    solver->slot_count = SlotCount(solver);
+
+    return SOLVE_OK;
+}
+
+SolveErr_t SolverLower(Solver_t* solver, const LowerCosts_t* costs, LowerStats_t* stats) {
+    assert( solver != NULL );
+    assert( costs != NULL );
+    assert( stats != NULL );
+
+    SolveErr_t err = LowerTape(&solver->f, costs, stats);
+    if (err == SOLVE_OK) {
+        err = LowerTape(&solver->df, costs, stats);
+    }
+    if (err == SOLVE_OK && solver->method == SOLVE_HALLEY) {
+        err = LowerTape(&solver->d2f, costs, stats);
+    }
+
+    solver->slot_count = SlotCount(solver);
+
+    return err;
+}
+
+SolveErr_t SolverDestroy(Solver_t* solver) {
+    assert( solver != NULL );
+
+    if (solver->f.code != NULL)   EvalTapeDestroy(&solver->f);
+    if (solver->df.code != NULL)  EvalTapeDestroy(&solver->df);
+    if (solver->d2f.code != NULL) EvalTapeDestroy(&solver->d2f);
+    solver->slot_count = 0;
+
+    return SOLVE_OK;
+}
+
+static Tree_t* OptimizedDiff(const Node_t* node, const char* var) {
+    Tree_t* tree = NULL;
+    if (TreeInit(&tree) != TREE_OK) {
+        return NULL;
+    }
+
+    tree->root = TreeDiff(node, var);
+    if (tree->root == NULL) {
+        TreeDestroy(&tree);
+        return NULL;
+    }
+    tree->root->parent = NULL;
+    TreeOptimization(tree, tree->root);
+
+    return tree;
+}
+
+static SolveErr_t CompileTape(EvalTape_t* tape, const Node_t* node, const char* const* vars, size_t var_count) {
+    switch (EvalTapeBuild(tape, node, vars, var_count)) {
+    case EVAL_OK:
+        return SOLVE_OK;
+    case EVAL_UNBOUND_VARIABLE:
+        return SOLVE_UNBOUND_VARIABLE;
+    case EVAL_UNDEFINED_NODE:
+        return SOLVE_UNDEFINED_NODE;
+    case EVAL_ALLOCATION_FAILED:
+    default:
+        return SOLVE_ALLOCATION_FAILED;
+    }
+}
+
+// The tape is left as it was if lowering fails
+static SolveErr_t LowerTape(EvalTape_t* tape, const LowerCosts_t* costs, LowerStats_t* stats) {
+    EvalTape_t lowered = {};
+    if (EvalTapeLower(tape, &lowered, costs, stats) != EVAL_OK) {
+        return SOLVE_ALLOCATION_FAILED;
+    }
+
+    EvalTapeDestroy(tape);
+    *tape = lowered;
+
+    return SOLVE_OK;
+}
+
+static size_t SlotCount(const Solver_t* solver) {
+    size_t count = solver->f.size;
+    if (solver->df.size > count)  count = solver->df.size;
+    if (solver->d2f.size > count) count = solver->d2f.size;
+
+    return count;
+}
+
+SolveErr_t SolveBatch(const Solver_t* solver, const SolveConfig_t* config, const SolveProblem_t* problems,
+                      size_t count, SolveResult_t* results, SolveStats_t* stats) {
+    assert( solver != NULL );
+    assert( config != NULL );
+    assert( problems != NULL || count == 0 );
+    assert( results != NULL || count == 0 );
+    assert( stats != NULL );
+
+    memset(stats, 0, sizeof(*stats));
+
+    size_t threads = config->threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (size_t)cpus : 1;
+    }
+    if (threads > count) {
+        threads = (count != 0) ? count : 1;
+    }
+
+    SolveWorker_t* workers = (SolveWorker_t*)calloc(threads, sizeof(SolveWorker_t));
+    if (workers == NULL) {
+        return SOLVE_ALLOCATION_FAILED;
+    }
+
+    struct timespec start = {}, end = {};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    SolveErr_t err = SOLVE_OK;
+    for (size_t i = 0; i < threads; i++) {
+        workers[i].solver   = solver;
+        workers[i].config   = config;
+        workers[i].problems = problems;
+        workers[i].results  = results;
+        workers[i].count    = count;
+        workers[i].index    = i;
+        workers[i].stride   = threads;
+        workers[i].slots    = (double*)calloc(solver->slot_count + 1, sizeof(double));
+        workers[i].values   = (double*)calloc(solver->param_count + 1, sizeof(double));
+
+        if (workers[i].slots == NULL || workers[i].values == NULL) {
+            err = SOLVE_ALLOCATION_FAILED;
+        }
+    }
+
+    // the calling thread takes the first share
+    size_t started = 1;
+    for (; err == SOLVE_OK && started < threads; started++) {
+        if (pthread_create(&workers[started].thread, NULL, SolveWorker, &workers[started]) != 0) {
+            err = SOLVE_THREAD_FAILED;
+            break;
+        }
+    }
+    if (err == SOLVE_OK) {
+        SolveWorker(&workers[0]);
+    }
+
+    for (size_t i = 0; i < threads; i++) {
+        if (i != 0 && i < started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+
+        const SolveStats_t* part = &workers[i].stats;
+        stats->problems   += part->problems;
+        stats->iterations += part->iterations;
+        stats->bisections += part->bisections;
+        for (size_t k = 0; k < SOLVE_STATUS_COUNT; k++) {
+            stats->status[k] += part->status[k];
+        }
+        if (part->max_iterations > stats->max_iterations) {
+            stats->max_iterations = part->max_iterations;
+        }
+
+        FREE(workers[i].slots);
+        FREE(workers[i].values);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+    stats->threads = (err == SOLVE_OK) ? started : 0;
+
+    FREE(workers);
+
+    return err;
+}
+
+static void* SolveWorker(void* arg) {
+    SolveWorker_t* worker = (SolveWorker_t*)arg;
+
+    for (size_t i = worker->index; i < worker->count; i += worker->stride) {
+        SolveOne(worker, &worker->problems[i], &worker->results[i]);
+
+        const SolveResult_t* result = &worker->results[i];
+        ++worker->stats.problems;
+        ++worker->stats.status[result->status];
+        worker->stats.iterations += result->iterations;
+        if (result->iterations > worker->stats.max_iterations) {
+            worker->stats.max_iterations = result->iterations;
+        }
+    }
+
+    return NULL;
+}
+
+static double Eval(SolveWorker_t* worker, const EvalTape_t* tape, double x) {
+    worker->values[0] = x;
+    return EvalTapeRun(tape, worker->values, worker->slots);
+}
+
+// Newton or Halley step; with a bracket, steps that leave it or are not
+// finite fall back to bisection and the bracket shrinks around the root
+static void SolveOne(SolveWorker_t* worker, const SolveProblem_t* problem, SolveResult_t* result) {
+    const Solver_t* solver = worker->solver;
+    const SolveConfig_t* config = worker->config;
+
+    for (size_t k = 0; k < solver->param_count; k++) {
+        worker->values[k + 1] = problem->params[k];
+    }
+
+    double lo = problem->lo, hi = problem->hi;
+    double f_lo = 0;
+    int bracket = lo < hi && isfinite(lo) && isfinite(hi);
+    if (bracket) {
+        f_lo = Eval(worker, &solver->f, lo);
+        double f_hi = Eval(worker, &solver->f, hi);
+        bracket = isfinite(f_lo) && isfinite(f_hi) && (f_lo < 0) != (f_hi < 0);
+    }
+
+    double x = problem->x0;
+    if (bracket && !(lo <= x && x <= hi)) {
+        x = 0.5 * (lo + hi);
+    }
+
+    result->status = SOLVE_MAX_ITERATIONS;
+    result->iterations = 0;
+
+    while (result->iterations < config->max_iterations) {
+        ++result->iterations;
+
+        double fx = Eval(worker, &solver->f, x);
+        if (fx == 0) {
+            result->status = SOLVE_CONVERGED;
+            break;
+        }
+
+        double step = NAN;
+        if (isfinite(fx)) {
+            double dfx = Eval(worker, &solver->df, x);
+            if (dfx == 0 && !bracket) {
+                result->status = SOLVE_STALLED;
+                break;
+            }
+
+            // a zero denominator leaves the step NAN, which the bracket bisects
+            if (dfx != 0) {
+                step = fx / dfx;
+
+                double denominator = 0;
+                if (solver->method == SOLVE_HALLEY) {
+                    double d2fx = Eval(worker, &solver->d2f, x);
+                    denominator = dfx * dfx - 0.5 * fx * d2fx;
+                }
+                if (denominator != 0) {
+                    double halley = fx * dfx / denominator;
+                    if (isfinite(halley)) {
+                        step = halley;
+                    }
+                }
+            }
+        } else if (!bracket) {
+            result->status = SOLVE_DIVERGED;
+            break;
+        }
+
+        double next = x - step;
+
+        if (bracket) {
+            if (isfinite(fx)) {
+                if ((fx < 0) == (f_lo < 0)) {
+                    lo = x;
+                    f_lo = fx;
+                } else {
+                    hi = x;
+                }
+            }
+
+            if (!(lo < next && next < hi)) {
+                next = 0.5 * (lo + hi);
+                ++worker->stats.bisections;
+            }
+        } else if (!isfinite(next)) {
+            result->status = isfinite(step) ? SOLVE_DIVERGED : SOLVE_STALLED;
+            break;
+        }
+
+        double scale = config->tolerance * fmax(1, fabs(next));
+        int done = fabs(next - x) <= scale || (bracket && hi - lo <= scale);
+
+        x = next;
+        if (done) {
+            result->status = SOLVE_CONVERGED;
+            break;
+        }
+    }
+
+    result->root = x;
+    result->residual = Eval(worker, &solver->f, x);
+}
+
+void SolveStatsPrint(const SolveStats_t* stats, FILE* fp) {
+    assert( stats != NULL );
+    assert( fp != NULL );
+
+    double seconds = (stats->seconds > 0) ? stats->seconds : 1e-9;
+    double problems = (stats->problems != 0) ? (double)stats->problems : 1;
+
+    fprintf(fp, "solve: %zu problems, %zu converged, %zu max iterations, %zu diverged, %zu stalled\n",
+            stats->problems, stats->status[SOLVE_CONVERGED], stats->status[SOLVE_MAX_ITERATIONS],
+            stats->status[SOLVE_DIVERGED], stats->status[SOLVE_STALLED]);
+    fprintf(fp, "solve: %.2lf iterations on average, %zu at most, %zu bisections\n",
+            (double)stats->iterations / problems, stats->max_iterations, stats->bisections);
+    fprintf(fp, "solve: %.3lf s on %zu threads, %.0lf problems/s\n",
+            stats->seconds, stats->threads, (double)stats->problems / seconds);
+}
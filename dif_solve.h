@@ -0,0 +1,86 @@
+#ifndef DIF_SOLVE_H
+#define DIF_SOLVE_H
+
+#include <stdio.h>
+
+#include "tree.h"
+#include "dif_eval.h"
+#include "dif_lower.h"
+
+enum SolveErr_t {
+    SOLVE_OK,
+    SOLVE_UNBOUND_VARIABLE,
+    SOLVE_UNDEFINED_NODE,
+    SOLVE_ALLOCATION_FAILED,
+    SOLVE_THREAD_FAILED
+};
+
+enum SolveMethod_t {
+    SOLVE_NEWTON,
+    SOLVE_HALLEY
+};
+
+enum SolveStatus_t {
+    SOLVE_CONVERGED,
+    SOLVE_MAX_ITERATIONS,
+    SOLVE_DIVERGED,             // f is not finite and there is no bracket to fall back to
+    SOLVE_STALLED,              // zero derivative and no bracket
+    SOLVE_STATUS_COUNT
+};
+
+struct SolveConfig_t {
+    size_t threads;             // 0 - all cores
+    size_t max_iterations;
+    double tolerance;           // on the step, relative to max(1, |x|)
+};
+
+// lo < hi with a sign change of f is a bracket: steps leaving it are
+// replaced by bisection. Anything else - unbracketed Newton from x0.
+struct SolveProblem_t {
+    double x0;
+    double lo;
+    double hi;
+    const double* params;       // param_count values, NULL if there are none
+};
+
+struct SolveResult_t {
+    double root;
+    double residual;
+    size_t iterations;
+    SolveStatus_t status;
+};
+
+struct SolveStats_t {
+    size_t problems;
+    size_t status[SOLVE_STATUS_COUNT];
+    size_t iterations;
+    size_t max_iterations;
+    size_t bisections;
+    size_t threads;
+    double seconds;
+};
+
+// f, f' and, for Halley, f'' compiled to tapes. Tape variables are the
+// unknown followed by the parameters.
+struct Solver_t {
+    SolveMethod_t method;
+    EvalTape_t f;
+    EvalTape_t df;
+    EvalTape_t d2f;
+    size_t param_count;
+    size_t slot_count;
+};
+
+void SolveConfigInit(SolveConfig_t* config);
+
+SolveErr_t SolverInit(Solver_t* solver, const Node_t* f, const char* var,
+                      const char* const* params, size_t param_count, SolveMethod_t method);
+SolveErr_t SolverDestroy(Solver_t* solver);
+// Replaces the tapes by their EvalTapeLower versions, stats add up over all of them
+SolveErr_t SolverLower(Solver_t* solver, const LowerCosts_t* costs, LowerStats_t* stats);
+
+SolveErr_t SolveBatch(const Solver_t* solver, const SolveConfig_t* config, const SolveProblem_t* problems,
+                      size_t count, SolveResult_t* results, SolveStats_t* stats);
+void SolveStatsPrint(const SolveStats_t* stats, FILE* fp);
+
+#endif // DIF_SOLVE_H
@@ -0,0 +1,842 @@
+#include "dif_verify.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "dif_math.h"
+#include "dif_optimize.h"
+#include "dif_eval.h"
+#include "dif_incremental.h"
+#include "dif_interval.h"
+#include "dif_jacobian.h"
+
+// 8th order central difference, h ~ eps^(1/9) balances truncation and rounding
+const double VERIFY_STEP        = 1e-2;
+const double VERIFY_CONSISTENCY = 1e-9;     // quotients with h and h/2 must agree this well
+const size_t VERIFY_SHRINK_POINTS = 64;
+const size_t VERIFY_BOXES         = 16;     // [x_min, x_max] is split into this many interval boxes
+const double VERIFY_SMALL_COEFFICIENT = 1e-8;   // below the optimizer's tolerance, must not fold to 0
+
+static const double stencil[] = {4.0 / 5, -1.0 / 5, 4.0 / 105, -1.0 / 280};
+
+static const char* const verify_vars[] = {"x", "y"};
+
+// Compiled expression with its raw and optimized derivatives by x; y is a
+// parameter that must be treated as a constant.
+struct VerifySubject_t {
+    EvalTape_t f;
+    EvalTape_t d;
+    EvalTape_t d_opt;
+    double* slots;
+};
+
+struct VerifyWorker_t {
+    const VerifyConfig_t* config;
+    size_t index;
+    size_t stride;
+    pthread_t thread;
+    size_t expressions;
+    size_t points;
+    size_t skipped;
+    size_t failures;
+    size_t edits;
+    size_t edit_failures;
+    size_t boxes;
+    size_t box_failures;
+    size_t jacobians;
+    size_t jacobian_failures;
+    size_t worst_count;
+    VerifyCase_t worst[VERIFY_MAX_WORST];
+};
+
+struct VerifyResult_t {
+    double error;
+    double x;
+    int optimized;
+    size_t checked;
+    size_t skipped;
+};
+
+static uint64_t RngNext(uint64_t* state);
+static double RngUniform(uint64_t* state);
+static size_t RngBelow(uint64_t* state, size_t n);
+static Node_t* GenerateExpression(uint64_t* rng, size_t depth);
+static int SubjectInit(VerifySubject_t* subject, const Node_t* f);
+static void SubjectDestroy(VerifySubject_t* subject);
+static int Quotient(VerifySubject_t* subject, double x, double y, double h, double* result, double* magnitude);
+static double SlotsMagnitude(const double* slots, size_t size);
+static VerifyResult_t CheckPoints(VerifySubject_t* subject, double y, const double* xs, size_t count);
+static VerifyResult_t CheckExpression(const Node_t* f, double y, const double* xs, size_t count);
+static int CheckIncremental(const Node_t* f, int small, uint64_t* rng, size_t depth,
+                            double y, const double* xs, size_t count, double tolerance);
+static size_t CheckEnclosure(const Node_t* f, double y, const double* xs, size_t count, double x_min, double x_max);
+static int CheckJacobian(const Node_t* f, uint64_t* rng, size_t depth, double y, const double* xs, size_t count,
+                         double tolerance);
+static double JacobianEntry(const Jacobian_t* jac, size_t row, size_t col);
+static double MaxDifference(const Node_t* a, const Node_t* b, double y, const double* xs, size_t count, double scale);
+static Node_t* Shrink(Node_t* f, double y, const double* xs, size_t count, double tolerance);
+static Node_t* CopyReplacing(const Node_t* node, size_t* index, size_t target, int kind, Node_t* parent);
+static Node_t* NodeAt(Node_t* node, size_t* index, size_t target);
+static char* TreeString(Node_t* node);
+static void* VerifyWorker(void* arg);
+static void RunExpression(VerifyWorker_t* worker, size_t expression);
+static void WorstInsert(VerifyCase_t* worst, size_t* count, size_t limit, VerifyCase_t* item);
+
+void VerifyConfigInit(VerifyConfig_t* config) {
+    assert( config != NULL );
+
+    config->expressions = 1000;
+    config->points      = 2000;
+    config->depth       = 5;
+    config->threads     = 0;
+    config->worst       = 5;
+    config->seed        = 1;
+    config->tolerance   = 1e-6;
+    config->x_min       = -3;
+    config->x_max       = 3;
+}
+
+VerifyErr_t VerifyDerivatives(const VerifyConfig_t* config, VerifyReport_t* report) {
+    assert( config != NULL );
+    assert( report != NULL );
+
+    memset(report, 0, sizeof(*report));
+
+    size_t threads = config->threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (size_t)cpus : 1;
+    }
+
+    VerifyWorker_t* workers = (VerifyWorker_t*)calloc(threads, sizeof(VerifyWorker_t));
+    if (workers == NULL) {
+        return VERIFY_ALLOCATION_FAILED;
+    }
+
+    struct timespec start = {}, end = {};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    VerifyErr_t err = VERIFY_OK;
+    size_t started = 0;
+    for (; started < threads; started++) {
+        workers[started].config = config;
+        workers[started].index  = started;
+        workers[started].stride = threads;
+
+        if (pthread_create(&workers[started].thread, NULL, VerifyWorker, &workers[started]) != 0) {
+            err = VERIFY_THREAD_FAILED;
+            break;
+        }
+    }
+
+    size_t limit = (config->worst < VERIFY_MAX_WORST) ? config->worst : VERIFY_MAX_WORST;
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        report->expressions   += workers[i].expressions;
+        report->points        += workers[i].points;
+        report->skipped       += workers[i].skipped;
+        report->failures      += workers[i].failures;
+        report->edits         += workers[i].edits;
+        report->edit_failures += workers[i].edit_failures;
+        report->boxes         += workers[i].boxes;
+        report->box_failures  += workers[i].box_failures;
+        report->jacobians         += workers[i].jacobians;
+        report->jacobian_failures += workers[i].jacobian_failures;
+
+        for (size_t j = 0; j < workers[i].worst_count; j++) {
+            WorstInsert(report->worst, &report->worst_count, limit, &workers[i].worst[j]);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+    report->threads = started;
+
+    FREE(workers);
+
+    return err;
+}
+
+static void* VerifyWorker(void* arg) {
+    VerifyWorker_t* worker = (VerifyWorker_t*)arg;
+
+    for (size_t i = worker->index; i < worker->config->expressions; i += worker->stride) {
+        RunExpression(worker, i);
+    }
+
+    return NULL;
+}
+
+static void RunExpression(VerifyWorker_t* worker, size_t expression) {
+    const VerifyConfig_t* config = worker->config;
+
+    uint64_t rng = config->seed + expression * 0x9E3779B97F4A7C15ull;     // reproducible for any thread count
+    Node_t* f = GenerateExpression(&rng, config->depth);
+    double y = 0.5 + 1.5 * RngUniform(&rng);
+
+    double* xs = (double*)calloc(config->points, sizeof(double));
+    if (f == NULL || xs == NULL) {
+        TreeDestroySubtree(&f);
+        FREE(xs);
+        return;
+    }
+    for (size_t i = 0; i < config->points; i++) {
+        xs[i] = config->x_min + (config->x_max - config->x_min) * RngUniform(&rng);
+    }
+
+    VerifyResult_t result = CheckExpression(f, y, xs, config->points);
+
+    ++worker->expressions;
+    worker->points  += result.checked;
+    worker->skipped += result.skipped;
+
+    size_t limit = (config->worst < VERIFY_MAX_WORST) ? config->worst : VERIFY_MAX_WORST;
+    int failed = result.error > config->tolerance;
+    int worst = result.checked != 0 && (worker->worst_count < limit || result.error > worker->worst[limit - 1].error);
+
+    if (failed) {
+        ++worker->failures;
+    }
+
+    for (int small = 0; small < 2; small++) {
+        int edited = CheckIncremental(f, small, &rng, config->depth, y, xs, config->points, config->tolerance);
+        worker->edits += (edited >= 0) ? 1u : 0u;
+        worker->edit_failures += (edited > 0) ? 1u : 0u;
+    }
+
+    worker->boxes += VERIFY_BOXES;
+    worker->box_failures += CheckEnclosure(f, y, xs, config->points, config->x_min, config->x_max);
+
+    int jacobian = CheckJacobian(f, &rng, config->depth, y, xs, config->points, config->tolerance);
+    worker->jacobians += (jacobian >= 0) ? 1u : 0u;
+    worker->jacobian_failures += (jacobian > 0) ? 1u : 0u;
+
+    if (worst) {
+        VerifyCase_t item = {result.error, result.x, y, result.optimized, TreeString(f), NULL};
+
+        if (failed) {
+            // shrink against the failing point and a prefix of the samples
+            size_t count = (config->points < VERIFY_SHRINK_POINTS) ? config->points : VERIFY_SHRINK_POINTS;
+            xs[0] = result.x;
+
+            Node_t* minimal = Shrink(f, y, xs, count, config->tolerance);
+            item.minimal = TreeString(minimal);
+            TreeDestroySubtree(&minimal);
+        }
+
+        WorstInsert(worker->worst, &worker->worst_count, limit, &item);
+    }
+
+    TreeDestroySubtree(&f);
+    FREE(xs);
+}
+
+static void WorstInsert(VerifyCase_t* worst, size_t* count, size_t limit, VerifyCase_t* item) {
+    size_t pos = *count;
+    for (; pos > 0 && worst[pos - 1].error < item->error; pos--);
+
+    if (pos >= limit) {
+        FREE(item->expression);
+        FREE(item->minimal);
+        return;
+    }
+
+    if (*count == limit) {
+        FREE(worst[limit - 1].expression);
+        FREE(worst[limit - 1].minimal);
+        --*count;
+    }
+
+    memmove(&worst[pos + 1], &worst[pos], (*count - pos) * sizeof(VerifyCase_t));
+    worst[pos] = *item;
+    ++*count;
+}
+
+static VerifyResult_t CheckExpression(const Node_t* f, double y, const double* xs, size_t count) {
+    VerifyResult_t result = {};
+
+    VerifySubject_t subject = {};
+    if (!SubjectInit(&subject, f)) {
+        result.skipped = count;
+        return result;
+    }
+
+    result = CheckPoints(&subject, y, xs, count);
+
+    SubjectDestroy(&subject);
+
+    return result;
+}
+
+static int SubjectInit(VerifySubject_t* subject, const Node_t* f) {
+    Tree_t* deriv = NULL;
+    if (TreeInit(&deriv) != TREE_OK) {
+        return 0;
+    }
+
+    Node_t* d = TreeDiff(f, "x");
+    if (d == NULL) {
+        TreeDestroy(&deriv);
+        return 0;
+    }
+    deriv->root = TreeCopySubtree(d, NULL);
+    TreeOptimization(deriv, deriv->root);
+
+    int ok = EvalTapeBuild(&subject->f, f, verify_vars, 2) == EVAL_OK;
+    ok = ok && EvalTapeBuild(&subject->d, d, verify_vars, 2) == EVAL_OK;
+    ok = ok && EvalTapeBuild(&subject->d_opt, deriv->root, verify_vars, 2) == EVAL_OK;
+
+    TreeDestroySubtree(&d);
+    TreeDestroy(&deriv);
+
+    if (ok) {
+        size_t size = subject->f.size;
+        if (subject->d.size > size)     size = subject->d.size;
+        if (subject->d_opt.size > size) size = subject->d_opt.size;
+
+        subject->slots = (double*)calloc(size, sizeof(double));
+        ok = subject->slots != NULL;
+    }
+
+    if (!ok) {
+        SubjectDestroy(subject);
+    }
+
+    return ok;
+}
+
+static void SubjectDestroy(VerifySubject_t* subject) {
+    if (subject->f.code != NULL)     EvalTapeDestroy(&subject->f);
+    if (subject->d.code != NULL)     EvalTapeDestroy(&subject->d);
+    if (subject->d_opt.code != NULL) EvalTapeDestroy(&subject->d_opt);
+    FREE(subject->slots);
+}
+
+static int Quotient(VerifySubject_t* subject, double x, double y, double h, double* result, double* magnitude) {
+    double sum = 0;
+
+    for (size_t k = 1; k <= sizeof(stencil) / sizeof(stencil[0]); k++) {
+        double plus[]  = {x + (double)k * h, y};
+        double minus[] = {x - (double)k * h, y};
+
+        double fp = EvalTapeRun(&subject->f, plus,  subject->slots);
+        double fm = EvalTapeRun(&subject->f, minus, subject->slots);
+        if (!isfinite(fp) || !isfinite(fm)) {
+            return 0;
+        }
+
+        sum += stencil[k - 1] * (fp - fm);
+        *magnitude = fmax(*magnitude, fmax(fabs(fp), fabs(fm)));
+    }
+
+    *result = sum / h;
+
+    return 1;
+}
+
+// Largest subexpression magnitude, infinity if some subexpression is outside its domain
+static double SlotsMagnitude(const double* slots, size_t size) {
+    double magnitude = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (!isfinite(slots[i])) {
+            return INFINITY;
+        }
+        magnitude = fmax(magnitude, fabs(slots[i]));
+    }
+
+    return magnitude;
+}
+
+// A point counts only where every subexpression of f is finite, small enough
+// for x + h to be resolved, and the difference quotient is stable; the error is relative to max(1, |f'|).
+// Non-finite derivatives (inf * 0 from a singular inner derivative) are not
+// checked.
+static VerifyResult_t CheckPoints(VerifySubject_t* subject, double y, const double* xs, size_t count) {
+    VerifyResult_t result = {};
+
+    for (size_t i = 0; i < count; i++) {
+        double x = xs[i];
+        double h = VERIFY_STEP * fmax(1, fabs(x));
+
+        double point[] = {x, y};
+        EvalTapeRun(&subject->f, point, subject->slots);
+
+        double magnitude = SlotsMagnitude(subject->slots, subject->f.size);
+        if (!isfinite(magnitude)) {
+            ++result.skipped;               // some subexpression is outside its domain
+            continue;
+        }
+
+        double fd = 0, fd_half = 0;
+        if (!Quotient(subject, x, y, h, &fd, &magnitude) || !Quotient(subject, x, y, h / 2, &fd_half, &magnitude)) {
+            ++result.skipped;
+            continue;
+        }
+
+        double scale = fmax(1, fabs(fd_half));
+        if (fabs(fd - fd_half) > VERIFY_CONSISTENCY * scale
+            || DBL_EPSILON * magnitude / h > VERIFY_CONSISTENCY * scale) {     // rounding swamps the quotient
+            ++result.skipped;
+            continue;
+        }
+
+        double d     = EvalTapeRun(&subject->d,     point, subject->slots);
+        double d_opt = EvalTapeRun(&subject->d_opt, point, subject->slots);
+        if (!isfinite(d) && !isfinite(d_opt)) {
+            ++result.skipped;               // singular derivative of an inner function
+            continue;
+        }
+
+        double error     = isfinite(d)     ? fabs(d     - fd_half) / scale : 0;
+        double error_opt = isfinite(d_opt) ? fabs(d_opt - fd_half) / scale : 0;
+
+        ++result.checked;
+        if (fmax(error, error_opt) > result.error || result.checked == 1) {
+            result.error     = fmax(error, error_opt);
+            result.x         = x;
+            result.optimized = error_opt > error;
+        }
+    }
+
+    return result;
+}
+
+// IncDiff of f after one of its subtrees is replaced by a new expression
+// must agree with TreeDiff of the edited tree where both are finite. A small
+// f is VERIFY_SMALL_COEFFICIENT * f, its error is relative to
+// max(VERIFY_SMALL_COEFFICIENT, |TreeDiff|), so a coefficient folded to 0 fails.
+// 1 - they disagree, 0 - they agree, -1 - nothing was checked.
+static int CheckIncremental(const Node_t* f, int small, uint64_t* rng, size_t depth,
+                            double y, const double* xs, size_t count, double tolerance) {
+    Tree_t* tree = NULL;
+    if (TreeInit(&tree) != TREE_OK) {
+        return -1;
+    }
+
+    Node_t* copy = TreeCopySubtree(f, NULL);
+    tree->root = copy;
+    if (copy != NULL && small) {
+        Node_t* coefficient = NodeInit(NULL, NULL, NULL, TYPE_NUMBER, VERIFY_SMALL_COEFFICIENT);
+        tree->root = (coefficient != NULL) ? NodeInit(NULL, coefficient, copy, TYPE_OPERATION, OPERATION_MUL) : NULL;
+        if (tree->root == NULL) {
+            TreeDestroySubtree(&coefficient);
+            TreeDestroySubtree(&copy);
+        }
+    }
+
+    IncDiff_t inc = {};
+    if (tree->root == NULL || IncDiffInit(&inc, tree, "x") != TREE_OK) {
+        TreeDestroy(&tree);
+        return -1;
+    }
+
+    size_t index = 0;
+    Node_t* target = NodeAt(copy, &index, RngBelow(rng, TreeSubtreeSize(copy)));
+    Node_t* subtree = GenerateExpression(rng, (depth + 1) / 2);
+
+    int result = -1;
+    if (subtree != NULL && IncDiffReplace(&inc, target, subtree) == TREE_OK) {
+        Node_t* incremental = IncDiffResult(&inc);
+        Node_t* fresh = TreeDiff(tree->root, "x");
+
+        if (incremental != NULL && fresh != NULL) {
+            double scale = small ? VERIFY_SMALL_COEFFICIENT : 1;
+            result = MaxDifference(incremental, fresh, y, xs, count, scale) > tolerance;
+        }
+
+        TreeDestroySubtree(&incremental);
+        TreeDestroySubtree(&fresh);
+    } else {
+        TreeDestroySubtree(&subtree);
+    }
+
+    IncDiffDestroy(&inc);
+    TreeDestroy(&tree);
+
+    return result;
+}
+
+// [x_min, x_max] x {y} is split into VERIFY_BOXES boxes. The interval of f
+// over a box must contain the value of f at every sample inside it where all
+// subexpressions are finite, and
+// IntervalEvalBatch must give the same interval as TreeEvalInterval.
+// Returns the number of boxes that fail.
+static size_t CheckEnclosure(const Node_t* f, double y, const double* xs, size_t count, double x_min, double x_max) {
+    EvalTape_t tape = {};
+    if (EvalTapeBuild(&tape, f, verify_vars, 2) != EVAL_OK) {
+        return 0;
+    }
+
+    Interval_t boxes[VERIFY_BOXES * 2] = {};
+    Interval_t batch[VERIFY_BOXES] = {};
+    unsigned domains[VERIFY_BOXES] = {};
+    int failed[VERIFY_BOXES] = {};
+
+    for (size_t i = 0; i < VERIFY_BOXES; i++) {
+        boxes[2 * i].lo = x_min + (x_max - x_min) * (double)i / (double)VERIFY_BOXES;
+        boxes[2 * i].hi = (i + 1 < VERIFY_BOXES) ? x_min + (x_max - x_min) * (double)(i + 1) / (double)VERIFY_BOXES
+                                                 : x_max;
+        boxes[2 * i + 1] = IntervalPoint(y);
+    }
+
+    double* slots = (double*)calloc(tape.size, sizeof(double));
+    if (slots == NULL || IntervalEvalBatch(&tape, boxes, VERIFY_BOXES, batch, domains) != EVAL_OK) {
+        FREE(slots);
+        EvalTapeDestroy(&tape);
+        return 0;
+    }
+
+    for (size_t i = 0; i < VERIFY_BOXES; i++) {
+        IntervalVar_t vars[] = {{verify_vars[0], boxes[2 * i]}, {verify_vars[1], boxes[2 * i + 1]}};
+        Interval_t single = IntervalEmpty();
+        unsigned domain = 0;
+
+        if (TreeEvalInterval(f, vars, 2, &single, &domain) != EVAL_OK) {
+            continue;
+        }
+
+        int same = (IntervalIsEmpty(single) && IntervalIsEmpty(batch[i]))
+                   || memcmp(&single, &batch[i], sizeof(single)) == 0;
+        failed[i] = !same || domain != domains[i];
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t box = 0;
+        while (box + 1 < VERIFY_BOXES && xs[i] > boxes[2 * box].hi) {
+            box++;
+        }
+
+        double point[] = {xs[i], y};
+        double value = EvalTapeRun(&tape, point, slots);
+        if (!isfinite(SlotsMagnitude(slots, tape.size))) {
+            continue;                       // pow(NaN, 0) is 1 outside the domain
+        }
+        if (IntervalIsEmpty(batch[box]) || value < batch[box].lo || value > batch[box].hi) {
+            failed[box] = 1;
+        }
+    }
+
+    size_t failures = 0;
+    for (size_t i = 0; i < VERIFY_BOXES; i++) {
+        failures += (size_t)failed[i];
+    }
+
+    FREE(slots);
+    EvalTapeDestroy(&tape);
+
+    return failures;
+}
+
+// The Jacobian of {f, g} by {x, y}, g a new expression, in forward and in
+// reverse mode must agree with TreeDiff by each variable, and its residuals
+// with f and g, where both are finite.
+// 1 - they disagree, 0 - they agree, -1 - nothing was checked.
+static int CheckJacobian(const Node_t* f, uint64_t* rng, size_t depth, double y, const double* xs, size_t count,
+                         double tolerance) {
+    const size_t rows = 2, cols = sizeof(verify_vars) / sizeof(verify_vars[0]);
+
+    Node_t* g = GenerateExpression(rng, (depth + 1) / 2);
+    const Node_t* exprs[] = {f, g};
+
+    Node_t* derivs[rows * cols] = {};
+    EvalTape_t tapes[rows * cols + rows] = {};      // derivatives row by row, then the expressions
+    Jacobian_t forward = {}, reverse = {};
+    double* slots = NULL;
+
+    int ok = g != NULL;
+    for (size_t i = 0; ok && i < rows * cols; i++) {
+        derivs[i] = TreeDiff(exprs[i / cols], verify_vars[i % cols]);
+        ok = derivs[i] != NULL && EvalTapeBuild(&tapes[i], derivs[i], verify_vars, cols) == EVAL_OK;
+    }
+    for (size_t i = 0; ok && i < rows; i++) {
+        ok = EvalTapeBuild(&tapes[rows * cols + i], exprs[i], verify_vars, cols) == EVAL_OK;
+    }
+
+    int forward_ok = ok && JacobianInit(&forward, exprs, rows, verify_vars, cols, JACOBIAN_FORWARD) == JACOBIAN_OK;
+    int reverse_ok = ok && JacobianInit(&reverse, exprs, rows, verify_vars, cols, JACOBIAN_REVERSE) == JACOBIAN_OK;
+
+    if (forward_ok && reverse_ok) {
+        size_t size = 0;
+        for (size_t i = 0; i < rows * cols + rows; i++) {
+            size = (tapes[i].size > size) ? tapes[i].size : size;
+        }
+        slots = (double*)calloc(size, sizeof(double));
+    }
+
+    double max = 0;
+    for (size_t i = 0; slots != NULL && i < count; i++) {
+        double point[] = {xs[i], y};
+        double residuals[2][rows] = {};
+
+        JacobianEval(&forward, point, residuals[0]);
+        JacobianEval(&reverse, point, residuals[1]);
+
+        for (size_t entry = 0; entry < rows * cols + rows; entry++) {
+            double expected = EvalTapeRun(&tapes[entry], point, slots);
+            if (!isfinite(expected)) {
+                continue;
+            }
+
+            for (int mode = 0; mode < 2; mode++) {
+                const Jacobian_t* jac = mode ? &reverse : &forward;
+                double actual = (entry >= rows * cols) ? residuals[mode][entry - rows * cols]
+                                                       : JacobianEntry(jac, entry / cols, entry % cols);
+                if (isfinite(actual)) {
+                    max = fmax(max, fabs(actual - expected) / fmax(1, fabs(expected)));
+                }
+            }
+        }
+    }
+
+    int result = (slots != NULL) ? max > tolerance : -1;
+
+    FREE(slots);
+    if (forward_ok) JacobianDestroy(&forward);
+    if (reverse_ok) JacobianDestroy(&reverse);
+    for (size_t i = 0; i < rows * cols + rows; i++) {
+        if (tapes[i].code != NULL) EvalTapeDestroy(&tapes[i]);
+    }
+    for (size_t i = 0; i < rows * cols; i++) {
+        TreeDestroySubtree(&derivs[i]);
+    }
+    TreeDestroySubtree(&g);
+
+    return result;
+}
+
+// Entry (row, col) of the matrix, 0 outside its pattern
+static double JacobianEntry(const Jacobian_t* jac, size_t row, size_t col) {
+    const SparseMatrix_t* matrix = &jac->matrix;
+    for (size_t k = matrix->row_ptr[row]; k < matrix->row_ptr[row + 1]; k++) {
+        if (matrix->col_idx[k] == col) {
+            return matrix->values[k];
+        }
+    }
+
+    return 0;
+}
+
+// Relative to max(scale, |b|) over the points where both are finite
+static double MaxDifference(const Node_t* a, const Node_t* b, double y, const double* xs, size_t count, double scale) {
+    EvalTape_t tape_a = {}, tape_b = {};
+    double* slots = NULL;
+
+    double max = 0;
+    if (EvalTapeBuild(&tape_a, a, verify_vars, 2) == EVAL_OK && EvalTapeBuild(&tape_b, b, verify_vars, 2) == EVAL_OK) {
+        slots = (double*)calloc((tape_a.size > tape_b.size) ? tape_a.size : tape_b.size, sizeof(double));
+    }
+
+    for (size_t i = 0; slots != NULL && i < count; i++) {
+        double point[] = {xs[i], y};
+        double value_a = EvalTapeRun(&tape_a, point, slots);
+        double value_b = EvalTapeRun(&tape_b, point, slots);
+
+        if (isfinite(value_a) && isfinite(value_b)) {
+            max = fmax(max, fabs(value_a - value_b) / fmax(scale, fabs(value_b)));
+        }
+    }
+
+    FREE(slots);
+    if (tape_a.code != NULL) EvalTapeDestroy(&tape_a);
+    if (tape_b.code != NULL) EvalTapeDestroy(&tape_b);
+
+    return max;
+}
+
+// Greedy shrinking: replace a subtree by one of its operands, by x or by a
+// constant while the smaller expression still fails.
+static Node_t* Shrink(Node_t* f, double y, const double* xs, size_t count, double tolerance) {
+    Node_t* current = TreeCopySubtree(f, NULL);
+
+    int progress = 1;
+    while (progress && current != NULL) {
+        progress = 0;
+        size_t size = TreeSubtreeSize(current);
+
+        for (size_t target = 0; target < size && !progress; target++) {
+            for (int kind = 0; kind < 4 && !progress; kind++) {
+                size_t index = 0;
+                const Node_t* node = NodeAt(current, &index, target);
+                if ((kind == 0 && node->left == NULL) || (kind == 1 && node->right == NULL)) {
+                    continue;
+                }
+
+                index = 0;
+                Node_t* candidate = CopyReplacing(current, &index, target, kind, NULL);
+                if (candidate == NULL) {
+                    continue;
+                }
+
+                if (TreeSubtreeSize(candidate) < size
+                    && CheckExpression(candidate, y, xs, count).error > tolerance) {
+                    TreeDestroySubtree(&current);
+                    current = candidate;
+                    progress = 1;
+                } else {
+                    TreeDestroySubtree(&candidate);
+                }
+            }
+        }
+    }
+
+    return current;
+}
+
+// Copies the tree with the target-th node (preorder) replaced by its left
+// operand, right operand, x or 1 depending on kind. NULL if the node has no
+// such operand.
+static Node_t* CopyReplacing(const Node_t* node, size_t* index, size_t target, int kind, Node_t* parent) {
+    if (node == NULL) {
+        return NULL;
+    }
+
+    if ((*index)++ == target) {
+        switch (kind) {
+        case 0:  return TreeCopySubtree(node->left,  parent);
+        case 1:  return TreeCopySubtree(node->right, parent);
+        case 2:  return NodeInit(parent, NULL, NULL, TYPE_VARIABLE, "x");
+        default: return NodeInit(parent, NULL, NULL, TYPE_NUMBER, 1.0);
+        }
+    }
+
+    Node_t* copy = EmptyNodeInit;
+    NodeCopyData(copy, node);
+    copy->parent = parent;
+    copy->left   = CopyReplacing(node->left,  index, target, kind, copy);
+    copy->right  = CopyReplacing(node->right, index, target, kind, copy);
+
+    return copy;
+}
+
+static Node_t* NodeAt(Node_t* node, size_t* index, size_t target) {
+    if (node == NULL) {
+        return NULL;
+    }
+    if ((*index)++ == target) {
+        return node;
+    }
+
+    Node_t* found = NodeAt(node->left, index, target);
+
+    return (found != NULL) ? found : NodeAt(node->right, index, target);
+}
+
+static char* TreeString(Node_t* node) {
+    char* str = NULL;
+    size_t size = 0;
+
+    FILE* fp = open_memstream(&str, &size);
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    Tree_t tree = {node, 0};
+    WriteTree(&tree, fp);
+    fclose(fp);
+
+    if (size != 0 && str[size - 1] == '\n') {
+        str[size - 1] = '\0';
+    }
+
+    return str;
+}
+
+static Node_t* GenerateExpression(uint64_t* rng, size_t depth) {
+    if (depth == 0 || RngBelow(rng, 5) == 0) {
+        size_t kind = RngBelow(rng, 10);
+        if (kind < 6) return NodeInit(NULL, NULL, NULL, TYPE_VARIABLE, "x");
+        if (kind < 8) return NodeInit(NULL, NULL, NULL, TYPE_VARIABLE, "y");
+
+        return NodeInit(NULL, NULL, NULL, TYPE_NUMBER, (double)(1 + RngBelow(rng, 6)) / 2);
+    }
+
+    static const Operation_t binary[] = {OPERATION_ADD, OPERATION_SUB, OPERATION_MUL, OPERATION_DIV};
+    static const Operation_t unary[]  = {OPERATION_SQRT, OPERATION_LN, OPERATION_SIN, OPERATION_COS,
+                                         OPERATION_TAN, OPERATION_COT, OPERATION_SINH, OPERATION_COSH,
+                                         OPERATION_TANH, OPERATION_COTH, OPERATION_ASIN, OPERATION_ACOS,
+                                         OPERATION_ATAN, OPERATION_ACOT};
+
+    size_t kind = RngBelow(rng, 100);
+    if (kind < 40) {
+        return NodeInit(NULL, GenerateExpression(rng, depth - 1), GenerateExpression(rng, depth - 1),
+                        TYPE_OPERATION, binary[kind % 4]);
+    }
+    if (kind < 52) {                            // number exponent, number base or general power
+        Node_t* base = (kind % 3 == 1) ? NodeInit(NULL, NULL, NULL, TYPE_NUMBER, (double)(2 + RngBelow(rng, 3)))
+                                       : GenerateExpression(rng, depth - 1);
+        Node_t* exponent = (kind % 3 == 0) ? NodeInit(NULL, NULL, NULL, TYPE_NUMBER, (double)RngBelow(rng, 7) - 3)
+                                           : GenerateExpression(rng, depth - 1);
+        return NodeInit(NULL, base, exponent, TYPE_OPERATION, OPERATION_EXP);
+    }
+    if (kind < 58) {                            // constant or variable base
+        Node_t* base = (kind % 2) ? NodeInit(NULL, NULL, NULL, TYPE_NUMBER, (double)(2 + RngBelow(rng, 3)))
+                                  : GenerateExpression(rng, depth - 1);
+        return NodeInit(NULL, base, GenerateExpression(rng, depth - 1), TYPE_OPERATION, OPERATION_LOG);
+    }
+
+    return NodeInit(NULL, NULL, GenerateExpression(rng, depth - 1), TYPE_OPERATION,
+                    unary[RngBelow(rng, sizeof(unary) / sizeof(unary[0]))]);
+}
+
+static uint64_t RngNext(uint64_t* state) {     // splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+
+    return z ^ (z >> 31);
+}
+
+static double RngUniform(uint64_t* state) {
+    return (double)(RngNext(state) >> 11) * 0x1p-53;
+}
+
+static size_t RngBelow(uint64_t* state, size_t n) {
+    return RngNext(state) % n;
+}
+
+void VerifyReportPrint(const VerifyReport_t* report, FILE* fp) {
+    assert( report != NULL );
+    assert( fp != NULL );
+
+    double seconds = (report->seconds > 0) ? report->seconds : 1e-9;
+
+    fprintf(fp, "verify: %zu expressions, %zu points checked, %zu skipped, %zu failures\n",
+            report->expressions, report->points, report->skipped, report->failures);
+    fprintf(fp, "verify: %zu incremental edits, %zu disagree with a fresh derivative\n",
+            report->edits, report->edit_failures);
+    fprintf(fp, "verify: %zu interval boxes, %zu fail to enclose a sampled value\n",
+            report->boxes, report->box_failures);
+    fprintf(fp, "verify: %zu Jacobians, %zu disagree with TreeDiff by each variable\n",
+            report->jacobians, report->jacobian_failures);
+    fprintf(fp, "verify: %.3lf s on %zu threads, %.0lf expressions/s, %.0lf points/s\n",
+            report->seconds, report->threads, (double)report->expressions / seconds,
+            (double)(report->points + report->skipped) / seconds);
+
+    for (size_t i = 0; i < report->worst_count; i++) {
+        const VerifyCase_t* item = &report->worst[i];
+
+        fprintf(fp, "  %.3lg at x=%.17lg y=%.17lg%s: %s\n", item->error, item->x, item->y,
+                item->optimized ? " (optimized)" : "", item->expression ? item->expression : "?");
+        if (item->minimal != NULL) {
+            fprintf(fp, "    minimal: %s\n", item->minimal);
+        }
+    }
+}
+
+void VerifyReportDestroy(VerifyReport_t* report) {
+    assert( report != NULL );
+
+    for (size_t i = 0; i < report->worst_count; i++) {
+        FREE(report->worst[i].expression);
+        FREE(report->worst[i].minimal);
+    }
+    report->worst_count = 0;
+}
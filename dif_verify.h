@@ -0,0 +1,61 @@
+#ifndef DIF_VERIFY_H
+#define DIF_VERIFY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tree.h"
+
+const size_t VERIFY_MAX_WORST = 16;
+
+enum VerifyErr_t {
+    VERIFY_OK,
+    VERIFY_ALLOCATION_FAILED,
+    VERIFY_THREAD_FAILED
+};
+
+struct VerifyConfig_t {
+    size_t expressions;
+    size_t points;          // sample points per expression
+    size_t depth;           // depth of generated expressions
+    size_t threads;         // 0 - all cores
+    size_t worst;           // how many worst cases to report
+    uint64_t seed;
+    double tolerance;       // relative error that counts as a failure
+    double x_min;
+    double x_max;
+};
+
+struct VerifyCase_t {
+    double error;
+    double x;
+    double y;
+    int optimized;          // the error is in the optimized derivative
+    char* expression;
+    char* minimal;          // shrunk failing expression, NULL if it passed
+};
+
+struct VerifyReport_t {
+    size_t expressions;
+    size_t points;
+    size_t skipped;         // singular points and points where the difference quotient is unstable
+    size_t failures;
+    size_t edits;           // incremental derivatives checked after a subtree replacement
+    size_t edit_failures;
+    size_t boxes;           // interval enclosures checked against the samples inside them
+    size_t box_failures;
+    size_t jacobians;       // Jacobians of f and a second expression checked against TreeDiff by x and by y
+    size_t jacobian_failures;
+    size_t threads;
+    double seconds;
+    size_t worst_count;
+    VerifyCase_t worst[VERIFY_MAX_WORST];
+};
+
+void VerifyConfigInit(VerifyConfig_t* config);
+
+VerifyErr_t VerifyDerivatives(const VerifyConfig_t* config, VerifyReport_t* report);
+void VerifyReportPrint(const VerifyReport_t* report, FILE* fp);
+void VerifyReportDestroy(VerifyReport_t* report);
+
+#endif // DIF_VERIFY_H
@@ -0,0 +1,739 @@
+#include "disk_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "operations.h"
+
+const char DISK_CACHE_SUFFIX[]     = ".dc";
+const char DISK_CACHE_TMP_PREFIX[] = "tmp.";
+const char DISK_CACHE_LOCK[]       = "lock";
+const size_t DISK_CACHE_HASH_DIGITS = 32;
+const size_t DISK_CACHE_NAME_MAX   = 64;
+const time_t DISK_CACHE_TMP_AGE    = 60;           // seconds before a temporary file is taken as left by a dead writer
+const time_t DISK_CACHE_TOUCH_AGE  = 1;            // a hit on a newer entry leaves its mtime alone
+const size_t DISK_CACHE_TAPE_RECORD = 2 + 4 * sizeof(uint64_t);
+const uint64_t DISK_CACHE_SEED_LO  = 0xCBF29CE484222325ull;
+const uint64_t DISK_CACHE_SEED_HI  = 0x84222325CBF29CE4ull;
+
+struct DiskHeader_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key_size;
+    uint64_t tree_size;
+    uint64_t tape_size;         // instructions, 0 - no tape
+    uint64_t var_count;
+    uint64_t checksum;          // of everything after the header
+};
+
+struct DiskBuffer_t {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    int failed;
+};
+
+struct DiskReader_t {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    int failed;
+};
+
+struct DiskEntry_t {
+    char name[DISK_CACHE_NAME_MAX];
+    int64_t mtime;              // ns
+    size_t size;
+};
+
+static DiskCacheErr_t EncodeKey(DiskBuffer_t* key, const Node_t* node, const char* var, const char* options);
+static DiskCacheErr_t EncodeTree(DiskBuffer_t* buffer, const Node_t* node);
+static void EncodeTape(DiskBuffer_t* buffer, const EvalTape_t* tape);
+static DiskCacheErr_t DecodeEntry(const unsigned char* data, size_t size, const DiskBuffer_t* key,
+                                  Node_t** derivative, EvalTape_t* tape);
+static Node_t* DecodeTree(DiskReader_t* reader, Node_t* parent);
+static DiskCacheErr_t DecodeTape(DiskReader_t* reader, EvalTape_t* tape, size_t size, size_t var_count);
+static void BufferPut(DiskBuffer_t* buffer, const void* data, size_t size);
+static void ReaderTake(DiskReader_t* reader, void* data, size_t size);
+static void EntryPath(const DiskCache_t* cache, const DiskBuffer_t* key, char* path);
+static int IsEntryName(const char* name);
+static DiskCacheErr_t ReadWhole(int fd, unsigned char** data, size_t* size, time_t* mtime);
+static DiskCacheErr_t WriteWhole(const char* path, const unsigned char* data, size_t size);
+static DiskCacheErr_t Sweep(DiskCache_t* cache);
+static int EntryCompare(const void* first, const void* second);
+static uint64_t HashBytes(const void* data, size_t size, uint64_t seed);
+
+DiskCacheErr_t DiskCacheOpen(DiskCache_t* cache, const char* dir, size_t max_bytes) {
+    assert( cache != NULL );
+    assert( dir != NULL );
+
+    memset(cache, 0, sizeof(*cache));
+    if (strlen(dir) + DISK_CACHE_NAME_MAX + 2 > DISK_CACHE_PATH_MAX) {
+        return DISK_CACHE_IO_FAILED;
+    }
+
+    struct stat st = {};
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return DISK_CACHE_IO_FAILED;
+    }
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return DISK_CACHE_IO_FAILED;
+    }
+
+    cache->dir = strdup(dir);
+    if (cache->dir == NULL) {
+        return DISK_CACHE_ALLOCATION_FAILED;
+    }
+    cache->max_bytes = (max_bytes != 0) ? max_bytes : DISK_CACHE_MAX_BYTES;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    DiskCacheErr_t err = Sweep(cache);
+    if (err != DISK_CACHE_OK) {
+        DiskCacheClose(cache);
+    }
+
+    return err;
+}
+
+DiskCacheErr_t DiskCacheClose(DiskCache_t* cache) {
+    assert( cache != NULL );
+
+    if (cache->dir != NULL) {
+        FREE(cache->dir);
+        pthread_mutex_destroy(&cache->lock);
+    }
+
+    return DISK_CACHE_OK;
+}
+
+DiskCacheErr_t DiskCacheLookup(DiskCache_t* cache, const Node_t* node, const char* var, const char* options,
+                               Node_t** derivative, EvalTape_t* tape) {
+    assert( cache != NULL );
+    assert( node != NULL );
+    assert( var != NULL );
+    assert( derivative != NULL );
+
+    *derivative = NULL;
+    if (tape != NULL) {
+        memset(tape, 0, sizeof(*tape));
+    }
+
+    DiskBuffer_t key = {};
+    DiskCacheErr_t err = EncodeKey(&key, node, var, options);
+    if (err != DISK_CACHE_OK) {
+        FREE(key.data);
+        return err;
+    }
+
+    char path[DISK_CACHE_PATH_MAX] = "";
+    EntryPath(cache, &key, path);
+
+    unsigned char* data = NULL;
+    size_t size = 0;
+    time_t mtime = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err = (errno == ENOENT) ? DISK_CACHE_MISS : DISK_CACHE_IO_FAILED;
+    } else {
+        err = ReadWhole(fd, &data, &size, &mtime);
+    }
+    if (err == DISK_CACHE_OK) {
+        err = DecodeEntry(data, size, &key, derivative, tape);
+    }
+    if (err == DISK_CACHE_OK && time(NULL) - mtime >= DISK_CACHE_TOUCH_AGE) {
+        futimens(fd, NULL);     // recently used, the sweep evicts by mtime
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    ++cache->stats.lookups;
+    cache->stats.hits    += (err == DISK_CACHE_OK);
+    cache->stats.corrupt += (err == DISK_CACHE_CORRUPT);
+    pthread_mutex_unlock(&cache->lock);
+
+    FREE(data);
+    FREE(key.data);
+
+    return err;
+}
+
+DiskCacheErr_t DiskCacheInsert(DiskCache_t* cache, const Node_t* node, const char* var, const char* options,
+                               const Node_t* derivative, const EvalTape_t* tape) {
+    assert( cache != NULL );
+    assert( node != NULL );
+    assert( var != NULL );
+    assert( derivative != NULL );
+
+    DiskBuffer_t key = {};
+    DiskBuffer_t entry = {};
+    DiskHeader_t header = {DISK_CACHE_MAGIC, DISK_CACHE_VERSION, 0, 0, 0, 0, 0};
+
+    DiskCacheErr_t err = EncodeKey(&key, node, var, options);
+    if (err == DISK_CACHE_OK) {
+        BufferPut(&entry, &header, sizeof(header));
+        BufferPut(&entry, key.data, key.size);
+
+        size_t tree_begin = entry.size;
+        err = EncodeTree(&entry, derivative);
+        header.key_size  = key.size;
+        header.tree_size = entry.size - tree_begin;
+    }
+    if (err == DISK_CACHE_OK && tape != NULL) {
+        EncodeTape(&entry, tape);
+        header.tape_size = tape->size;
+        header.var_count = tape->var_count;
+    }
+    if (err == DISK_CACHE_OK && entry.failed) {
+        err = DISK_CACHE_ALLOCATION_FAILED;
+    }
+
+    char path[DISK_CACHE_PATH_MAX] = "";
+    char tmp_path[DISK_CACHE_PATH_MAX] = "";
+    size_t replaced = 0;                        // bytes of the entry the rename overwrites
+    if (err == DISK_CACHE_OK) {
+        static size_t tmp_counter = 0;
+        size_t tmp_index = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+
+        header.checksum = HashBytes(entry.data + sizeof(header), entry.size - sizeof(header), DISK_CACHE_SEED_LO);
+        memcpy(entry.data, &header, sizeof(header));
+
+        EntryPath(cache, &key, path);
+        snprintf(tmp_path, sizeof(tmp_path), "%s/%s%ld.%zu", cache->dir, DISK_CACHE_TMP_PREFIX,
+                 (long)getpid(), tmp_index);
+
+        // readers see the old entry or the new one, never a part of it
+        err = WriteWhole(tmp_path, entry.data, entry.size);
+
+        struct stat st = {};
+        if (err == DISK_CACHE_OK && stat(path, &st) == 0) {
+            replaced = (size_t)st.st_size;
+        }
+        if (err == DISK_CACHE_OK && rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+            err = DISK_CACHE_IO_FAILED;
+        }
+    }
+
+    int sweep = 0;
+    if (err == DISK_CACHE_OK) {
+        pthread_mutex_lock(&cache->lock);
+        ++cache->stats.inserts;
+        cache->bytes -= (replaced < cache->bytes) ? replaced : cache->bytes;   // another process may have written it
+        cache->bytes += entry.size;
+        sweep = (cache->bytes > cache->max_bytes);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    if (sweep) {
+        err = Sweep(cache);
+    }
+
+    FREE(key.data);
+    FREE(entry.data);
+
+    return err;
+}
+
+DiskCacheStats_t DiskCacheGetStats(DiskCache_t* cache) {
+    assert( cache != NULL );
+
+    pthread_mutex_lock(&cache->lock);
+    DiskCacheStats_t stats = cache->stats;
+    stats.bytes = cache->bytes;
+    pthread_mutex_unlock(&cache->lock);
+
+    return stats;
+}
+
+void DiskCachePrintStats(DiskCache_t* cache, FILE* fp) {
+    assert( cache != NULL );
+    assert( fp != NULL );
+
+    DiskCacheStats_t stats = DiskCacheGetStats(cache);
+    double hit_rate = (stats.lookups != 0) ? (double)stats.hits / (double)stats.lookups : 0;
+
+    fprintf(fp, "{\"disk_lookups\": %llu, \"disk_hits\": %llu, \"disk_hit_rate\": %lg, \"disk_corrupt\": %llu, "
+                "\"disk_inserts\": %llu, \"disk_evictions\": %llu, \"disk_bytes\": %zu}\n",
+            (unsigned long long)stats.lookups, (unsigned long long)stats.hits, hit_rate,
+            (unsigned long long)stats.corrupt, (unsigned long long)stats.inserts,
+            (unsigned long long)stats.evictions, stats.bytes);
+}
+
+// The source tree, then var and options with their terminating zeros
+static DiskCacheErr_t EncodeKey(DiskBuffer_t* key, const Node_t* node, const char* var, const char* options) {
+    if (options == NULL) {
+        options = "";
+    }
+
+    DiskCacheErr_t err = EncodeTree(key, node);
+    BufferPut(key, var, strlen(var) + 1);
+    BufferPut(key, options, strlen(options) + 1);
+
+    if (err == DISK_CACHE_OK && key->failed) {
+        err = DISK_CACHE_ALLOCATION_FAILED;
+    }
+
+    return err;
+}
+
+// Preorder: a type byte, 0 for a missing child, then the data
+static DiskCacheErr_t EncodeTree(DiskBuffer_t* buffer, const Node_t* node) {
+    unsigned char type = (node != NULL) ? (unsigned char)node->type : 0;
+    BufferPut(buffer, &type, sizeof(type));
+
+    if (node == NULL) {
+        return DISK_CACHE_OK;
+    }
+
+    switch (node->type) {
+    case TYPE_OPERATION: {
+        unsigned char operation = (unsigned char)node->data.operation;
+        BufferPut(buffer, &operation, sizeof(operation));
+        break;
+    }
+    case TYPE_VARIABLE: {
+        uint32_t length = (uint32_t)strlen(node->data.variable);
+        BufferPut(buffer, &length, sizeof(length));
+        BufferPut(buffer, node->data.variable, length);
+        break;
+    }
+    case TYPE_NUMBER:
+        BufferPut(buffer, &node->data.number, sizeof(node->data.number));
+        break;
+    case TYPE_UNDEFINED:
+    case TYPE_THUNK:
+    default:
+        return DISK_CACHE_UNSUPPORTED_NODE;
+    }
+
+    DiskCacheErr_t err = EncodeTree(buffer, node->left);
+    if (err == DISK_CACHE_OK) {
+        err = EncodeTree(buffer, node->right);
+    }
+
+    return err;
+}
+
+static void EncodeTape(DiskBuffer_t* buffer, const EvalTape_t* tape) {
+    for (size_t i = 0; i < tape->size; i++) {
+        const TapeInstr_t* instr = &tape->code[i];
+        unsigned char type = (unsigned char)instr->type;
+        unsigned char operation = (unsigned char)instr->operation;
+        uint64_t fields[3] = {instr->left, instr->right, instr->var};
+
+        BufferPut(buffer, &type, sizeof(type));
+        BufferPut(buffer, &operation, sizeof(operation));
+        BufferPut(buffer, fields, sizeof(fields));
+        BufferPut(buffer, &instr->number, sizeof(instr->number));
+    }
+}
+
+static DiskCacheErr_t DecodeEntry(const unsigned char* data, size_t size, const DiskBuffer_t* key,
+                                  Node_t** derivative, EvalTape_t* tape) {
+    DiskHeader_t header = {};
+    if (size < sizeof(header)) {
+        return DISK_CACHE_CORRUPT;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (header.magic != DISK_CACHE_MAGIC) {
+        return DISK_CACHE_CORRUPT;
+    }
+    if (header.version != DISK_CACHE_VERSION) {
+        return DISK_CACHE_MISS;                 // written by another version, replaced on insert
+    }
+
+    size_t payload = size - sizeof(header);
+    if (header.key_size > payload || header.tree_size > payload - header.key_size
+        || header.tape_size > (payload - header.key_size - header.tree_size) / DISK_CACHE_TAPE_RECORD
+        || header.key_size + header.tree_size + header.tape_size * DISK_CACHE_TAPE_RECORD != payload
+        || header.checksum != HashBytes(data + sizeof(header), payload, DISK_CACHE_SEED_LO)) {
+        return DISK_CACHE_CORRUPT;
+    }
+
+    if (header.key_size != key->size || memcmp(data + sizeof(header), key->data, key->size) != 0) {
+        return DISK_CACHE_MISS;                 // another key with the same hash
+    }
+
+    DiskReader_t reader = {data + sizeof(header) + header.key_size, header.tree_size, 0, 0};
+    *derivative = DecodeTree(&reader, NULL);
+    if (*derivative == NULL || reader.failed || reader.pos != reader.size) {
+        TreeDestroySubtree(derivative);
+        return (reader.failed == 2) ? DISK_CACHE_ALLOCATION_FAILED : DISK_CACHE_CORRUPT;
+    }
+
+    if (tape != NULL && header.tape_size != 0) {
+        reader = {data + sizeof(header) + header.key_size + header.tree_size,
+                  header.tape_size * DISK_CACHE_TAPE_RECORD, 0, 0};
+
+        DiskCacheErr_t err = DecodeTape(&reader, tape, header.tape_size, header.var_count);
+        if (err != DISK_CACHE_OK) {
+            TreeDestroySubtree(derivative);
+            return err;
+        }
+    }
+
+    return DISK_CACHE_OK;
+}
+
+// reader->failed: 1 - malformed, 2 - out of memory
+static Node_t* DecodeTree(DiskReader_t* reader, Node_t* parent) {
+    unsigned char type = 0;
+    ReaderTake(reader, &type, sizeof(type));
+
+    Node_t* node = NULL;
+    if (reader->failed || type == 0) {
+        return NULL;
+    }
+
+    if (type == TYPE_OPERATION) {
+        unsigned char operation = 0;
+        ReaderTake(reader, &operation, sizeof(operation));
+        if (reader->failed || operation == OPERATION_UNDEF || operation >= OPERATION_COUNT) {
+            reader->failed = 1;
+            return NULL;
+        }
+        node = NodeInit(parent, NULL, NULL, TYPE_OPERATION, (Operation_t)operation);
+    } else if (type == TYPE_VARIABLE) {
+        uint32_t length = 0;
+        ReaderTake(reader, &length, sizeof(length));
+        if (reader->failed || length > reader->size - reader->pos) {
+            reader->failed = 1;
+            return NULL;
+        }
+
+        char* name = (char*)calloc(length + 1, sizeof(char));
+        if (name == NULL) {
+            reader->failed = 2;
+            return NULL;
+        }
+        ReaderTake(reader, name, length);
+        node = NodeInit(parent, NULL, NULL, TYPE_VARIABLE, name);
+        FREE(name);
+    } else if (type == TYPE_NUMBER) {
+        double number = 0;
+        ReaderTake(reader, &number, sizeof(number));
+        if (reader->failed) {
+            return NULL;
+        }
+        node = NodeInit(parent, NULL, NULL, TYPE_NUMBER, number);
+    } else {
+        reader->failed = 1;
+        return NULL;
+    }
+
+    if (node == NULL) {
+        reader->failed = 2;
+        return NULL;
+    }
+
+    node->left  = DecodeTree(reader, node);
+    node->right = DecodeTree(reader, node);
+
+    // the shapes the rest of the tree code relies on
+    int leaf = (node->type != TYPE_OPERATION);
+    int unary = !leaf && OPERATIONS[node->data.operation].arity == 1;
+    if (!reader->failed && ((leaf && (node->left != NULL || node->right != NULL))
+                            || (!leaf && (node->right == NULL || (node->left == NULL) != unary)))) {
+        reader->failed = 1;
+    }
+    if (reader->failed) {
+        TreeDestroySubtree(&node);
+    }
+
+    return node;
+}
+
+// Operands before their users, as EvalTapeRun assumes
+static DiskCacheErr_t DecodeTape(DiskReader_t* reader, EvalTape_t* tape, size_t size, size_t var_count) {
+    tape->code = (TapeInstr_t*)calloc(size, sizeof(TapeInstr_t));
+    if (tape->code == NULL) {
+        return DISK_CACHE_ALLOCATION_FAILED;
+    }
+    tape->size      = size;
+    tape->capacity  = size;
+    tape->var_count = var_count;
+
+    for (size_t i = 0; i < size; i++) {
+        TapeInstr_t* instr = &tape->code[i];
+        unsigned char type = 0;
+        unsigned char operation = 0;
+        uint64_t fields[3] = {};
+
+        ReaderTake(reader, &type, sizeof(type));
+        ReaderTake(reader, &operation, sizeof(operation));
+        ReaderTake(reader, fields, sizeof(fields));
+        ReaderTake(reader, &instr->number, sizeof(instr->number));
+
+        instr->type      = (TreeElemType)type;
+        instr->operation = (Operation_t)((operation < OPERATION_COUNT) ? operation : 0);
+        instr->left      = fields[0];
+        instr->right     = fields[1];
+        instr->var       = fields[2];
+
+        int valid = 0;
+        if (type == TYPE_OPERATION) {
+            valid = instr->operation != OPERATION_UNDEF && instr->right < i
+                 && (instr->left < i || (instr->left == TAPE_NONE && OPERATIONS[instr->operation].arity == 1));
+        } else if (type == TYPE_VARIABLE) {
+            valid = instr->var < var_count;
+        } else if (type == TYPE_NUMBER) {
+            valid = 1;
+        }
+
+        if (reader->failed || !valid) {
+            EvalTapeDestroy(tape);
+            return DISK_CACHE_CORRUPT;
+        }
+    }
+
+    return DISK_CACHE_OK;
+}
+
+static void BufferPut(DiskBuffer_t* buffer, const void* data, size_t size) {
+    if (buffer->failed) {
+        return;
+    }
+
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = 2 * buffer->capacity + 256;
+        while (capacity < buffer->size + size) {
+            capacity *= 2;
+        }
+
+        unsigned char* grown = (unsigned char*)realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            buffer->failed = 1;
+            return;
+        }
+
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void ReaderTake(DiskReader_t* reader, void* data, size_t size) {
+    if (reader->failed || size > reader->size - reader->pos) {
+        reader->failed = (reader->failed != 0) ? reader->failed : 1;
+        return;
+    }
+
+    memcpy(data, reader->data + reader->pos, size);
+    reader->pos += size;
+}
+
+static void EntryPath(const DiskCache_t* cache, const DiskBuffer_t* key, char* path) {
+    snprintf(path, DISK_CACHE_PATH_MAX, "%s/%016llx%016llx%s", cache->dir,
+             (unsigned long long)HashBytes(key->data, key->size, DISK_CACHE_SEED_HI),
+             (unsigned long long)HashBytes(key->data, key->size, DISK_CACHE_SEED_LO), DISK_CACHE_SUFFIX);
+}
+
+static int IsEntryName(const char* name) {
+    if (strlen(name) != DISK_CACHE_HASH_DIGITS + sizeof(DISK_CACHE_SUFFIX) - 1
+        || strcmp(name + DISK_CACHE_HASH_DIGITS, DISK_CACHE_SUFFIX) != 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < DISK_CACHE_HASH_DIGITS; i++) {
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f'))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static DiskCacheErr_t ReadWhole(int fd, unsigned char** data, size_t* size, time_t* mtime) {
+    struct stat st = {};
+    if (fstat(fd, &st) != 0) {
+        return DISK_CACHE_IO_FAILED;
+    }
+    *mtime = st.st_mtime;
+
+    *size = (size_t)st.st_size;
+    *data = (unsigned char*)calloc(*size + 1, sizeof(unsigned char));
+    if (*data == NULL) {
+        return DISK_CACHE_ALLOCATION_FAILED;
+    }
+
+    size_t done = 0;
+    while (done < *size) {
+        ssize_t got = read(fd, *data + done, *size - done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return DISK_CACHE_CORRUPT;          // shorter than fstat said
+        }
+        done += (size_t)got;
+    }
+
+    return DISK_CACHE_OK;
+}
+
+static DiskCacheErr_t WriteWhole(const char* path, const unsigned char* data, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return DISK_CACHE_IO_FAILED;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t put = write(fd, data + done, size - done);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            break;
+        }
+        done += (size_t)put;
+    }
+
+    if (close(fd) != 0 || done != size) {
+        unlink(path);
+        return DISK_CACHE_IO_FAILED;
+    }
+
+    return DISK_CACHE_OK;
+}
+
+// Recounts the directory and evicts the least recently used entries down to
+// three quarters of max_bytes. Temporary files of dead writers go too.
+static DiskCacheErr_t Sweep(DiskCache_t* cache) {
+    char lock_path[DISK_CACHE_PATH_MAX] = "";
+    snprintf(lock_path, sizeof(lock_path), "%s/%s", cache->dir, DISK_CACHE_LOCK);
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0) {
+        return DISK_CACHE_IO_FAILED;
+    }
+    if (flock(lock_fd, LOCK_EX) != 0) {
+        close(lock_fd);
+        return DISK_CACHE_IO_FAILED;
+    }
+
+    DIR* dir = opendir(cache->dir);
+    if (dir == NULL) {
+        flock(lock_fd, LOCK_UN);
+        close(lock_fd);
+        return DISK_CACHE_IO_FAILED;
+    }
+
+    DiskCacheErr_t err = DISK_CACHE_OK;
+    DiskEntry_t* entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t total = 0;
+    uint64_t evicted = 0;
+    time_t now = time(NULL);
+
+    for (struct dirent* dirent = readdir(dir); dirent != NULL; dirent = readdir(dir)) {
+        const char* name = dirent->d_name;
+        int is_tmp = (strncmp(name, DISK_CACHE_TMP_PREFIX, sizeof(DISK_CACHE_TMP_PREFIX) - 1) == 0);
+        struct stat st = {};
+
+        if ((!is_tmp && !IsEntryName(name)) || fstatat(dirfd(dir), name, &st, 0) != 0) {
+            continue;                           // not ours, or unlinked meanwhile
+        }
+
+        if (is_tmp) {
+            if (now - st.st_mtime > DISK_CACHE_TMP_AGE) {
+                unlinkat(dirfd(dir), name, 0);
+            }
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = 2 * capacity + 64;
+            DiskEntry_t* grown = (DiskEntry_t*)realloc(entries, capacity * sizeof(DiskEntry_t));
+            if (grown == NULL) {
+                err = DISK_CACHE_ALLOCATION_FAILED;
+                break;
+            }
+            entries = grown;
+        }
+
+        DiskEntry_t* entry = &entries[count++];
+        strcpy(entry->name, name);
+        entry->mtime = st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        entry->size  = (size_t)st.st_size;
+        total += entry->size;
+    }
+
+    if (err == DISK_CACHE_OK && total > cache->max_bytes) {
+        qsort(entries, count, sizeof(DiskEntry_t), EntryCompare);
+
+        size_t low_water = cache->max_bytes - cache->max_bytes / 4;
+        for (size_t i = 0; i < count && total > low_water; i++) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+                ++evicted;
+            }
+        }
+    }
+
+    closedir(dir);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    FREE(entries);
+
+    pthread_mutex_lock(&cache->lock);
+    if (err == DISK_CACHE_OK) {
+        cache->bytes = total;
+    }
+    cache->stats.evictions += evicted;
+    pthread_mutex_unlock(&cache->lock);
+
+    return err;
+}
+
+// Least recently used first
+static int EntryCompare(const void* first, const void* second) {
+    const DiskEntry_t* a = (const DiskEntry_t*)first;
+    const DiskEntry_t* b = (const DiskEntry_t*)second;
+
+    if (a->mtime != b->mtime) {
+        return (a->mtime < b->mtime) ? -1 : 1;
+    }
+
+    return strcmp(a->name, b->name);
+}
+
+// FNV-1a over 8-byte words from seed, finished by the murmur3 mixer. Every
+// step is invertible, so an entry differing in one word never matches.
+static uint64_t HashBytes(const void* data, size_t size, uint64_t seed) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = seed ^ size;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ull;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
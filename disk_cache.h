@@ -0,0 +1,71 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "tree.h"
+#include "dif_eval.h"
+
+const size_t DISK_CACHE_PATH_MAX   = 1024;         // of the directory plus an entry name
+const size_t DISK_CACHE_MAX_BYTES  = 64 << 20;     // when DiskCacheOpen is given 0
+const uint32_t DISK_CACHE_MAGIC    = 0x43464944;   // "DIFC" read in host byte order
+const uint32_t DISK_CACHE_VERSION  = 1;
+
+enum DiskCacheErr_t {
+    DISK_CACHE_OK,
+    DISK_CACHE_MISS,
+    DISK_CACHE_ALLOCATION_FAILED,
+    DISK_CACHE_IO_FAILED,
+    DISK_CACHE_CORRUPT,
+    DISK_CACHE_UNSUPPORTED_NODE         // thunks and undefined nodes have no stored form
+};
+
+struct DiskCacheStats_t {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t corrupt;                   // entries that failed their checksum or did not decode
+    uint64_t inserts;
+    uint64_t evictions;
+    size_t bytes;
+};
+
+/*
+Content-addressed directory of derivatives shared by every process that
+opens it. An entry is named by a 128-bit hash of its key: the source tree in
+the stored encoding, the variable and an options string naming whatever else
+the result depends on (the differentiation path, the tape variables). The
+full key is stored in the entry and compared, so a hash collision is a miss.
+
+Entries are written to a temporary file and renamed into place, so readers
+see a whole entry or none. A hit bumps the entry mtime; when the directory
+grows past max_bytes the oldest entries are unlinked, under an flock so
+concurrent sweeps do not race. The bound is checked against this process's
+own writes between sweeps, others' writes are seen at the next sweep.
+
+Entries use the host byte order and are not meant to move between machines.
+*/
+struct DiskCache_t {
+    char* dir;
+    size_t max_bytes;
+    size_t bytes;                       // at the last sweep plus own inserts since
+    DiskCacheStats_t stats;
+    pthread_mutex_t lock;
+};
+
+// Creates dir if it does not exist
+DiskCacheErr_t DiskCacheOpen(DiskCache_t* cache, const char* dir, size_t max_bytes);
+DiskCacheErr_t DiskCacheClose(DiskCache_t* cache);
+
+// derivative is a new tree on a hit. tape may be NULL; otherwise it gets the
+// stored tape, or stays empty (code == NULL) if the entry has none.
+DiskCacheErr_t DiskCacheLookup(DiskCache_t* cache, const Node_t* node, const char* var, const char* options,
+                               Node_t** derivative, EvalTape_t* tape);
+// tape may be NULL
+DiskCacheErr_t DiskCacheInsert(DiskCache_t* cache, const Node_t* node, const char* var, const char* options,
+                               const Node_t* derivative, const EvalTape_t* tape);
+
+DiskCacheStats_t DiskCacheGetStats(DiskCache_t* cache);
+void DiskCachePrintStats(DiskCache_t* cache, FILE* fp);
+
+#endif // DISK_CACHE_H
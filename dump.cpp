@@ -5,6 +5,7 @@
 #include <assert.h>
 
 #include "io.h"
+#include "metrics.h"
 
 static size_t DotInitNodes(Node_t* node, FILE* fp, size_t* node_cnt);
 
@@ -12,8 +13,11 @@ void DotVizualizeTree(const Tree_t* tree, const char* filename) {
     assert( tree != NULL );
     assert( filename != NULL );
 
+    METRICS_PHASE_BEGIN(PHASE_DUMP);
+
     FILE* fp = fopen(filename, "w");
     if (fp == NULL) {
+        METRICS_PHASE_END(PHASE_DUMP);
         return; 
     }
 
@@ -31,6 +35,8 @@ void DotVizualizeTree(const Tree_t* tree, const char* filename) {
 
     system("dot -Tsvg img.txt > img.svg");
 
+    METRICS_PHASE_END(PHASE_DUMP);
+
     return;
 }
 
@@ -50,15 +56,21 @@ static size_t DotInitNodes(Node_t* node, FILE* fp, size_t* node_cnt) {
 
     ++(*node_cnt);
 
+    char number[NUMBER_STR_MAX] = "";
+    FormatDouble(number, sizeof(number), (node->type == TYPE_NUMBER) ? node->data.number : 0);
+
     if (node->type == TYPE_NUMBER)
-        fprintf(fp, "node%zu [label=\"{{{<f0> %p | <f1> type = NUMBER | <f2> data = %lg}} | { <f3> left: %p | <f4> right: %p}}\"];\n\t", 
-                *node_cnt, node, node->data.number, node->left, node->right);
+        fprintf(fp, "node%zu [label=\"{{{<f0> %p | <f1> type = NUMBER | <f2> data = %s}} | { <f3> left: %p | <f4> right: %p}}\"];\n\t", 
+                *node_cnt, node, number, node->left, node->right);
     else if (node->type == TYPE_OPERATION) 
         fprintf(fp, "node%zu [label=\"{{{<f0> %p | <f1> type = OPERATION | <f2> data = %s}} | { <f3> left: %p | <f4> right: %p}}\"];\n\t", 
                 *node_cnt, node, GetStrOp(node->data.operation), node->left, node->right);
     else if (node->type == TYPE_VARIABLE)
         fprintf(fp, "node%zu [label=\"{{{<f0> %p | <f1> type = VARIABLE | <f2> data = %s}} | { <f3> left: %p | <f4> right: %p}}\"];\n\t", 
                 *node_cnt, node, node->data.variable, node->left, node->right);
+    else if (node->type == TYPE_THUNK)
+        fprintf(fp, "node%zu [label=\"{{{<f0> %p | <f1> type = THUNK | <f2> data = %p}} | { <f3> left: %p | <f4> right: %p}}\"];\n\t", 
+                *node_cnt, node, node->data.thunk->source, node->left, node->right);
 
     if (node->left != NULL) {
         if (node->left->parent == node) {
@@ -6,7 +6,8 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
-#include <math.h>
+
+#include <charconv>
 
 #ifdef __linux__
 #include <sys/types.h>
@@ -14,48 +15,9 @@
 #include <unistd.h>
 #endif
 
-struct OperationMapping {
-    const char* value;
-    Operation_t operation;
-};
-/*!SECTION
-OPERATION_SQRT,
-    OPERATION_LN,
-    OPERATION_LOG,
-    OPERATION_SIN,
-    OPERATION_COS,
-    OPERATION_TAN,
-    OPERATION_COT,
-    OPERATION_SINH,
-    OPERATION_COSH,
-    OPERATION_TANH,
-    OPERATION_COTH
-*/
-OperationMapping bin_ops[] = {
-    {"U",       OPERATION_UNDEF},
-    {"+",       OPERATION_ADD},
-    {"-",       OPERATION_SUB},
-    {"*",       OPERATION_MUL},
-    {"/",       OPERATION_DIV},
-    {"^",       OPERATION_EXP},
-    {"sqrt",    OPERATION_SQRT},
-    {"ln",      OPERATION_LN},
-    {"log",     OPERATION_LOG},
-    {"sin",     OPERATION_SIN},
-    {"cos",     OPERATION_COS},
-    {"tan",     OPERATION_TAN},
-    {"cot",     OPERATION_COT},
-    {"sinh",    OPERATION_SINH},
-    {"cosh",    OPERATION_COSH},
-    {"tanh",    OPERATION_TANH},
-    {"coth",    OPERATION_COTH},
-    {"arcsin",  OPERATION_ASIN},
-    {"arccos",  OPERATION_ACOS},
-    {"arctan",  OPERATION_ATAN},
-    {"arccot",  OPERATION_ACOT},
-};
-
-size_t bin_ops_size = sizeof(bin_ops)/sizeof(bin_ops[0]);
+#include "operations.h"
+#include "alloc_track.h"
+#include "debug.h"
 
 IOErr_t BufferInit(Buffer_t* buffer, size_t capacity) {
     assert( buffer != NULL );
@@ -64,7 +26,7 @@ IOErr_t BufferInit(Buffer_t* buffer, size_t capacity) {
     
     if (capacity != 0) {
         buffer->capacity = capacity;
-        buffer->data = (char*)calloc(capacity, sizeof(char));
+        buffer->data = (char*)TRACK_CALLOC(capacity, sizeof(char), ALLOC_BUFFER);
         if (buffer->data == NULL) {
             return IO_BUFFER_ALLOCATION_FAILED;
         }
@@ -82,20 +44,36 @@ IOErr_t BufferDestroy(Buffer_t* buffer) {
 
     buffer->size = 0;
     buffer->capacity = 0;
-    FREE(buffer->data);
+    TRACK_FREE(buffer->data);
     
     return IO_OK;
 }
 
+#ifndef DIF_LIBRARY
+
 IOErr_t BufferGet(Buffer_t* buffer) {
+    return BufferGetLine(buffer, stdin);
+}
+
+#endif // DIF_LIBRARY
+
+IOErr_t BufferGetLine(Buffer_t* buffer, FILE* fp) {
     assert( buffer != NULL );
+    assert( fp != NULL );
+
+    char* old_data = buffer->data;
+    ssize_t size = getline(&buffer->data, &buffer->capacity, fp);
+    TRACK_RESIZED(old_data, buffer->data, buffer->capacity, ALLOC_BUFFER);
 
-    buffer->size = (size_t)getline(&buffer->data, &buffer->capacity, stdin);
-    if (buffer->size == (size_t)-1) {
+    if (size < 0) {
+        buffer->size = 0;
         return IO_BUFFER_GETLINE_FAILED;
     }
 
-    buffer->data[buffer->size - 1] = '\0';
+    buffer->size = (size_t)size;
+    if (buffer->size != 0 && buffer->data[buffer->size - 1] == '\n') {
+        buffer->data[--buffer->size] = '\0';
+    }
 
     return IO_OK;
 }
@@ -123,7 +101,11 @@ char* GetStringFromBuffer(char** position) {
 
     char* right_idx = left_idx + 1; // skip '"'
 
-    for (; *right_idx != '"'; ++right_idx);
+    for (; *right_idx != '"'; ++right_idx) {
+        if (*right_idx == '\0') {
+            return NULL;
+        }
+    }
     *right_idx = '\0';
 
     char* NodeName = strdup(left_idx + 1);
@@ -137,18 +119,16 @@ char* GetStringFromBuffer(char** position) {
 IOErr_t DefineTreeElem(TreeElemType* type, TreeElem_t* data, char* str) {
     assert( str != NULL );
 
-    for (size_t i = 0; i < bin_ops_size; i++) {
-        if (strcmp(bin_ops[i].value, str) == 0) {
-            *type = TYPE_OPERATION;
-            data->operation = bin_ops[i].operation;
+    const OperationInfo_t* info = OperationFind(str);
+    if (info != NULL) {
+        *type = TYPE_OPERATION;
+        data->operation = info->operation;
 
-            return IO_OK;
-        }
+        return IO_OK;
     }
 
-    char* endptr = NULL;
-    double temp_num = strtod(str, &endptr);
-    if (*endptr == '\0') {
+    double temp_num = 0;
+    if (ParseDouble(str, &temp_num)) {
         *type = TYPE_NUMBER;
         data->number = temp_num;
 
@@ -156,7 +136,7 @@ IOErr_t DefineTreeElem(TreeElemType* type, TreeElem_t* data, char* str) {
     }
 
     *type = TYPE_VARIABLE;
-    data->variable = strdup(str);
+    data->variable = TRACK_STRDUP(str);
     
     return IO_OK;
 }
@@ -166,7 +146,9 @@ void SkipSpaces(char** position) { // FIXME SkipSpaces(char*) -> char*
 }
 
 const char* GetStrOp(Operation_t op) {
-    return bin_ops[op].value;
+    const OperationInfo_t* info = OperationGet(op);
+
+    return (info != NULL) ? info->name : OPERATIONS[OPERATION_UNDEF].name;
 }
 
 char* MultiStrCat(size_t count, ...) {
@@ -198,48 +180,79 @@ char* MultiStrCat(size_t count, ...) {
 }
 
 char* StrFromDouble(double x) {
-    int size = snprintf(NULL, 0, "%lg", x);
-    if (size < 0) {
-        return NULL;
-    }
+    char str[NUMBER_STR_MAX] = "";
+    FormatDouble(str, sizeof(str), x);
 
-    char* str = (char*)calloc((size_t)size + 1, sizeof(char));
-    if (str == NULL) {
-        return NULL;
-    }
+    return strdup(str);
+}
 
-    snprintf(str, (size_t)size + 1, "%lg", x);
+// Shortest string that reads back to the same double, independent of the locale
+size_t FormatDouble(char* str, size_t size, double x) {
+    assert( str != NULL );
+    assert( size >= NUMBER_STR_MAX );
 
-    return str;
+    std::to_chars_result res = std::to_chars(str, str + size - 1, x);
+    *res.ptr = '\0';
+
+    return (size_t)(res.ptr - str);
 }
 
-double GetFuncOp(Operation_t operation, double a, double b) {
-    switch (operation) {
-    case OPERATION_ADD:
-        return a + b;
+// The whole string must be a number: [+-]digits[.digits][e[+-]digits],
+// inf, nan or a 0x hex float
+int ParseDouble(const char* str, double* x) {
+    assert( str != NULL );
+    assert( x != NULL );
+
+    const char* begin = str;
+    int negative = 0;
+    if (*begin == '+' || *begin == '-') {
+        negative = *begin == '-';
+        ++begin;
+    }
+
+    std::chars_format format = std::chars_format::general;
+    if (begin[0] == '0' && (begin[1] == 'x' || begin[1] == 'X')) {
+        format = std::chars_format::hex;
+        begin += 2;
+    }
 
-    case OPERATION_SUB:
-        return a - b;
+    const char* end = begin + strlen(begin);
+    if (begin == end || *begin == '+' || *begin == '-') {
+        return 0;
+    }
 
-    case OPERATION_MUL:
-        return a * b;
+    double value = 0;
+    std::from_chars_result res = std::from_chars(begin, end, value, format);
+    if (res.ptr != end) {
+        return 0;
+    }
+    if (res.ec == std::errc::result_out_of_range) {
+        value = strtod(str, NULL);      // overflow to inf or underflow to 0 like strtod
+        negative = 0;
+    } else if (res.ec != std::errc()) {
+        return 0;
+    }
 
-    case OPERATION_DIV:
-        return a / b;
+    *x = negative ? -value : value;
 
-    case OPERATION_EXP:
-        return pow(a, b);
-    
-    case OPERATION_UNDEF:
-        fprintf(stderr, "UNDEFINED_OPERATION IN GetFuncOp\n");
-        break;
+    return 1;
+}
 
-    default:
-        fprintf(stderr, "default in GetFuncOp\n");
-        break;
+double GetFuncOp(Operation_t operation, double a, double b) {
+    const OperationInfo_t* info = OperationGet(operation);
+    if (info == NULL || info->eval == NULL) {
+        LOG_ERROR("io", "UNDEFINED_OPERATION IN GetFuncOp");
+        return 0;
     }
 
-    return 0;
+    return info->eval(a, b);
+}
+
+int FoldFuncOp(const Node_t* node, double* value) {
+    assert( node != NULL );
+    assert( value != NULL );
+
+    return FoldFuncOpScalar(node, value);
 }
 
 /*!SECTION
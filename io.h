@@ -1,6 +1,8 @@
 #ifndef IO_H
 #define IO_H
 
+#include <stdio.h>
+
 #include "tree.h"
 
 enum IOErr_t {
@@ -16,6 +18,8 @@ enum IOErr_t {
     IO_BUFFER_ALLOCATION_FAILED
 };
 
+const size_t NUMBER_STR_MAX = 32;       // longest shortest-round-trip double is 24 characters
+
 struct Buffer_t {
     char* data;
     size_t size;
@@ -26,7 +30,10 @@ IOErr_t GetFileSize(const char* file_name, size_t* file_size);
 
 IOErr_t BufferInit(Buffer_t* buffer, size_t capacity);
 IOErr_t BufferDestroy(Buffer_t* buffer);
+#ifndef DIF_LIBRARY
 IOErr_t BufferGet(Buffer_t* buffer);
+#endif // DIF_LIBRARY
+IOErr_t BufferGetLine(Buffer_t* buffer, FILE* fp);
 
 IOErr_t DefineTreeElem(TreeElemType* type, TreeElem_t* data, char* str);
 
@@ -37,5 +44,11 @@ const char* GetStrOp(Operation_t op);
 
 char* MultiStrCat(size_t count, ...);
 char* StrFromDouble(double x);
+size_t FormatDouble(char* str, size_t size, double x);
+int ParseDouble(const char* str, double* x);
 double GetFuncOp(Operation_t operation, double a, double b);
+// Value of an operation node whose operands are numbers; a unary function has
+// no left operand. 0 if it cannot be folded, also when the value is not
+// finite: a domain error is left in the tree for evaluation to meet.
+int FoldFuncOp(const Node_t* node, double* value);
 #endif // IO_H
@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# libdif.a and libdif.so with the C API of dif_api.h
+
+source="dif_api.cpp tree.cpp io.cpp dif_math.cpp dif_optimize.cpp utils.cpp metrics.cpp node_map.cpp dif_cache.cpp dif_lazy.cpp dif_eval.cpp dif_interval.cpp dif_jacobian.cpp share.cpp alloc_track.cpp debug.cpp budget.cpp scan.cpp"
+
+flags=" \
+-D DIF_LIBRARY -D NDEBUG -O2 -fPIC -pthread -std=c++17 -Wall -Wextra -Weffc++ -Wcast-qual -Wconversion -Wshadow             \
+-Wsign-conversion -Wundef -Wunused -Wno-missing-field-initializers -Wno-old-style-cast -fvisibility=hidden                   \
+"
+
+mkdir -p lib_build
+rm -f lib_build/*.o
+
+for file in $source; do
+    g++ $flags -c $file -o lib_build/${file%.cpp}.o || exit 1
+done
+
+ar rcs libdif.a lib_build/*.o
+g++ -shared -pthread -Wl,--no-undefined lib_build/*.o -o libdif.so
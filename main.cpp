@@ -1,12 +1,249 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 #include "tree.h"
 #include "dif_math.h"
 #include "dif_optimize.h"
 #include "dump.h"
+#include "metrics.h"
+#include "server.h"
+#include "dif_verify.h"
+#include "dif_parallel.h"
+#include "dif_poly.h"
+#include "dif_solve.h"
+#include "alloc_track.h"
+#include "budget.h"
+#include "disk_cache.h"
+#include "debug.h"
+#include "dif_partial.h"
+#include "dif_precision.h"
+#include "io.h"
 
+const size_t BINDINGS_MAX = 32;
+
+int main(int argc, char* argv[]) {
+    const char* metrics_file = NULL;
+    int use_cache = 0;
+    int use_lazy = 0;
+    int use_parallel = 0;
+    int use_poly = 0;
+    int use_consume = 0;
+    const char* serve = NULL;
+    size_t workers = 0;
+    size_t verify = 0;
+    size_t solve = 0;
+    size_t precision = 0;
+    int use_halley = 0;
+    int use_lower = 0;
+    int alloc_report = 0;
+    const char* disk_cache_dir = NULL;
+    size_t disk_cache_max = 0;
+    PartialBinding_t bindings[BINDINGS_MAX] = {};
+    size_t binding_count = 0;
+    BudgetLimits_t limits = {};
+    BudgetLimitsInit(&limits);
+    DebugConfigFromEnv();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_file = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            use_cache = 1;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            use_lazy = 1;
+        } else if (strcmp(argv[i], "--parallel") == 0) {
+            use_parallel = 1;
+        } else if (strcmp(argv[i], "--poly") == 0) {
+            use_poly = 1;
+        } else if (strcmp(argv[i], "--consume") == 0) {
+            use_consume = 1;                    // the input tree is not needed after differentiation
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve = argv[++i];                  // socket path, or "-" for stdin/stdout
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {
+            verify = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--solve") == 0 && i + 1 < argc) {
+            solve = strtoul(argv[++i], NULL, 10);       // starting points spread over [-10, 10]
+        } else if (strcmp(argv[i], "--precision") == 0 && i + 1 < argc) {
+            precision = strtoul(argv[++i], NULL, 10);   // points of f(x) over [-10, 10] in each scalar type
+        } else if (strcmp(argv[i], "--halley") == 0) {
+            use_halley = 1;
+        } else if (strcmp(argv[i], "--lower") == 0) {
+            use_lower = 1;                      // cost-model rewrites of the solver tapes
+        } else if (strcmp(argv[i], "--alloc") == 0) {
+            alloc_report = 1;                   // needs a DIF_ALLOC_TRACK build
+        } else if (strcmp(argv[i], "--disk-cache") == 0 && i + 1 < argc) {
+            disk_cache_dir = argv[++i];         // derivatives kept across runs
+        } else if (strcmp(argv[i], "--disk-cache-max") == 0 && i + 1 < argc) {
+            disk_cache_max = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            DebugSetLevel(DebugParseLevel(argv[++i], DEBUG_LEVEL_ERROR));
+        } else if (strcmp(argv[i], "--step") == 0) {
+            DebugSetStep(stdin);                // stop at every step point, trace builds stop in the optimizer too
+        } else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc) {
+            char* eq = strchr(argv[++i], '=');       // name=value, fixed before differentiation
+            if (eq == NULL || binding_count == BINDINGS_MAX || !ParseDouble(eq + 1, &bindings[binding_count].value)) {
+                fprintf(stderr, "bad binding %s\n", argv[i]);
+                return 1;
+            }
+            *eq = '\0';
+            bindings[binding_count++].name = argv[i];
+        } else if (strcmp(argv[i], "--max-nodes") == 0 && i + 1 < argc) {
+            limits.max_nodes = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-bytes") == 0 && i + 1 < argc) {
+            limits.max_bytes = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            limits.max_depth = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-ms") == 0 && i + 1 < argc) {
+            limits.max_ns = strtoull(argv[++i], NULL, 10) * 1000000;
+        }
+    }
+
+    if (verify != 0) {
+        VerifyConfig_t config = {};
+        VerifyConfigInit(&config);
+        config.expressions = verify;
+        config.threads     = workers;
+
+        VerifyReport_t report = {};
+        VerifyErr_t err = VerifyDerivatives(&config, &report);
+        if (err != VERIFY_OK) {
+            fprintf(stderr, "verification failed: %d\n", err);
+        }
+
+        VerifyReportPrint(&report, stdout);
+        size_t failures = report.failures + report.edit_failures + report.box_failures
+                        + report.jacobian_failures;
+        VerifyReportDestroy(&report);
+
+        return (err == VERIFY_OK && failures == 0) ? 0 : 1;
+    }
+
+    if (solve != 0) {
+        char input_file[] = "input.txt";
+        Tree_t* tree = NULL;
+        TreeInit(&tree);
+
+        Solver_t solver = {};
+        SolveErr_t err = SOLVE_ALLOCATION_FAILED;
+        if (ReadTree(tree, input_file) == TREE_OK
+            && (binding_count == 0 || TreeSpecializeInPlace(tree, bindings, binding_count) == PARTIAL_OK)) {
+            err = SolverInit(&solver, tree->root, "x", NULL, 0, use_halley ? SOLVE_HALLEY : SOLVE_NEWTON);
+        }
+        if (err == SOLVE_OK && use_lower) {
+            LowerCosts_t costs = {};
+            LowerCostsInit(&costs);
+
+            LowerStats_t lower_stats = {};
+            err = SolverLower(&solver, &costs, &lower_stats);
+            LowerStatsPrint(&lower_stats, stdout);
+        }
+
+        SolveProblem_t* problems = (SolveProblem_t*)calloc(solve, sizeof(SolveProblem_t));
+        SolveResult_t* results = (SolveResult_t*)calloc(solve, sizeof(SolveResult_t));
+
+        if (err == SOLVE_OK && problems != NULL && results != NULL) {
+            for (size_t i = 0; i < solve; i++) {
+                problems[i].x0 = -10 + 20 * (double)i / (double)solve;
+                problems[i].lo = NAN;
+                problems[i].hi = NAN;
+            }
+
+            SolveConfig_t config = {};
+            SolveConfigInit(&config);
+            config.threads = workers;
+
+            SolveStats_t stats = {};
+            err = SolveBatch(&solver, &config, problems, solve, results, &stats);
+            SolveStatsPrint(&stats, stdout);
+        }
+
+        if (err != SOLVE_OK) {
+            fprintf(stderr, "solve failed: %d\n", err);
+        }
+
+        FREE(problems);
+        FREE(results);
+        SolverDestroy(&solver);
+        TreeDestroy(&tree);
+
+        return (err == SOLVE_OK) ? 0 : 1;
+    }
+
+    if (precision != 0) {
+        char input_file[] = "input.txt";
+        Tree_t* tree = NULL;
+        TreeInit(&tree);
+
+        EvalErr_t err = EVAL_UNDEFINED_NODE;
+        if (ReadTree(tree, input_file) == TREE_OK
+            && (binding_count == 0 || TreeSpecializeInPlace(tree, bindings, binding_count) == PARTIAL_OK)) {
+            PrecisionConfig_t config = {};
+            PrecisionConfigInit(&config);
+            config.points = precision;
+
+            PrecisionReport_t report = {};
+            err = PrecisionBench(tree->root, "x", &config, &report);
+            if (err == EVAL_OK) {
+                PrecisionReportPrint(&report, stdout);
+            }
+        }
+
+        if (err != EVAL_OK) {
+            fprintf(stderr, "precision failed: %d\n", err);
+        }
+
+        TreeDestroy(&tree);
+
+        return (err == EVAL_OK) ? 0 : 1;
+    }
+
+    if (serve != NULL) {
+        Server_t server = {};
+        if (ServerInit(&server, workers) != SERVER_OK) {
+            fprintf(stderr, "ServerInit failed\n");
+            return 1;
+        }
+        server.limits = limits;
+
+        ServerErr_t err = (strcmp(serve, "-") == 0) ? ServerServeStream(&server, stdin, stdout)
+                                                    : ServerServeSocket(&server, serve);
+        if (err != SERVER_OK) {
+            fprintf(stderr, "server failed: %d\n", err);
+        }
+
+        if (metrics_file != NULL) {
+            FILE* metrics_fp = fopen(metrics_file, "a");
+            if (metrics_fp != NULL) {
+                MetricsDumpJson(metrics_fp, serve);
+                fclose(metrics_fp);
+            }
+        }
+
+        ServerDestroy(&server);
+        if (alloc_report) {
+            AllocTrackReport(stderr);
+        }
+
+        return (err == SERVER_OK) ? 0 : 1;
+    }
+
+    DiffCache_t cache = {};
+    if (use_cache) {
+        DiffCacheInit(&cache, 1024, 1 << 20);
+    }
+
+    DiskCache_t disk_cache = {};
+    int use_disk_cache = 0;
+    if (disk_cache_dir != NULL) {
+        use_disk_cache = (DiskCacheOpen(&disk_cache, disk_cache_dir, disk_cache_max) == DISK_CACHE_OK);
+        if (!use_disk_cache) {
+            fprintf(stderr, "cannot open disk cache %s\n", disk_cache_dir);
+        }
+    }
 
-int main() {
     // Node_t* node = NodeInit(NULL, NULL, NULL, TYPE_NUMBER, 1.0);
 
     // printf("%d\n", node->type);
@@ -17,36 +254,101 @@ int main() {
     Tree_t* tree = NULL;
     TreeInit(&tree);
 
+    Budget_t budget = {};
+    char report[BUDGET_REPORT_MAX] = "";
+
+    BudgetBegin(&budget, &limits, NULL);
     ReadTree(tree, "input.txt");
+    if (binding_count != 0 && tree->root != NULL && TreeSpecializeInPlace(tree, bindings, binding_count) != PARTIAL_OK) {
+        fprintf(stderr, "specialization failed\n");
+    }
+    if (BudgetEnd(&budget) != BUDGET_WITHIN) {
+        BudgetDescribe(&budget, report, sizeof(report));
+        fprintf(stderr, "budget exceeded: %s\n", report);
+        TreeDestroy(&tree);
+        return 1;
+    }
 
     // PrintLatexTree(tree);
 
     DotVizualizeTree(tree, "img.txt");
-    getchar();
+    DebugStep("main", "input dumped to %s", "img.txt");
 
     // TreeOptimization(tree, tree->root);
 
     // DotVizualizeTree(tree, "img.txt");
-    // getchar();
+    // DebugStep("main", "optimized input dumped to %s", "img.txt");
 
     Tree_t* tree2 = NULL;
     TreeInit(&tree2);
 
-    tree2->root = TreeDiff(tree->root, "x");
-    tree2->root->parent = NULL;
+    LazyDiff_t lazy = {};
+    BudgetBegin(&budget, &limits, NULL);
+    if (use_lazy) {
+        tree2->root = TreeDiffLazy(&lazy, tree->root, "x");
+    } else if (use_consume) {
+        tree2->root = TreeDiffConsume(tree->root, "x");
+        tree->root = NULL;
+    } else if (use_poly) {
+        tree2->root = TreeDiffPoly(tree->root, "x");
+    } else if (use_parallel) {
+        tree2->root = TreeDiffParallel(tree->root, "x", workers);
+    } else if (use_disk_cache && DiskCacheLookup(&disk_cache, tree->root, "x", "diff", &tree2->root, NULL) == DISK_CACHE_OK) {
+        // differentiated by an earlier run
+    } else {
+        tree2->root = TreeDiffCached(tree->root, "x", use_cache ? &cache : NULL);
+        if (use_disk_cache && tree2->root != NULL && !BudgetExceeded()) {
+            DiskCacheInsert(&disk_cache, tree->root, "x", "diff", tree2->root, NULL);
+        }
+    }
+    if (tree2->root != NULL) {
+        tree2->root->parent = NULL;
 
-    // TreeOptimization(tree2, tree2->root);
-    // TreeOptimization(tree2, tree2->root);
-    // TreeOptimization(tree2, tree2->root);
-    // PrintLatexTree(tree2);
-    PrintTree(tree2);
+        // TreeOptimization(tree2, tree2->root);
+        // TreeOptimization(tree2, tree2->root);
+        // TreeOptimization(tree2, tree2->root);
+        // PrintLatexTree(tree2);
+        PrintTree(tree2);
+    }
 
-    DotVizualizeTree(tree2, "img.txt");
-    getchar();
+    int exit_code = 0;
+    if (BudgetEnd(&budget) != BUDGET_WITHIN) {
+        BudgetDescribe(&budget, report, sizeof(report));
+        fprintf(stderr, "budget exceeded: %s\n", report);
+        exit_code = 1;
+    } else if (tree2->root != NULL) {
+        DotVizualizeTree(tree2, "img.txt");
+        DebugStep("main", "derivative dumped to %s", "img.txt");
+    }
 
     TreeDestroy(&tree2);
+    if (use_lazy) {
+        LazyDiffDestroy(&lazy);
+    }
     
     
     TreeDestroy(&tree);
-    return 0;
+
+    if (use_cache) {
+        DiffCachePrintStats(&cache, stderr);
+        DiffCacheDestroy(&cache);
+    }
+    if (use_disk_cache) {
+        DiskCachePrintStats(&disk_cache, stderr);
+        DiskCacheClose(&disk_cache);
+    }
+
+    if (metrics_file != NULL) {
+        FILE* metrics_fp = fopen(metrics_file, "a");
+        if (metrics_fp != NULL) {
+            MetricsDumpJson(metrics_fp, "input.txt");
+            fclose(metrics_fp);
+        }
+    }
+
+    if (alloc_report) {
+        AllocTrackReport(stderr);
+    }
+
+    return exit_code;
 }
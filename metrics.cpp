@@ -0,0 +1,147 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+static const char* counter_names[COUNTER_COUNT] = {
+    "nodes_allocated",
+    "nodes_freed",
+    "subtree_copies",
+    "nodes_copied",
+    "rewrite_const_fold",
+    "rewrite_add",
+    "rewrite_sub",
+    "rewrite_mul",
+    "rewrite_div",
+    "rewrite_exp",
+    "diff_input_nodes",
+    "diff_output_nodes",
+    "diff_cache_lookups",
+    "diff_cache_hits",
+    "lazy_thunks",
+    "lazy_forced",
+    "lazy_skipped",
+    "inc_rebuilt",
+    "server_requests",
+    "server_errors",
+    "poly_subtrees",
+    "subtrees_moved"
+};
+
+static const char* phase_names[PHASE_COUNT] = {
+    "parse",
+    "diff",
+    "optimize",
+    "print",
+    "dump"
+};
+
+static uint64_t counters[COUNTER_COUNT] = {};
+static uint64_t phase_ns[PHASE_COUNT] = {};
+static uint64_t phase_calls[PHASE_COUNT] = {};
+
+static __thread MetricsPhase_t current_phase = PHASE_COUNT;
+
+static void WriteJsonString(FILE* fp, const char* str);
+
+MetricsPhase_t MetricsPhaseEnter(MetricsPhase_t phase) {
+    MetricsPhase_t prev = current_phase;
+    current_phase = phase;
+
+    return prev;
+}
+
+void MetricsPhaseLeave(MetricsPhase_t prev) {
+    current_phase = prev;
+}
+
+MetricsPhase_t MetricsCurrentPhase() {
+    return current_phase;
+}
+
+#ifdef DIF_METRICS
+
+void MetricsInc(MetricsCounter_t counter, uint64_t value) {
+    __atomic_fetch_add(&counters[counter], value, __ATOMIC_RELAXED);
+}
+
+uint64_t MetricsNow() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void MetricsAddTime(MetricsPhase_t phase, uint64_t ns) {
+    __atomic_fetch_add(&phase_ns[phase], ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phase_calls[phase], 1, __ATOMIC_RELAXED);
+}
+
+#endif // DIF_METRICS
+
+void MetricsReset() {
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+    for (size_t i = 0; i < PHASE_COUNT; i++) {
+        __atomic_store_n(&phase_ns[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&phase_calls[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t MetricsGet(MetricsCounter_t counter) {
+    return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+const char* MetricsPhaseName(MetricsPhase_t phase) {
+    return (phase < PHASE_COUNT) ? phase_names[phase] : "other";
+}
+
+void MetricsDumpJson(FILE* fp, const char* label) {
+    assert( fp != NULL );
+
+    fprintf(fp, "{\"label\": ");
+    WriteJsonString(fp, label ? label : "");
+#ifdef DIF_METRICS
+    fprintf(fp, ", \"enabled\": true, \"counters\": {");
+#else
+    fprintf(fp, ", \"enabled\": false, \"counters\": {");
+#endif
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(fp, "%s\"%s\": %llu", (i == 0) ? "" : ", ", counter_names[i],
+                (unsigned long long)MetricsGet((MetricsCounter_t)i));
+    }
+
+    fprintf(fp, "}, \"phases\": {");
+    for (size_t i = 0; i < PHASE_COUNT; i++) {
+        fprintf(fp, "%s\"%s\": {\"calls\": %llu, \"ns\": %llu}", (i == 0) ? "" : ", ", phase_names[i],
+                (unsigned long long)__atomic_load_n(&phase_calls[i], __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&phase_ns[i], __ATOMIC_RELAXED));
+    }
+
+    uint64_t input_nodes  = MetricsGet(COUNTER_DIFF_INPUT_NODES);
+    uint64_t output_nodes = MetricsGet(COUNTER_DIFF_OUTPUT_NODES);
+    double growth = (input_nodes != 0) ? (double)output_nodes / (double)input_nodes : 0;
+
+    fprintf(fp, "}, \"diff_growth\": %lg}\n", growth);
+}
+
+// The label is a path given on the command line, which may hold any byte
+static void WriteJsonString(FILE* fp, const char* str) {
+    fputc('"', fp);
+
+    for (const unsigned char* ch = (const unsigned char*)str; *ch != '\0'; ch++) {
+        if (*ch == '"' || *ch == '\\') {
+            fputc('\\', fp);
+            fputc(*ch, fp);
+        } else if (*ch < 0x20) {
+            fprintf(fp, "\\u%04x", *ch);
+        } else {
+            fputc(*ch, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
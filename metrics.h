@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum MetricsCounter_t {
+    COUNTER_NODES_ALLOCATED,
+    COUNTER_NODES_FREED,
+    COUNTER_SUBTREE_COPIES,
+    COUNTER_NODES_COPIED,
+    COUNTER_REWRITE_CONST_FOLD,
+    COUNTER_REWRITE_ADD,
+    COUNTER_REWRITE_SUB,
+    COUNTER_REWRITE_MUL,
+    COUNTER_REWRITE_DIV,
+    COUNTER_REWRITE_EXP,
+    COUNTER_DIFF_INPUT_NODES,
+    COUNTER_DIFF_OUTPUT_NODES,
+    COUNTER_DIFF_CACHE_LOOKUPS,
+    COUNTER_DIFF_CACHE_HITS,
+    COUNTER_LAZY_THUNKS,
+    COUNTER_LAZY_FORCED,
+    COUNTER_LAZY_SKIPPED,
+    COUNTER_INC_REBUILT,
+    COUNTER_SERVER_REQUESTS,
+    COUNTER_SERVER_ERRORS,
+    COUNTER_POLY_SUBTREES,
+    COUNTER_SUBTREES_MOVED,
+    COUNTER_COUNT
+};
+
+enum MetricsPhase_t {
+    PHASE_PARSE,
+    PHASE_DIFF,
+    PHASE_OPTIMIZE,
+    PHASE_PRINT,
+    PHASE_DUMP,
+    PHASE_COUNT
+};
+
+// The phase the calling thread is in, PHASE_COUNT outside of all of them.
+// Kept in every build: allocation tracking and budgets report it.
+MetricsPhase_t MetricsPhaseEnter(MetricsPhase_t phase);
+void MetricsPhaseLeave(MetricsPhase_t prev);
+MetricsPhase_t MetricsCurrentPhase();
+
+#define METRICS_PHASE_ENTER(phase)  MetricsPhase_t metrics_prev_##phase = MetricsPhaseEnter(phase)
+#define METRICS_PHASE_LEAVE(phase)  MetricsPhaseLeave(metrics_prev_##phase)
+
+#ifdef DIF_METRICS
+
+void MetricsInc(MetricsCounter_t counter, uint64_t value);
+uint64_t MetricsNow();
+void MetricsAddTime(MetricsPhase_t phase, uint64_t ns);
+
+#define METRICS_ADD(counter, value) MetricsInc(counter, value)
+#define METRICS_INC(counter)        MetricsInc(counter, 1)
+#define METRICS_PHASE_BEGIN(phase)  uint64_t metrics_start_##phase = MetricsNow(); METRICS_PHASE_ENTER(phase)
+#define METRICS_PHASE_END(phase)    MetricsAddTime(phase, MetricsNow() - metrics_start_##phase); METRICS_PHASE_LEAVE(phase)
+#define METRICS_ONLY(code)          code
+
+#else // DIF_METRICS
+
+#define METRICS_ADD(counter, value) ((void)0)
+#define METRICS_INC(counter)        ((void)0)
+#define METRICS_PHASE_BEGIN(phase)  METRICS_PHASE_ENTER(phase)
+#define METRICS_PHASE_END(phase)    METRICS_PHASE_LEAVE(phase)
+#define METRICS_ONLY(code)
+
+#endif // DIF_METRICS
+
+void MetricsReset();
+uint64_t MetricsGet(MetricsCounter_t counter);
+const char* MetricsPhaseName(MetricsPhase_t phase);
+void MetricsDumpJson(FILE* fp, const char* label);
+
+#endif // METRICS_H
@@ -0,0 +1,168 @@
+#include "node_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static const size_t NODE_MAP_MIN_CAPACITY = 16;
+
+static size_t NodeMapSlot(const NodeMap_t* map, const Node_t* key);
+static TreeErr_t NodeMapGrow(NodeMap_t* map);
+static uint64_t RecursiveBuildHashes(NodeMap_t* map, const Node_t* node, size_t* size, TreeErr_t* err);
+
+TreeErr_t NodeMapInit(NodeMap_t* map, size_t capacity) {
+    assert( map != NULL );
+
+    size_t real_capacity = NODE_MAP_MIN_CAPACITY;
+    while (real_capacity < capacity * 2) {
+        real_capacity *= 2;
+    }
+
+    map->entries = (NodeMapEntry_t*)calloc(real_capacity, sizeof(NodeMapEntry_t));
+    if (map->entries == NULL) {
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    map->size = 0;
+    map->capacity = real_capacity;
+
+    return TREE_OK;
+}
+
+TreeErr_t NodeMapDestroy(NodeMap_t* map) {
+    assert( map != NULL );
+
+    FREE(map->entries);
+    map->size = 0;
+    map->capacity = 0;
+
+    return TREE_OK;
+}
+
+static size_t NodeMapSlot(const NodeMap_t* map, const Node_t* key) {
+    uint64_t hash = (uint64_t)key;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+
+    return hash & (map->capacity - 1);
+}
+
+NodeInfo_t* NodeMapFind(const NodeMap_t* map, const Node_t* key) {
+    assert( map != NULL );
+    assert( key != NULL );
+
+    for (size_t i = NodeMapSlot(map, key); map->entries[i].key != NULL; i = (i + 1) & (map->capacity - 1)) {
+        if (map->entries[i].key == key) {
+            return &map->entries[i].info;
+        }
+    }
+
+    return NULL;
+}
+
+NodeInfo_t* NodeMapInsert(NodeMap_t* map, const Node_t* key) {
+    assert( map != NULL );
+    assert( key != NULL );
+
+    if ((map->size + 1) * 2 > map->capacity && NodeMapGrow(map) != TREE_OK) {
+        return NULL;
+    }
+
+    size_t i = NodeMapSlot(map, key);
+    for (; map->entries[i].key != NULL; i = (i + 1) & (map->capacity - 1)) {
+        if (map->entries[i].key == key) {
+            return &map->entries[i].info;
+        }
+    }
+
+    map->entries[i].key = key;
+    memset(&map->entries[i].info, 0, sizeof(NodeInfo_t));
+    ++map->size;
+
+    return &map->entries[i].info;
+}
+
+TreeErr_t NodeMapErase(NodeMap_t* map, const Node_t* key) {
+    assert( map != NULL );
+    assert( key != NULL );
+
+    size_t mask = map->capacity - 1;
+    size_t i = NodeMapSlot(map, key);
+    for (; map->entries[i].key != key; i = (i + 1) & mask) {
+        if (map->entries[i].key == NULL) {
+            return TREE_OK;
+        }
+    }
+
+    // backward shift deletion keeps probe chains intact without tombstones
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; map->entries[j].key != NULL; j = (j + 1) & mask) {
+        size_t home = NodeMapSlot(map, map->entries[j].key);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            map->entries[hole] = map->entries[j];
+            hole = j;
+        }
+    }
+
+    map->entries[hole].key = NULL;
+    --map->size;
+
+    return TREE_OK;
+}
+
+static TreeErr_t NodeMapGrow(NodeMap_t* map) {
+    NodeMap_t new_map = {};
+    if (NodeMapInit(&new_map, map->capacity) != TREE_OK) {
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->entries[i].key != NULL) {
+            *NodeMapInsert(&new_map, map->entries[i].key) = map->entries[i].info;
+        }
+    }
+
+    NodeMapDestroy(map);
+    *map = new_map;
+
+    return TREE_OK;
+}
+
+TreeErr_t NodeMapBuildHashes(NodeMap_t* map, const Node_t* root) {
+    assert( map != NULL );
+    assert( root != NULL );
+
+    TreeErr_t err = TREE_OK;
+    size_t size = 0;
+    RecursiveBuildHashes(map, root, &size, &err);
+
+    return err;
+}
+
+static uint64_t RecursiveBuildHashes(NodeMap_t* map, const Node_t* node, size_t* size, TreeErr_t* err) {
+    uint64_t left_hash = 0, right_hash = 0;
+    size_t left_size = 0, right_size = 0;
+
+    if (node->left != NULL) {
+        left_hash = RecursiveBuildHashes(map, node->left, &left_size, err);
+    }
+    if (node->right != NULL) {
+        right_hash = RecursiveBuildHashes(map, node->right, &right_size, err);
+    }
+
+    *size = 1 + left_size + right_size;
+
+    uint64_t hash = NodeHash(node, left_hash, right_hash);
+
+    NodeInfo_t* info = NodeMapInsert(map, node);
+    if (info == NULL) {
+        *err = TREE_ALLOCATION_FAILED;
+        return hash;
+    }
+
+    info->hash = hash;
+    info->size = *size;
+
+    return hash;
+}
@@ -0,0 +1,33 @@
+#ifndef NODE_MAP_H
+#define NODE_MAP_H
+
+#include "tree.h"
+
+struct NodeInfo_t {
+    uint64_t hash;
+    size_t size;
+    unsigned flags;
+    void* data;
+};
+
+struct NodeMapEntry_t {
+    const Node_t* key;
+    NodeInfo_t info;
+};
+
+struct NodeMap_t {
+    NodeMapEntry_t* entries;
+    size_t size;
+    size_t capacity;
+};
+
+TreeErr_t NodeMapInit(NodeMap_t* map, size_t capacity);
+TreeErr_t NodeMapDestroy(NodeMap_t* map);
+
+NodeInfo_t* NodeMapInsert(NodeMap_t* map, const Node_t* key);
+NodeInfo_t* NodeMapFind(const NodeMap_t* map, const Node_t* key);
+TreeErr_t NodeMapErase(NodeMap_t* map, const Node_t* key);
+
+TreeErr_t NodeMapBuildHashes(NodeMap_t* map, const Node_t* root);
+
+#endif // NODE_MAP_H
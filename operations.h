@@ -0,0 +1,217 @@
+#ifndef OPERATIONS_H
+#define OPERATIONS_H
+
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "tree.h"
+#include "scalar.h"
+
+struct DiffCtx_t;
+
+typedef double (*EvalKernel)(double a, double b);              // unary functions take b
+typedef Node_t* (*DiffRule)(const Node_t* node, DiffCtx_t* ctx);
+typedef void (*PartialKernel)(double a, double b, double value, double* da, double* db);
+
+// Rules live in dif_math.cpp
+Node_t* DiffRuleAdd (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleSub (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleMul (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleDiv (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleExp (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleSqrt(const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleLn  (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleLog (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleSin (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleCos (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleTan (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleCot (const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleSinh(const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleCosh(const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleTanh(const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleCoth(const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleAsin(const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleAcos(const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleAtan(const Node_t* node, DiffCtx_t* ctx);
+Node_t* DiffRuleAcot(const Node_t* node, DiffCtx_t* ctx);
+
+// Local partial derivatives for tape tangent and adjoint passes, value is the
+// operation result. Those that divide give inf at a pole, see SCALAR_IEEE_DIVISION.
+inline void PartialAdd (double,   double,   double,   double* da, double* db) { *da = 1;     *db = 1; }
+inline void PartialSub (double,   double,   double,   double* da, double* db) { *da = 1;     *db = -1; }
+inline void PartialMul (double a, double b, double,   double* da, double* db) { *da = b;     *db = a; }
+SCALAR_IEEE_DIVISION inline void PartialDiv (double a, double b, double,   double* da, double* db) { *da = 1 / b; *db = -a / (b * b); }
+inline void PartialExp (double a, double b, double v, double* da, double* db) { *da = b * pow(a, b - 1); *db = v * log(a); }
+SCALAR_IEEE_DIVISION inline void PartialSqrt(double,   double,   double v, double* da, double* db) { *da = 0;     *db = 0.5 / v; }
+SCALAR_IEEE_DIVISION inline void PartialLn  (double,   double b, double,   double* da, double* db) { *da = 0;     *db = 1 / b; }
+SCALAR_IEEE_DIVISION inline void PartialLog (double a, double b, double v, double* da, double* db) { *da = -v / (a * log(a)); *db = 1 / (b * log(a)); }
+inline void PartialSin (double,   double b, double,   double* da, double* db) { *da = 0;     *db = cos(b); }
+inline void PartialCos (double,   double b, double,   double* da, double* db) { *da = 0;     *db = -sin(b); }
+inline void PartialTan (double,   double,   double v, double* da, double* db) { *da = 0;     *db = 1 + v * v; }
+inline void PartialCot (double,   double,   double v, double* da, double* db) { *da = 0;     *db = -(1 + v * v); }
+inline void PartialSinh(double,   double b, double,   double* da, double* db) { *da = 0;     *db = cosh(b); }
+inline void PartialCosh(double,   double b, double,   double* da, double* db) { *da = 0;     *db = sinh(b); }
+inline void PartialTanh(double,   double,   double v, double* da, double* db) { *da = 0;     *db = 1 - v * v; }
+inline void PartialCoth(double,   double,   double v, double* da, double* db) { *da = 0;     *db = 1 - v * v; }
+SCALAR_IEEE_DIVISION inline void PartialAsin(double,   double b, double,   double* da, double* db) { *da = 0;     *db = 1 / sqrt(1 - b * b); }
+SCALAR_IEEE_DIVISION inline void PartialAcos(double,   double b, double,   double* da, double* db) { *da = 0;     *db = -1 / sqrt(1 - b * b); }
+inline void PartialAtan(double,   double b, double,   double* da, double* db) { *da = 0;     *db = 1 / (1 + b * b); }
+inline void PartialAcot(double,   double b, double,   double* da, double* db) { *da = 0;     *db = -1 / (1 + b * b); }
+
+const int PRECEDENCE_ADD  = 1;
+const int PRECEDENCE_MUL  = 2;
+const int PRECEDENCE_EXP  = 3;
+const int PRECEDENCE_FUNC = 4;
+
+// latex: template, @1 - left operand, @2 - right operand. Operands of infix
+// templates get parentheses when their precedence is lower.
+struct OperationInfo_t {
+    Operation_t operation;
+    const char* name;
+    size_t arity;
+    int precedence;
+    int infix;
+    const char* latex;
+    EvalKernel eval;
+    DiffRule diff;
+    int linear;                 // the derivative needs only the operands' derivatives
+    PartialKernel partial;
+    double cost;                // rough flops of one evaluation, the default for dif_lower
+};
+
+// Indexed by Operation_t. A new operation needs an enum value, a row here,
+// its scalar kernel in ScalarFuncOp and its derivative rule and partials.
+constexpr OperationInfo_t OPERATIONS[] = {
+    {OPERATION_UNDEF, "U",      0, 0,               0, "",                           NULL,               NULL,         0, NULL,         0},
+    {OPERATION_ADD,   "+",      2, PRECEDENCE_ADD,  1, "@1+@2",                      ScalarAdd<double>,  DiffRuleAdd,  1, PartialAdd,   1},
+    {OPERATION_SUB,   "-",      2, PRECEDENCE_ADD,  1, "@1-@2",                      ScalarSub<double>,  DiffRuleSub,  1, PartialSub,   1},
+    {OPERATION_MUL,   "*",      2, PRECEDENCE_MUL,  1, "@1*@2",                      ScalarMul<double>,  DiffRuleMul,  0, PartialMul,   1},
+    {OPERATION_DIV,   "/",      2, PRECEDENCE_MUL,  0, "\\frac{@1}{@2}",             ScalarDiv<double>,  DiffRuleDiv,  0, PartialDiv,   4},
+    {OPERATION_EXP,   "^",      2, PRECEDENCE_EXP,  0, "{@1}^{@2}",                  ScalarExp<double>,  DiffRuleExp,  0, PartialExp,  40},
+    {OPERATION_SQRT,  "sqrt",   1, PRECEDENCE_FUNC, 0, "\\sqrt{@2}",                 ScalarSqrt<double>, DiffRuleSqrt, 0, PartialSqrt,  6},
+    {OPERATION_LN,    "ln",     1, PRECEDENCE_FUNC, 0, "\\ln(@2)",                   ScalarLn<double>,   DiffRuleLn,   0, PartialLn,   20},
+    {OPERATION_LOG,   "log",    2, PRECEDENCE_FUNC, 0, "\\log_{@1}(@2)",             ScalarLog<double>,  DiffRuleLog,  0, PartialLog,  42},
+    {OPERATION_SIN,   "sin",    1, PRECEDENCE_FUNC, 0, "\\sin(@2)",                  ScalarSin<double>,  DiffRuleSin,  0, PartialSin,  20},
+    {OPERATION_COS,   "cos",    1, PRECEDENCE_FUNC, 0, "\\cos(@2)",                  ScalarCos<double>,  DiffRuleCos,  0, PartialCos,  20},
+    {OPERATION_TAN,   "tan",    1, PRECEDENCE_FUNC, 0, "\\tan(@2)",                  ScalarTan<double>,  DiffRuleTan,  0, PartialTan,  30},
+    {OPERATION_COT,   "cot",    1, PRECEDENCE_FUNC, 0, "\\cot(@2)",                  ScalarCot<double>,  DiffRuleCot,  0, PartialCot,  34},
+    {OPERATION_SINH,  "sinh",   1, PRECEDENCE_FUNC, 0, "\\sinh(@2)",                 ScalarSinh<double>, DiffRuleSinh, 0, PartialSinh, 30},
+    {OPERATION_COSH,  "cosh",   1, PRECEDENCE_FUNC, 0, "\\cosh(@2)",                 ScalarCosh<double>, DiffRuleCosh, 0, PartialCosh, 30},
+    {OPERATION_TANH,  "tanh",   1, PRECEDENCE_FUNC, 0, "\\tanh(@2)",                 ScalarTanh<double>, DiffRuleTanh, 0, PartialTanh, 30},
+    {OPERATION_COTH,  "coth",   1, PRECEDENCE_FUNC, 0, "\\coth(@2)",                 ScalarCoth<double>, DiffRuleCoth, 0, PartialCoth, 34},
+    {OPERATION_ASIN,  "arcsin", 1, PRECEDENCE_FUNC, 0, "\\arcsin(@2)",               ScalarAsin<double>, DiffRuleAsin, 0, PartialAsin, 30},
+    {OPERATION_ACOS,  "arccos", 1, PRECEDENCE_FUNC, 0, "\\arccos(@2)",               ScalarAcos<double>, DiffRuleAcos, 0, PartialAcos, 30},
+    {OPERATION_ATAN,  "arctan", 1, PRECEDENCE_FUNC, 0, "\\arctan(@2)",               ScalarAtan<double>, DiffRuleAtan, 0, PartialAtan, 25},
+    {OPERATION_ACOT,  "arccot", 1, PRECEDENCE_FUNC, 0, "\\operatorname{arccot}(@2)", ScalarAcot<double>, DiffRuleAcot, 0, PartialAcot, 26},
+};
+
+const size_t OPERATION_COUNT = sizeof(OPERATIONS) / sizeof(OPERATIONS[0]);
+
+constexpr int OperationsOrdered() {
+    for (size_t i = 0; i < OPERATION_COUNT; i++) {
+        if ((size_t)OPERATIONS[i].operation != i) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static_assert(OperationsOrdered(), "OPERATIONS must be indexed by Operation_t");
+
+// Perfect hash of the operation names: the seed is searched at compile time
+// so that every name lands in its own slot.
+const size_t OPERATION_HASH_SIZE = 64;
+
+struct OperationHash_t {
+    uint32_t seed;
+    signed char slots[OPERATION_HASH_SIZE];     // index in OPERATIONS, -1 - empty
+};
+
+constexpr uint32_t OperationNameHash(const char* str, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (; *str != '\0'; ++str) {
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    }
+
+    return hash ^ (hash >> 15);
+}
+
+constexpr OperationHash_t OperationHashBuild() {
+    OperationHash_t hash = {};
+
+    for (uint32_t seed = 1; seed < 100000; seed++) {
+        for (size_t i = 0; i < OPERATION_HASH_SIZE; i++) {
+            hash.slots[i] = -1;
+        }
+
+        int perfect = 1;
+        for (size_t i = 0; i < OPERATION_COUNT && perfect; i++) {
+            size_t slot = OperationNameHash(OPERATIONS[i].name, seed) % OPERATION_HASH_SIZE;
+            if (hash.slots[slot] != -1) {
+                perfect = 0;
+            }
+            hash.slots[slot] = (signed char)i;
+        }
+
+        if (perfect) {
+            hash.seed = seed;
+            return hash;
+        }
+    }
+
+    hash.seed = 0;
+    return hash;
+}
+
+constexpr OperationHash_t OPERATION_HASH = OperationHashBuild();
+
+static_assert(OPERATION_HASH.seed != 0, "no perfect hash seed for the operation names");
+
+// NULL if str is not an operation name
+inline const OperationInfo_t* OperationFind(const char* str) {
+    int index = OPERATION_HASH.slots[OperationNameHash(str, OPERATION_HASH.seed) % OPERATION_HASH_SIZE];
+    if (index < 0 || strcmp(OPERATIONS[index].name, str) != 0) {
+        return NULL;
+    }
+
+    return &OPERATIONS[index];
+}
+
+inline const OperationInfo_t* OperationGet(Operation_t operation) {
+    return ((size_t)operation < OPERATION_COUNT) ? &OPERATIONS[operation] : NULL;
+}
+
+// FoldFuncOp in any scalar type: the value of an operation node on number
+// operands, 0 if there is none or it is not finite
+template <typename S>
+inline int FoldFuncOpScalar(const Node_t* node, S* value) {
+    if (node->type != TYPE_OPERATION || node->right == NULL || node->right->type != TYPE_NUMBER) {
+        return 0;
+    }
+
+    const OperationInfo_t* info = OperationGet(node->data.operation);
+    if (info == NULL || info->eval == NULL) {
+        return 0;
+    }
+
+    S left = ScalarTraits<S>::Splat(0);
+    if (info->arity == 2) {
+        if (node->left == NULL || node->left->type != TYPE_NUMBER) {
+            return 0;
+        }
+        left = ScalarTraits<S>::Splat(node->left->data.number);
+    }
+
+    S result = ScalarFuncOp(node->data.operation, left, ScalarTraits<S>::Splat(node->right->data.number));
+    if (!ScalarTraits<S>::Finite(result)) {
+        return 0;
+    }
+
+    *value = result;
+
+    return 1;
+}
+
+#endif // OPERATIONS_H
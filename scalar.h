@@ -0,0 +1,201 @@
+#ifndef SCALAR_H
+#define SCALAR_H
+
+#include <math.h>
+#include <stddef.h>
+
+#include "tree.h"
+
+/*
+Scalar types the evaluation is instantiated for: float, double, long double
+and Lanes_t, a fixed batch of N points of one of them evaluated together.
+Arithmetic on Lanes_t is a loop over the lanes the compiler can vectorize;
+the library functions still run once per lane.
+
+Tree numbers are doubles whatever the scalar type: long double evaluation
+rounds less on the way, not in the constants.
+*/
+template <typename T, size_t N>
+struct Lanes_t {
+    T lane[N];
+};
+
+// Division by zero gives inf or NaN on purpose: evaluation tells the points
+// outside a domain by their non-finite values. The kernels that divide opt out
+// of -fsanitize=float-divide-by-zero.
+#define SCALAR_IEEE_DIVISION __attribute__((no_sanitize("float-divide-by-zero")))
+
+// Elem_t - the type of one lane, EPS - the tolerance of ScalarIsEqual
+template <typename S> struct ScalarTraits;
+
+// EPS of double is the one the optimizer always used, float rounds too much
+// for it. Long double keeps it: the constants it compares are doubles.
+template <> struct ScalarTraits<float> {
+    typedef float Elem_t;
+    static const size_t LANES = 1;
+    static constexpr float EPS = 1e-4f;
+    static float Splat(long double x) { return (float)x; }
+    static float Lane(float x, size_t) { return x; }
+    static void SetLane(float* x, size_t, float value) { *x = value; }
+    static int Finite(float x) { return isfinite(x); }
+};
+
+template <> struct ScalarTraits<double> {
+    typedef double Elem_t;
+    static const size_t LANES = 1;
+    static constexpr double EPS = 1e-7;
+    static double Splat(long double x) { return (double)x; }
+    static double Lane(double x, size_t) { return x; }
+    static void SetLane(double* x, size_t, double value) { *x = value; }
+    static int Finite(double x) { return isfinite(x); }
+};
+
+template <> struct ScalarTraits<long double> {
+    typedef long double Elem_t;
+    static const size_t LANES = 1;
+    static constexpr long double EPS = 1e-7L;
+    static long double Splat(long double x) { return x; }
+    static long double Lane(long double x, size_t) { return x; }
+    static void SetLane(long double* x, size_t, long double value) { *x = value; }
+    static int Finite(long double x) { return isfinite(x); }
+};
+
+template <typename T, size_t N> struct ScalarTraits<Lanes_t<T, N>> {
+    typedef T Elem_t;
+    static const size_t LANES = N;
+
+    static Lanes_t<T, N> Splat(long double x) {
+        Lanes_t<T, N> result = {};
+        for (size_t i = 0; i < N; i++) {
+            result.lane[i] = ScalarTraits<T>::Splat(x);
+        }
+
+        return result;
+    }
+
+    static T Lane(const Lanes_t<T, N>& x, size_t i) { return x.lane[i]; }
+    static void SetLane(Lanes_t<T, N>* x, size_t i, T value) { x->lane[i] = value; }
+
+    static int Finite(const Lanes_t<T, N>& x) {
+        for (size_t i = 0; i < N; i++) {
+            if (!isfinite(x.lane[i])) {
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+};
+
+#define LANES_OPERATOR(op_, attr_)                                                              \
+template <typename T, size_t N>                                                                 \
+attr_ inline Lanes_t<T, N> operator op_(const Lanes_t<T, N>& a, const Lanes_t<T, N>& b) {       \
+    Lanes_t<T, N> result = {};                                                                  \
+    for (size_t i = 0; i < N; i++) {                                                            \
+        result.lane[i] = a.lane[i] op_ b.lane[i];                                               \
+    }                                                                                           \
+                                                                                                \
+    return result;                                                                              \
+}
+
+#define LANES_FUNCTION(func_)                                                                   \
+template <typename T, size_t N>                                                                 \
+inline Lanes_t<T, N> func_(const Lanes_t<T, N>& a) {                                            \
+    Lanes_t<T, N> result = {};                                                                  \
+    for (size_t i = 0; i < N; i++) {                                                            \
+        result.lane[i] = func_(a.lane[i]);                                                      \
+    }                                                                                           \
+                                                                                                \
+    return result;                                                                              \
+}
+
+LANES_OPERATOR(+, )
+LANES_OPERATOR(-, )
+LANES_OPERATOR(*, )
+LANES_OPERATOR(/, SCALAR_IEEE_DIVISION)
+
+LANES_FUNCTION(sqrt)
+LANES_FUNCTION(log)
+LANES_FUNCTION(sin)
+LANES_FUNCTION(cos)
+LANES_FUNCTION(tan)
+LANES_FUNCTION(sinh)
+LANES_FUNCTION(cosh)
+LANES_FUNCTION(tanh)
+LANES_FUNCTION(asin)
+LANES_FUNCTION(acos)
+LANES_FUNCTION(atan)
+
+#undef LANES_OPERATOR
+#undef LANES_FUNCTION
+
+template <typename T, size_t N>
+inline Lanes_t<T, N> pow(const Lanes_t<T, N>& a, const Lanes_t<T, N>& b) {
+    Lanes_t<T, N> result = {};
+    for (size_t i = 0; i < N; i++) {
+        result.lane[i] = pow(a.lane[i], b.lane[i]);
+    }
+
+    return result;
+}
+
+// Evaluation kernels of OPERATIONS, unary functions take b
+template <typename S> inline S ScalarAdd (S a, S b) { return a + b; }
+template <typename S> inline S ScalarSub (S a, S b) { return a - b; }
+template <typename S> inline S ScalarMul (S a, S b) { return a * b; }
+template <typename S> SCALAR_IEEE_DIVISION inline S ScalarDiv (S a, S b) { return a / b; }
+template <typename S> inline S ScalarExp (S a, S b) { return pow(a, b); }
+template <typename S> inline S ScalarSqrt(S,   S b) { return sqrt(b); }
+template <typename S> inline S ScalarLn  (S,   S b) { return log(b); }
+template <typename S> SCALAR_IEEE_DIVISION inline S ScalarLog (S a, S b) { return log(b) / log(a); }
+template <typename S> inline S ScalarSin (S,   S b) { return sin(b); }
+template <typename S> inline S ScalarCos (S,   S b) { return cos(b); }
+template <typename S> inline S ScalarTan (S,   S b) { return tan(b); }
+template <typename S> SCALAR_IEEE_DIVISION inline S ScalarCot (S,   S b) { return ScalarTraits<S>::Splat(1) / tan(b); }
+template <typename S> inline S ScalarSinh(S,   S b) { return sinh(b); }
+template <typename S> inline S ScalarCosh(S,   S b) { return cosh(b); }
+template <typename S> inline S ScalarTanh(S,   S b) { return tanh(b); }
+template <typename S> SCALAR_IEEE_DIVISION inline S ScalarCoth(S,   S b) { return ScalarTraits<S>::Splat(1) / tanh(b); }
+template <typename S> inline S ScalarAsin(S,   S b) { return asin(b); }
+template <typename S> inline S ScalarAcos(S,   S b) { return acos(b); }
+template <typename S> inline S ScalarAtan(S,   S b) { return atan(b); }
+template <typename S> inline S ScalarAcot(S,   S b) { return ScalarTraits<S>::Splat(M_PI_2l) - atan(b); }
+
+// GetFuncOp of any scalar type: a switch rather than the table, so that the
+// kernels inline into the evaluation loops
+template <typename S>
+inline S ScalarFuncOp(Operation_t operation, S a, S b) {
+    switch (operation) {
+    case OPERATION_ADD:  return ScalarAdd (a, b);
+    case OPERATION_SUB:  return ScalarSub (a, b);
+    case OPERATION_MUL:  return ScalarMul (a, b);
+    case OPERATION_DIV:  return ScalarDiv (a, b);
+    case OPERATION_EXP:  return ScalarExp (a, b);
+    case OPERATION_SQRT: return ScalarSqrt(a, b);
+    case OPERATION_LN:   return ScalarLn  (a, b);
+    case OPERATION_LOG:  return ScalarLog (a, b);
+    case OPERATION_SIN:  return ScalarSin (a, b);
+    case OPERATION_COS:  return ScalarCos (a, b);
+    case OPERATION_TAN:  return ScalarTan (a, b);
+    case OPERATION_COT:  return ScalarCot (a, b);
+    case OPERATION_SINH: return ScalarSinh(a, b);
+    case OPERATION_COSH: return ScalarCosh(a, b);
+    case OPERATION_TANH: return ScalarTanh(a, b);
+    case OPERATION_COTH: return ScalarCoth(a, b);
+    case OPERATION_ASIN: return ScalarAsin(a, b);
+    case OPERATION_ACOS: return ScalarAcos(a, b);
+    case OPERATION_ATAN: return ScalarAtan(a, b);
+    case OPERATION_ACOT: return ScalarAcot(a, b);
+
+    case OPERATION_UNDEF:
+    default:
+        return ScalarTraits<S>::Splat(0);
+    }
+}
+
+template <typename S>
+inline int ScalarIsEqual(S a, S b) {
+    return fabs(a - b) < ScalarTraits<S>::EPS;
+}
+
+#endif // SCALAR_H
@@ -0,0 +1,290 @@
+#include "scan.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "tree.h"
+
+const size_t SCAN_LOOKAHEAD = 2;        // nil is matched at 'n' by the two bytes after it
+
+#if defined(__AVX2__)
+
+struct ScanBlock_t {
+    __m256i v[2];
+};
+
+#elif defined(__SSE2__)
+
+struct ScanBlock_t {
+    __m128i v[4];
+};
+
+#else
+
+struct ScanBlock_t {
+    unsigned char v[SCAN_BLOCK];
+};
+
+#endif
+
+struct ScanMasks_t {
+    uint64_t quote;
+    uint64_t open;
+    uint64_t close;
+    uint64_t nil;               // 'n' followed by "il"
+    uint64_t space;
+};
+
+static ScanErr_t ScannerFill(Scanner_t* scanner);
+static void ScanBlock(Scanner_t* scanner, const char* block, uint64_t valid);
+static void ClassifyBlock(const char* block, ScanMasks_t* masks);
+static ScanBlock_t LoadBlock(const char* block);
+static uint64_t MatchByte(const ScanBlock_t* block, char c);
+static uint64_t MatchSpace(const ScanBlock_t* block);
+static uint64_t PrefixXor(uint64_t mask);
+
+ScanErr_t ScannerInit(Scanner_t* scanner, const char* str, size_t length) {
+    assert( scanner != NULL );
+    assert( str != NULL );
+
+    *scanner = {};
+    scanner->str    = str;
+    scanner->length = length;
+
+    scanner->tape = (size_t*)calloc(SCAN_TAPE_CAPACITY, sizeof(size_t));
+    if (scanner->tape == NULL) {
+        return SCAN_ALLOCATION_FAILED;
+    }
+
+    return SCAN_OK;
+}
+
+void ScannerDestroy(Scanner_t* scanner) {
+    assert( scanner != NULL );
+
+    FREE(scanner->tape);
+    scanner->tape_size = 0;
+    scanner->tape_pos  = 0;
+}
+
+ScanErr_t ScannerNext(Scanner_t* scanner, size_t* offset) {
+    assert( scanner != NULL );
+    assert( offset != NULL );
+
+    if (scanner->tape_pos == scanner->tape_size) {
+        ScanErr_t err = ScannerFill(scanner);
+        if (err != SCAN_OK) {
+            return err;
+        }
+    }
+
+    *offset = scanner->tape[scanner->tape_pos++];
+
+    return SCAN_OK;
+}
+
+// Classifies blocks until the tape has tokens or the input ends
+static ScanErr_t ScannerFill(Scanner_t* scanner) {
+    scanner->tape_size = 0;
+    scanner->tape_pos  = 0;
+
+    while (scanner->tape_size == 0 && scanner->err == SCAN_OK && scanner->position < scanner->length) {
+        while (scanner->tape_size + SCAN_BLOCK <= SCAN_TAPE_CAPACITY && scanner->err == SCAN_OK) {
+            size_t left = scanner->length - scanner->position;
+
+            // the lookahead of a full block may read the terminating '\0', not past it
+            if (left >= SCAN_BLOCK + SCAN_LOOKAHEAD - 1) {
+                ScanBlock(scanner, scanner->str + scanner->position, ~0ull);
+                scanner->position += SCAN_BLOCK;
+                continue;
+            }
+
+            if (left == 0) {
+                break;
+            }
+
+            char tail[SCAN_BLOCK + SCAN_LOOKAHEAD] = {};
+            memcpy(tail, scanner->str + scanner->position, left);
+            ScanBlock(scanner, tail, (left < SCAN_BLOCK) ? (1ull << left) - 1 : ~0ull);
+            scanner->position += (left < SCAN_BLOCK) ? left : SCAN_BLOCK;
+        }
+    }
+
+    if (scanner->tape_size != 0) {
+        return SCAN_OK;
+    }
+    if (scanner->err != SCAN_OK) {
+        return scanner->err;
+    }
+    if (scanner->in_string) {
+        scanner->err = SCAN_UNTERMINATED_STRING;
+        scanner->err_offset = scanner->length;
+        return scanner->err;
+    }
+
+    return SCAN_END;
+}
+
+static void ScanBlock(Scanner_t* scanner, const char* block, uint64_t valid) {
+    ScanMasks_t masks = {};
+    ClassifyBlock(block, &masks);
+
+    // a string runs from its opening quote up to the closing one
+    uint64_t in_string = PrefixXor(masks.quote & valid) ^ scanner->in_string;
+    scanner->in_string = (uint64_t)0 - (in_string >> (SCAN_BLOCK - 1));
+
+    uint64_t outside  = ~in_string & ~masks.quote & valid;
+    uint64_t nil      = masks.nil & outside;
+    uint64_t nil_tail = (nil << 1) | (nil << 2) | scanner->nil_tail;
+    scanner->nil_tail = (nil >> (SCAN_BLOCK - 2)) | (nil >> (SCAN_BLOCK - 1));
+
+    uint64_t structural = (masks.open | masks.close | nil) & outside;
+    uint64_t stray = outside & ~(structural | nil_tail | masks.space);
+    if (stray != 0) {
+        scanner->err = SCAN_STRAY_CHAR;
+        scanner->err_offset = scanner->position + (size_t)__builtin_ctzll(stray);
+        return;
+    }
+
+    uint64_t tokens = structural | (masks.quote & valid);
+    size_t* tape = scanner->tape + scanner->tape_size;
+    size_t count = 0;
+
+    while (tokens != 0) {
+        tape[count++] = scanner->position + (size_t)__builtin_ctzll(tokens);
+        tokens &= tokens - 1;
+    }
+    scanner->tape_size += count;
+}
+
+static void ClassifyBlock(const char* block, ScanMasks_t* masks) {
+    ScanBlock_t bytes = LoadBlock(block);
+    ScanBlock_t next  = LoadBlock(block + 1);
+    ScanBlock_t after = LoadBlock(block + 2);
+
+    masks->quote = MatchByte(&bytes, '"');
+    masks->open  = MatchByte(&bytes, '(');
+    masks->close = MatchByte(&bytes, ')');
+    masks->nil   = MatchByte(&bytes, 'n') & MatchByte(&next, 'i') & MatchByte(&after, 'l');
+    masks->space = MatchSpace(&bytes);
+}
+
+#if defined(__AVX2__)
+
+static ScanBlock_t LoadBlock(const char* block) {
+    ScanBlock_t loaded = {};
+    loaded.v[0] = _mm256_loadu_si256((const __m256i*)block);
+    loaded.v[1] = _mm256_loadu_si256((const __m256i*)(block + 32));
+
+    return loaded;
+}
+
+static uint64_t MatchByte(const ScanBlock_t* block, char c) {
+    __m256i pattern = _mm256_set1_epi8(c);
+    uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block->v[0], pattern));
+    uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block->v[1], pattern));
+
+    return lo | (hi << 32);
+}
+
+// ' ' and '\t'..'\r', as isspace in the C locale
+static uint64_t MatchSpace(const ScanBlock_t* block) {
+    uint64_t mask = 0;
+
+    for (size_t i = 0; i < 2; i++) {
+        __m256i control = _mm256_sub_epi8(block->v[i], _mm256_set1_epi8('\t'));
+        __m256i is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8('\r' - '\t')), control);
+        __m256i is_space = _mm256_or_si256(is_control, _mm256_cmpeq_epi8(block->v[i], _mm256_set1_epi8(' ')));
+        mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_space) << (32 * i);
+    }
+
+    return mask;
+}
+
+#elif defined(__SSE2__)
+
+static ScanBlock_t LoadBlock(const char* block) {
+    ScanBlock_t loaded = {};
+    for (size_t i = 0; i < 4; i++) {
+        loaded.v[i] = _mm_loadu_si128((const __m128i*)(block + 16 * i));
+    }
+
+    return loaded;
+}
+
+static uint64_t MatchByte(const ScanBlock_t* block, char c) {
+    __m128i pattern = _mm_set1_epi8(c);
+    uint64_t mask = 0;
+
+    for (size_t i = 0; i < 4; i++) {
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block->v[i], pattern)) << (16 * i);
+    }
+
+    return mask;
+}
+
+// ' ' and '\t'..'\r', as isspace in the C locale
+static uint64_t MatchSpace(const ScanBlock_t* block) {
+    uint64_t mask = 0;
+
+    for (size_t i = 0; i < 4; i++) {
+        __m128i control = _mm_sub_epi8(block->v[i], _mm_set1_epi8('\t'));
+        __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8('\r' - '\t')), control);
+        __m128i is_space = _mm_or_si128(is_control, _mm_cmpeq_epi8(block->v[i], _mm_set1_epi8(' ')));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_space) << (16 * i);
+    }
+
+    return mask;
+}
+
+#else
+
+static ScanBlock_t LoadBlock(const char* block) {
+    ScanBlock_t loaded = {};
+    memcpy(loaded.v, block, SCAN_BLOCK);
+
+    return loaded;
+}
+
+static uint64_t MatchByte(const ScanBlock_t* block, char c) {
+    uint64_t mask = 0;
+
+    for (size_t i = 0; i < SCAN_BLOCK; i++) {
+        mask |= (uint64_t)(block->v[i] == (unsigned char)c) << i;
+    }
+
+    return mask;
+}
+
+// ' ' and '\t'..'\r', as isspace in the C locale
+static uint64_t MatchSpace(const ScanBlock_t* block) {
+    uint64_t mask = 0;
+
+    for (size_t i = 0; i < SCAN_BLOCK; i++) {
+        unsigned char c = block->v[i];
+        mask |= (uint64_t)(c == ' ' || (c >= '\t' && c <= '\r')) << i;
+    }
+
+    return mask;
+}
+
+#endif
+
+// Bit i is the parity of the bits 0..i
+static uint64_t PrefixXor(uint64_t mask) {
+    mask ^= mask << 1;
+    mask ^= mask << 2;
+    mask ^= mask << 4;
+    mask ^= mask << 8;
+    mask ^= mask << 16;
+    mask ^= mask << 32;
+
+    return mask;
+}
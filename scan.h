@@ -0,0 +1,53 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Structural scanner for the input.txt format. Blocks of SCAN_BLOCK bytes are
+classified at once into bit masks of quotes, parentheses, nil and spaces;
+the offsets of the structural characters go to a tape the parser reads
+them from. Everything between two tokens outside a string has to be a
+space, so the parser never looks at the bytes in between.
+
+Tokens, by the character at their offset:
+    '(' ')'     parentheses outside strings
+    '"'         both quotes of a string, strings have no escapes
+    'n'         the start of nil
+
+The tape is refilled as the parser drains it, so a dump of any size needs
+SCAN_TAPE_CAPACITY offsets of memory.
+*/
+
+const size_t SCAN_BLOCK         = 64;
+const size_t SCAN_TAPE_CAPACITY = 4096;
+
+enum ScanErr_t {
+    SCAN_OK,
+    SCAN_END,
+    SCAN_STRAY_CHAR,
+    SCAN_UNTERMINATED_STRING,
+    SCAN_ALLOCATION_FAILED
+};
+
+struct Scanner_t {
+    const char* str;
+    size_t length;
+    size_t position;            // start of the next block to classify
+    uint64_t in_string;         // all ones when the last block ended inside a string
+    uint64_t nil_tail;          // bits of a nil that started in the last block
+    size_t* tape;
+    size_t tape_size;
+    size_t tape_pos;
+    ScanErr_t err;              // stops the scan, reported once the tape is drained
+    size_t err_offset;
+};
+
+ScanErr_t ScannerInit(Scanner_t* scanner, const char* str, size_t length);
+void ScannerDestroy(Scanner_t* scanner);
+
+// SCAN_END after the last token
+ScanErr_t ScannerNext(Scanner_t* scanner, size_t* offset);
+
+#endif // SCAN_H
@@ -0,0 +1,594 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tree.h"
+#include "io.h"
+#include "dif_math.h"
+#include "dif_optimize.h"
+#include "dif_eval.h"
+#include "metrics.h"
+
+const size_t SERVER_CACHE_ENTRIES    = 4096;
+const size_t SERVER_CACHE_NODES      = 1 << 22;
+const size_t SERVER_SIMPLIFY_PASSES  = 8;
+
+enum ServerOutput_t {
+    OUTPUT_SIMPLIFY    = 1 << 0,
+    OUTPUT_LATEX       = 1 << 1,
+    OUTPUT_VALUE       = 1 << 2,
+    OUTPUT_DERIV       = 1 << 3,
+    OUTPUT_DERIV_LATEX = 1 << 4,
+    OUTPUT_DERIV_VALUE = 1 << 5
+};
+
+const unsigned OUTPUT_ANY_DERIV = OUTPUT_DERIV | OUTPUT_DERIV_LATEX | OUTPUT_DERIV_VALUE;
+
+struct OutputMapping {
+    const char* name;
+    unsigned mask;
+};
+
+static const OutputMapping output_names[] = {
+    {"simplify",    OUTPUT_SIMPLIFY},
+    {"latex",       OUTPUT_LATEX},
+    {"value",       OUTPUT_VALUE},
+    {"deriv",       OUTPUT_DERIV},
+    {"deriv_latex", OUTPUT_DERIV_LATEX},
+    {"deriv_value", OUTPUT_DERIV_VALUE},
+};
+
+enum RequestErr_t {
+    REQUEST_OK,
+    REQUEST_BAD_FORMAT,
+    REQUEST_UNKNOWN_OUTPUT,
+    REQUEST_TOO_MANY_VARS,
+    REQUEST_BAD_VALUE,
+    REQUEST_SYNTAX_ERROR,
+    REQUEST_UNBOUND_VARIABLE,
+    REQUEST_EVAL_FAILED,
+    REQUEST_DIFF_FAILED,
+    REQUEST_PRINT_FAILED,
+    REQUEST_ALLOCATION_FAILED,
+    REQUEST_BUDGET_EXCEEDED
+};
+
+static const char* request_errors[] = {
+    "ok",
+    "expected: <id> <outputs> <var> [<name>=<value> ...] <tree>",
+    "unknown output",
+    "too many variables",
+    "bad variable value",
+    "tree syntax error",
+    "unbound variable",
+    "evaluation failed",
+    "differentiation failed",
+    "printing failed",
+    "allocation failed",
+    "budget exceeded"
+};
+
+struct ServerRequest_t {
+    char* id;
+    char* var;
+    char* tree;
+    unsigned outputs;
+    EvalVar_t vars[SERVER_MAX_VARS];
+    size_t var_count;
+};
+
+// Each worker keeps its line buffer warm across requests.
+struct ServerWorker_t {
+    Server_t* server;
+    ServerStream_t* stream;
+    pthread_t thread;
+    Buffer_t line;
+};
+
+static ServerErr_t ServerRunWorkers(Server_t* server, ServerStream_t* stream, void* (*func)(void*));
+static void* StreamWorker(void* arg);
+static void* SocketWorker(void* arg);
+static void ServeStream(ServerWorker_t* worker);
+static void ServerStop(Server_t* server);
+static int ServerStopped(Server_t* server);
+static void HandleLine(ServerWorker_t* worker);
+static char* NextToken(char** position);
+static RequestErr_t ParseRequest(char* line, ServerRequest_t* request);
+static RequestErr_t ProcessRequest(Server_t* server, const ServerRequest_t* request, FILE* fp, size_t* lines);
+static RequestErr_t ProcessInput(const ServerRequest_t* request, Tree_t* input, FILE* fp, size_t* lines);
+static RequestErr_t ProcessDeriv(Server_t* server, const ServerRequest_t* request, Tree_t* input, FILE* fp, size_t* lines);
+static RequestErr_t WriteValue(const ServerRequest_t* request, const Node_t* node, const char* name, FILE* fp);
+static RequestErr_t WriteTreeLine(Tree_t* tree, const char* name, TreeErr_t (*write)(Tree_t*, FILE*), FILE* fp);
+
+ServerErr_t ServerInit(Server_t* server, size_t workers) {
+    assert( server != NULL );
+
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0) ? (size_t)cpus : 1;
+    }
+
+    if (DiffCacheInit(&server->cache, SERVER_CACHE_ENTRIES, SERVER_CACHE_NODES) != DIF_CACHE_OK) {
+        return SERVER_ALLOCATION_FAILED;
+    }
+
+    BudgetLimitsInit(&server->limits);
+    server->workers   = workers;
+    server->listen_fd = -1;
+    server->stop      = 0;
+
+    return SERVER_OK;
+}
+
+ServerErr_t ServerDestroy(Server_t* server) {
+    assert( server != NULL );
+
+    DiffCacheDestroy(&server->cache);
+    server->workers = 0;
+
+    return SERVER_OK;
+}
+
+ServerErr_t ServerServeStream(Server_t* server, FILE* in, FILE* out) {
+    assert( server != NULL );
+    assert( in != NULL );
+    assert( out != NULL );
+
+    ServerStream_t stream = {};
+    stream.in  = in;
+    stream.out = out;
+    pthread_mutex_init(&stream.read_lock, NULL);
+    pthread_mutex_init(&stream.write_lock, NULL);
+
+    ServerErr_t err = ServerRunWorkers(server, &stream, StreamWorker);
+
+    pthread_mutex_destroy(&stream.read_lock);
+    pthread_mutex_destroy(&stream.write_lock);
+
+    return err;
+}
+
+ServerErr_t ServerServeSocket(Server_t* server, const char* path) {
+    assert( server != NULL );
+    assert( path != NULL );
+
+    struct sockaddr_un addr = {};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return SERVER_SOCKET_FAILED;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    signal(SIGPIPE, SIG_IGN);   // a client that hangs up must not kill the server
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return SERVER_SOCKET_FAILED;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return SERVER_SOCKET_FAILED;
+    }
+
+    server->listen_fd = fd;
+
+    ServerErr_t err = ServerRunWorkers(server, NULL, SocketWorker);
+
+    server->listen_fd = -1;
+    close(fd);
+    unlink(path);
+
+    return err;
+}
+
+static ServerErr_t ServerRunWorkers(Server_t* server, ServerStream_t* stream, void* (*func)(void*)) {
+    ServerWorker_t* workers = (ServerWorker_t*)calloc(server->workers, sizeof(ServerWorker_t));
+    if (workers == NULL) {
+        return SERVER_ALLOCATION_FAILED;
+    }
+
+    ServerErr_t err = SERVER_OK;
+    size_t started = 0;
+    for (; started < server->workers; started++) {
+        ServerWorker_t* worker = &workers[started];
+        worker->server = server;
+        worker->stream = stream;
+        BufferInit(&worker->line, 0);
+
+        if (pthread_create(&worker->thread, NULL, func, worker) != 0) {
+            BufferDestroy(&worker->line);
+            err = SERVER_THREAD_FAILED;
+            break;
+        }
+    }
+
+    if (started == 0) {
+        FREE(workers);
+        return err;
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        BufferDestroy(&workers[i].line);
+    }
+
+    FREE(workers);
+
+    return err;
+}
+
+static void* StreamWorker(void* arg) {
+    ServeStream((ServerWorker_t*)arg);
+
+    return NULL;
+}
+
+static void* SocketWorker(void* arg) {
+    ServerWorker_t* worker = (ServerWorker_t*)arg;
+    Server_t* server = worker->server;
+
+    while (!ServerStopped(server)) {
+        int conn = accept(server->listen_fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        int out_fd = dup(conn);
+        FILE* in  = fdopen(conn, "r");
+        FILE* out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+        if (in == NULL || out == NULL) {
+            if (in  != NULL) fclose(in);  else close(conn);
+            if (out != NULL) fclose(out); else if (out_fd >= 0) close(out_fd);
+            continue;
+        }
+
+        ServerStream_t stream = {};
+        stream.in  = in;
+        stream.out = out;
+        pthread_mutex_init(&stream.read_lock, NULL);
+        pthread_mutex_init(&stream.write_lock, NULL);
+
+        worker->stream = &stream;
+        ServeStream(worker);
+        worker->stream = NULL;
+
+        fclose(in);
+        fclose(out);
+        pthread_mutex_destroy(&stream.read_lock);
+        pthread_mutex_destroy(&stream.write_lock);
+    }
+
+    return NULL;
+}
+
+static void ServeStream(ServerWorker_t* worker) {
+    ServerStream_t* stream = worker->stream;
+
+    while (!ServerStopped(worker->server)) {
+        pthread_mutex_lock(&stream->read_lock);
+        IOErr_t err = ServerStopped(worker->server) ? IO_BUFFER_GETLINE_FAILED
+                                                    : BufferGetLine(&worker->line, stream->in);
+        pthread_mutex_unlock(&stream->read_lock);
+
+        if (err != IO_OK) {
+            break;
+        }
+
+        HandleLine(worker);
+    }
+}
+
+static void ServerStop(Server_t* server) {
+    __atomic_store_n(&server->stop, 1, __ATOMIC_RELAXED);
+
+    if (server->listen_fd >= 0) {
+        shutdown(server->listen_fd, SHUT_RDWR);     // wakes up the workers blocked in accept()
+    }
+}
+
+static int ServerStopped(Server_t* server) {
+    return __atomic_load_n(&server->stop, __ATOMIC_RELAXED);
+}
+
+static void HandleLine(ServerWorker_t* worker) {
+    char* line = worker->line.data;
+    SkipSpaces(&line);
+
+    if (*line == '\0') {
+        return;
+    }
+    if (strcmp(line, "shutdown") == 0) {
+        ServerStop(worker->server);
+        return;
+    }
+
+    METRICS_INC(COUNTER_SERVER_REQUESTS);
+
+    char* body = NULL;
+    size_t body_size = 0;
+    size_t lines = 0;
+    char report[BUDGET_REPORT_MAX] = "";
+
+    ServerRequest_t request = {};
+    RequestErr_t err = ParseRequest(line, &request);
+
+    FILE* body_fp = open_memstream(&body, &body_size);
+    if (body_fp == NULL) {
+        err = REQUEST_ALLOCATION_FAILED;
+    } else {
+        if (err == REQUEST_OK) {
+            Budget_t budget = {};
+            BudgetBegin(&budget, &worker->server->limits, &worker->server->stop);
+
+            err = ProcessRequest(worker->server, &request, body_fp, &lines);
+
+            if (BudgetEnd(&budget) != BUDGET_WITHIN) {  // whatever failed, it failed on the limit
+                err = REQUEST_BUDGET_EXCEEDED;
+                BudgetDescribe(&budget, report, sizeof(report));
+            }
+        }
+        fclose(body_fp);
+    }
+
+    const char* id = (request.id != NULL) ? request.id : "-";
+    ServerStream_t* stream = worker->stream;
+
+    pthread_mutex_lock(&stream->write_lock);
+
+    if (err == REQUEST_OK) {
+        fprintf(stream->out, "%s ok %zu\n", id, lines);
+        fwrite(body, sizeof(char), body_size, stream->out);
+    } else {
+        fprintf(stream->out, "%s error 1\nmessage %s%s%s\n", id, request_errors[err],
+                (*report != '\0') ? ": " : "", report);
+        METRICS_INC(COUNTER_SERVER_ERRORS);
+    }
+    fflush(stream->out);
+
+    pthread_mutex_unlock(&stream->write_lock);
+
+    free(body);
+}
+
+static char* NextToken(char** position) {
+    SkipSpaces(position);
+
+    char* token = *position;
+    if (*token == '\0' || *token == '(') {
+        return NULL;
+    }
+
+    for (; **position != '\0' && !isspace(**position); ++(*position));
+    if (**position != '\0') {
+        **position = '\0';
+        ++(*position);
+    }
+
+    return token;
+}
+
+static RequestErr_t ParseRequest(char* line, ServerRequest_t* request) {
+    char* position = line;
+
+    request->id = NextToken(&position);
+    char* outputs = NextToken(&position);
+    request->var = NextToken(&position);
+    if (request->id == NULL || outputs == NULL || request->var == NULL) {
+        return REQUEST_BAD_FORMAT;
+    }
+
+    char* save = NULL;
+    for (char* name = strtok_r(outputs, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        size_t i = 0;
+        for (; i < sizeof(output_names) / sizeof(output_names[0]); i++) {
+            if (strcmp(output_names[i].name, name) == 0) {
+                break;
+            }
+        }
+        if (i == sizeof(output_names) / sizeof(output_names[0])) {
+            return REQUEST_UNKNOWN_OUTPUT;
+        }
+
+        request->outputs |= output_names[i].mask;
+    }
+
+    char* binding = NULL;
+    while ((binding = NextToken(&position)) != NULL) {
+        char* value = strchr(binding, '=');
+        if (value == NULL) {
+            return REQUEST_BAD_FORMAT;
+        }
+        if (request->var_count == SERVER_MAX_VARS) {
+            return REQUEST_TOO_MANY_VARS;
+        }
+
+        *value++ = '\0';
+
+        double number = 0;
+        if (!ParseDouble(value, &number)) {
+            return REQUEST_BAD_VALUE;
+        }
+
+        request->vars[request->var_count].name  = binding;
+        request->vars[request->var_count].value = number;
+        ++request->var_count;
+    }
+
+    if (*position != '(') {
+        return REQUEST_BAD_FORMAT;
+    }
+    request->tree = position;
+
+    return REQUEST_OK;
+}
+
+static RequestErr_t ProcessRequest(Server_t* server, const ServerRequest_t* request, FILE* fp, size_t* lines) {
+    Tree_t* input = NULL;
+    if (TreeInit(&input) != TREE_OK) {
+        return REQUEST_ALLOCATION_FAILED;
+    }
+
+    RequestErr_t err = REQUEST_OK;
+    if (ReadTreeFromString(input, request->tree) != TREE_OK) {
+        err = REQUEST_SYNTAX_ERROR;
+    }
+
+    if (err == REQUEST_OK) {
+        err = ProcessInput(request, input, fp, lines);
+    }
+    if (err == REQUEST_OK && (request->outputs & OUTPUT_ANY_DERIV)) {
+        err = ProcessDeriv(server, request, input, fp, lines);
+    }
+
+    TreeDestroy(&input);
+
+    return err;
+}
+
+static RequestErr_t ProcessInput(const ServerRequest_t* request, Tree_t* input, FILE* fp, size_t* lines) {
+    if (request->outputs & OUTPUT_SIMPLIFY) {
+        Tree_t* simple = NULL;
+        if (TreeInit(&simple) != TREE_OK) {
+            return REQUEST_ALLOCATION_FAILED;
+        }
+
+        simple->root = TreeCopySubtree(input->root, NULL);
+        TreeSimplify(simple, SERVER_SIMPLIFY_PASSES);
+
+        RequestErr_t err = WriteTreeLine(simple, "simplify", WriteTree, fp);
+        TreeDestroy(&simple);
+        if (err != REQUEST_OK) {
+            return err;
+        }
+        ++*lines;
+    }
+
+    if (request->outputs & OUTPUT_LATEX) {
+        RequestErr_t err = WriteTreeLine(input, "latex", WriteLatexTree, fp);
+        if (err != REQUEST_OK) {
+            return err;
+        }
+        ++*lines;
+    }
+
+    if (request->outputs & OUTPUT_VALUE) {
+        RequestErr_t err = WriteValue(request, input->root, "value", fp);
+        if (err != REQUEST_OK) {
+            return err;
+        }
+        ++*lines;
+    }
+
+    return REQUEST_OK;
+}
+
+static RequestErr_t ProcessDeriv(Server_t* server, const ServerRequest_t* request, Tree_t* input, FILE* fp, size_t* lines) {
+    Tree_t* deriv = NULL;
+    if (TreeInit(&deriv) != TREE_OK) {
+        return REQUEST_ALLOCATION_FAILED;
+    }
+
+    deriv->root = TreeDiffCached(input->root, request->var, &server->cache);
+    if (deriv->root == NULL) {
+        TreeDestroy(&deriv);
+        return REQUEST_DIFF_FAILED;
+    }
+    deriv->root->parent = NULL;
+
+    TreeSimplify(deriv, SERVER_SIMPLIFY_PASSES);
+
+    RequestErr_t err = REQUEST_OK;
+
+    if (err == REQUEST_OK && (request->outputs & OUTPUT_DERIV)) {
+        err = WriteTreeLine(deriv, "deriv", WriteTree, fp);
+        if (err == REQUEST_OK) {
+            ++*lines;
+        }
+    }
+
+    if (err == REQUEST_OK && (request->outputs & OUTPUT_DERIV_LATEX)) {
+        err = WriteTreeLine(deriv, "deriv_latex", WriteLatexTree, fp);
+        if (err == REQUEST_OK) {
+            ++*lines;
+        }
+    }
+
+    if (err == REQUEST_OK && (request->outputs & OUTPUT_DERIV_VALUE)) {
+        err = WriteValue(request, deriv->root, "deriv_value", fp);
+        if (err == REQUEST_OK) {
+            ++*lines;
+        }
+    }
+
+    TreeDestroy(&deriv);
+
+    return err;
+}
+
+static RequestErr_t WriteValue(const ServerRequest_t* request, const Node_t* node, const char* name, FILE* fp) {
+    double value = 0;
+    EvalErr_t err = TreeEval(node, request->vars, request->var_count, &value);
+    if (err != EVAL_OK) {
+        return (err == EVAL_UNBOUND_VARIABLE) ? REQUEST_UNBOUND_VARIABLE : REQUEST_EVAL_FAILED;
+    }
+
+    char number[NUMBER_STR_MAX] = "";
+    FormatDouble(number, sizeof(number), value);
+    fprintf(fp, "%s %s\n", name, number);
+
+    return REQUEST_OK;
+}
+
+// The tree is rendered aside first, so a failure leaves no partial line in
+// the response
+static RequestErr_t WriteTreeLine(Tree_t* tree, const char* name, TreeErr_t (*write)(Tree_t*, FILE*), FILE* fp) {
+    char* text = NULL;
+    size_t size = 0;
+
+    FILE* text_fp = open_memstream(&text, &size);
+    if (text_fp == NULL) {
+        return REQUEST_ALLOCATION_FAILED;
+    }
+
+    TreeErr_t err = write(tree, text_fp);
+    fclose(text_fp);
+
+    RequestErr_t result = REQUEST_OK;
+    switch (err) {
+    case TREE_OK:
+        fprintf(fp, "%s %s", name, text);
+        break;
+    case TREE_BUDGET_EXCEEDED:
+        result = REQUEST_BUDGET_EXCEEDED;
+        break;
+    case TREE_ALLOCATION_FAILED:
+    case NODE_ALLOCATION_FAILED:
+        result = REQUEST_ALLOCATION_FAILED;
+        break;
+    case TREE_PRINT_LATEX_FAILED:
+    case TREE_FILE_OPEN_FAILED:
+    case TREE_GET_FILE_SIZE_FAILED:
+    case TREE_BUFFER_FREAD_FAILED:
+    case TREE_SYNTAX_ERROR:
+    default:
+        result = REQUEST_PRINT_FAILED;
+        break;
+    }
+
+    free(text);
+
+    return result;
+}
@@ -0,0 +1,62 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "dif_cache.h"
+#include "budget.h"
+
+/*
+Line protocol, one request per line:
+
+    <id> <outputs> <var> [<name>=<value> ...] <tree>
+
+    outputs: comma separated list of deriv, deriv_latex, deriv_value,
+             simplify, latex, value
+    var:     variable to differentiate by
+    tree:    the expression in the input.txt format, on a single line
+
+Response, possibly out of order when several workers share one stream:
+
+    <id> ok <n>             followed by n lines "<output> <payload>"
+    <id> error 1            followed by "message <text>"
+
+A request past the server's limits fails with a message that tells which
+limit it hit and how far it got. The line "shutdown" stops the server and
+cancels the requests in progress.
+*/
+
+const size_t SERVER_MAX_VARS = 16;
+
+enum ServerErr_t {
+    SERVER_OK,
+    SERVER_ALLOCATION_FAILED,
+    SERVER_SOCKET_FAILED,
+    SERVER_THREAD_FAILED
+};
+
+struct ServerStream_t {
+    FILE* in;
+    FILE* out;
+    pthread_mutex_t read_lock;
+    pthread_mutex_t write_lock;
+};
+
+// Workers share one derivative cache for the whole lifetime of the server.
+// The limits apply to each request and are unlimited after ServerInit.
+struct Server_t {
+    DiffCache_t cache;
+    BudgetLimits_t limits;
+    size_t workers;
+    int listen_fd;
+    int stop;
+};
+
+ServerErr_t ServerInit(Server_t* server, size_t workers);
+ServerErr_t ServerDestroy(Server_t* server);
+
+ServerErr_t ServerServeStream(Server_t* server, FILE* in, FILE* out);
+ServerErr_t ServerServeSocket(Server_t* server, const char* path);
+
+#endif // SERVER_H
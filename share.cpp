@@ -0,0 +1,227 @@
+#include "share.h"
+#include "budget.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// A distinct subexpression is its label and the representatives of its
+// operands, so equality is one label compare and two pointer compares.
+struct ShareRep_t {
+    const Node_t* node;
+    const Node_t* left;
+    const Node_t* right;
+    uint64_t hash;
+};
+
+// Representatives of distinct subexpressions, open addressing by hash
+struct ShareReps_t {
+    ShareRep_t* slots;
+    size_t capacity;
+};
+
+struct ShareOrder_t {
+    const Node_t** nodes;       // representatives in postorder
+    size_t size;
+};
+
+static TreeErr_t RecursiveCanonical(ShareTable_t* share, ShareReps_t* reps, const Node_t* node,
+                                    const Node_t** rep, size_t* size);
+static TreeErr_t RecursiveCountUses(ShareTable_t* share, const Node_t* rep, ShareOrder_t* order);
+static TreeErr_t CountUsesNode(ShareTable_t* share, const Node_t* rep, ShareOrder_t* order);
+static TreeErr_t CanonicalNode(ShareTable_t* share, ShareReps_t* reps, const Node_t* node,
+                               const Node_t** rep, size_t* size);
+static const Node_t* Representative(const ShareTable_t* share, const Node_t* node);
+
+TreeErr_t ShareTableBuild(ShareTable_t* share, const Node_t* root) {
+    assert( share != NULL );
+    assert( root != NULL );
+
+    memset(share, 0, sizeof(*share));
+
+    size_t size = TreeSubtreeSize(root);
+
+    ShareReps_t reps = {};
+    reps.capacity = 16;
+    while (reps.capacity < size * 2) {
+        reps.capacity *= 2;
+    }
+    reps.slots = (ShareRep_t*)calloc(reps.capacity, sizeof(ShareRep_t));
+
+    ShareOrder_t order = {};
+    order.nodes = (const Node_t**)calloc(size, sizeof(const Node_t*));
+
+    TreeErr_t err = TREE_ALLOCATION_FAILED;
+    const Node_t* root_rep = NULL;
+    size_t root_size = 0;
+    if (reps.slots != NULL && order.nodes != NULL && NodeMapInit(&share->nodes, size) == TREE_OK) {
+        err = RecursiveCanonical(share, &reps, root, &root_rep, &root_size);
+    }
+
+    if (err == TREE_OK) {
+        err = RecursiveCountUses(share, root_rep, &order);
+    }
+
+    if (err == TREE_OK) {
+        share->temps = (const Node_t**)calloc(order.size + 1, sizeof(const Node_t*));
+        if (share->temps == NULL) {
+            err = TREE_ALLOCATION_FAILED;
+        }
+    }
+
+    if (err == TREE_OK) {
+        // postorder: a definition only contains temporaries numbered before it
+        for (size_t i = 0; i < order.size; i++) {
+            NodeInfo_t* info = NodeMapFind(&share->nodes, order.nodes[i]);
+
+            if (info->flags >= 2 && info->size >= SHARE_MIN_SIZE && order.nodes[i]->type == TYPE_OPERATION) {
+                share->temps[share->count++] = order.nodes[i];
+                info->flags = (unsigned)share->count;
+            } else {
+                info->flags = 0;
+            }
+        }
+
+        for (size_t i = 0; i < share->nodes.capacity; i++) {
+            NodeMapEntry_t* entry = &share->nodes.entries[i];
+            if (entry->key != NULL && entry->info.data != entry->key) {
+                entry->info.flags = NodeMapFind(&share->nodes, (const Node_t*)entry->info.data)->flags;
+            }
+        }
+    }
+
+    FREE(reps.slots);
+    FREE(order.nodes);
+
+    if (err != TREE_OK) {
+        ShareTableDestroy(share);
+    }
+
+    return err;
+}
+
+TreeErr_t ShareTableDestroy(ShareTable_t* share) {
+    assert( share != NULL );
+
+    if (share->nodes.entries != NULL) {
+        NodeMapDestroy(&share->nodes);
+    }
+    FREE(share->temps);
+    share->count = 0;
+
+    return TREE_OK;
+}
+
+size_t ShareTableFind(const ShareTable_t* share, const Node_t* node) {
+    assert( share != NULL );
+    assert( node != NULL );
+
+    const NodeInfo_t* info = NodeMapFind(&share->nodes, node);
+
+    return (info != NULL) ? info->flags : 0;
+}
+
+static const Node_t* Representative(const ShareTable_t* share, const Node_t* node) {
+    return (const Node_t*)NodeMapFind(&share->nodes, node)->data;
+}
+
+static TreeErr_t RecursiveCanonical(ShareTable_t* share, ShareReps_t* reps, const Node_t* node,
+                                    const Node_t** rep, size_t* size) {
+    if (!BudgetDescend()) {
+        return TREE_BUDGET_EXCEEDED;
+    }
+
+    TreeErr_t err = CanonicalNode(share, reps, node, rep, size);
+
+    BudgetAscend();
+
+    return err;
+}
+
+// Bottom-up hash consing: the operands already have their representatives,
+// so a node costs O(1) whatever the size of its subtree
+static TreeErr_t CanonicalNode(ShareTable_t* share, ShareReps_t* reps, const Node_t* node,
+                               const Node_t** rep, size_t* size) {
+    const Node_t* left = NULL;
+    const Node_t* right = NULL;
+    size_t left_size = 0, right_size = 0;
+
+    if (node->left != NULL) {
+        TreeErr_t err = RecursiveCanonical(share, reps, node->left, &left, &left_size);
+        if (err != TREE_OK) {
+            return err;
+        }
+    }
+    if (node->right != NULL) {
+        TreeErr_t err = RecursiveCanonical(share, reps, node->right, &right, &right_size);
+        if (err != TREE_OK) {
+            return err;
+        }
+    }
+
+    NodeInfo_t* info = NodeMapInsert(&share->nodes, node);
+    if (info == NULL) {
+        return TREE_ALLOCATION_FAILED;
+    }
+
+    *size = 1 + left_size + right_size;
+    info->size = *size;
+    info->hash = NodeHash(node, (uintptr_t)left, (uintptr_t)right);
+
+    size_t mask = reps->capacity - 1;
+    size_t i = info->hash & mask;
+    for (; reps->slots[i].node != NULL; i = (i + 1) & mask) {
+        const ShareRep_t* slot = &reps->slots[i];
+        if (slot->hash == info->hash && slot->left == left && slot->right == right
+            && NodeLabelEqual(slot->node, node)) {
+            *rep = slot->node;
+            info->data = (void*)(uintptr_t)slot->node;
+            return TREE_OK;
+        }
+    }
+
+    ShareRep_t slot = {node, left, right, info->hash};
+    reps->slots[i] = slot;
+    *rep = node;
+    info->data = (void*)(uintptr_t)node;
+
+    return TREE_OK;
+}
+
+// Counts references between distinct subexpressions: every subexpression is
+// walked once, so a repeat nested inside a repeat is counted only once.
+static TreeErr_t RecursiveCountUses(ShareTable_t* share, const Node_t* rep, ShareOrder_t* order) {
+    NodeInfo_t* info = NodeMapFind(&share->nodes, rep);
+    if (info->flags++ != 0) {
+        return TREE_OK;
+    }
+
+    if (!BudgetDescend()) {
+        return TREE_BUDGET_EXCEEDED;
+    }
+
+    TreeErr_t err = CountUsesNode(share, rep, order);
+
+    BudgetAscend();
+
+    return err;
+}
+
+static TreeErr_t CountUsesNode(ShareTable_t* share, const Node_t* rep, ShareOrder_t* order) {
+    if (rep->left != NULL) {
+        TreeErr_t err = RecursiveCountUses(share, Representative(share, rep->left), order);
+        if (err != TREE_OK) {
+            return err;
+        }
+    }
+    if (rep->right != NULL) {
+        TreeErr_t err = RecursiveCountUses(share, Representative(share, rep->right), order);
+        if (err != TREE_OK) {
+            return err;
+        }
+    }
+
+    order->nodes[order->size++] = rep;
+
+    return TREE_OK;
+}
@@ -0,0 +1,24 @@
+#ifndef SHARE_H
+#define SHARE_H
+
+#include "tree.h"
+#include "node_map.h"
+
+const size_t SHARE_MIN_SIZE = 4;    // smaller subtrees are cheaper to repeat than to name
+
+// Repeated subexpressions of one tree. Structurally equal nodes get one
+// representative; a representative referenced twice or more from the tree of
+// distinct subexpressions becomes temporary t_k. Definitions are numbered so
+// that each one refers only to earlier temporaries.
+struct ShareTable_t {
+    NodeMap_t nodes;            // flags: number of the node's temporary, 0 - none
+    const Node_t** temps;       // definitions of t_1 ... t_count
+    size_t count;
+};
+
+TreeErr_t ShareTableBuild(ShareTable_t* share, const Node_t* root);
+TreeErr_t ShareTableDestroy(ShareTable_t* share);
+
+size_t ShareTableFind(const ShareTable_t* share, const Node_t* node);
+
+#endif // SHARE_H
@@ -8,14 +8,31 @@
 
 #include "io.h"
 #include "dump.h"
+#include "metrics.h"
+#include "debug.h"
+#include "share.h"
+#include "operations.h"
+#include "alloc_track.h"
+#include "budget.h"
+#include "scan.h"
 
 #define va_arg_enum(type) ((type)va_arg(args, int))
 
-Node_t* RecursiveReadTree(char** position);
-char* RecursiveLatexTree(Node_t* node);
+Node_t* RecursiveReadTree(Scanner_t* scanner, char* str, TreeErr_t* err);
+static Node_t* ReadTreeNode(Scanner_t* scanner, char* str, TreeErr_t* err);
+char* RecursiveLatexTree(Node_t* node, const ShareTable_t* share, const Node_t* def);
+static char* LatexTreeNode(Node_t* node, const ShareTable_t* share, const Node_t* def);
+static void RecursivePrintShared(Node_t* node, const ShareTable_t* share, const Node_t* def, FILE* fp);
+static void WriteNodeLabel(const Node_t* node, FILE* fp);
+static void RecursiveWriteTree(Node_t* node, FILE* fp);
+static int LatexPrecedence(const Node_t* node, const ShareTable_t* share);
+static void ParenthesizeStr(char** str);
+static char* LatexExpand(const char* pattern, const char* left, const char* right);
 // Node_t* RecursiveDifferentiation(Node_t* node);
 
+#ifndef DIF_LIBRARY
 TreeErr_t PrintNode(Node_t** node_ptr);
+#endif // DIF_LIBRARY
 
 TreeErr_t TreeInit(Tree_t** tree) {
     assert( tree != NULL );
@@ -36,8 +53,7 @@ TreeErr_t TreeInit(Tree_t** tree) {
 TreeErr_t TreeDestroy(Tree_t** tree) {
     assert( tree != NULL );
 
-    if ((*tree)->root != NULL ) 
-        PostorderTraversal((*tree)->root, NodeDestroy);
+    TreeDestroySubtree(&(*tree)->root);
 
     FREE(*tree);
 
@@ -45,10 +61,12 @@ TreeErr_t TreeDestroy(Tree_t** tree) {
 }
 
 Node_t* NodeInit(Node_t* parent, Node_t* left, Node_t* right, TreeElemType type, ...) {
-    Node_t* node_ptr = (Node_t*)calloc(1, sizeof(Node_t));
+    Node_t* node_ptr = (Node_t*)TRACK_CALLOC(1, sizeof(Node_t), ALLOC_NODE);
     if (node_ptr == NULL) {
         return NULL;
     }
+    METRICS_INC(COUNTER_NODES_ALLOCATED);
+    BudgetCharge(1, sizeof(Node_t));
 
     node_ptr->parent = parent;
     node_ptr->left = left;
@@ -71,13 +89,20 @@ Node_t* NodeInit(Node_t* parent, Node_t* left, Node_t* right, TreeElemType type,
         node_ptr->data.operation = va_arg_enum(Operation_t);
         break;
 
-    case TYPE_VARIABLE:
-        node_ptr->data.variable = strdup(va_arg(args, char*));
+    case TYPE_VARIABLE: {
+        const char* name = va_arg(args, char*);
+        node_ptr->data.variable = TRACK_STRDUP(name);
+        BudgetCharge(0, strlen(name) + 1);
         break;
+    }
 
     case TYPE_NUMBER:
         node_ptr->data.number = va_arg(args, double);
-        printf("node: %lg\n", node_ptr->data.number);
+        LOG_TRACE("tree", "node %lg", node_ptr->data.number);
+        break;
+
+    case TYPE_THUNK:
+        node_ptr->data.thunk = va_arg(args, const Thunk_t*);
         break;
 
     case TYPE_UNDEFINED:
@@ -85,7 +110,7 @@ Node_t* NodeInit(Node_t* parent, Node_t* left, Node_t* right, TreeElemType type,
         break;
     
     default:
-        fprintf(stderr, "WRONG TreeElemType\n");
+        LOG_ERROR("tree", "WRONG TreeElemType");
         break;
     }
 
@@ -94,7 +119,7 @@ Node_t* NodeInit(Node_t* parent, Node_t* left, Node_t* right, TreeElemType type,
     return node_ptr;
 }
 
-TreeErr_t NodeCopyData(Node_t* dest_node, Node_t* src_node) {
+TreeErr_t NodeCopyData(Node_t* dest_node, const Node_t* src_node) {
     assert( dest_node != NULL );
     assert( src_node != NULL );
 
@@ -110,15 +135,20 @@ TreeErr_t NodeCopyData(Node_t* dest_node, Node_t* src_node) {
         break;
 
     case TYPE_VARIABLE:
-        dest_node->data.variable = strdup(src_node->data.variable);
+        dest_node->data.variable = TRACK_STRDUP(src_node->data.variable);
+        BudgetCharge(0, strlen(src_node->data.variable) + 1);
+        break;
+
+    case TYPE_THUNK:
+        dest_node->data.thunk = src_node->data.thunk;
         break;
 
     case TYPE_UNDEFINED:
-        fprintf(stderr, "TYPE_UNDEFINED in NodeCopyData\n");
+        LOG_ERROR("tree", "TYPE_UNDEFINED in NodeCopyData");
         break;
     
     default:
-        fprintf(stderr, "default in NodeCopyData\n");
+        LOG_ERROR("tree", "default in NodeCopyData");
         break;
     }
 
@@ -129,6 +159,10 @@ TreeErr_t NodeDestroy(Node_t** node) {
     assert( node != NULL );
 
     Node_t* node_ptr = *node;
+
+    // whatever is still attached goes with the node
+    TreeDestroySubtree(&node_ptr->left);
+    TreeDestroySubtree(&node_ptr->right);
     
     switch (node_ptr->type) {
     case TYPE_NUMBER:
@@ -140,11 +174,15 @@ TreeErr_t NodeDestroy(Node_t** node) {
         break;
 
     case TYPE_VARIABLE:
-        FREE(node_ptr->data.variable);
+        TRACK_FREE(node_ptr->data.variable);
+        break;
+
+    case TYPE_THUNK:
+        node_ptr->data.thunk = NULL;
         break;
 
     case TYPE_UNDEFINED:
-        fprintf(stderr, "TYPE_UNDEFINED in NodeDestroy\n");
+        LOG_ERROR("tree", "TYPE_UNDEFINED in NodeDestroy");
         break;
     
     default:
@@ -160,15 +198,65 @@ TreeErr_t NodeDestroy(Node_t** node) {
     node_ptr->right = NULL;
     node_ptr->left = NULL;
     
-    FREE(*node);
+    TRACK_FREE(*node);
+    METRICS_INC(COUNTER_NODES_FREED);
+
+    return TREE_OK;
+}
+
+Node_t* NodeForce(Node_t** node_ptr) {
+    assert( node_ptr != NULL );
+
+    Node_t* node = *node_ptr;
+    if (node == NULL || node->type != TYPE_THUNK) {
+        return node;
+    }
+
+    Node_t* expanded = node->data.thunk->expand(node->data.thunk);
+    if (expanded == NULL) {
+        return node;
+    }
+
+    Node_t* parent = node->parent;
+    Node_t** parent_ptr = GetParentNodePointer(node);
+
+    node->parent = NULL;
+    NodeDestroy(&node);
+
+    if (parent_ptr != NULL) {
+        *parent_ptr = expanded;
+    }
+    expanded->parent = parent;
+    *node_ptr = expanded;
+
+    // a rule may return an operand's derivative as it is, still unexpanded
+    return (expanded->type == TYPE_THUNK) ? NodeForce(node_ptr) : expanded;
+}
+
+TreeErr_t TreeForce(Node_t** node_ptr) {
+    assert( node_ptr != NULL );
+
+    Node_t* node = NodeForce(node_ptr);
+    if (node == NULL) {
+        return TREE_OK;
+    }
+
+    if (node->left != NULL) {
+        TreeForce(&node->left);
+    }
+    if (node->right != NULL) {
+        TreeForce(&node->right);
+    }
 
     return TREE_OK;
 }
 
+#ifndef DIF_LIBRARY
+
 TreeErr_t InorderTraversal(Node_t* node, TreeFunc func) {
     assert( node != NULL );
 
-    printf("(");
+    NodeForce(&node);
 
     if (node->left != NULL) {
         InorderTraversal(node->left, func);
@@ -180,16 +268,14 @@ TreeErr_t InorderTraversal(Node_t* node, TreeFunc func) {
         InorderTraversal(node->right, func);
     }
 
-    printf(")");
-
     return TREE_OK;
 }
 
+#endif // DIF_LIBRARY
+
 TreeErr_t PostorderTraversal(Node_t* node, TreeFunc func) {
     assert( node != NULL );
 
-    printf("(");
-
     if (node->left != NULL) {
         PostorderTraversal(node->left, func);
         // fprintf(stderr, "L\n");
@@ -202,8 +288,6 @@ TreeErr_t PostorderTraversal(Node_t* node, TreeFunc func) {
 
     func(&node);
 
-    printf(")");
-
     return TREE_OK;
 }
 
@@ -220,144 +304,446 @@ TreeErr_t ReadTree(Tree_t* tree, char* file_name) {
 
     size_t file_size = 0;
     if (GetFileSize(file_name, &file_size) == IO_GET_FILE_SIZE_FAILED) {
+        fclose(fp);
         return TREE_GET_FILE_SIZE_FAILED;
     }
 
     Buffer_t buffer;
-    BufferInit(&buffer, file_size + 1);
+    if (BufferInit(&buffer, file_size + 1) != IO_OK) {
+        fclose(fp);
+        return TREE_ALLOCATION_FAILED;
+    }
 
     buffer.size = fread(buffer.data, sizeof(char), file_size, fp);
     buffer.data[buffer.size++] = '\0';
-    if (buffer.size < buffer.capacity) {
-        return TREE_BUFFER_FREAD_FAILED;
-    }
+    fclose(fp);
 
-    char* position = buffer.data;
-    tree->root = RecursiveReadTree(&position);
-    tree->root->parent = NULL;
+    TreeErr_t err = TREE_BUFFER_FREAD_FAILED;
+    if (buffer.size == buffer.capacity) {
+        err = ReadTreeFromString(tree, buffer.data);
+    }
 
     BufferDestroy(&buffer);
 
-    fclose(fp);
+    return err;
+}
 
-    if (tree->root == NULL) {
-        return TREE_SYNTAX_ERROR;
+TreeErr_t ReadTreeFromString(Tree_t* tree, char* str) {
+    assert( tree != NULL );
+    assert( str != NULL );
+
+    METRICS_PHASE_BEGIN(PHASE_PARSE);
+
+    Scanner_t scanner = {};
+    TreeErr_t err = TREE_OK;
+    Node_t* root = NULL;
+
+    if (ScannerInit(&scanner, str, strlen(str)) != SCAN_OK) {
+        err = TREE_ALLOCATION_FAILED;
+    } else {
+        root = RecursiveReadTree(&scanner, str, &err);
+
+        size_t offset = 0;
+        if (err == TREE_OK && (root == NULL || ScannerNext(&scanner, &offset) != SCAN_END)) {
+            err = TREE_SYNTAX_ERROR;
+        }
     }
+    ScannerDestroy(&scanner);
 
-    return TREE_OK;
+    if (err == TREE_OK) {
+        root->parent = NULL;
+        tree->root = root;
+    } else {
+        TreeDestroySubtree(&root);
+    }
+
+    METRICS_PHASE_END(PHASE_PARSE);
+
+    return err;
 }
 
-Node_t* RecursiveReadTree(char** position) {
-    assert( position != NULL );
+static int NodeShapeValid(const Node_t* node) {
+    switch (node->type) {
+    case TYPE_NUMBER:
+    case TYPE_VARIABLE:
+        return node->left == NULL && node->right == NULL;
+
+    case TYPE_OPERATION: {
+        const OperationInfo_t* info = OperationGet(node->data.operation);
+        if (info == NULL || info->arity == 0) {
+            return 0;
+        }
+
+        return (node->left != NULL) == (info->arity == 2) && node->right != NULL;
+    }
 
-    if (**position == '(') {
-        Node_t* node = EmptyNodeInit;
+    case TYPE_THUNK:
+    case TYPE_UNDEFINED:
+    default:
+        return 0;
+    }
+}
 
-        ++(*position); // skip '('
-        SkipSpaces(position);
+Node_t* RecursiveReadTree(Scanner_t* scanner, char* str, TreeErr_t* err) {
+    assert( scanner != NULL );
+    assert( str != NULL );
+    assert( err != NULL );
 
-        char* string = GetStringFromBuffer(position);
-        DefineTreeElem(&node->type, &node->data, string);
-        FREE(string);
+    if (!BudgetDescend()) {
+        *err = TREE_BUDGET_EXCEEDED;
+        return NULL;
+    }
 
-        SkipSpaces(position);
+    Node_t* node = ReadTreeNode(scanner, str, err);
 
-        node->left  = RecursiveReadTree(position);
-        node->right = RecursiveReadTree(position);
+    BudgetAscend();
 
-        if (node->left != NULL && node->right != NULL) {
-            node->left->parent  = node;
-            node->right->parent = node;
-        }
+    return node;
+}
 
-        ++(*position); // skip ')'
-        SkipSpaces(position);
+// The scanner has checked that only spaces lie between the tokens and that
+// every 'n' token is a whole nil, so the grammar is on tokens alone:
+// node = '(' '"' '"' node node ')' | nil
+static Node_t* ReadTreeNode(Scanner_t* scanner, char* str, TreeErr_t* err) {
+    size_t start = 0;
 
-        return node;
+    if (ScannerNext(scanner, &start) != SCAN_OK) {
+        *err = TREE_SYNTAX_ERROR;
+        return NULL;
+    }
+    if (str[start] == 'n') {
+        return NULL;
+    }
 
-    } else if ((*position)[0] == 'n' && (*position)[1] == 'i' && (*position)[2] == 'l') {
-        *position = *position + 3;
-        SkipSpaces(position);
+    size_t open = 0, close = 0;
+    if (str[start] != '(' || ScannerNext(scanner, &open) != SCAN_OK || str[open] != '"'
+                          || ScannerNext(scanner, &close) != SCAN_OK) {
+        *err = TREE_SYNTAX_ERROR;
         return NULL;
     }
 
-    fprintf(stderr, "ERROR IN RECREADTREE\n");
-    return NULL;
+    Node_t* node = EmptyNodeInit;
+    if (node == NULL) {
+        *err = NODE_ALLOCATION_FAILED;
+        return NULL;
+    }
+
+    str[close] = '\0';                      // the name is read in place
+    DefineTreeElem(&node->type, &node->data, str + open + 1);
+    str[close] = '"';
+
+    node->left  = RecursiveReadTree(scanner, str, err);
+    node->right = RecursiveReadTree(scanner, str, err);
+
+    if (node->left != NULL) {
+        node->left->parent  = node;
+    }
+    if (node->right != NULL) {
+        node->right->parent = node;
+    }
+
+    size_t end = 0;
+    if (*err == TREE_OK && (ScannerNext(scanner, &end) != SCAN_OK || str[end] != ')' || !NodeShapeValid(node))) {
+        *err = TREE_SYNTAX_ERROR;
+    }
+    if (*err != TREE_OK) {
+        TreeDestroySubtree(&node);
+        return NULL;
+    }
+
+    return node;
 }
 
+#ifndef DIF_LIBRARY
+
 TreeErr_t PrintLatexTree(Tree_t* tree) {
+    return WriteLatexTreeShared(tree, stdout); // FIXME latex в файл
+}
+
+#endif // DIF_LIBRARY
+
+TreeErr_t WriteLatexTree(Tree_t* tree, FILE* fp) {
     assert( tree != NULL );
+    assert( fp != NULL );
 
     if (tree->root == NULL) {
         return TREE_OK;
     }
 
-    char* tex_str = RecursiveLatexTree(tree->root);
+    METRICS_PHASE_BEGIN(PHASE_PRINT);
+
+    NodeForce(&tree->root);
+    char* tex_str = RecursiveLatexTree(tree->root, NULL, NULL);
     if (tex_str == NULL) {
-        fprintf(stderr, "ERROR IN RECLATEXTREE\n");
+        METRICS_PHASE_END(PHASE_PRINT);
+        if (BudgetExceeded()) {
+            return TREE_BUDGET_EXCEEDED;
+        }
+        LOG_ERROR("tree", "ERROR IN RECLATEXTREE");
         return TREE_PRINT_LATEX_FAILED;
     }
-    printf("%s\n", tex_str); // FIXME latex в файл
+    fprintf(fp, "%s\n", tex_str);
 
     FREE(tex_str);
 
+    METRICS_PHASE_END(PHASE_PRINT);
+
     return TREE_OK;
 }
 
-char* RecursiveLatexTree(Node_t* node) {
+// Repeated subexpressions are written once:
+// f = t_2 + t_1 \quad \text{where } t_1 = ...,\ t_2 = ...
+TreeErr_t WriteLatexTreeShared(Tree_t* tree, FILE* fp) {
+    assert( tree != NULL );
+    assert( fp != NULL );
+
+    if (tree->root == NULL) {
+        return TREE_OK;
+    }
+
+    TreeForce(&tree->root);
+
+    ShareTable_t share = {};
+    TreeErr_t share_err = ShareTableBuild(&share, tree->root);
+    if (share_err == TREE_BUDGET_EXCEEDED) {
+        return share_err;
+    }
+    if (share_err != TREE_OK) {
+        return WriteLatexTree(tree, fp);
+    }
+
+    METRICS_PHASE_BEGIN(PHASE_PRINT);
+
+    TreeErr_t err = TREE_OK;
+
+    char* tex_str = RecursiveLatexTree(tree->root, &share, tree->root);
+    if (tex_str == NULL) {
+        err = TREE_PRINT_LATEX_FAILED;
+    } else {
+        fputs(tex_str, fp);
+        FREE(tex_str);
+    }
+
+    for (size_t i = 0; i < share.count && err == TREE_OK; i++) {
+        Node_t* def = (Node_t*)(uintptr_t)share.temps[i];
+
+        char* def_str = RecursiveLatexTree(def, &share, def);
+        if (def_str == NULL) {
+            err = TREE_PRINT_LATEX_FAILED;
+            break;
+        }
+        fprintf(fp, "%st_{%zu} = %s", (i == 0) ? " \\quad \\text{where } " : ",\\ ", i + 1, def_str);
+        FREE(def_str);
+    }
+    fputc('\n', fp);
+
+    if (err != TREE_OK && BudgetExceeded()) {
+        err = TREE_BUDGET_EXCEEDED;
+    } else if (err != TREE_OK) {
+        LOG_ERROR("tree", "ERROR IN RECLATEXTREE");
+    }
+
+    ShareTableDestroy(&share);
+
+    METRICS_PHASE_END(PHASE_PRINT);
+
+    return err;
+}
+
+char* RecursiveLatexTree(Node_t* node, const ShareTable_t* share, const Node_t* def) {
     assert( node != NULL );
 
+    if (!BudgetDescend()) {
+        return NULL;
+    }
+
+    char* str = LatexTreeNode(node, share, def);
+
+    BudgetAscend();
+
+    return str;
+}
+
+static char* LatexTreeNode(Node_t* node, const ShareTable_t* share, const Node_t* def) {
+    NodeForce(&node);
+
+    size_t temp = (share != NULL && node != def) ? ShareTableFind(share, node) : 0;
+    if (temp != 0) {
+        char* index = StrFromDouble((double)temp);
+        char* res = MultiStrCat(3, "t_{", index, "}");
+        FREE(index);
+
+        return res;
+    }
+
     if (node->type == TYPE_VARIABLE) {
         return strdup(node->data.variable);
     } else if (node->type == TYPE_NUMBER) {
         return StrFromDouble(node->data.number);
     }
 
-    char* left = RecursiveLatexTree(node->left);
-    char* right = RecursiveLatexTree(node->right);
-    
-    char* res = NULL;
-
-    if (node->parent != NULL) {
-        if (node->data.operation == OPERATION_DIV) {
-            res = MultiStrCat(5, "\\frac{", left, "}{", right, "}");
-        } else if ( (node->data.operation == OPERATION_ADD || node->data.operation == OPERATION_SUB) 
-             && (node->parent->data.operation == OPERATION_MUL) ) {
-                res = MultiStrCat(5, "(", left, GetStrOp(node->data.operation), right, ")");
-            }
-        else {
-            res = MultiStrCat(3, left, GetStrOp(node->data.operation), right);
+    const OperationInfo_t* info = OperationGet(node->data.operation);
+    if (info == NULL || info->arity == 0) {
+        return NULL;
+    }
+
+    char* left = (node->left != NULL) ? RecursiveLatexTree(node->left, share, def) : NULL;
+    char* right = RecursiveLatexTree(node->right, share, def);
+
+    if (info->infix) {
+        if (node->left != NULL && LatexPrecedence(node->left, share) < info->precedence) {
+            ParenthesizeStr(&left);
         }
-    } else {
-        if (node->data.operation == OPERATION_DIV) {
-            res = MultiStrCat(5, "\\frac{", left, "}{", right, "}");
-        } else {
-            res = MultiStrCat(3, left, GetStrOp(node->data.operation), right);
+        if (LatexPrecedence(node->right, share) < info->precedence) {
+            ParenthesizeStr(&right);
         }
     }
 
+    char* res = (right != NULL && (info->arity == 1 || left != NULL)) ? LatexExpand(info->latex, left, right) : NULL;
+
     FREE(left);
     FREE(right);
 
     return res;
 }
 
-Node_t* TreeCopySubtree(Node_t* cur_node, Node_t* parent) {
+static int LatexPrecedence(const Node_t* node, const ShareTable_t* share) {
+    if (node->type != TYPE_OPERATION || (share != NULL && ShareTableFind(share, node) != 0)) {
+        return PRECEDENCE_FUNC + 1;
+    }
+
+    const OperationInfo_t* info = OperationGet(node->data.operation);
+
+    return (info != NULL) ? info->precedence : 0;
+}
+
+static void ParenthesizeStr(char** str) {
+    if (*str == NULL) {
+        return;
+    }
+
+    char* res = MultiStrCat(3, "(", *str, ")");
+    FREE(*str);
+    *str = res;
+}
+
+// Fills a LaTeX template: @1 - left, @2 - right
+static char* LatexExpand(const char* pattern, const char* left, const char* right) {
+    size_t size = 0;
+    for (const char* c = pattern; *c != '\0'; ++c) {
+        if (c[0] == '@' && (c[1] == '1' || c[1] == '2')) {
+            size += strlen((c[1] == '1') ? left : right);
+            ++c;
+        } else {
+            ++size;
+        }
+    }
+
+    char* str = (char*)calloc(size + 1, sizeof(char));
+    if (str == NULL) {
+        return NULL;
+    }
+
+    char* end = str;
+    for (const char* c = pattern; *c != '\0'; ++c) {
+        if (c[0] == '@' && (c[1] == '1' || c[1] == '2')) {
+            const char* operand = (c[1] == '1') ? left : right;
+            size_t len = strlen(operand);
+
+            memcpy(end, operand, len);
+            end += len;
+            ++c;
+        } else {
+            *end++ = *c;
+        }
+    }
+
+    return str;
+}
+
+TreeErr_t WriteTree(Tree_t* tree, FILE* fp) {
+    assert( tree != NULL );
+    assert( fp != NULL );
+
+    METRICS_PHASE_BEGIN(PHASE_PRINT);
+
+    if (tree->root != NULL) {
+        NodeForce(&tree->root);
+        RecursiveWriteTree(tree->root, fp);
+    } else {
+        fputs("nil", fp);
+    }
+    fputc('\n', fp);
+
+    METRICS_PHASE_END(PHASE_PRINT);
+
+    return BudgetExceeded() ? TREE_BUDGET_EXCEEDED : TREE_OK;
+}
+
+static void RecursiveWriteTree(Node_t* node, FILE* fp) {
+    if (node == NULL) {
+        fputs("nil", fp);
+        return;
+    }
+    if (!BudgetDescend()) {
+        return;
+    }
+
+    NodeForce(&node);
+
+    fputs("(\"", fp);
+    switch (node->type) {
+    case TYPE_NUMBER: {
+        char number[NUMBER_STR_MAX] = "";
+        FormatDouble(number, sizeof(number), node->data.number);
+        fputs(number, fp);
+        break;
+    }
+
+    case TYPE_OPERATION:
+        fputs(GetStrOp(node->data.operation), fp);
+        break;
+
+    case TYPE_VARIABLE:
+        fputs(node->data.variable, fp);
+        break;
+
+    case TYPE_THUNK:
+    case TYPE_UNDEFINED:
+    default:
+        break;
+    }
+    fputs("\" ", fp);
+
+    RecursiveWriteTree(node->left, fp);
+    fputc(' ', fp);
+    RecursiveWriteTree(node->right, fp);
+    fputc(')', fp);
+
+    BudgetAscend();
+}
+
+Node_t* TreeCopySubtree(const Node_t* cur_node, Node_t* parent) {
     assert( cur_node != NULL );
 
     Node_t* new_node = EmptyNodeInit;
 
-    if (cur_node->left != NULL) {
-        new_node->left = TreeCopySubtree(cur_node->left, new_node);
-    }
-    if (cur_node->right != NULL) {
-        new_node->right = TreeCopySubtree(cur_node->right, new_node);
+    // past the budget the copy loses its operands, the failing operation drops it
+    if (BudgetDescend()) {
+        if (cur_node->left != NULL) {
+            new_node->left = TreeCopySubtree(cur_node->left, new_node);
+        }
+        if (cur_node->right != NULL) {
+            new_node->right = TreeCopySubtree(cur_node->right, new_node);
+        }
+        BudgetAscend();
     }
 
     new_node->parent = parent;
     NodeCopyData(new_node, cur_node);
+    METRICS_INC(COUNTER_NODES_COPIED);
 
-    fprintf(stderr, "%p\n", cur_node);
+    LOG_TRACE("tree", "copied %p", cur_node);
     return new_node;
 }
 
@@ -374,47 +760,243 @@ Node_t** GetParentNodePointer(Node_t* node) {
         return &node->parent->right;
     }
 
-    fprintf(stderr, "GetParentNodePointer failed!\n");
+    LOG_ERROR("tree", "GetParentNodePointer failed!");
     return NULL;
 }
 
+#ifndef DIF_LIBRARY
+
 TreeErr_t PrintNode(Node_t** node_ptr) {
     assert( node_ptr != NULL );
 
-    Node_t* node = *node_ptr;
-    printf("/%p/", node->parent);
+    WriteNodeLabel(*node_ptr, stdout);
+
+    return TREE_OK;
+}
+
+#endif // DIF_LIBRARY
+
+static void WriteNodeLabel(const Node_t* node, FILE* fp) {
     switch (node->type) {
-    case TYPE_NUMBER:
-        printf("%lg", node->data.number);
+    case TYPE_NUMBER: {
+        char number[NUMBER_STR_MAX] = "";
+        FormatDouble(number, sizeof(number), node->data.number);
+        fputs(number, fp);
         break;
+    }
 
     case TYPE_OPERATION:
-        printf("%s", GetStrOp(node->data.operation));
+        fprintf(fp, "%s", GetStrOp(node->data.operation));
         break;
     case TYPE_VARIABLE:
-        printf("%s", node->data.variable);
+        fprintf(fp, "%s", node->data.variable);
+        break;
+    case TYPE_THUNK:
+        fprintf(fp, "THUNK");
         break;
     case TYPE_UNDEFINED:
-        printf("TYPE_UNDEFINED");
+        fprintf(fp, "TYPE_UNDEFINED");
         break;
 
     default:
         break;
     }
-
-    return TREE_OK;
 }
 
+#ifndef DIF_LIBRARY
+
+// Repeated subexpressions are printed once as let bindings before the tree
 TreeErr_t PrintTree(Tree_t* tree) {
     assert( tree != NULL );
-    
-    if (tree->root) {
-        InorderTraversal(tree->root, PrintNode);
-    }   printf("\n");
+
+    if (tree->root == NULL) {
+        printf("\n");
+        return TREE_OK;
+    }
+
+    TreeForce(&tree->root);
+
+    METRICS_PHASE_BEGIN(PHASE_PRINT);
+
+    ShareTable_t share = {};
+    TreeErr_t share_err = ShareTableBuild(&share, tree->root);
+    if (share_err == TREE_BUDGET_EXCEEDED) {
+        METRICS_PHASE_END(PHASE_PRINT);
+        return share_err;
+    }
+    int shared = share_err == TREE_OK;
+
+    if (shared) {
+        for (size_t i = 0; i < share.count; i++) {
+            Node_t* def = (Node_t*)(uintptr_t)share.temps[i];
+
+            printf("let t%zu = ", i + 1);
+            RecursivePrintShared(def, &share, def, stdout);
+            printf("\n");
+        }
+
+        RecursivePrintShared(tree->root, &share, tree->root, stdout);
+        ShareTableDestroy(&share);
+    } else {
+        RecursivePrintShared(tree->root, NULL, tree->root, stdout);
+    }
+    printf("\n");
+
+    METRICS_PHASE_END(PHASE_PRINT);
+
+    return TREE_OK;
+}
+
+#endif // DIF_LIBRARY
+
+// Without a share table the whole tree is printed in the same format
+static void RecursivePrintShared(Node_t* node, const ShareTable_t* share, const Node_t* def, FILE* fp) {
+    size_t temp = (share != NULL && node != def) ? ShareTableFind(share, node) : 0;
+    if (temp != 0) {
+        fprintf(fp, "(t%zu)", temp);
+        return;
+    }
+
+    fputc('(', fp);
+
+    if (node->left != NULL) {
+        RecursivePrintShared(node->left, share, def, fp);
+    }
+
+    WriteNodeLabel(node, fp);
+
+    if (node->right != NULL) {
+        RecursivePrintShared(node->right, share, def, fp);
+    }
+
+    fputc(')', fp);
+}
+
+size_t TreeSubtreeSize(const Node_t* node) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    return 1 + TreeSubtreeSize(node->left) + TreeSubtreeSize(node->right);
+}
+
+TreeErr_t TreeDestroySubtree(Node_t** node) {
+    assert( node != NULL );
+
+    Node_t* node_ptr = *node;
+    if (node_ptr == NULL) {
+        return TREE_OK;
+    }
+
+    TreeDestroySubtree(&node_ptr->left);
+    TreeDestroySubtree(&node_ptr->right);
+
+    NodeDestroy(&node_ptr);     // local copy: NodeDestroy may clear *node through the parent link
+    *node = NULL;
 
     return TREE_OK;
 }
 
+static uint64_t HashMix(uint64_t hash, uint64_t value) {
+    hash ^= value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2);
+    hash *= 0xFF51AFD7ED558CCDull;
+
+    return hash ^ (hash >> 33);
+}
+
+static uint64_t NumberBits(double number) {
+    number += 0.0; // -0 and 0 are the same constant
+
+    uint64_t bits = 0;
+    memcpy(&bits, &number, sizeof(bits));
+
+    return bits;
+}
+
+uint64_t HashString(const char* str) {
+    assert( str != NULL );
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (; *str != '\0'; ++str) {
+        hash = (hash ^ (unsigned char)*str) * 0x100000001B3ull;
+    }
+
+    return hash;
+}
+
+uint64_t NodeHash(const Node_t* node, uint64_t left_hash, uint64_t right_hash) {
+    assert( node != NULL );
+
+    uint64_t hash = HashMix(0, (uint64_t)node->type);
+    switch (node->type) {
+    case TYPE_NUMBER:
+        hash = HashMix(hash, NumberBits(node->data.number));
+        break;
+
+    case TYPE_OPERATION:
+        hash = HashMix(hash, (uint64_t)node->data.operation);
+        break;
+
+    case TYPE_VARIABLE:
+        hash = HashMix(hash, HashString(node->data.variable));
+        break;
+
+    case TYPE_THUNK:
+        hash = HashMix(hash, (uint64_t)node->data.thunk);
+        break;
+
+    case TYPE_UNDEFINED:
+    default:
+        break;
+    }
+
+    hash = HashMix(hash, (node->left  != NULL) ? left_hash  : 0);
+    hash = HashMix(hash, (node->right != NULL) ? right_hash : 0);
+
+    return hash;
+}
+
+uint64_t TreeHashSubtree(const Node_t* node) {
+    assert( node != NULL );
+
+    uint64_t left_hash  = (node->left  != NULL) ? TreeHashSubtree(node->left)  : 0;
+    uint64_t right_hash = (node->right != NULL) ? TreeHashSubtree(node->right) : 0;
+
+    return NodeHash(node, left_hash, right_hash);
+}
+
+int NodeLabelEqual(const Node_t* a, const Node_t* b) {
+    assert( a != NULL );
+    assert( b != NULL );
+
+    if (a->type != b->type) {
+        return 0;
+    }
+
+    switch (a->type) {
+    case TYPE_NUMBER:
+        return NumberBits(a->data.number) == NumberBits(b->data.number);
+    case TYPE_OPERATION:
+        return a->data.operation == b->data.operation;
+    case TYPE_VARIABLE:
+        return strcmp(a->data.variable, b->data.variable) == 0;
+    case TYPE_THUNK:
+        return a->data.thunk == b->data.thunk;
+
+    case TYPE_UNDEFINED:
+    default:
+        return 1;
+    }
+}
+
+int TreeEqualSubtree(const Node_t* a, const Node_t* b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+
+    return NodeLabelEqual(a, b) && TreeEqualSubtree(a->left, b->left) && TreeEqualSubtree(a->right, b->right);
+}
+
 // TreeDestroy
 
 
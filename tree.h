@@ -1,7 +1,9 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define FREE(ptr) free(ptr); ptr = NULL;
 
@@ -11,7 +13,8 @@ enum TreeElemType {
     TYPE_UNDEFINED,
     TYPE_OPERATION,
     TYPE_VARIABLE,
-    TYPE_NUMBER
+    TYPE_NUMBER,
+    TYPE_THUNK
 };
 
 enum Operation_t {
@@ -38,10 +41,22 @@ enum Operation_t {
     OPERATION_ACOT
 };
 
+struct Node_t;
+struct Thunk_t;
+
+typedef Node_t* (*ThunkFunc)(const Thunk_t* thunk);
+
+struct Thunk_t {
+    ThunkFunc expand;
+    const Node_t* source;
+    void* ctx;
+};
+
 union TreeElem_t {
     Operation_t operation;
     char* variable;
     double number;
+    const Thunk_t* thunk;
 };
 
 struct Node_t {
@@ -74,7 +89,8 @@ enum TreeErr_t {
     TREE_FILE_OPEN_FAILED,
     TREE_GET_FILE_SIZE_FAILED,
     TREE_BUFFER_FREAD_FAILED,
-    TREE_SYNTAX_ERROR
+    TREE_SYNTAX_ERROR,
+    TREE_BUDGET_EXCEEDED
 };
 
 typedef TreeErr_t (*TreeFunc)(Node_t**);
@@ -87,19 +103,40 @@ TreeErr_t NodeDestroy(Node_t** node);
 
 #define EmptyNodeInit NodeInit(NULL, NULL, NULL, TYPE_UNDEFINED, NULL)
 
-TreeErr_t NodeCopyData(Node_t* dest_node, Node_t* src_node);
+TreeErr_t NodeCopyData(Node_t* dest_node, const Node_t* src_node);
+Node_t* NodeForce(Node_t** node_ptr);
+TreeErr_t TreeForce(Node_t** node_ptr);
 
-TreeErr_t InorderTraversal(Node_t* node, TreeFunc func);
 TreeErr_t PostorderTraversal(Node_t* node, TreeFunc func);
 
 Node_t** GetParentNodePointer(Node_t* node);
 
 TreeErr_t ReadTree(Tree_t* tree, char* file_name);
-TreeErr_t PrintLatexTree(Tree_t* tree);
+TreeErr_t ReadTreeFromString(Tree_t* tree, char* str);
+TreeErr_t WriteTree(Tree_t* tree, FILE* fp);
+TreeErr_t WriteLatexTree(Tree_t* tree, FILE* fp);
+TreeErr_t WriteLatexTreeShared(Tree_t* tree, FILE* fp);
 // TreeErr_t TreeDifferentiation(Tree_t* tree, Tree_t* new_tree);
 // TreeErr_t ConstOptimization(Node_t* node, Tree_t* tree);
 
-Node_t* TreeCopySubtree(Node_t* cur_node, Node_t* parent);
+Node_t* TreeCopySubtree(const Node_t* cur_node, Node_t* parent);
+size_t TreeSubtreeSize(const Node_t* node);
+TreeErr_t TreeDestroySubtree(Node_t** node);
+
+uint64_t HashString(const char* str);
+uint64_t NodeHash(const Node_t* node, uint64_t left_hash, uint64_t right_hash);
+uint64_t TreeHashSubtree(const Node_t* node);
+// type and data only, the operands are not compared
+int NodeLabelEqual(const Node_t* a, const Node_t* b);
+int TreeEqualSubtree(const Node_t* a, const Node_t* b);
+
+// Console output, left out of the library build
+#ifndef DIF_LIBRARY
+
+TreeErr_t InorderTraversal(Node_t* node, TreeFunc func);
+TreeErr_t PrintLatexTree(Tree_t* tree);
 TreeErr_t PrintTree(Tree_t* tree);
 
+#endif // DIF_LIBRARY
+
 #endif // TREE_H
@@ -3,12 +3,8 @@
 #include <stdio.h>
 #include <math.h>
 
-const double EPS = 1e-7;
+#include "scalar.h"
 
 int isEqual(double a, double b) {
-    if (fabs(a - b) < EPS) {
-        return 1;
-    }
-    
-    return 0;
+    return ScalarIsEqual(a, b);
 }